@@ -0,0 +1,489 @@
+/**
+ * Copyright (C) 2024 Parrot S.A.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Userspace harness of the ulogger ring buffer core (ulogger_ring.h), to
+ * measure how writes scale with the number of writer threads when a log is a
+ * single ring behind one lock, and when it is split into per-CPU sub-rings,
+ * each with its own lock (see struct ulogger_cpu_ring in the driver).
+ *
+ * Writers do what the driver does: build the entry, lock the ring (the
+ * sub-ring of the current CPU in per-CPU mode), fix up read offsets and copy
+ * the entry. Meanwhile, a reader drains the log, merging sub-rings in time
+ * order one lock at a time, as read() does. Each case is run with 1, 2, 4, ...
+ * up to N threads; reported ns/op is the wall-clock time of a run divided by
+ * the total number of writes. The run fails if entries read and entries
+ * dropped do not add up to entries written.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "ulogger.h"
+
+/* not in include path: kernel/ulogger.h would shadow libulog's ulogger.h */
+#include "../ulogger_ring.h"
+
+#define BENCH_DEFAULT_ITER      100000
+#define BENCH_DEFAULT_THREADS   4
+#define BENCH_DEFAULT_SIZE      18
+#define BENCH_MIN_RING_SIZE     (1U << 14)
+#define BENCH_MSG_LEN           64
+#define BENCH_READER_SLEEP_US   1000
+
+/* offsets of the reader in a ring */
+struct bench_reader {
+	size_t r_off;
+	size_t r_dropped;
+	unsigned long long r_seq;
+};
+
+/* a log ring, or a sub-ring of a per-CPU log, with its lock */
+struct bench_ring {
+	struct ulogger_ring ring;
+	pthread_mutex_t     lock;
+	struct bench_reader reader;
+} __attribute__((aligned(64)));
+
+struct bench_log {
+	struct bench_ring  *rings;
+	unsigned int        nrings;
+};
+
+struct bench_case {
+	const char *name;
+	int         percpu;
+};
+
+struct bench_thread {
+	pthread_t           thread;
+	struct bench_log   *log;
+	unsigned int        id;
+	uint64_t            start;
+	uint64_t            end;
+};
+
+struct bench_result {
+	unsigned long long  read;
+	unsigned long long  dropped;
+	unsigned long long  late;     /* entries older than the previous one */
+};
+
+/* payload of entries: <pname>\0<tname>\0<priority:4><tag>\0<message> */
+struct bench_payload {
+	char                names[17];
+	uint32_t            prio;
+	char                tag[6];
+	uint32_t            writer;
+	uint32_t            seq;
+	char                pad[BENCH_MSG_LEN - 2*sizeof(uint32_t)];
+} __attribute__((packed));
+
+static const struct bench_case cases[] = {
+	{ "single", 0 },
+	{ "percpu", 1 },
+};
+
+static struct {
+	unsigned int        iter;
+	unsigned int        max_threads;
+	unsigned int        size_pow2;
+	unsigned int        ncpus;
+	int                 stop;
+	pthread_barrier_t   barrier;
+} bench;
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned int roundup_pow2(unsigned int n)
+{
+	unsigned int size = 1;
+
+	while (size < n)
+		size <<= 1;
+	return size;
+}
+
+static void log_destroy(struct bench_log *log)
+{
+	unsigned int i;
+
+	for (i = 0; i < log->nrings; i++) {
+		pthread_mutex_destroy(&log->rings[i].lock);
+		free(log->rings[i].ring.buffer);
+	}
+	free(log->rings);
+}
+
+/* split the log size between CPUs as the driver does, 16 kB at least */
+static int log_init(struct bench_log *log, int percpu)
+{
+	size_t size = (size_t)1 << bench.size_pow2;
+	struct bench_ring *r;
+	unsigned int i;
+
+	log->nrings = percpu ? bench.ncpus : 1;
+	if (percpu) {
+		size /= roundup_pow2(bench.ncpus);
+		if (size < BENCH_MIN_RING_SIZE)
+			size = BENCH_MIN_RING_SIZE;
+	}
+
+	if (posix_memalign((void **)&log->rings, 64,
+			   log->nrings * sizeof(*log->rings)) != 0)
+		return -ENOMEM;
+	memset(log->rings, 0, log->nrings * sizeof(*log->rings));
+
+	for (i = 0; i < log->nrings; i++) {
+		r = &log->rings[i];
+		pthread_mutex_init(&r->lock, NULL);
+		r->ring.size = size;
+		r->ring.buffer = malloc(size);
+		if (r->ring.buffer == NULL) {
+			log->nrings = i + 1;
+			log_destroy(log);
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+static void bench_write(struct bench_log *log, unsigned int id, uint32_t seq)
+{
+	char entry[sizeof(struct ulogger_entry) + sizeof(struct bench_payload)];
+	struct ulogger_entry header;
+	struct bench_payload payload;
+	struct bench_ring *r;
+	struct timespec now;
+	size_t size = sizeof(entry);
+	int cpu;
+
+	/* build the entry before locking, as the driver does */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	header.len = sizeof(payload);
+	header.hdr_size = sizeof(header);
+	header.pid = getpid();
+	header.tid = (int32_t)id;
+	header.sec = (int32_t)now.tv_sec;
+	header.nsec = (int32_t)now.tv_nsec;
+	header.euid = 0;
+
+	memcpy(payload.names, "ringbench\0writer", sizeof(payload.names));
+	payload.prio = 6;
+	memcpy(payload.tag, "bench", sizeof(payload.tag));
+	payload.writer = id;
+	payload.seq = seq;
+	memset(payload.pad, 'x', sizeof(payload.pad));
+
+	memcpy(entry, &header, sizeof(header));
+	memcpy(entry + sizeof(header), &payload, sizeof(payload));
+
+	if (log->nrings > 1) {
+		cpu = sched_getcpu();
+		r = &log->rings[(cpu < 0 ? id : (unsigned int)cpu) %
+				log->nrings];
+	} else {
+		r = &log->rings[0];
+	}
+
+	pthread_mutex_lock(&r->lock);
+	ulogger_ring_fix_up(&r->ring, size, &r->ring.head, &r->ring.dropped);
+	ulogger_ring_fix_up(&r->ring, size, &r->reader.r_off,
+			    &r->reader.r_dropped);
+	ulogger_ring_write(&r->ring, entry, size);
+	pthread_mutex_unlock(&r->lock);
+}
+
+static void *writer_thread(void *arg)
+{
+	struct bench_thread *bt = arg;
+	unsigned int i;
+
+	pthread_barrier_wait(&bench.barrier);
+	bt->start = now_ns();
+
+	for (i = 0; i < bench.iter; i++)
+		bench_write(bt->log, bt->id, i);
+
+	bt->end = now_ns();
+	return NULL;
+}
+
+/*
+ * Return the ring holding the oldest unread entry, locked, or NULL; rings
+ * are only locked one at a time while looking for it.
+ */
+static struct bench_ring *next_ring(struct bench_log *log)
+{
+	struct bench_ring *r, *best = NULL;
+	unsigned long long time, best_time = 0;
+	unsigned int i;
+
+	for (i = 0; i < log->nrings; i++) {
+		r = &log->rings[i];
+		pthread_mutex_lock(&r->lock);
+		if (r->ring.w_off != r->reader.r_off) {
+			time = ulogger_ring_entry_time(&r->ring,
+						       r->reader.r_off);
+			if (best == NULL || time < best_time) {
+				best = r;
+				best_time = time;
+			}
+		}
+		pthread_mutex_unlock(&r->lock);
+	}
+
+	if (best)
+		pthread_mutex_lock(&best->lock);
+	return best;
+}
+
+static void *reader_thread(void *arg)
+{
+	struct bench_log *log = arg;
+	struct bench_result *res;
+	struct bench_ring *r;
+	struct ulogger_entry *entry;
+	char buf[ULOGGER_ENTRY_MAX_LEN];
+	unsigned long long time, last = 0;
+	size_t len;
+	ssize_t ret;
+	int stop;
+
+	res = calloc(1, sizeof(*res));
+	if (res == NULL)
+		return NULL;
+
+	for (;;) {
+		/* once writers are done, drain what is left */
+		stop = __atomic_load_n(&bench.stop, __ATOMIC_ACQUIRE);
+		r = next_ring(log);
+		if (r == NULL) {
+			if (stop)
+				break;
+			usleep(BENCH_READER_SLEEP_US);
+			continue;
+		}
+
+		if (r->reader.r_dropped) {
+			res->dropped += r->reader.r_dropped;
+			ret = ulogger_ring_read_drop_summary(
+				&r->ring, "bench", r->reader.r_off, 2,
+				&r->reader.r_dropped, &r->reader.r_seq, buf,
+				sizeof(buf));
+			pthread_mutex_unlock(&r->lock);
+			if (ret < 0)
+				break;
+			continue;
+		}
+
+		/* writers may have pulled the reader to the write head */
+		if (r->ring.w_off == r->reader.r_off) {
+			pthread_mutex_unlock(&r->lock);
+			continue;
+		}
+
+		len = sizeof(struct ulogger_entry) +
+		      ulogger_ring_entry_msg_len(&r->ring, r->reader.r_off);
+		ret = ulogger_ring_read(&r->ring, &r->reader.r_off, 2, buf,
+					len);
+		pthread_mutex_unlock(&r->lock);
+		if (ret < 0)
+			break;
+
+		entry = (struct ulogger_entry *)buf;
+		time = (unsigned long long)entry->sec * 1000000000ULL +
+		       (unsigned int)entry->nsec;
+		if (time < last)
+			res->late++;
+		else
+			last = time;
+		res->read++;
+	}
+
+	return res;
+}
+
+static int run_case(const struct bench_case *bc, unsigned int nthreads)
+{
+	struct bench_log log;
+	struct bench_thread *bt;
+	struct bench_result *res = NULL;
+	pthread_t reader;
+	uint64_t start = UINT64_MAX, end = 0, elapsed;
+	unsigned long long total = (unsigned long long)nthreads * bench.iter;
+	unsigned int i;
+	int ret;
+
+	ret = log_init(&log, bc->percpu);
+	if (ret < 0)
+		return ret;
+
+	bt = calloc(nthreads, sizeof(*bt));
+	if (bt == NULL) {
+		log_destroy(&log);
+		return -ENOMEM;
+	}
+
+	bench.stop = 0;
+	pthread_barrier_init(&bench.barrier, NULL, nthreads);
+	ret = pthread_create(&reader, NULL, reader_thread, &log);
+	if (ret != 0) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+		goto out;
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		bt[i].log = &log;
+		bt[i].id = i + 1;
+		ret = pthread_create(&bt[i].thread, NULL, writer_thread,
+				     &bt[i]);
+		if (ret != 0) {
+			/* cannot recover from a partial barrier */
+			fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(bt[i].thread, NULL);
+		if (bt[i].start < start)
+			start = bt[i].start;
+		if (bt[i].end > end)
+			end = bt[i].end;
+	}
+	__atomic_store_n(&bench.stop, 1, __ATOMIC_RELEASE);
+	pthread_join(reader, (void **)&res);
+
+	if (res == NULL) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	elapsed = (end > start) ? end - start : 1;
+	printf("%-8s %3u %5u %10.1f %12.0f %10llu %10llu %8llu\n", bc->name,
+	       nthreads, log.nrings, (double)elapsed / total,
+	       total * 1e9 / elapsed, res->read, res->dropped, res->late);
+
+	if (res->read + res->dropped != total) {
+		fprintf(stderr, "%s: %llu entries read, %llu dropped, "
+			"%llu written\n", bc->name, res->read, res->dropped,
+			total);
+		ret = -EIO;
+	}
+
+out:
+	pthread_barrier_destroy(&bench.barrier);
+	free(res);
+	free(bt);
+	log_destroy(&log);
+	return ret;
+}
+
+static void show_usage(const char *cmd)
+{
+	fprintf(stderr, "Usage: %s [options]\n", cmd);
+
+	fprintf(stderr, "options include:\n"
+		"  -n <n>          Writes per thread (default %d)\n"
+		"  -t <n>          Maximum number of threads (default %d)\n"
+		"  -s <pow2>       Log size, as a power of two (default %d)\n"
+		"  -c <n>          Number of CPUs of per-CPU logs (default: "
+		"all)\n"
+		"  -f <name>       Only run cases whose name contains <name>\n"
+		"  -h              Show this help\n"
+		"\n", BENCH_DEFAULT_ITER, BENCH_DEFAULT_THREADS,
+		BENCH_DEFAULT_SIZE);
+}
+
+int main(int argc, char *argv[])
+{
+	int c, ret = 0;
+	unsigned int i, nthreads;
+	const char *filter = NULL;
+	long ncpus;
+
+	bench.iter = BENCH_DEFAULT_ITER;
+	bench.max_threads = BENCH_DEFAULT_THREADS;
+	bench.size_pow2 = BENCH_DEFAULT_SIZE;
+	ncpus = sysconf(_SC_NPROCESSORS_CONF);
+	bench.ncpus = ncpus > 0 ? (unsigned int)ncpus : 1;
+
+	while ((c = getopt(argc, argv, "c:f:hn:s:t:")) != -1) {
+		switch (c) {
+		case 'c':
+			bench.ncpus = (unsigned int)atoi(optarg);
+			break;
+		case 'f':
+			filter = optarg;
+			break;
+		case 'n':
+			bench.iter = (unsigned int)atoi(optarg);
+			break;
+		case 's':
+			bench.size_pow2 = (unsigned int)atoi(optarg);
+			break;
+		case 't':
+			bench.max_threads = (unsigned int)atoi(optarg);
+			break;
+		case 'h':
+			show_usage(argv[0]);
+			return 0;
+		default:
+			show_usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	/* 16 kB <= size <= 16 MB, as in the driver */
+	if (bench.iter == 0 || bench.max_threads == 0 || bench.ncpus == 0 ||
+	    bench.size_pow2 < 14 || bench.size_pow2 > 24) {
+		show_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	printf("%-8s %3s %5s %10s %12s %10s %10s %8s\n", "case", "thr",
+	       "rings", "ns/op", "ops/s", "read", "dropped", "late");
+
+	for (i = 0; i < sizeof(cases)/sizeof(cases[0]); i++) {
+		if (filter && !strstr(cases[i].name, filter))
+			continue;
+
+		for (nthreads = 1; nthreads <= bench.max_threads;
+		     nthreads = (nthreads*2 > bench.max_threads &&
+				 nthreads < bench.max_threads) ?
+				bench.max_threads : nthreads*2) {
+			fflush(stdout);
+			if (run_case(&cases[i], nthreads) < 0)
+				ret = EXIT_FAILURE;
+		}
+	}
+
+	return ret;
+}
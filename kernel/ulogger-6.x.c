@@ -26,6 +26,7 @@
 #include <linux/poll.h>
 #include <linux/slab.h>
 #include <linux/time.h>
+#include <linux/timer.h>
 #include <linux/device.h>
 #include <linux/ctype.h>
 #include <linux/string.h>
@@ -38,30 +39,68 @@
 
 #include <asm/ioctls.h>
 
+/* ring buffer reads copy data to userspace */
+#define ulogger_ring_copy_out(dst, src, n) copy_to_user(dst, src, n)
+/* the status page is read concurrently by readers mapping the log */
+#define ulogger_ring_write_once(x, v) WRITE_ONCE(x, v)
+#define ulogger_ring_wmb() smp_wmb()
+#include "ulogger_ring.h"
+
+/*
+ * struct ulogger_cpu_ring - the sub-ring of a CPU, in a per-CPU log
+ *
+ * Writers running on a CPU only lock the sub-ring of that CPU, so that they
+ * do not contend with writers of other CPUs. The structure is protected by
+ * the mutex 'mutex'.
+ */
+struct ulogger_cpu_ring {
+	struct ulogger_ring ring; /* the sub-ring buffer and its offsets */
+	struct list_head readers; /* read offsets of readers in this sub-ring */
+	struct rt_mutex mutex; /* mutex protecting sub-ring */
+} ____cacheline_aligned_in_smp;
+
+/*
+ * struct ulogger_cpu_reader - the read offsets of a reader in a sub-ring
+ *
+ * The structure is protected by the mutex of the sub-ring.
+ */
+struct ulogger_cpu_reader {
+	struct list_head list; /* entry in ulogger_cpu_ring's list */
+	size_t r_off; /* current read head offset */
+	size_t r_dropped; /* dropped entries for reader */
+	unsigned long long r_seq; /* see struct ulogger_ring */
+};
+
 /*
  * struct ulogger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
  * not need additional reference counting. The structure is protected by the
  * mutex 'mutex'.
+ *
+ * In per-CPU mode ('cpu_rings' is not NULL), entries are written to the
+ * sub-ring of the current CPU, 'ring' only holds the total size of the log,
+ * and 'mutex' only serializes readers; read() merges sub-rings in time order.
  */
 struct ulogger_log {
-	unsigned char *buffer; /* the ring buffer itself */
+	struct ulogger_ring ring; /* the ring buffer and its offsets */
+	struct ulogger_mmap_status *status; /* status page, before ring buffer */
 	struct miscdevice misc; /* misc device representing the log */
 	wait_queue_head_t wq; /* wait queue for readers */
 	struct list_head readers; /* this log's readers */
 	struct rt_mutex mutex; /* mutex protecting buffer */
-	size_t w_off; /* current write head offset */
-	size_t head; /* new readers start here */
-	size_t size; /* size of the log */
-	size_t dropped; /* number of globally dropped entries */
+	struct ulogger_cpu_ring *cpu_rings; /* per-CPU sub-rings, or NULL */
+	unsigned int nr_cpu_rings; /* number of sub-rings */
+	unsigned int wm_readers; /* number of readers with a watermark */
+	struct ulogger_ring_keep *keep; /* high priority entries, or NULL */
 };
 
 /*
  * struct ulogger_reader - a logging device open for reading
  *
  * This object lives from open to release, so we don't need additional
- * reference counting. The structure is protected by log->mutex.
+ * reference counting. The structure is protected by log->mutex, except for
+ * its offsets in the sub-rings of a per-CPU log, protected by their sub-ring.
  */
 struct ulogger_reader {
 	struct ulogger_log *log; /* associated log */
@@ -69,15 +108,21 @@ struct ulogger_reader {
 	size_t r_off; /* current read head offset */
 	bool r_all; /* reader can read all entries */
 	int r_ver; /* reader ABI version */
+	bool r_bulk; /* read() returns as many entries as fit */
 	size_t r_dropped; /* dropped entries for reader */
+	unsigned long long r_seq; /* see struct ulogger_ring */
+	struct ulogger_ring_names *r_names; /* names sent, in version 3 */
+	struct ulogger_cpu_reader *r_cpu; /* offsets in sub-rings, or NULL */
+	wait_queue_head_t r_wq; /* wait queue, if the reader has a watermark */
+	size_t r_wm_bytes; /* woken up with that many bytes readable, or 0 */
+	u64 r_wm_latency; /* ... or that long (ns) after entries are pending */
+	u64 r_wm_since; /* when entries were first found pending, or 0 */
+	struct timer_list r_wm_timer; /* wakes the reader after its latency */
+	size_t k_off; /* read offset in the keep ring of the log */
+	size_t k_dropped; /* entries of the keep ring missed */
+	unsigned long long k_seq; /* see struct ulogger_ring */
 };
 
-/* ulogger_offset - returns index 'n' into the log via (optimized) modulus */
-size_t ulogger_offset(struct ulogger_log *log, size_t n)
-{
-	return n & (log->size - 1);
-}
-
 /* extract pointer from private data */
 static inline void *file_get_private_ptr(struct file *file)
 {
@@ -127,208 +172,335 @@ static inline struct ulogger_log *file_get_log(struct file *file)
 }
 
 /*
- * get_entry_header - returns a pointer to the ulogger_entry header within
- * 'log' starting at offset 'off'. A temporary ulogger_entry 'scratch' must
- * be provided. Typically the return value will be a pointer within
- * 'ulogger->buf'.  However, a pointer to 'scratch' may be returned if
- * the log entry spans the end and beginning of the circular buffer.
+ * get_next_entry_by_uid - Starting at 'off', returns an offset into
+ * 'ring->buffer' which contains the first entry readable by 'euid', and skips
+ * the numbers of entries in between in '*seq'
  */
-static struct ulogger_entry *get_entry_header(struct ulogger_log *log,
-					      size_t off,
-					      struct ulogger_entry *scratch)
+static size_t get_next_entry_by_uid(struct ulogger_ring *ring, size_t off,
+				    kuid_t euid, unsigned long long *seq)
 {
-	size_t len = min(sizeof(struct ulogger_entry), log->size - off);
-	if (len != sizeof(struct ulogger_entry)) {
-		memcpy(((void *)scratch), log->buffer + off, len);
-		memcpy(((void *)scratch) + len, log->buffer,
-		       sizeof(struct ulogger_entry) - len);
-		return scratch;
+	while (off != ring->w_off) {
+		struct ulogger_entry *entry;
+		struct ulogger_entry scratch;
+		size_t next_len;
+
+		entry = ulogger_ring_entry_header(ring, off, &scratch);
+
+		if (uid_eq(entry->euid, euid))
+			return off;
+
+		next_len = sizeof(struct ulogger_entry) + entry->len;
+		off = ulogger_ring_offset(ring, off + next_len);
+		(*seq)++;
 	}
 
-	return (struct ulogger_entry *)(log->buffer + off);
+	return off;
 }
 
 /*
- * get_entry_msg_len - Grabs the length of the message of the entry
- * starting from from 'off'.
- *
- * An entry length is 2 bytes (16 bits) in host endian order.
- * In the log, the length does not include the size of the log entry structure.
- * This function returns the size including the log entry structure.
+ * read_entry - read the entry of 'ring' at '*r_off' into 'buf' (or in version
+ * 3, its names first if needed), or if there are '*r_dropped' dropped entries,
+ * those still in the keep ring of the log and summaries of the others.
  *
- * Caller needs to hold log->mutex.
+ * The caller needs to hold the lock of 'ring'.
  */
-static __u32 get_entry_msg_len(struct ulogger_log *log, size_t off)
+static ssize_t read_entry(struct ulogger_reader *reader,
+			  struct ulogger_ring *ring, size_t *r_off,
+			  size_t *r_dropped, unsigned long long *r_seq,
+			  char __user *buf, size_t count)
 {
-	struct ulogger_entry scratch;
-	struct ulogger_entry *entry;
+	struct ulogger_log *log = reader->log;
 
-	entry = get_entry_header(log, off, &scratch);
-	return entry->len;
+	/*
+	 * If this reader has missed dropped entries, return a fake generated
+	 * log entry with drop information, or kept entries first for readers
+	 * of all entries, since those are not filtered by uid.
+	 */
+	if (unlikely(*r_dropped > 0))
+		return ulogger_ring_read_dropped(ring,
+						 reader->r_all ? log->keep :
+						 NULL, log->misc.name, *r_off,
+						 reader->r_ver, reader->r_names,
+						 r_dropped, r_seq,
+						 &reader->k_off,
+						 &reader->k_dropped,
+						 &reader->k_seq, buf, count);
+
+	/* get exactly one record from the log */
+	return ulogger_ring_read_record(ring, r_off, reader->r_ver,
+					reader->r_names, r_seq, buf, count);
 }
 
-static size_t get_user_hdr_len(int ver)
+/*
+ * read_more_entries - in bulk mode, read the whole entries following the one
+ * just read which fit in the 'count' bytes left in 'buf'. Returns the number
+ * of bytes read.
+ *
+ * The caller needs to hold log->mutex.
+ */
+static ssize_t read_more_entries(struct ulogger_reader *reader,
+				 char __user *buf, size_t count)
 {
-	if (ver < 2)
-		return sizeof(struct user_ulogger_entry_compat);
-	else
-		return sizeof(struct ulogger_entry);
+	struct ulogger_log *log = reader->log;
+	ssize_t ret, total = 0;
+
+	while (1) {
+		if (!reader->r_all)
+			reader->r_off = get_next_entry_by_uid(&log->ring,
+							      reader->r_off,
+							      current_euid(),
+							      &reader->r_seq);
+
+		if (log->ring.w_off == reader->r_off)
+			break;
+
+		/* kept entries are read in bulk too */
+		ret = read_entry(reader, &log->ring, &reader->r_off,
+				 &reader->r_dropped, &reader->r_seq,
+				 buf + total, count);
+		if (ret < 0)
+			break;
+
+		total += ret;
+		count -= ret;
+	}
+
+	return total;
 }
 
-static ssize_t copy_header_to_user(int ver, struct ulogger_entry *entry,
-				   char __user *buf)
+/*
+ * cpu_rings_readable - tell whether some sub-ring of a per-CPU log has
+ * entries which 'reader' has not read. This is only a hint, checked without
+ * locks before sleeping, as writers wake up readers after each write.
+ */
+static bool cpu_rings_readable(struct ulogger_reader *reader)
 {
-	void *hdr;
-	size_t hdr_len;
-	struct user_ulogger_entry_compat v1;
-
-	if (ver < 2) {
-		v1.len = entry->len;
-		v1.__pad = 0;
-		v1.pid = entry->pid;
-		v1.tid = entry->tid;
-		v1.sec = entry->sec;
-		v1.nsec = entry->nsec;
-		hdr = &v1;
-		hdr_len = sizeof(struct user_ulogger_entry_compat);
-	} else {
-		hdr = entry;
-		hdr_len = sizeof(struct ulogger_entry);
-	}
+	struct ulogger_log *log = reader->log;
+	unsigned int i;
+
+	for (i = 0; i < log->nr_cpu_rings; i++)
+		if (READ_ONCE(log->cpu_rings[i].ring.w_off) !=
+		    READ_ONCE(reader->r_cpu[i].r_off))
+			return true;
 
-	return copy_to_user(buf, hdr, hdr_len);
+	return false;
 }
 
 /*
- * do_read_drop_summary_to_user - provides a summary of dropped log entries to
- * user-space buffer 'buf'.
+ * next_cpu_ring - in a per-CPU log, find the sub-ring whose next entry
+ * readable by 'reader' is the oldest one, and return it locked, with the
+ * offsets of the reader in that sub-ring in '*r_cpu'. Returns NULL if there
+ * is nothing to read.
  *
- * Caller must hold log->mutex.
+ * Sub-rings are locked one at a time, so that writers are only delayed on
+ * one CPU. The caller needs to hold log->mutex.
  */
-static ssize_t do_read_drop_summary(struct ulogger_log *log,
-				    struct ulogger_reader *reader,
-				    char __user *buf, size_t count)
+static struct ulogger_cpu_ring *next_cpu_ring(struct ulogger_reader *reader,
+					      struct ulogger_cpu_reader **r_cpu)
 {
-	int ret;
-	size_t hdrlen;
-	char msgbuf[128];
-	struct ulogger_entry *entry;
-	struct ulogger_entry summary, scratch;
+	struct ulogger_log *log = reader->log;
+	struct ulogger_cpu_ring *cpu_ring, *best = NULL;
+	struct ulogger_cpu_reader *pos;
+	unsigned long long time, best_time = 0;
+	unsigned int i;
+
+again:
+	for (i = 0; i < log->nr_cpu_rings; i++) {
+		cpu_ring = &log->cpu_rings[i];
+		pos = &reader->r_cpu[i];
+
+		rt_mutex_lock(&cpu_ring->mutex);
+		if (!reader->r_all)
+			pos->r_off = get_next_entry_by_uid(&cpu_ring->ring,
+							   pos->r_off,
+							   current_euid(),
+							   &pos->r_seq);
+
+		if (cpu_ring->ring.w_off != pos->r_off) {
+			time = ulogger_ring_entry_time(&cpu_ring->ring,
+						       pos->r_off);
+			if (!best || time < best_time) {
+				best = cpu_ring;
+				best_time = time;
+				*r_cpu = pos;
+			}
+		}
+		rt_mutex_unlock(&cpu_ring->mutex);
+	}
+
+	if (!best)
+		return NULL;
 
 	/*
-	 * First, copy the header to userspace, using the version of
-	 * the header requested
+	 * Writers may only have pulled the reader forward since, to another
+	 * entry of the sub-ring, which is fine.
 	 */
-	entry = get_entry_header(log, reader->r_off, &scratch);
-
-	/* build a fake log entry indicating how many entries were dropped */
-	memcpy(&summary, entry, sizeof(summary));
-	summary.pid = -1;
-	summary.tid = -1;
-
-	ret = snprintf(msgbuf, sizeof(msgbuf),
-		       /* <pname>\0<tname>\0<priority:4><tag>\0<message> */
-		       "%c%c%c%c%c%s%c%d log entries dropped\n",
-		       '\0', /* empty pname, no thread (pid=tid) */
-		       4, 0, 0, 0, /* WARN prio level */
-		       log->misc.name, /* tag */
-		       '\0', /* tag trailing null byte */
-		       (int)reader->r_dropped);
-
-	if ((ret < 0) || (ret >= sizeof(msgbuf)))
-		return -EFAULT;
-
-	summary.len = ret + 1; /* count trailing null byte */
-	hdrlen = get_user_hdr_len(reader->r_ver);
+	rt_mutex_lock(&best->mutex);
+	if (unlikely(best->ring.w_off == (*r_cpu)->r_off)) {
+		rt_mutex_unlock(&best->mutex);
+		best = NULL;
+		goto again;
+	}
 
-	if (count < hdrlen + summary.len)
-		return -EINVAL;
+	return best;
+}
 
-	if (copy_header_to_user(reader->r_ver, &summary, buf))
-		return -EFAULT;
+/*
+ * read_more_cpu_entries - same as read_more_entries(), for a per-CPU log.
+ * Stop at dropped entries, so that their summary is read next, in order.
+ *
+ * The caller needs to hold log->mutex.
+ */
+static ssize_t read_more_cpu_entries(struct ulogger_reader *reader,
+				     char __user *buf, size_t count)
+{
+	struct ulogger_cpu_ring *cpu_ring;
+	struct ulogger_cpu_reader *r_cpu;
+	ssize_t ret, total = 0;
 
-	buf += hdrlen;
+	while ((cpu_ring = next_cpu_ring(reader, &r_cpu)) != NULL) {
+		ret = -EINVAL;
+		if (!r_cpu->r_dropped)
+			ret = read_entry(reader, &cpu_ring->ring,
+					 &r_cpu->r_off, &r_cpu->r_dropped,
+					 &r_cpu->r_seq, buf + total, count);
+		rt_mutex_unlock(&cpu_ring->mutex);
+		if (ret < 0)
+			break;
 
-	if (copy_to_user(buf, msgbuf, summary.len))
-		return -EFAULT;
+		total += ret;
+		count -= ret;
+	}
 
-	reader->r_dropped = 0;
-	return hdrlen + summary.len;
+	return total;
 }
 
 /*
- * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
- *
- * Caller must hold log->mutex.
+ * ulogger_read_cpu_rings - read() of a per-CPU log, merging the entries of
+ * its sub-rings in time order.
  */
-static ssize_t do_read_log_to_user(struct ulogger_log *log,
-				   struct ulogger_reader *reader,
-				   char __user *buf, size_t count)
+static ssize_t ulogger_read_cpu_rings(struct file *file, char __user *buf,
+				      size_t count)
 {
-	struct ulogger_entry scratch;
-	struct ulogger_entry *entry;
-	size_t len;
-	size_t msg_start;
+	struct ulogger_reader *reader = file_get_private_ptr(file);
+	struct ulogger_log *log = reader->log;
+	struct ulogger_cpu_ring *cpu_ring;
+	struct ulogger_cpu_reader *r_cpu;
+	ssize_t ret;
+	DEFINE_WAIT(wait);
 
-	/*
-	 * First, copy the header to userspace, using the version of
-	 * the header requested
-	 */
-	entry = get_entry_header(log, reader->r_off, &scratch);
-	if (copy_header_to_user(reader->r_ver, entry, buf))
-		return -EFAULT;
+start:
+	while (1) {
+		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-	count -= get_user_hdr_len(reader->r_ver);
-	buf += get_user_hdr_len(reader->r_ver);
-	msg_start = ulogger_offset(log, reader->r_off +
-						sizeof(struct ulogger_entry));
+		ret = 0;
+		if (cpu_rings_readable(reader))
+			break;
 
-	/*
-	 * We read from the msg in two disjoint operations. First, we read from
-	 * the current msg head offset up to 'count' bytes or to the end of
-	 * the log, whichever comes first.
-	 */
-	len = min(count, log->size - msg_start);
-	if (copy_to_user(buf, log->buffer + msg_start, len))
-		return -EFAULT;
+		if (file->f_flags & O_NONBLOCK) {
+			ret = -EAGAIN;
+			break;
+		}
 
-	/*
-	 * Second, we read any remaining bytes, starting back at the head of
-	 * the log.
-	 */
-	if (count != len)
-		if (copy_to_user(buf + len, log->buffer, count - len))
-			return -EFAULT;
+		if (signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+
+		schedule();
+	}
+
+	finish_wait(&log->wq, &wait);
+	if (ret)
+		return ret;
+
+	rt_mutex_lock(&log->mutex);
+
+	/* is there still something to read or did we race? */
+	cpu_ring = next_cpu_ring(reader, &r_cpu);
+	if (unlikely(!cpu_ring)) {
+		rt_mutex_unlock(&log->mutex);
+		goto start;
+	}
 
-	reader->r_off = ulogger_offset(
-		log, reader->r_off + sizeof(struct ulogger_entry) + count);
+	ret = read_entry(reader, &cpu_ring->ring, &r_cpu->r_off,
+			 &r_cpu->r_dropped, &r_cpu->r_seq, buf, count);
+	rt_mutex_unlock(&cpu_ring->mutex);
 
-	return count + get_user_hdr_len(reader->r_ver);
+	if (reader->r_bulk && ret > 0)
+		ret += read_more_cpu_entries(reader, buf + ret, count - ret);
+
+	rt_mutex_unlock(&log->mutex);
+
+	return ret;
 }
 
 /*
- * get_next_entry_by_uid - Starting at 'off', returns an offset into
- * 'log->buffer' which contains the first entry readable by 'euid'
+ * reader_wq - the wait queue of 'reader': its own if it has a watermark, so
+ * that writers only wake it up when it is ready, the one of its log otherwise.
  */
-static size_t get_next_entry_by_uid(struct ulogger_log *log, size_t off,
-				    kuid_t euid)
+static inline wait_queue_head_t *reader_wq(struct ulogger_reader *reader)
 {
-	while (off != log->w_off) {
-		struct ulogger_entry *entry;
-		struct ulogger_entry scratch;
-		size_t next_len;
+	return reader->r_wm_bytes ? &reader->r_wq : &reader->log->wq;
+}
 
-		entry = get_entry_header(log, off, &scratch);
+/*
+ * reader_ready - tell whether 'reader' has entries to read, and enough of them
+ * if it has a watermark (see ULOGGER_SET_WATERMARK); if not, arm its timer for
+ * the end of its latency. Not for per-CPU logs.
+ *
+ * The caller needs to hold log->mutex.
+ */
+static bool reader_ready(struct ulogger_reader *reader)
+{
+	struct ulogger_log *log = reader->log;
+	u64 now;
+
+	if (!reader->r_wm_bytes)
+		return log->ring.w_off != reader->r_off;
+
+	now = ktime_get_ns();
+	if (ulogger_ring_wait_ready(&log->ring, reader->r_off,
+				    reader->r_dropped, reader->r_wm_bytes,
+				    reader->r_wm_latency, &reader->r_wm_since,
+				    now))
+		return true;
+
+	if (reader->r_wm_since && reader->r_wm_latency &&
+	    !timer_pending(&reader->r_wm_timer))
+		mod_timer(&reader->r_wm_timer, jiffies + 1 +
+			  nsecs_to_jiffies(reader->r_wm_since +
+					   reader->r_wm_latency - now));
+	return false;
+}
 
-		if (uid_eq(entry->euid, euid))
-			return off;
+static void reader_wm_timeout(struct timer_list *t)
+{
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 16, 0))
+	struct ulogger_reader *reader = timer_container_of(reader, t,
+							   r_wm_timer);
+#else
+	struct ulogger_reader *reader = from_timer(reader, t, r_wm_timer);
+#endif
 
-		next_len = sizeof(struct ulogger_entry) + entry->len;
-		off = ulogger_offset(log, off + next_len);
-	}
+	wake_up_interruptible(&reader->r_wq);
+}
 
-	return off;
+/*
+ * wake_up_watermark_readers - wake up the sleeping readers of 'log' with a
+ * watermark which are now ready.
+ *
+ * The caller needs to hold log->mutex.
+ */
+static void wake_up_watermark_readers(struct ulogger_log *log)
+{
+	struct ulogger_reader *reader;
+
+	list_for_each_entry(reader, &log->readers, list) {
+		if (reader->r_wm_bytes && wq_has_sleeper(&reader->r_wq) &&
+		    reader_ready(reader))
+			wake_up_interruptible(&reader->r_wq);
+	}
 }
 
 /*
@@ -337,8 +509,10 @@ static size_t get_next_entry_by_uid(struct ulogger_log *log, size_t off,
  * Behavior:
  *
  *	- O_NONBLOCK works
- *	- If there are no log entries to read, blocks until log is written to
- *	- Atomically reads exactly one log entry
+ *	- If there are no log entries to read, blocks until log is written to,
+ *	  or until the watermark of the reader is reached if it has one
+ *	- Atomically reads exactly one log entry, or in bulk mode (see
+ *	  ULOGGER_SET_BULK_READ) as many whole entries as fit in the buffer
  *
  * Will set errno to EINVAL if read
  * buffer is insufficient to hold next entry.
@@ -348,16 +522,25 @@ static ssize_t ulogger_read(struct file *file, char __user *buf, size_t count,
 {
 	struct ulogger_reader *reader = file_get_private_ptr(file);
 	struct ulogger_log *log = reader->log;
+	wait_queue_head_t *wq;
 	ssize_t ret;
 	DEFINE_WAIT(wait);
 
+	if (log->cpu_rings)
+		return ulogger_read_cpu_rings(file, buf, count);
+
 start:
 	while (1) {
 		rt_mutex_lock(&log->mutex);
 
-		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
+		wq = reader_wq(reader);
+		prepare_to_wait(wq, &wait, TASK_INTERRUPTIBLE);
 
-		ret = (log->w_off == reader->r_off);
+		/* non-blocking readers get whatever is there */
+		if (file->f_flags & O_NONBLOCK)
+			ret = (log->ring.w_off == reader->r_off);
+		else
+			ret = !reader_ready(reader);
 		rt_mutex_unlock(&log->mutex);
 		if (!ret)
 			break;
@@ -373,166 +556,178 @@ start:
 		}
 
 		schedule();
+		finish_wait(wq, &wait);
 	}
 
-	finish_wait(&log->wq, &wait);
+	finish_wait(wq, &wait);
 	if (ret)
 		return ret;
 
 	rt_mutex_lock(&log->mutex);
 
 	if (!reader->r_all)
-		reader->r_off = get_next_entry_by_uid(log, reader->r_off,
-						      current_euid());
+		reader->r_off = get_next_entry_by_uid(&log->ring, reader->r_off,
+						      current_euid(),
+						      &reader->r_seq);
 
 	/* is there still something to read or did we race? */
-	if (unlikely(log->w_off == reader->r_off)) {
+	if (unlikely(log->ring.w_off == reader->r_off)) {
 		rt_mutex_unlock(&log->mutex);
 		goto start;
 	}
 
-	/*
-	 * If this reader has missed dropped entries, return a fake generated
-	 * log entry with drop information.
-	 */
-	if (unlikely((reader->r_dropped > 0))) {
-		ret = do_read_drop_summary(log, reader, buf, count);
-		goto out;
-	}
-
-	/* get the size of the next entry */
-	ret = get_user_hdr_len(reader->r_ver) +
-	      get_entry_msg_len(log, reader->r_off);
-	if (count < ret) {
-		ret = -EINVAL;
-		goto out;
-	}
+	ret = read_entry(reader, &log->ring, &reader->r_off,
+			 &reader->r_dropped, &reader->r_seq, buf, count);
 
-	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
+	if (reader->r_bulk && ret > 0)
+		ret += read_more_entries(reader, buf + ret, count - ret);
 
-out:
 	rt_mutex_unlock(&log->mutex);
 
 	return ret;
 }
 
 /*
- * get_next_entry - return the offset of the first valid entry at least 'len'
- * bytes after 'off'.
- *
- * Caller must hold log->mutex.
+ * lock_write_ring - lock the ring buffer written by the current task, and
+ * return it: the ring of 'log', or in per-CPU mode the sub-ring of the
+ * current CPU, which is also returned in '*cpu_ring' (NULL otherwise).
  */
-static size_t get_next_entry(struct ulogger_log *log, size_t off, size_t len,
-			     size_t *dropped)
+static struct ulogger_ring *lock_write_ring(struct ulogger_log *log,
+					    struct ulogger_cpu_ring **cpu_ring)
 {
-	size_t count = 0, entries = 0;
-
-	do {
-		size_t nr = sizeof(struct ulogger_entry) +
-			    get_entry_msg_len(log, off);
-		off = ulogger_offset(log, off + nr);
-		count += nr;
-		entries++;
-	} while (count < len);
+	if (!log->cpu_rings) {
+		*cpu_ring = NULL;
+		rt_mutex_lock(&log->mutex);
+		return &log->ring;
+	}
 
-	*dropped = entries;
-	return off;
+	/* a task migrating meanwhile just writes to another CPU's sub-ring */
+	*cpu_ring = &log->cpu_rings[raw_smp_processor_id()];
+	rt_mutex_lock(&(*cpu_ring)->mutex);
+	return &(*cpu_ring)->ring;
 }
 
 /*
- * is_between - is a < c < b, accounting for wrapping of a, b, and c
- *    positions in the buffer
- *
- * That is, if a<b, check for c between a and b
- * and if a>b, check for c outside (not between) a and b
- *
- * |------- a xxxxxxxx b --------|
- *               c^
- *
- * |xxxxx b --------- a xxxxxxxxx|
- *    c^
- *  or                    c^
+ * unlock_write_ring - publish entries written since lock_write_ring(), unlock
+ * the ring and wake up any blocked readers.
  */
-static inline int is_between(size_t a, size_t b, size_t c)
+static void unlock_write_ring(struct ulogger_log *log,
+			      struct ulogger_cpu_ring *cpu_ring)
 {
-	if (a < b) {
-		/* is c between a and b? */
-		if (a < c && c <= b)
-			return 1;
-	} else {
-		/* is c outside of b through a? */
-		if (c <= b || a < c)
-			return 1;
+	if (!cpu_ring) {
+		ulogger_ring_mmap_end(&log->ring, log->status);
+		if (log->wm_readers)
+			wake_up_watermark_readers(log);
+		rt_mutex_unlock(&log->mutex);
+		wake_up_interruptible(&log->wq);
+		return;
 	}
 
-	return 0;
+	rt_mutex_unlock(&cpu_ring->mutex);
+
+	/* the wait queue lock is shared by all CPUs, only take it if needed */
+	if (wq_has_sleeper(&log->wq))
+		wake_up_interruptible(&log->wq);
 }
 
 /*
  * fix_up_readers - walk the list of all readers and "fix up" any who were
  * lapped by the writer; also do the same for the default "start head".
  * We do this by "pulling forward" the readers and start head to the first
- * entry after the new write head.
+ * entry after the new write head. Readers mapping the log are told about the
+ * write beforehand. In per-CPU mode, this is only done in sub-ring 'cpu_ring'.
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to hold the lock of the ring, see lock_write_ring().
  */
-static void fix_up_readers(struct ulogger_log *log, size_t len)
+static void fix_up_readers(struct ulogger_log *log,
+			   struct ulogger_cpu_ring *cpu_ring, size_t len)
 {
-	size_t old = log->w_off, dropped;
-	size_t new = ulogger_offset(log, old + len);
 	struct ulogger_reader *reader;
+	struct ulogger_cpu_reader *r_cpu;
+
+	if (cpu_ring) {
+		ulogger_ring_fix_up(&cpu_ring->ring, len, &cpu_ring->ring.head,
+				    &cpu_ring->ring.dropped);
 
-	if (is_between(old, new, log->head)) {
-		log->head = get_next_entry(log, log->head, len, &dropped);
-		log->dropped += dropped;
+		list_for_each_entry(r_cpu, &cpu_ring->readers, list)
+			ulogger_ring_fix_up(&cpu_ring->ring, len, &r_cpu->r_off,
+					    &r_cpu->r_dropped);
+		return;
 	}
 
+	ulogger_ring_mmap_begin(&log->ring, log->status, len);
+
+	ulogger_ring_fix_up(&log->ring, len, &log->ring.head,
+			    &log->ring.dropped);
+
 	list_for_each_entry(reader, &log->readers, list)
-		if (is_between(old, new, reader->r_off)) {
-			reader->r_off = get_next_entry(log, reader->r_off, len,
-						       &dropped);
-			reader->r_dropped += dropped;
-		}
+		ulogger_ring_fix_up(&log->ring, len, &reader->r_off,
+				    &reader->r_dropped);
 }
 
 /*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
+ * keep_entry - copy the entry just written at 'off' to the keep ring of 'log',
+ * if it has one and the entry is of high priority, fixing up readers there.
  *
  * The caller needs to hold log->mutex.
  */
-static void do_write_log(struct ulogger_log *log, const void *buf, size_t count)
+static void keep_entry(struct ulogger_log *log, size_t off)
 {
+	struct ulogger_ring_keep *keep = log->keep;
+	struct ulogger_reader *reader;
 	size_t len;
+	int prio;
 
-	len = min_t(size_t, count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
+	if (!keep)
+		return;
 
-	if (count != len)
-		memcpy(log->buffer, buf + len, count - len);
+	prio = ulogger_ring_entry_priority(&log->ring, off);
+	if (prio < 0 || prio > ULOGGER_KEEP_PRIORITY)
+		return;
+
+	len = sizeof(struct ulogger_entry) +
+	      ulogger_ring_entry_msg_len(&log->ring, off);
+
+	ulogger_ring_fix_up(&keep->ring, len, &keep->ring.head,
+			    &keep->ring.dropped);
+
+	list_for_each_entry(reader, &log->readers, list)
+		ulogger_ring_fix_up(&keep->ring, len, &reader->k_off,
+				    &reader->k_dropped);
 
-	log->w_off = ulogger_offset(log, log->w_off + count);
+	ulogger_ring_keep_write(keep, &log->ring, off, len, log->ring.w_seq);
+}
+
+/*
+ * do_write_log - writes 'len' bytes from 'buf' to 'ring'
+ *
+ * The caller needs to hold the lock of the ring.
+ */
+static void do_write_log(struct ulogger_ring *ring, const void *buf,
+			 size_t count)
+{
+	ulogger_ring_write(ring, buf, count);
 }
 
 /*
  * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
+ * the ring 'ring'
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to hold the lock of the ring.
  *
  * Returns 'count' on success, negative error code on failure.
  */
-static ssize_t do_write_log_from_user(struct ulogger_log *log,
+static ssize_t do_write_log_from_user(struct ulogger_ring *ring,
 				      const void __user *buf, size_t count)
 {
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
+	len = min(count, ring->size - ring->w_off);
+	if (len && copy_from_user(ring->buffer + ring->w_off, buf, len))
 		return -EFAULT;
 
 	if (count != len)
-		if (copy_from_user(log->buffer, buf + len, count - len))
+		if (copy_from_user(ring->buffer, buf + len, count - len))
 			/*
 			 * Note that by not updating w_off, this abandons the
 			 * portion of the new entry that *was* successfully
@@ -541,11 +736,45 @@ static ssize_t do_write_log_from_user(struct ulogger_log *log,
 			 */
 			return -EFAULT;
 
-	log->w_off = ulogger_offset(log, log->w_off + count);
+	ring->w_off = ulogger_ring_offset(ring, ring->w_off + count);
 
 	return count;
 }
 
+#define commlen (sizeof(current->comm))
+
+/*
+ * get_current_header - fill 'header' with the identity of the current task and
+ * the current time, and retrieve null-terminated process and thread names into
+ * 'pcomm' and 'tcomm' (thread name is empty if pid == tid).
+ */
+static void get_current_header(struct ulogger_entry *header, char *pcomm,
+			       size_t *plen, char *tcomm, size_t *tlen)
+{
+	struct timespec64 now;
+
+	ktime_get_ts64(&now);
+
+	header->pid = current->tgid;
+	header->tid = current->pid;
+
+	/* retrieve process (thread group leader) and thread names */
+	memcpy(pcomm, current->group_leader->comm, commlen);
+	pcomm[commlen] = '\0';
+	*plen = strlen(pcomm) + 1;
+	if (header->pid != header->tid) {
+		memcpy(tcomm, current->comm, commlen);
+		tcomm[commlen] = '\0';
+		*tlen = strlen(tcomm) + 1;
+	} else {
+		*tlen = 0;
+	}
+
+	header->sec = now.tv_sec;
+	header->nsec = now.tv_nsec;
+	header->euid = current_euid();
+}
+
 /*
  * ulogger_write_iter - our write method, implementing support for write(),
  * writev(), and write_iter(). Writes are our fast path, and we try to optimize
@@ -553,11 +782,11 @@ static ssize_t do_write_log_from_user(struct ulogger_log *log,
  */
 ssize_t ulogger_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-#define commlen (sizeof(current->comm))
 	struct ulogger_log *log = file_get_log(iocb->ki_filp);
+	struct ulogger_cpu_ring *cpu_ring;
+	struct ulogger_ring *ring;
 	size_t orig;
 	struct ulogger_entry header;
-	struct timespec64 now;
 	ssize_t ret = 0;
 	const size_t prefix = sizeof(header.len) + sizeof(header.hdr_size);
 	char tcomm[commlen + 4];
@@ -572,26 +801,7 @@ ssize_t ulogger_write_iter(struct kiocb *iocb, struct iov_iter *from)
 		len -= (sizeof(struct ulogger_entry) - prefix);
 		header.len = min_t(size_t, len, ULOGGER_ENTRY_MAX_PAYLOAD);
 	} else {
-		ktime_get_ts64(&now);
-
-		header.pid = current->tgid;
-		header.tid = current->pid;
-
-		/* retrieve process (thread group leader) and thread names */
-		memcpy(pcomm, current->group_leader->comm, commlen);
-		pcomm[commlen] = '\0';
-		plen = strlen(pcomm) + 1;
-		if (header.pid != header.tid) {
-			memcpy(tcomm, current->comm, commlen);
-			tcomm[commlen] = '\0';
-			tlen = strlen(tcomm) + 1;
-		} else {
-			tlen = 0;
-		}
-
-		header.sec = now.tv_sec;
-		header.nsec = now.tv_nsec;
-		header.euid = current_euid();
+		get_current_header(&header, pcomm, &plen, tcomm, &tlen);
 		header.len = min_t(size_t, plen + tlen + len,
 				   ULOGGER_ENTRY_MAX_PAYLOAD);
 	}
@@ -605,9 +815,9 @@ ssize_t ulogger_write_iter(struct kiocb *iocb, struct iov_iter *from)
 	/* the amount of bytes we need to write now */
 	size = sizeof(struct ulogger_entry) + header.len;
 
-	rt_mutex_lock(&log->mutex);
+	ring = lock_write_ring(log, &cpu_ring);
 
-	orig = log->w_off;
+	orig = ring->w_off;
 
 	/*
 	 * Fix up any readers, pulling them forward to the first readable
@@ -615,22 +825,22 @@ ssize_t ulogger_write_iter(struct kiocb *iocb, struct iov_iter *from)
 	 * because if we partially fail, we can end up with clobbered log
 	 * entries that encroach on readable buffer.
 	 */
-	fix_up_readers(log, size);
+	fix_up_readers(log, cpu_ring, size);
 
 	if (!rawmode) {
-		do_write_log(log, &header, sizeof(struct ulogger_entry));
+		do_write_log(ring, &header, sizeof(struct ulogger_entry));
 		size -= sizeof(struct ulogger_entry);
 
 		/* append null-terminated process and thread names */
-		do_write_log(log, pcomm, plen);
+		do_write_log(ring, pcomm, plen);
 		size -= plen;
 		if (tlen) {
-			do_write_log(log, tcomm, tlen);
+			do_write_log(ring, tcomm, tlen);
 			size -= tlen;
 		}
 	} else {
 		/* in raw mode, just enforce entry and header size */
-		do_write_log(log, &header, prefix);
+		do_write_log(ring, &header, prefix);
 		size -= prefix;
 	}
 
@@ -647,11 +857,11 @@ ssize_t ulogger_write_iter(struct kiocb *iocb, struct iov_iter *from)
 
 			/* write out this segment's payload */
 			ssize_t nr =
-				do_write_log_from_user(log, iov->iov_base, len);
+				do_write_log_from_user(ring, iov->iov_base, len);
 
 			if (unlikely(nr < 0)) {
-				log->w_off = orig;
-				rt_mutex_unlock(&log->mutex);
+				ring->w_off = orig;
+				unlock_write_ring(log, cpu_ring);
 				return nr;
 			}
 
@@ -666,23 +876,74 @@ ssize_t ulogger_write_iter(struct kiocb *iocb, struct iov_iter *from)
 		size_t len = min_t(size_t, size, iov_iter_count(from));
 
 		/* write out the payload */
-		ret = do_write_log_from_user(log, from->ubuf, len);
+		ret = do_write_log_from_user(ring, from->ubuf, len);
 
 		if (unlikely(ret < 0)) {
-			log->w_off = orig;
-			rt_mutex_unlock(&log->mutex);
+			ring->w_off = orig;
+			unlock_write_ring(log, cpu_ring);
 			return ret;
 		}
 	}
 
-	rt_mutex_unlock(&log->mutex);
+	if (!cpu_ring)
+		keep_entry(log, orig);
+	ring->w_seq++;
 
-	/* wake up any blocked readers */
-	wake_up_interruptible(&log->wq);
+	/* publish entries and wake up any blocked readers */
+	unlock_write_ring(log, cpu_ring);
 
 	return ret;
 }
 
+/*
+ * add_cpu_reader - start 'reader' at the start head of each sub-ring of a
+ * per-CPU log, and register its offsets there so that writers fix them up.
+ *
+ * The caller needs to hold log->mutex.
+ */
+static int add_cpu_reader(struct ulogger_reader *reader)
+{
+	struct ulogger_log *log = reader->log;
+	struct ulogger_cpu_ring *cpu_ring;
+	struct ulogger_cpu_reader *r_cpu;
+	unsigned int i;
+
+	reader->r_cpu = kcalloc(log->nr_cpu_rings, sizeof(*reader->r_cpu),
+				GFP_KERNEL);
+	if (!reader->r_cpu)
+		return -ENOMEM;
+
+	for (i = 0; i < log->nr_cpu_rings; i++) {
+		cpu_ring = &log->cpu_rings[i];
+		r_cpu = &reader->r_cpu[i];
+
+		rt_mutex_lock(&cpu_ring->mutex);
+		r_cpu->r_off = cpu_ring->ring.head;
+		r_cpu->r_dropped = cpu_ring->ring.dropped;
+		r_cpu->r_seq = cpu_ring->ring.head_seq;
+		list_add_tail(&r_cpu->list, &cpu_ring->readers);
+		rt_mutex_unlock(&cpu_ring->mutex);
+	}
+
+	return 0;
+}
+
+static void del_cpu_reader(struct ulogger_reader *reader)
+{
+	struct ulogger_log *log = reader->log;
+	struct ulogger_cpu_ring *cpu_ring;
+	unsigned int i;
+
+	for (i = 0; i < log->nr_cpu_rings; i++) {
+		cpu_ring = &log->cpu_rings[i];
+		rt_mutex_lock(&cpu_ring->mutex);
+		list_del(&reader->r_cpu[i].list);
+		rt_mutex_unlock(&cpu_ring->mutex);
+	}
+
+	kfree(reader->r_cpu);
+}
+
 /*
  * ulogger_open - the log's open() file operation
  *
@@ -710,14 +971,39 @@ static int ulogger_open(struct inode *inode, struct file *file)
 
 		reader->log = log;
 		reader->r_ver = 2;
+		reader->r_bulk = false;
 		reader->r_all = in_egroup_p(inode->i_gid) ||
 				capable(CAP_SYS_ADMIN);
+		reader->r_names = NULL;
+		reader->r_cpu = NULL;
+		init_waitqueue_head(&reader->r_wq);
+		reader->r_wm_bytes = 0;
+		reader->r_wm_latency = 0;
+		reader->r_wm_since = 0;
+		timer_setup(&reader->r_wm_timer, reader_wm_timeout, 0);
+		reader->k_off = 0;
+		reader->k_dropped = 0;
+		reader->k_seq = 0;
 
 		INIT_LIST_HEAD(&reader->list);
 
 		rt_mutex_lock(&log->mutex);
-		reader->r_off = log->head;
-		reader->r_dropped = log->dropped;
+		if (log->cpu_rings) {
+			ret = add_cpu_reader(reader);
+			if (ret) {
+				rt_mutex_unlock(&log->mutex);
+				kfree(reader);
+				return ret;
+			}
+		}
+		reader->r_off = log->ring.head;
+		reader->r_dropped = log->ring.dropped;
+		reader->r_seq = log->ring.head_seq;
+		if (log->keep) {
+			reader->k_off = log->keep->ring.head;
+			reader->k_dropped = log->keep->ring.dropped;
+			reader->k_seq = log->keep->ring.head_seq;
+		}
 		list_add_tail(&reader->list, &log->readers);
 		rt_mutex_unlock(&log->mutex);
 		file_set_private_data(file, reader, 0);
@@ -740,8 +1026,18 @@ static int ulogger_release(struct inode *ignored, struct file *file)
 
 		rt_mutex_lock(&log->mutex);
 		list_del(&reader->list);
+		if (reader->r_cpu)
+			del_cpu_reader(reader);
+		if (reader->r_wm_bytes)
+			log->wm_readers--;
 		rt_mutex_unlock(&log->mutex);
 
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0))
+		timer_delete_sync(&reader->r_wm_timer);
+#else
+		del_timer_sync(&reader->r_wm_timer);
+#endif
+		kfree(reader->r_names);
 		kfree(reader);
 	}
 
@@ -761,6 +1057,8 @@ static unsigned int ulogger_poll(struct file *file, poll_table *wait)
 {
 	struct ulogger_reader *reader;
 	struct ulogger_log *log;
+	struct ulogger_cpu_ring *cpu_ring;
+	struct ulogger_cpu_reader *r_cpu;
 	unsigned int ret = POLLOUT | POLLWRNORM;
 
 	if (!(file->f_mode & FMODE_READ))
@@ -769,33 +1067,167 @@ static unsigned int ulogger_poll(struct file *file, poll_table *wait)
 	reader = file_get_private_ptr(file);
 	log = reader->log;
 
-	poll_wait(file, &log->wq, wait);
+	/* a reader setting its watermark meanwhile wakes up both queues */
+	poll_wait(file, log->cpu_rings ? &log->wq : reader_wq(reader), wait);
 
 	rt_mutex_lock(&log->mutex);
+	if (log->cpu_rings) {
+		cpu_ring = next_cpu_ring(reader, &r_cpu);
+		if (cpu_ring) {
+			rt_mutex_unlock(&cpu_ring->mutex);
+			ret |= POLLIN | POLLRDNORM;
+		}
+		rt_mutex_unlock(&log->mutex);
+		return ret;
+	}
+
 	if (!reader->r_all)
-		reader->r_off = get_next_entry_by_uid(log, reader->r_off,
-						      current_euid());
+		reader->r_off = get_next_entry_by_uid(&log->ring, reader->r_off,
+						      current_euid(),
+						      &reader->r_seq);
 
-	if (log->w_off != reader->r_off)
+	if (reader_ready(reader))
 		ret |= POLLIN | POLLRDNORM;
 	rt_mutex_unlock(&log->mutex);
 
 	return ret;
 }
 
+/*
+ * ulogger_set_version - set the ABI version of entries read by 'reader'.
+ * Version 3 numbers entries per log, which sub-rings of a per-CPU log do not
+ * allow; names are sent again after each call.
+ */
 static long ulogger_set_version(struct ulogger_reader *reader, void __user *arg)
 {
 	int version;
 	if (copy_from_user(&version, arg, sizeof(int)))
 		return -EFAULT;
 
-	if ((version < 1) || (version > 2))
+	if ((version < 1) || (version > 3))
 		return -EINVAL;
 
+	if (version == 3) {
+		if (reader->log->cpu_rings)
+			return -EINVAL;
+		if (!reader->r_names) {
+			reader->r_names = kmalloc(sizeof(*reader->r_names),
+						  GFP_KERNEL);
+			if (!reader->r_names)
+				return -ENOMEM;
+		}
+		memset(reader->r_names, 0, sizeof(*reader->r_names));
+	}
+
 	reader->r_ver = version;
 	return 0;
 }
 
+/*
+ * ulogger_set_read_pos - move the read head of 'reader' to the position of the
+ * status page read from 'arg', typically after reading entries up to there
+ * from a mapping of the log, so that poll() waits for newer entries.
+ */
+static long ulogger_set_read_pos(struct ulogger_reader *reader,
+				 void __user *arg)
+{
+	struct ulogger_log *log = reader->log;
+	__u64 pos;
+
+	/* per-CPU logs cannot be mapped */
+	if (log->cpu_rings)
+		return -EINVAL;
+
+	if (copy_from_user(&pos, arg, sizeof(pos)))
+		return -EFAULT;
+
+	if (pos > log->status->w_pos)
+		return -EINVAL;
+
+	/* older entries may have been overwritten */
+	if (pos < log->status->head)
+		pos = log->status->head;
+
+	/* count entries skipped, to number the next ones */
+	ulogger_ring_seek(&log->ring, ulogger_ring_offset(&log->ring, pos),
+			  &reader->r_off, &reader->r_dropped, &reader->r_seq);
+	return 0;
+}
+
+/*
+ * ulogger_set_read_seq - move the read head of 'reader' to the entry numbered
+ * with the sequence number read from 'arg', typically the entry following the
+ * last one consumed before a reader restarted.
+ */
+static long ulogger_set_read_seq(struct ulogger_reader *reader,
+				 void __user *arg)
+{
+	struct ulogger_log *log = reader->log;
+	__u64 seq;
+
+	/* entries of sub-rings are not numbered as a whole */
+	if (log->cpu_rings)
+		return -EINVAL;
+
+	if (copy_from_user(&seq, arg, sizeof(seq)))
+		return -EFAULT;
+
+	ulogger_ring_seek_seq(&log->ring, seq, &reader->r_off,
+			      &reader->r_dropped, &reader->r_seq);
+	return 0;
+}
+
+/*
+ * ulogger_set_watermark - only wake up 'reader' when enough bytes are readable,
+ * or some time after entries are pending (see ULOGGER_SET_WATERMARK). This is
+ * not supported by per-CPU logs, whose sub-rings are written without the lock
+ * of the log.
+ */
+static long ulogger_set_watermark(struct ulogger_reader *reader,
+				  void __user *arg)
+{
+	struct ulogger_log *log = reader->log;
+	struct ulogger_watermark wm;
+
+	if (log->cpu_rings)
+		return -EINVAL;
+
+	if (copy_from_user(&wm, arg, sizeof(wm)))
+		return -EFAULT;
+
+	/* a single byte is the default: woken up by each entry */
+	if (wm.bytes > 1) {
+		if (!reader->r_wm_bytes)
+			log->wm_readers++;
+		reader->r_wm_bytes = min_t(size_t, wm.bytes,
+					   log->ring.size / 2);
+	} else if (reader->r_wm_bytes) {
+		log->wm_readers--;
+		reader->r_wm_bytes = 0;
+	}
+	reader->r_wm_latency = (u64)wm.latency_ms * NSEC_PER_MSEC;
+	reader->r_wm_since = 0;
+
+	/* sleepers need to wait again, on the right queue */
+	wake_up_interruptible(&reader->r_wq);
+	wake_up_interruptible(&log->wq);
+	return 0;
+}
+
+static long ulogger_set_bulk_read(struct ulogger_reader *reader,
+				  void __user *arg)
+{
+	int mode;
+	if (copy_from_user(&mode, arg, sizeof(int)))
+		return -EFAULT;
+
+	if ((mode != 0) && (mode != 1))
+		return -EINVAL;
+
+	reader->r_bulk = mode;
+	return 0;
+}
+
 static long ulogger_set_raw_mode(struct file *file, void __user *arg)
 {
 	int mode;
@@ -809,19 +1241,207 @@ static long ulogger_set_raw_mode(struct file *file, void __user *arg)
 	return 0;
 }
 
+/*
+ * ulogger_write_batch - write several entries with a single lock acquisition.
+ *
+ * The whole batch is copied and validated before taking the lock of the ring,
+ * so that either all entries are written, or none. In per-CPU mode, all
+ * entries go to the same sub-ring.
+ */
+static long ulogger_write_batch(struct file *file, void __user *arg)
+{
+	struct ulogger_log *log = file_get_log(file);
+	const bool rawmode = file_get_private_flag(file);
+	struct ulogger_cpu_ring *cpu_ring;
+	struct ulogger_ring *ring;
+	struct ulogger_batch batch;
+	struct ulogger_entry header, current_header;
+	char tcomm[commlen + 4];
+	char pcomm[commlen + 4];
+	size_t off, start, len, tlen = 0, plen = 0;
+	unsigned char *buf;
+	__u32 i;
+	long ret;
+
+	if (copy_from_user(&batch, arg, sizeof(batch)))
+		return -EFAULT;
+
+	if (batch.len > ULOGGER_BATCH_MAX_LEN)
+		return -E2BIG;
+
+	if (!batch.count || !batch.len)
+		return 0;
+
+	buf = kvmalloc(batch.len, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	if (copy_from_user(buf, u64_to_user_ptr(batch.buf), batch.len)) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	/* check that all records are within buffer */
+	for (i = 0, off = 0; i < batch.count; i++) {
+		if (batch.len - off < sizeof(struct ulogger_entry)) {
+			ret = -EINVAL;
+			goto out;
+		}
+		memcpy(&header, buf + off, sizeof(header));
+		off += sizeof(struct ulogger_entry);
+		if (batch.len - off < header.len) {
+			ret = -EINVAL;
+			goto out;
+		}
+		off += header.len;
+	}
+
+	if (!rawmode)
+		get_current_header(&current_header, pcomm, &plen, tcomm, &tlen);
+
+	ring = lock_write_ring(log, &cpu_ring);
+
+	for (i = 0, off = 0; i < batch.count; i++) {
+		memcpy(&header, buf + off, sizeof(header));
+		off += sizeof(struct ulogger_entry);
+		len = header.len;
+
+		if (rawmode) {
+			header.len = min_t(size_t, len,
+					   ULOGGER_ENTRY_MAX_PAYLOAD);
+		} else {
+			memcpy(&header, &current_header, sizeof(header));
+			header.len = min_t(size_t, plen + tlen + len,
+					   ULOGGER_ENTRY_MAX_PAYLOAD);
+		}
+		header.hdr_size = sizeof(struct ulogger_entry);
+
+		/* null writes succeed, skip them */
+		if (unlikely(!len))
+			continue;
+
+		fix_up_readers(log, cpu_ring,
+			       sizeof(struct ulogger_entry) + header.len);
+		start = ring->w_off;
+		do_write_log(ring, &header, sizeof(struct ulogger_entry));
+
+		if (!rawmode) {
+			/* append null-terminated process and thread names */
+			do_write_log(ring, pcomm, plen);
+			if (tlen)
+				do_write_log(ring, tcomm, tlen);
+			do_write_log(ring, buf + off, header.len - plen - tlen);
+		} else {
+			do_write_log(ring, buf + off, header.len);
+		}
+
+		if (!cpu_ring)
+			keep_entry(log, start);
+		ring->w_seq++;
+		off += len;
+	}
+
+	/* publish entries and wake up any blocked readers */
+	unlock_write_ring(log, cpu_ring);
+
+	ret = batch.count;
+out:
+	kvfree(buf);
+	return ret;
+}
+
+/*
+ * get_cpu_rings_len - returns the number of bytes 'reader' has not read in
+ * the sub-rings of a per-CPU log.
+ *
+ * The caller needs to hold log->mutex.
+ */
+static long get_cpu_rings_len(struct ulogger_reader *reader)
+{
+	struct ulogger_log *log = reader->log;
+	struct ulogger_cpu_ring *cpu_ring;
+	unsigned int i;
+	long len = 0;
+
+	for (i = 0; i < log->nr_cpu_rings; i++) {
+		cpu_ring = &log->cpu_rings[i];
+		rt_mutex_lock(&cpu_ring->mutex);
+		len += ulogger_ring_readable(&cpu_ring->ring,
+					     reader->r_cpu[i].r_off);
+		rt_mutex_unlock(&cpu_ring->mutex);
+	}
+
+	return len;
+}
+
+/*
+ * flush_cpu_rings - flush the sub-rings of a per-CPU log, for all readers.
+ *
+ * The caller needs to hold log->mutex.
+ */
+static void flush_cpu_rings(struct ulogger_log *log)
+{
+	struct ulogger_cpu_ring *cpu_ring;
+	struct ulogger_cpu_reader *r_cpu;
+	unsigned int i;
+
+	for (i = 0; i < log->nr_cpu_rings; i++) {
+		cpu_ring = &log->cpu_rings[i];
+		rt_mutex_lock(&cpu_ring->mutex);
+		list_for_each_entry(r_cpu, &cpu_ring->readers, list) {
+			r_cpu->r_off = cpu_ring->ring.w_off;
+			r_cpu->r_dropped = 0;
+			r_cpu->r_seq = cpu_ring->ring.w_seq;
+		}
+		cpu_ring->ring.head = cpu_ring->ring.w_off;
+		cpu_ring->ring.dropped = 0;
+		cpu_ring->ring.head_seq = cpu_ring->ring.w_seq;
+		rt_mutex_unlock(&cpu_ring->mutex);
+	}
+}
+
+/*
+ * flush_keep_ring - flush the keep ring of a log, for all readers.
+ *
+ * The caller needs to hold log->mutex.
+ */
+static void flush_keep_ring(struct ulogger_log *log)
+{
+	struct ulogger_ring *ring = &log->keep->ring;
+	struct ulogger_reader *reader;
+
+	list_for_each_entry(reader, &log->readers, list) {
+		reader->k_off = ring->w_off;
+		reader->k_dropped = 0;
+		reader->k_seq = ring->w_seq;
+	}
+	ring->head = ring->w_off;
+	ring->dropped = 0;
+	ring->head_seq = ring->w_seq;
+}
+
 static long ulogger_ioctl(struct file *file, unsigned int cmd,
 			  unsigned long arg)
 {
 	struct ulogger_log *log = file_get_log(file);
 	struct ulogger_reader *reader;
+	struct ulogger_cpu_ring *cpu_ring;
+	struct ulogger_cpu_reader *r_cpu;
 	long ret = -EINVAL;
 	void __user *argp = (void __user *)arg;
 
+	/* batch writes handle locking by themselves */
+	if (cmd == ULOGGER_WRITE_BATCH) {
+		if (!(file->f_mode & FMODE_WRITE))
+			return -EBADF;
+		return ulogger_write_batch(file, argp);
+	}
+
 	rt_mutex_lock(&log->mutex);
 
 	switch (cmd) {
 	case ULOGGER_GET_LOG_BUF_SIZE:
-		ret = log->size;
+		ret = log->ring.size;
 		break;
 	case ULOGGER_GET_LOG_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -829,10 +1449,14 @@ static long ulogger_ioctl(struct file *file, unsigned int cmd,
 			break;
 		}
 		reader = file_get_private_ptr(file);
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
+		if (log->cpu_rings)
+			ret = get_cpu_rings_len(reader);
 		else
-			ret = (log->size - reader->r_off) + log->w_off;
+			ret = ulogger_ring_readable(&log->ring, reader->r_off);
+		/* dropped entries may still be read from the keep ring */
+		if (log->keep && reader->r_all && reader->r_dropped)
+			ret += ulogger_ring_readable(&log->keep->ring,
+						     reader->k_off);
 		break;
 	case ULOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -841,13 +1465,29 @@ static long ulogger_ioctl(struct file *file, unsigned int cmd,
 		}
 		reader = file_get_private_ptr(file);
 
+		if (log->cpu_rings) {
+			cpu_ring = next_cpu_ring(reader, &r_cpu);
+			ret = 0;
+			if (cpu_ring) {
+				ret = ulogger_ring_record_len(&cpu_ring->ring,
+							      r_cpu->r_off,
+							      reader->r_ver,
+							      reader->r_names);
+				rt_mutex_unlock(&cpu_ring->mutex);
+			}
+			break;
+		}
+
 		if (!reader->r_all)
 			reader->r_off = get_next_entry_by_uid(
-				log, reader->r_off, current_euid());
-
-		if (log->w_off != reader->r_off)
-			ret = get_user_hdr_len(reader->r_ver) +
-			      get_entry_msg_len(log, reader->r_off);
+				&log->ring, reader->r_off, current_euid(),
+				&reader->r_seq);
+
+		if (log->ring.w_off != reader->r_off)
+			ret = ulogger_ring_record_len(&log->ring,
+						      reader->r_off,
+						      reader->r_ver,
+						      reader->r_names);
 		else
 			ret = 0;
 		break;
@@ -856,12 +1496,22 @@ static long ulogger_ioctl(struct file *file, unsigned int cmd,
 			ret = -EBADF;
 			break;
 		}
+		if (log->cpu_rings) {
+			flush_cpu_rings(log);
+			ret = 0;
+			break;
+		}
 		list_for_each_entry(reader, &log->readers, list) {
-			reader->r_off = log->w_off;
+			reader->r_off = log->ring.w_off;
 			reader->r_dropped = 0;
+			reader->r_seq = log->ring.w_seq;
 		}
-		log->head = log->w_off;
-		log->dropped = 0;
+		log->ring.head = log->ring.w_off;
+		log->ring.dropped = 0;
+		log->ring.head_seq = log->ring.w_seq;
+		ulogger_ring_mmap_end(&log->ring, log->status);
+		if (log->keep)
+			flush_keep_ring(log);
 		ret = 0;
 		break;
 	case ULOGGER_GET_VERSION:
@@ -897,6 +1547,38 @@ static long ulogger_ioctl(struct file *file, unsigned int cmd,
 #endif
 		ret = ulogger_set_raw_mode(file, argp);
 		break;
+	case ULOGGER_SET_READ_POS:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file_get_private_ptr(file);
+		ret = ulogger_set_read_pos(reader, argp);
+		break;
+	case ULOGGER_SET_READ_SEQ:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file_get_private_ptr(file);
+		ret = ulogger_set_read_seq(reader, argp);
+		break;
+	case ULOGGER_SET_BULK_READ:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file_get_private_ptr(file);
+		ret = ulogger_set_bulk_read(reader, argp);
+		break;
+	case ULOGGER_SET_WATERMARK:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file_get_private_ptr(file);
+		ret = ulogger_set_watermark(reader, argp);
+		break;
 	}
 
 	rt_mutex_unlock(&log->mutex);
@@ -904,11 +1586,55 @@ static long ulogger_ioctl(struct file *file, unsigned int cmd,
 	return ret;
 }
 
+/*
+ * ulogger_mmap - the log's mmap file operation
+ *
+ * Readers allowed to read all entries may map the status page of the log,
+ * followed by its ring buffer, read-only (see struct ulogger_mmap_status).
+ * This is not supported by per-CPU logs, nor by logs with a keep ring.
+ */
+static int ulogger_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct ulogger_reader *reader;
+	struct ulogger_log *log;
+
+	if (!(file->f_mode & FMODE_READ))
+		return -EACCES;
+
+	reader = file_get_private_ptr(file);
+	log = reader->log;
+
+	if (!reader->r_all || (vma->vm_flags & VM_WRITE))
+		return -EPERM;
+
+	/* sub-rings of per-CPU logs are not mapped, they must be read */
+	if (log->cpu_rings)
+		return -ENODEV;
+
+	/* likewise, read() merges kept entries with those of the log */
+	if (log->keep)
+		return -ENODEV;
+
+	if (vma->vm_pgoff != 0 ||
+	    vma->vm_end - vma->vm_start != PAGE_SIZE + log->ring.size)
+		return -EINVAL;
+
+	/* do not allow mprotect() to make the mapping writable */
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0))
+	vm_flags_clear(vma, VM_MAYWRITE);
+#else
+	vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+	return remap_vmalloc_range(vma, log->status, 0);
+}
+
 static const struct file_operations ulogger_fops = {
 	.owner = THIS_MODULE,
 	.read = ulogger_read,
 	.write_iter = ulogger_write_iter,
 	.poll = ulogger_poll,
+	.mmap = ulogger_mmap,
 	.unlocked_ioctl = ulogger_ioctl,
 	.compat_ioctl = ulogger_ioctl,
 	.open = ulogger_open,
@@ -922,7 +1648,14 @@ static const struct file_operations ulogger_fops = {
  */
 #define DEFINE_ULOGGER_DEVICE(VAR, NAME) \
 	static struct ulogger_log VAR = { \
-	.buffer = 0, \
+	.ring = { \
+		.buffer = NULL, \
+		.w_off = 0, \
+		.head = 0, \
+		.size = 0, \
+		.dropped = 0, \
+	}, \
+	.status = NULL, \
 	.misc = { \
 		.minor = MISC_DYNAMIC_MINOR, \
 		.name = NAME, \
@@ -933,10 +1666,9 @@ static const struct file_operations ulogger_fops = {
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
 	.readers = LIST_HEAD_INIT(VAR .readers), \
 	.mutex = __RT_MUTEX_INITIALIZER(VAR .mutex), \
-	.w_off = 0, \
-	.head = 0, \
-	.dropped = 0, \
-	.size = 0, \
+	.cpu_rings = NULL, \
+	.nr_cpu_rings = 0, \
+	.keep = NULL, \
 };
 
 DEFINE_ULOGGER_DEVICE(log_main, ULOGGER_LOG_MAIN)
@@ -954,6 +1686,12 @@ static DEFINE_MUTEX(logs_mutex);
 /* default size of ulog_main's buffer (in power of 2) */
 static int main_buffer_size = 18;
 
+/* split ulog_main's buffer into per-CPU sub-rings */
+static bool main_percpu;
+
+/* keep high priority entries of ulog_main in a companion ring */
+static bool main_keep;
+
 static int init_log(struct ulogger_log *log)
 {
 	int ret;
@@ -966,7 +1704,7 @@ static int init_log(struct ulogger_log *log)
 	}
 
 	pr_info("ulogger: created %luK log '%s'\n",
-		(unsigned long)log->size >> 10, log->misc.name);
+		(unsigned long)log->ring.size >> 10, log->misc.name);
 
 	return 0;
 }
@@ -986,9 +1724,11 @@ static ssize_t ulogger_show_logs(struct device *dev,
 	for (i = 0; i < ARRAY_SIZE(ulogger_logs); i++) {
 		if (ulogger_logs[i] == NULL)
 			break;
-		count += scnprintf(&buf[count], length, "%s %u\n",
+		count += scnprintf(&buf[count], length, "%s %u%s%s\n",
 				   ulogger_logs[i]->misc.name,
-				   ffs(ulogger_logs[i]->size) - 1);
+				   ffs(ulogger_logs[i]->ring.size) - 1,
+				   ulogger_logs[i]->cpu_rings ? " percpu" : "",
+				   ulogger_logs[i]->keep ? " keep" : "");
 	}
 
 	mutex_unlock(&logs_mutex);
@@ -996,6 +1736,111 @@ static ssize_t ulogger_show_logs(struct device *dev,
 	return count;
 }
 
+/*
+ * Allocate the ring buffer of 'log', of 'size' bytes, after its status page;
+ * both are mapped to userspace by ulogger_mmap().
+ */
+static int alloc_ring(struct ulogger_log *log, unsigned long size)
+{
+	log->status = vmalloc_user(PAGE_SIZE + size);
+	if (!log->status)
+		return -ENOMEM;
+
+	log->status->size = size;
+	log->status->offset = PAGE_SIZE;
+	log->ring.buffer = (unsigned char *)log->status + PAGE_SIZE;
+	log->ring.size = size;
+	/* sequence numbers start at 1 */
+	log->ring.w_seq = 1;
+	log->ring.head_seq = 1;
+	return 0;
+}
+
+/*
+ * Allocate the per-CPU sub-rings of 'log', sharing 'size' bytes, with at least
+ * 16 kB per sub-ring; they are not mapped to userspace.
+ */
+static int alloc_cpu_rings(struct ulogger_log *log, unsigned long size)
+{
+	struct ulogger_cpu_ring *cpu_ring;
+	unsigned long cpu_size;
+	unsigned int i;
+
+	cpu_size = max(size / roundup_pow_of_two(nr_cpu_ids), 1UL << 14);
+
+	log->cpu_rings = kcalloc(nr_cpu_ids, sizeof(*log->cpu_rings),
+				 GFP_KERNEL);
+	if (!log->cpu_rings)
+		return -ENOMEM;
+
+	log->nr_cpu_rings = nr_cpu_ids;
+	for (i = 0; i < log->nr_cpu_rings; i++) {
+		cpu_ring = &log->cpu_rings[i];
+		cpu_ring->ring.buffer = vmalloc(cpu_size);
+		if (!cpu_ring->ring.buffer)
+			return -ENOMEM;
+		cpu_ring->ring.size = cpu_size;
+		cpu_ring->ring.w_seq = 1;
+		cpu_ring->ring.head_seq = 1;
+		INIT_LIST_HEAD(&cpu_ring->readers);
+		rt_mutex_init(&cpu_ring->mutex);
+	}
+
+	/* only used to report the size of the log */
+	log->ring.size = size;
+	return 0;
+}
+
+static void free_cpu_rings(struct ulogger_log *log)
+{
+	unsigned int i;
+
+	if (!log->cpu_rings)
+		return;
+
+	for (i = 0; i < log->nr_cpu_rings; i++)
+		vfree(log->cpu_rings[i].ring.buffer);
+
+	kfree(log->cpu_rings);
+	log->cpu_rings = NULL;
+}
+
+/*
+ * Allocate the keep ring of 'log', a log of 'size' bytes, which keeps its
+ * high priority entries (see struct ulogger_ring_keep).
+ */
+static int alloc_keep_ring(struct ulogger_log *log, unsigned long size)
+{
+	struct ulogger_ring_keep *keep;
+
+	keep = kzalloc(sizeof(*keep), GFP_KERNEL);
+	if (!keep)
+		return -ENOMEM;
+
+	log->keep = keep;
+	keep->ring.size = ulogger_ring_keep_size(size);
+	keep->ring.buffer = vmalloc(keep->ring.size);
+	keep->nr_seqs = ulogger_ring_keep_nr_seqs(keep->ring.size);
+	keep->seqs = vmalloc(keep->nr_seqs * sizeof(*keep->seqs));
+	if (!keep->ring.buffer || !keep->seqs)
+		return -ENOMEM;
+
+	keep->ring.w_seq = 1;
+	keep->ring.head_seq = 1;
+	return 0;
+}
+
+static void free_keep_ring(struct ulogger_log *log)
+{
+	if (!log->keep)
+		return;
+
+	vfree(log->keep->seqs);
+	vfree(log->keep->ring.buffer);
+	kfree(log->keep);
+	log->keep = NULL;
+}
+
 static int check_buf_size(int pow2)
 {
 	/* 16 kB <= size <= 16 MB */
@@ -1003,23 +1848,39 @@ static int check_buf_size(int pow2)
 }
 
 /*
- * Dynamically allocate and register a new log device.
+ * Dynamically allocate and register a new log device, given a specification
+ * '<name> <size> [percpu|keep]': with option 'percpu', the buffer is split into
+ * per-CPU sub-rings (see struct ulogger_cpu_ring); with option 'keep', high
+ * priority entries are also kept in a companion ring (see struct
+ * ulogger_ring_keep).
  */
 static ssize_t ulogger_add_log(struct device *dev,
 			       struct device_attribute *attr, const char *buf,
 			       size_t count)
 {
 	char namebuf[16];
+	char modebuf[8];
 	int i, len, slot, ret = -EINVAL;
 	unsigned int size;
+	bool percpu = false, keep = false;
 	char *name = NULL;
-	unsigned char *buffer = NULL;
 	struct ulogger_log *log = NULL;
 
 	/* parse buffer specification */
-	if (sscanf(buf, "%15s %u", namebuf, &size) != 2)
+	ret = sscanf(buf, "%15s %u %7s", namebuf, &size, modebuf);
+	if (ret < 2)
 		goto bad_spec;
 
+	if (ret == 3) {
+		percpu = (strcmp(modebuf, "percpu") == 0);
+		keep = (strcmp(modebuf, "keep") == 0);
+	}
+	if (ret == 3 && !percpu && !keep) {
+		ret = -EINVAL;
+		goto bad_spec;
+	}
+	ret = -EINVAL;
+
 	/* log name should start with prefix ulog_ */
 	if (strncmp(namebuf, "ulog_", 5) != 0)
 		goto bad_spec;
@@ -1038,9 +1899,10 @@ static ssize_t ulogger_add_log(struct device *dev,
 	size = (1U << size);
 
 	log = kzalloc(sizeof(*log), GFP_KERNEL);
-	buffer = vmalloc(size);
 
-	if (!log || !buffer) {
+	if (!log || (percpu ? alloc_cpu_rings(log, size) :
+				     alloc_ring(log, size)) ||
+	    (keep && alloc_keep_ring(log, size))) {
 		pr_err("ulogger: failed to allocate log '%s' size %u\n", name,
 		       size);
 		ret = -ENOMEM;
@@ -1051,8 +1913,6 @@ static ssize_t ulogger_add_log(struct device *dev,
 	log->misc.name = name;
 	log->misc.fops = &ulogger_fops;
 	log->misc.mode = 0666;
-	log->size = size;
-	log->buffer = buffer;
 	init_waitqueue_head(&log->wq);
 	INIT_LIST_HEAD(&log->readers);
 	rt_mutex_init(&log->mutex);
@@ -1085,14 +1945,20 @@ bad_spec:
 	pr_err("ulogger: invalid buffer specification\n");
 fail:
 	kfree(name);
+	if (log) {
+		vfree(log->status);
+		free_cpu_rings(log);
+		free_keep_ring(log);
+	}
 	kfree(log);
-	vfree(buffer);
 	return ret;
 }
 
 static DEVICE_ATTR(logs, S_IWUSR | S_IRUGO, ulogger_show_logs, ulogger_add_log);
 
 module_param(main_buffer_size, int, S_IRUGO); // ulog_main's size parameter
+module_param(main_percpu, bool, S_IRUGO); // ulog_main's per-CPU parameter
+module_param(main_keep, bool, S_IRUGO); // ulog_main's keep ring parameter
 
 static int __init ulogger_init(void)
 {
@@ -1108,8 +1974,17 @@ static int __init ulogger_init(void)
 	}
 
 	size = 1UL << main_buffer_size;
-	log_main.buffer = vmalloc(size);
-	log_main.size = size;
+	if (main_percpu)
+		ret = alloc_cpu_rings(&log_main, size);
+	else
+		ret = alloc_ring(&log_main, size);
+	if (!ret && main_keep && !main_percpu)
+		ret = alloc_keep_ring(&log_main, size);
+	if (unlikely(ret)) {
+		free_cpu_rings(&log_main);
+		free_keep_ring(&log_main);
+		goto out;
+	}
 
 	/* static device 'main' is always present */
 	ret = init_log(&log_main);
@@ -1125,7 +2000,9 @@ out:
 static void delete_log(struct ulogger_log *current_log)
 {
 	misc_deregister(&current_log->misc);
-	vfree(current_log->buffer);
+	vfree(current_log->status);
+	free_cpu_rings(current_log);
+	free_keep_ring(current_log);
 	kfree(current_log->misc.name);
 	kfree(current_log);
 }
@@ -1136,7 +2013,9 @@ static void __exit ulogger_exit(void)
 
 	device_remove_file(log_main.misc.this_device, &dev_attr_logs);
 	misc_deregister(&log_main.misc);
-	vfree(log_main.buffer);
+	vfree(log_main.status);
+	free_cpu_rings(&log_main);
+	free_keep_ring(&log_main);
 
 	mutex_lock(&logs_mutex);
 
@@ -53,12 +53,86 @@ struct ulogger_entry {
 	char msg[0]; /* the entry's payload */
 };
 
+/*
+ * The structure for version 3 of the ulogger_entry ABI, returned to userspace
+ * if ioctl(ULOGGER_SET_VERSION) is called with version 3: log entries
+ * numbered with a per-log sequence number, without process and thread names,
+ * which are sent in separate records when they change (see the userspace
+ * version of this header).
+ */
+struct ulogger_entry_v3 {
+	__u16 len; /* length of the payload */
+	__u16 hdr_size; /* sizeof(struct ulogger_entry_v3) */
+	__u16 type; /* record type, ULOGGER_RECORD_* */
+	__u16 __pad;
+	__s32 pid; /* generating process's pid */
+	__s32 tid; /* generating process's tid */
+	__s32 sec; /* seconds since Epoch */
+	__s32 nsec; /* nanoseconds */
+	__u64 seq; /* sequence number in log */
+	char msg[0]; /* the record's payload */
+};
+
+#define ULOGGER_RECORD_ENTRY 0 /* a log entry, without names */
+#define ULOGGER_RECORD_NAMES 1 /* process and thread names */
+
+#define ULOGGER_NAMES_SLOTS 256
+
 #define ULOGGER_LOG_MAIN "ulog_main" /* everything else */
 
 #define ULOGGER_ENTRY_MAX_PAYLOAD 4076
 
 #define ULOGGER_MAX_LOGS 16
 
+/*
+ * Argument of ioctl(ULOGGER_WRITE_BATCH): 'count' records packed back to back
+ * in user buffer 'buf' of 'len' bytes. Each record is a struct ulogger_entry
+ * header followed by 'entry.len' payload bytes. In raw mode, the payload and
+ * header fields are the same as for a raw write(); otherwise only 'entry.len'
+ * is used and the payload is <priority:4><tag>\0<message>, as for write().
+ */
+struct ulogger_batch {
+	__u64 buf; /* user pointer to packed records */
+	__u32 len; /* size of buffer, at most ULOGGER_BATCH_MAX_LEN */
+	__u32 count; /* number of records in buffer */
+};
+
+#define ULOGGER_BATCH_MAX_LEN (64 * 1024)
+
+/*
+ * Status page of a log mapped by a reader with mmap(): the mapping is
+ * 'offset' bytes of status (one page), followed by the ring buffer of 'size'
+ * bytes, read-only. Positions are byte counters which never wrap; position
+ * 'pos' is at offset (pos & (size-1)) in the ring buffer.
+ *
+ * Entries are stored as struct ulogger_entry headers (version 2) followed by
+ * their payload, and may wrap. Complete entries lie between 'head' and
+ * 'w_pos'; a writer may be overwriting data up to position 'w_next'. A reader
+ * copies the entry at its position, then reads 'w_next' (after a read
+ * barrier): if it is more than 'size' bytes past the entry, the copy may be
+ * corrupted and the reader restarts from 'head'. Once it has caught up with
+ * 'w_pos', a reader moves its file position there with
+ * ioctl(ULOGGER_SET_READ_POS, &pos), then waits for new entries with poll().
+ */
+struct ulogger_mmap_status {
+	__u32 size; /* size of the ring buffer */
+	__u32 offset; /* offset of the ring buffer in the mapping */
+	__u64 head; /* position of the oldest entry */
+	__u64 w_pos; /* position after the last complete entry */
+	__u64 w_next; /* position after data being written */
+};
+
+/*
+ * Argument of ioctl(ULOGGER_SET_WATERMARK): a reader is only woken up when at
+ * least 'bytes' bytes are readable, or 'latency_ms' milliseconds after entries
+ * became pending (0 for no such bound). A 'bytes' of 0 or 1 is the default,
+ * waking up the reader for each entry.
+ */
+struct ulogger_watermark {
+	__u32 bytes; /* bytes readable, at most half of the log */
+	__u32 latency_ms; /* maximum delay of pending entries, or 0 */
+};
+
 #define __ULOGGERIO 0xAE
 
 #define ULOGGER_GET_LOG_BUF_SIZE _IO(__ULOGGERIO, 21) /* size of log */
@@ -68,5 +142,10 @@ struct ulogger_entry {
 #define ULOGGER_GET_VERSION _IO(__ULOGGERIO, 25) /* abi version */
 #define ULOGGER_SET_VERSION _IO(__ULOGGERIO, 26) /* abi version */
 #define ULOGGER_SET_RAW_MODE _IO(__ULOGGERIO, 27) /* write raw logs*/
+#define ULOGGER_WRITE_BATCH _IO(__ULOGGERIO, 28) /* write several logs */
+#define ULOGGER_SET_READ_POS _IO(__ULOGGERIO, 29) /* move mmap reader */
+#define ULOGGER_SET_BULK_READ _IO(__ULOGGERIO, 30) /* read several logs */
+#define ULOGGER_SET_READ_SEQ _IO(__ULOGGERIO, 31) /* seek reader to entry */
+#define ULOGGER_SET_WATERMARK _IO(__ULOGGERIO, 32) /* batch reader wakeups */
 
 #endif /* _LINUX_ULOGGER_H */
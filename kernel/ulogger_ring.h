@@ -0,0 +1,920 @@
+/*
+ * ulogger_ring.h
+ *
+ * Ring buffer core of the ulogger driver, shared by the kernel module and by
+ * the userspace emulation of ulogger devices (see libulogger-emu).
+ *
+ * Copyright (C) 2024 Parrot S.A.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * This file only contains buffer arithmetic and copies, and no locking: all
+ * functions must be called with the lock protecting the ring held. It does
+ * not include any header by itself; the including file must provide size_t,
+ * ssize_t, memcpy(), snprintf(), EFAULT, EINVAL, struct ulogger_entry,
+ * struct ulogger_entry_v3, struct user_ulogger_entry_compat,
+ * struct ulogger_mmap_status and ULOGGER_NAMES_SLOTS.
+ *
+ * Data read from the ring is copied with ulogger_ring_copy_out(), which
+ * returns non-zero on failure. It defaults to memcpy(); the kernel overrides
+ * it with copy_to_user().
+ *
+ * The status page of readers mapping the ring is updated with
+ * ulogger_ring_write_once() and ordered with ulogger_ring_wmb(), which
+ * default to compiler builtins; the kernel overrides them with WRITE_ONCE()
+ * and smp_wmb().
+ */
+
+#ifndef _ULOGGER_RING_H
+#define _ULOGGER_RING_H
+
+#ifndef __user
+#define __user
+#endif
+
+#ifndef ulogger_ring_copy_out
+#define ulogger_ring_copy_out(dst, src, n) (memcpy((dst), (src), (n)), 0)
+#endif
+
+#ifndef ulogger_ring_write_once
+#define ulogger_ring_write_once(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#endif
+
+#ifndef ulogger_ring_wmb
+#define ulogger_ring_wmb() __atomic_thread_fence(__ATOMIC_RELEASE)
+#endif
+
+/*
+ * struct ulogger_ring - the circular buffer of a log, and its offsets
+ *
+ * Readers are not tracked here: each reader owns a read offset (r_off) and a
+ * count of entries it missed (r_dropped), which must be fixed up by the owner
+ * of the ring before each write using ulogger_ring_fix_up().
+ *
+ * Entries are numbered, without storing numbers in the ring: 'w_seq' is the
+ * sequence number of the next entry written, which the owner of the ring
+ * increments after each write, and the entry at 'head' is numbered
+ * 'head_seq' + 'dropped'. Likewise, each reader owns a number 'r_seq' such
+ * that the entry at 'r_off' is numbered 'r_seq' + 'r_dropped', which remains
+ * true when ulogger_ring_fix_up() pulls the reader forward.
+ */
+struct ulogger_ring {
+	unsigned char *buffer; /* the ring buffer itself */
+	size_t w_off; /* current write head offset */
+	size_t head; /* new readers start here */
+	size_t size; /* size of the log, a power of two */
+	size_t dropped; /* number of globally dropped entries */
+	unsigned long long w_seq; /* sequence number of the next entry */
+	unsigned long long head_seq; /* sequence number at head, less dropped */
+};
+
+/*
+ * struct ulogger_ring_names - the names a reader of ABI version 3 got, as a
+ * hash of the names of the last thread seen in each slot of ULOGGER_NAMES_SLOTS
+ * (indexed by tid).
+ */
+struct ulogger_ring_name {
+	int pid;
+	int tid;
+	unsigned int hash; /* 0 if slot is unused */
+};
+
+struct ulogger_ring_names {
+	struct ulogger_ring_name slots[ULOGGER_NAMES_SLOTS];
+};
+
+/*
+ * struct ulogger_ring_keep - a companion ring of a log, keeping a copy of its
+ * entries at ULOGGER_KEEP_PRIORITY and above: they are only overwritten there
+ * by other such entries, however much lower priority entries are written.
+ *
+ * Entries of 'ring' are numbered like those of a log, and 'seqs' holds the
+ * number in the log of the entry numbered 'n' in 'ring' at n % 'nr_seqs'
+ * (at least the number of entries which fit in 'ring'). Readers own offsets
+ * in 'ring' like in the log, fixed up by the owner before each copy.
+ */
+struct ulogger_ring_keep {
+	struct ulogger_ring ring; /* copies of high priority entries */
+	unsigned long long *seqs; /* their numbers in the log */
+	size_t nr_seqs; /* size of 'seqs' */
+};
+
+#define ULOGGER_KEEP_PRIORITY	4 /* ULOG_WARN */
+#define ULOGGER_KEEP_MIN_SIZE	(8*1024) /* enough for any entry */
+
+/* size of the keep ring of a log of 'size' bytes, a power of two */
+static inline size_t ulogger_ring_keep_size(size_t size)
+{
+	return (size / 4 > ULOGGER_KEEP_MIN_SIZE) ? size / 4 :
+		ULOGGER_KEEP_MIN_SIZE;
+}
+
+/* number of sequence numbers needed by a keep ring of 'size' bytes */
+static inline size_t ulogger_ring_keep_nr_seqs(size_t size)
+{
+	return size / sizeof(struct ulogger_entry) + 1;
+}
+
+static inline size_t ulogger_ring_min(size_t a, size_t b)
+{
+	return (a < b) ? a : b;
+}
+
+/* ulogger_ring_offset - returns index 'n' into the ring (optimized modulus) */
+static inline size_t ulogger_ring_offset(const struct ulogger_ring *ring,
+					 size_t n)
+{
+	return n & (ring->size - 1);
+}
+
+/*
+ * ulogger_ring_entry_header - returns a pointer to the ulogger_entry header
+ * within 'ring' starting at offset 'off'. A temporary ulogger_entry 'scratch'
+ * must be provided. Typically the return value will be a pointer within
+ * 'ring->buffer'.  However, a pointer to 'scratch' may be returned if
+ * the log entry spans the end and beginning of the circular buffer.
+ */
+static inline struct ulogger_entry *
+ulogger_ring_entry_header(const struct ulogger_ring *ring, size_t off,
+			  struct ulogger_entry *scratch)
+{
+	size_t len = ulogger_ring_min(sizeof(struct ulogger_entry),
+				      ring->size - off);
+	if (len != sizeof(struct ulogger_entry)) {
+		memcpy((char *)scratch, ring->buffer + off, len);
+		memcpy((char *)scratch + len, ring->buffer,
+		       sizeof(struct ulogger_entry) - len);
+		return scratch;
+	}
+
+	return (struct ulogger_entry *)(ring->buffer + off);
+}
+
+/*
+ * ulogger_ring_entry_msg_len - Grabs the length of the message of the entry
+ * starting from from 'off'.
+ *
+ * In the log, the length does not include the size of the log entry structure.
+ */
+static inline size_t ulogger_ring_entry_msg_len(const struct ulogger_ring *ring,
+						size_t off)
+{
+	struct ulogger_entry scratch;
+	struct ulogger_entry *entry;
+
+	entry = ulogger_ring_entry_header(ring, off, &scratch);
+	return entry->len;
+}
+
+/*
+ * ulogger_ring_entry_time - returns the timestamp of the entry starting from
+ * 'off', in nanoseconds, to merge entries of several rings in time order.
+ */
+static inline unsigned long long
+ulogger_ring_entry_time(const struct ulogger_ring *ring, size_t off)
+{
+	struct ulogger_entry scratch;
+	struct ulogger_entry *entry;
+
+	entry = ulogger_ring_entry_header(ring, off, &scratch);
+	return (unsigned long long)entry->sec * 1000000000ULL +
+	       (unsigned int)entry->nsec;
+}
+
+/* size of the entry header returned to readers of ABI version 'ver' */
+static inline size_t ulogger_ring_user_hdr_len(int ver)
+{
+	if (ver < 2)
+		return sizeof(struct user_ulogger_entry_compat);
+	else if (ver == 2)
+		return sizeof(struct ulogger_entry);
+	else
+		return sizeof(struct ulogger_entry_v3);
+}
+
+/*
+ * ulogger_ring_copy_header - copies the header of 'entry' in version 'ver' to
+ * 'buf'; record type 'type' and sequence number 'seq' are only used by
+ * version 3.
+ */
+static inline int ulogger_ring_copy_header(int ver,
+					   const struct ulogger_entry *entry,
+					   unsigned int type,
+					   unsigned long long seq,
+					   char __user *buf)
+{
+	const void *hdr;
+	size_t hdr_len;
+	struct user_ulogger_entry_compat v1;
+	struct ulogger_entry_v3 v3;
+
+	if (ver < 2) {
+		v1.len = entry->len;
+		v1.__pad = 0;
+		v1.pid = entry->pid;
+		v1.tid = entry->tid;
+		v1.sec = entry->sec;
+		v1.nsec = entry->nsec;
+		hdr = &v1;
+		hdr_len = sizeof(struct user_ulogger_entry_compat);
+	} else if (ver == 2) {
+		hdr = entry;
+		hdr_len = sizeof(struct ulogger_entry);
+	} else {
+		v3.len = entry->len;
+		v3.hdr_size = sizeof(struct ulogger_entry_v3);
+		v3.type = type;
+		v3.__pad = 0;
+		v3.pid = entry->pid;
+		v3.tid = entry->tid;
+		v3.sec = entry->sec;
+		v3.nsec = entry->nsec;
+		v3.seq = seq;
+		hdr = &v3;
+		hdr_len = sizeof(struct ulogger_entry_v3);
+	}
+
+	return ulogger_ring_copy_out(buf, hdr, hdr_len);
+}
+
+/*
+ * ulogger_ring_copy_payload - copies 'count' bytes starting at offset 'off'
+ * of the ring, which may wrap, to buffer 'buf'.
+ */
+static inline int ulogger_ring_copy_payload(const struct ulogger_ring *ring,
+					    size_t off, char __user *buf,
+					    size_t count)
+{
+	size_t len;
+
+	off = ulogger_ring_offset(ring, off);
+
+	/*
+	 * We read from the msg in two disjoint operations. First, we read from
+	 * the current msg head offset up to 'count' bytes or to the end of
+	 * the log, whichever comes first.
+	 */
+	len = ulogger_ring_min(count, ring->size - off);
+	if (ulogger_ring_copy_out(buf, ring->buffer + off, len))
+		return -EFAULT;
+
+	/*
+	 * Second, we read any remaining bytes, starting back at the head of
+	 * the log.
+	 */
+	if (count != len)
+		if (ulogger_ring_copy_out(buf + len, ring->buffer, count - len))
+			return -EFAULT;
+
+	return 0;
+}
+
+/*
+ * ulogger_ring_read_drop_summary - provides a summary of '*r_dropped' dropped
+ * log entries to buffer 'buf', as an entry of log 'name' with the timestamp
+ * of the entry at 'r_off', numbered '*r_seq' like the first dropped entry.
+ * Resets '*r_dropped' on success, and skips their numbers in '*r_seq'.
+ */
+static inline ssize_t ulogger_ring_read_drop_summary(
+	const struct ulogger_ring *ring, const char *name, size_t r_off,
+	int r_ver, size_t *r_dropped, unsigned long long *r_seq,
+	char __user *buf, size_t count)
+{
+	int ret;
+	size_t hdrlen;
+	char msgbuf[128];
+	const char *msg = msgbuf;
+	struct ulogger_entry *entry;
+	struct ulogger_entry summary, scratch;
+
+	entry = ulogger_ring_entry_header(ring, r_off, &scratch);
+
+	/* build a fake log entry indicating how many entries were dropped */
+	memcpy(&summary, entry, sizeof(summary));
+	summary.pid = -1;
+	summary.tid = -1;
+
+	ret = snprintf(msgbuf, sizeof(msgbuf),
+		       /* <pname>\0<tname>\0<priority:4><tag>\0<message> */
+		       "%c%c%c%c%c%s%c%d log entries dropped\n",
+		       '\0', /* empty pname, no thread (pid=tid) */
+		       4, 0, 0, 0, /* WARN prio level */
+		       name, /* tag */
+		       '\0', /* tag trailing null byte */
+		       (int)*r_dropped);
+
+	if ((ret < 0) || (ret >= (int)sizeof(msgbuf)))
+		return -EFAULT;
+
+	summary.len = ret + 1; /* count trailing null byte */
+	hdrlen = ulogger_ring_user_hdr_len(r_ver);
+
+	/* version 3 entries have no names */
+	if (r_ver >= 3) {
+		msg++;
+		summary.len--;
+	}
+
+	if (count < hdrlen + summary.len)
+		return -EINVAL;
+
+	if (ulogger_ring_copy_header(r_ver, &summary, ULOGGER_RECORD_ENTRY,
+				     *r_seq, buf))
+		return -EFAULT;
+
+	buf += hdrlen;
+
+	if (ulogger_ring_copy_out(buf, msg, summary.len))
+		return -EFAULT;
+
+	*r_seq += *r_dropped;
+	*r_dropped = 0;
+	return hdrlen + summary.len;
+}
+
+/*
+ * ulogger_ring_read - reads exactly 'count' bytes (the header in version
+ * 'r_ver' followed by the payload) of the entry at '*r_off' into buffer 'buf',
+ * and advances '*r_off' to the next entry. Returns 'count' on success.
+ */
+static inline ssize_t ulogger_ring_read(const struct ulogger_ring *ring,
+					size_t *r_off, int r_ver,
+					char __user *buf, size_t count)
+{
+	struct ulogger_entry scratch;
+	struct ulogger_entry *entry;
+	size_t hdrlen;
+
+	/*
+	 * First, copy the header, using the version of the header requested
+	 */
+	entry = ulogger_ring_entry_header(ring, *r_off, &scratch);
+	if (ulogger_ring_copy_header(r_ver, entry, ULOGGER_RECORD_ENTRY, 0,
+				     buf))
+		return -EFAULT;
+
+	hdrlen = ulogger_ring_user_hdr_len(r_ver);
+	count -= hdrlen;
+	buf += hdrlen;
+
+	if (ulogger_ring_copy_payload(ring,
+				      *r_off + sizeof(struct ulogger_entry),
+				      buf, count))
+		return -EFAULT;
+
+	*r_off = ulogger_ring_offset(ring, *r_off +
+				     sizeof(struct ulogger_entry) + count);
+
+	return count + hdrlen;
+}
+
+/*
+ * ulogger_ring_entry_names - returns the length of the null-terminated process
+ * and thread names (thread name only if pid != tid) at the start of the
+ * payload of 'entry', at offset 'off', and their hash in '*hash'. Returns 0 if
+ * the payload does not start with names, as may happen in raw mode.
+ */
+static inline size_t ulogger_ring_entry_names(const struct ulogger_ring *ring,
+					      size_t off,
+					      const struct ulogger_entry *entry,
+					      unsigned int *hash)
+{
+	int nuls = (entry->pid != entry->tid) ? 2 : 1;
+	unsigned int h = 2166136261U; /* FNV-1a */
+	unsigned char c;
+	size_t i;
+
+	off += sizeof(struct ulogger_entry);
+	for (i = 0; i < entry->len; i++) {
+		c = ring->buffer[ulogger_ring_offset(ring, off + i)];
+		h = (h ^ c) * 16777619U;
+		if (c == '\0' && --nuls == 0) {
+			*hash = h ? h : 1;
+			return i + 1;
+		}
+	}
+
+	return 0;
+}
+
+/* ulogger_ring_names_slot - returns the slot of the thread of 'entry' */
+static inline struct ulogger_ring_name *
+ulogger_ring_names_slot(struct ulogger_ring_names *names,
+			const struct ulogger_entry *entry)
+{
+	return &names->slots[(unsigned int)entry->tid % ULOGGER_NAMES_SLOTS];
+}
+
+static inline int ulogger_ring_names_known(const struct ulogger_ring_name *slot,
+					   const struct ulogger_entry *entry,
+					   unsigned int hash)
+{
+	return slot->hash == hash && slot->pid == entry->pid &&
+	       slot->tid == entry->tid;
+}
+
+/*
+ * ulogger_ring_record_len - returns the length of the next record read at
+ * 'r_off' by a reader of ABI version 'r_ver': the entry there, or for version
+ * 3, the names record which precedes it if they are not in 'names' yet.
+ */
+static inline size_t ulogger_ring_record_len(const struct ulogger_ring *ring,
+					     size_t r_off, int r_ver,
+					     struct ulogger_ring_names *names)
+{
+	struct ulogger_entry scratch;
+	struct ulogger_entry *entry;
+	unsigned int hash = 0;
+	size_t names_len;
+
+	entry = ulogger_ring_entry_header(ring, r_off, &scratch);
+	if (r_ver < 3)
+		return ulogger_ring_user_hdr_len(r_ver) + entry->len;
+
+	names_len = ulogger_ring_entry_names(ring, r_off, entry, &hash);
+	if (names_len && !ulogger_ring_names_known(
+		    ulogger_ring_names_slot(names, entry), entry, hash))
+		return sizeof(struct ulogger_entry_v3) + names_len;
+
+	return sizeof(struct ulogger_entry_v3) + entry->len - names_len;
+}
+
+/*
+ * ulogger_ring_read_v3 - reads the next record of a reader of ABI version 3
+ * into 'buf': the names of the entry at '*r_off' if they are not in 'names'
+ * yet, or the entry itself without names, numbered '*r_seq'; in that case,
+ * advances '*r_off' and '*r_seq' to the next entry. Returns the length of the
+ * record, or -EINVAL if it does not fit in 'count' bytes.
+ */
+static inline ssize_t ulogger_ring_read_v3(const struct ulogger_ring *ring,
+					   size_t *r_off,
+					   struct ulogger_ring_names *names,
+					   unsigned long long *r_seq,
+					   char __user *buf, size_t count)
+{
+	const size_t hdrlen = sizeof(struct ulogger_entry_v3);
+	struct ulogger_entry scratch, hdr;
+	struct ulogger_entry *entry;
+	struct ulogger_ring_name *slot;
+	unsigned int hash = 0;
+	size_t names_len, start;
+
+	entry = ulogger_ring_entry_header(ring, *r_off, &scratch);
+	memcpy(&hdr, entry, sizeof(hdr));
+	start = *r_off + sizeof(struct ulogger_entry);
+	names_len = ulogger_ring_entry_names(ring, *r_off, &hdr, &hash);
+	slot = ulogger_ring_names_slot(names, &hdr);
+
+	if (names_len && !ulogger_ring_names_known(slot, &hdr, hash)) {
+		/* send names first, the entry itself is read next */
+		hdr.len = names_len;
+		if (count < hdrlen + hdr.len)
+			return -EINVAL;
+		if (ulogger_ring_copy_header(3, &hdr, ULOGGER_RECORD_NAMES,
+					     *r_seq, buf) ||
+		    ulogger_ring_copy_payload(ring, start, buf + hdrlen,
+					      hdr.len))
+			return -EFAULT;
+
+		slot->pid = hdr.pid;
+		slot->tid = hdr.tid;
+		slot->hash = hash;
+		return hdrlen + hdr.len;
+	}
+
+	hdr.len = entry->len - names_len;
+	if (count < hdrlen + hdr.len)
+		return -EINVAL;
+	if (ulogger_ring_copy_header(3, &hdr, ULOGGER_RECORD_ENTRY, *r_seq,
+				     buf) ||
+	    ulogger_ring_copy_payload(ring, start + names_len, buf + hdrlen,
+				      hdr.len))
+		return -EFAULT;
+
+	*r_off = ulogger_ring_offset(ring, start + names_len + hdr.len);
+	(*r_seq)++;
+	return hdrlen + hdr.len;
+}
+
+/*
+ * ulogger_ring_read_record - reads the next record at '*r_off' for a reader of
+ * ABI version 'r_ver' into 'buf' (see ulogger_ring_read_v3() for version 3,
+ * which needs 'names'), and advances '*r_off' and '*r_seq' past the entry
+ * read, if any. Returns the length of the record, or -EINVAL if it does not
+ * fit in 'count' bytes.
+ */
+static inline ssize_t ulogger_ring_read_record(const struct ulogger_ring *ring,
+					       size_t *r_off, int r_ver,
+					       struct ulogger_ring_names *names,
+					       unsigned long long *r_seq,
+					       char __user *buf, size_t count)
+{
+	ssize_t ret;
+
+	if (r_ver >= 3)
+		return ulogger_ring_read_v3(ring, r_off, names, r_seq, buf,
+					    count);
+
+	ret = ulogger_ring_user_hdr_len(r_ver) +
+	      ulogger_ring_entry_msg_len(ring, *r_off);
+	if (count < (size_t)ret)
+		return -EINVAL;
+
+	ret = ulogger_ring_read(ring, r_off, r_ver, buf, ret);
+	if (ret > 0)
+		(*r_seq)++;
+	return ret;
+}
+
+/*
+ * ulogger_ring_next_entry - return the offset of the first valid entry at
+ * least 'len' bytes after 'off', and the number of skipped entries in
+ * '*dropped'.
+ */
+static inline size_t ulogger_ring_next_entry(const struct ulogger_ring *ring,
+					     size_t off, size_t len,
+					     size_t *dropped)
+{
+	size_t count = 0, entries = 0;
+
+	do {
+		size_t nr = sizeof(struct ulogger_entry) +
+			    ulogger_ring_entry_msg_len(ring, off);
+		off = ulogger_ring_offset(ring, off + nr);
+		count += nr;
+		entries++;
+	} while (count < len);
+
+	*dropped = entries;
+	return off;
+}
+
+/*
+ * ulogger_ring_is_between - is a < c < b, accounting for wrapping of a, b,
+ *    and c positions in the buffer
+ *
+ * That is, if a<b, check for c between a and b
+ * and if a>b, check for c outside (not between) a and b
+ *
+ * |------- a xxxxxxxx b --------|
+ *               c^
+ *
+ * |xxxxx b --------- a xxxxxxxxx|
+ *    c^
+ *  or                    c^
+ */
+static inline int ulogger_ring_is_between(size_t a, size_t b, size_t c)
+{
+	if (a < b) {
+		/* is c between a and b? */
+		if (a < c && c <= b)
+			return 1;
+	} else {
+		/* is c outside of b through a? */
+		if (c <= b || a < c)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * ulogger_ring_fix_up - "fix up" a read offset '*off' (of a reader or of the
+ * start head) which is about to be lapped by a write of 'len' bytes, by
+ * pulling it forward to the first entry after the new write head. The count
+ * of entries lost this way is added to '*dropped'.
+ *
+ * This must be done for all offsets before calling ulogger_ring_write().
+ */
+static inline void ulogger_ring_fix_up(const struct ulogger_ring *ring,
+				       size_t len, size_t *off,
+				       size_t *dropped)
+{
+	size_t old = ring->w_off, nr;
+	size_t new = ulogger_ring_offset(ring, old + len);
+
+	if (ulogger_ring_is_between(old, new, *off)) {
+		*off = ulogger_ring_next_entry(ring, *off, len, &nr);
+		*dropped += nr;
+	}
+}
+
+/*
+ * ulogger_ring_write - writes 'count' bytes from 'buf' to 'ring'
+ */
+static inline void ulogger_ring_write(struct ulogger_ring *ring,
+				      const void *buf, size_t count)
+{
+	size_t len;
+
+	len = ulogger_ring_min(count, ring->size - ring->w_off);
+	memcpy(ring->buffer + ring->w_off, buf, len);
+
+	if (count != len)
+		memcpy(ring->buffer, (const char *)buf + len, count - len);
+
+	ring->w_off = ulogger_ring_offset(ring, ring->w_off + count);
+}
+
+/* number of bytes between read offset 'r_off' and the write head */
+static inline size_t ulogger_ring_readable(const struct ulogger_ring *ring,
+					   size_t r_off)
+{
+	if (ring->w_off >= r_off)
+		return ring->w_off - r_off;
+	else
+		return (ring->size - r_off) + ring->w_off;
+}
+
+/*
+ * ulogger_ring_seek - moves a read offset to the entry at 'off', between the
+ * start head and the write head, and updates the number of the reader: the
+ * entries in between are counted from the read offset if it is before 'off',
+ * from the start head otherwise.
+ */
+static inline void ulogger_ring_seek(const struct ulogger_ring *ring,
+				     size_t off, size_t *r_off,
+				     size_t *r_dropped,
+				     unsigned long long *r_seq)
+{
+	size_t pos = *r_off;
+	unsigned long long seq = *r_seq + *r_dropped;
+
+	if (ulogger_ring_offset(ring, off - pos) >
+	    ulogger_ring_readable(ring, pos)) {
+		pos = ring->head;
+		seq = ring->head_seq + ring->dropped;
+	}
+
+	while (pos != off && pos != ring->w_off) {
+		pos = ulogger_ring_offset(ring, pos +
+					  sizeof(struct ulogger_entry) +
+					  ulogger_ring_entry_msg_len(ring, pos));
+		seq++;
+	}
+
+	*r_off = off;
+	*r_dropped = 0;
+	*r_seq = seq;
+}
+
+/*
+ * ulogger_ring_seek_seq - moves a read offset to the entry numbered 'seq', or
+ * to the write head if it is not written yet. If entries from 'seq' on were
+ * overwritten, the reader is moved to the start head and they are reported as
+ * dropped; entries removed by a flush are not.
+ */
+static inline void ulogger_ring_seek_seq(const struct ulogger_ring *ring,
+					 unsigned long long seq,
+					 size_t *r_off, size_t *r_dropped,
+					 unsigned long long *r_seq)
+{
+	size_t pos = ring->head;
+	unsigned long long n = ring->head_seq + ring->dropped;
+
+	if (seq < n) {
+		if (seq < ring->head_seq)
+			seq = ring->head_seq;
+		*r_off = ring->head;
+		*r_dropped = (size_t)(n - seq);
+		*r_seq = seq;
+		return;
+	}
+
+	/* no need to walk from the start head if the reader is not past 'seq' */
+	if (*r_seq + *r_dropped <= seq) {
+		pos = *r_off;
+		n = *r_seq + *r_dropped;
+	}
+
+	while (n < seq && pos != ring->w_off) {
+		pos = ulogger_ring_offset(ring, pos +
+					  sizeof(struct ulogger_entry) +
+					  ulogger_ring_entry_msg_len(ring, pos));
+		n++;
+	}
+
+	*r_off = pos;
+	*r_dropped = 0;
+	*r_seq = n;
+}
+
+/*
+ * ulogger_ring_wait_ready - tells whether a reader with a watermark should be
+ * woken up: when 'bytes' bytes are readable, when entries were dropped, or
+ * 'latency' (ns, 0 if unbounded) after it first found entries pending. The
+ * reader owns '*since', the time ('now', ns) entries were first found pending,
+ * or 0. Entry timestamps are not used, raw writers may set any.
+ */
+static inline int ulogger_ring_wait_ready(const struct ulogger_ring *ring,
+					  size_t r_off, size_t r_dropped,
+					  size_t bytes,
+					  unsigned long long latency,
+					  unsigned long long *since,
+					  unsigned long long now)
+{
+	size_t avail = ulogger_ring_readable(ring, r_off);
+
+	if (avail == 0 && r_dropped == 0) {
+		*since = 0;
+		return 0;
+	}
+
+	if (*since == 0)
+		*since = now ? now : 1;
+
+	return r_dropped || avail >= bytes ||
+		(latency && now - *since >= latency);
+}
+
+/*
+ * ulogger_ring_entry_priority - returns the priority level of the entry at
+ * 'off', which follows process and thread names in its payload, or -1 if the
+ * payload is too short to have one.
+ */
+static inline int ulogger_ring_entry_priority(const struct ulogger_ring *ring,
+					     size_t off)
+{
+	struct ulogger_entry scratch;
+	struct ulogger_entry *entry;
+	unsigned char prio[4];
+	unsigned int hash, level;
+	size_t names_len, i;
+
+	entry = ulogger_ring_entry_header(ring, off, &scratch);
+	names_len = ulogger_ring_entry_names(ring, off, entry, &hash);
+	if (entry->len < names_len + sizeof(prio))
+		return -1;
+
+	off += sizeof(struct ulogger_entry) + names_len;
+	for (i = 0; i < sizeof(prio); i++)
+		prio[i] = ring->buffer[ulogger_ring_offset(ring, off + i)];
+
+	memcpy(&level, prio, sizeof(level));
+	return (int)(level & 0x7); /* ULOG_PRIO_LEVEL_MASK */
+}
+
+/*
+ * ulogger_ring_keep_write - copies the entry of 'len' bytes at 'off' in 'ring',
+ * numbered 'seq', to the write head of 'keep'. Offsets in 'keep' must have
+ * been fixed up with ulogger_ring_fix_up() beforehand.
+ */
+static inline void ulogger_ring_keep_write(struct ulogger_ring_keep *keep,
+					   const struct ulogger_ring *ring,
+					   size_t off, size_t len,
+					   unsigned long long seq)
+{
+	size_t done, n;
+
+	for (done = 0; done < len; done += n) {
+		off = ulogger_ring_offset(ring, off);
+		n = ulogger_ring_min(len - done, ring->size - off);
+		ulogger_ring_write(&keep->ring, ring->buffer + off, n);
+		off += n;
+	}
+
+	keep->seqs[keep->ring.w_seq % keep->nr_seqs] = seq;
+	keep->ring.w_seq++;
+}
+
+/*
+ * ulogger_ring_keep_next - moves a reader of 'keep' past the entries numbered
+ * before 'seq' in the log, and returns the number in the log of the entry it
+ * is left at, or 0 if there is none.
+ */
+static inline unsigned long long
+ulogger_ring_keep_next(const struct ulogger_ring_keep *keep, size_t *k_off,
+		       size_t *k_dropped, unsigned long long *k_seq,
+		       unsigned long long seq)
+{
+	unsigned long long n, s;
+
+	while (*k_off != keep->ring.w_off) {
+		n = *k_seq + *k_dropped;
+		s = keep->seqs[n % keep->nr_seqs];
+		if (s >= seq)
+			return s;
+
+		*k_off = ulogger_ring_offset(&keep->ring, *k_off +
+					     sizeof(struct ulogger_entry) +
+					     ulogger_ring_entry_msg_len(
+						     &keep->ring, *k_off));
+		*k_seq = n + 1;
+		*k_dropped = 0;
+	}
+
+	return 0;
+}
+
+/*
+ * ulogger_ring_read_dropped - reads the next record for a reader of log 'name'
+ * which missed the '*r_dropped' entries of 'ring' from number '*r_seq' on:
+ * the entries kept in 'keep' (if not NULL) among them, in order, each one
+ * preceded by a summary of the entries dropped before it, and a summary of
+ * the remaining ones. The reader owns offsets '*k_off', '*k_dropped' and
+ * '*k_seq' in 'keep'. Returns the length of the record, or -EINVAL if it does
+ * not fit in 'count' bytes.
+ */
+static inline ssize_t ulogger_ring_read_dropped(
+	const struct ulogger_ring *ring, const struct ulogger_ring_keep *keep,
+	const char *name, size_t r_off, int r_ver,
+	struct ulogger_ring_names *names, size_t *r_dropped,
+	unsigned long long *r_seq, size_t *k_off, size_t *k_dropped,
+	unsigned long long *k_seq, char __user *buf, size_t count)
+{
+	unsigned long long seq = 0, n;
+	size_t left, off;
+	ssize_t ret;
+
+	if (keep)
+		seq = ulogger_ring_keep_next(keep, k_off, k_dropped, k_seq,
+					     *r_seq);
+
+	if (seq == 0 || seq >= *r_seq + *r_dropped)
+		return ulogger_ring_read_drop_summary(ring, name, r_off, r_ver,
+						      r_dropped, r_seq, buf,
+						      count);
+
+	if (seq > *r_seq) {
+		/* summary of the entries before, as old as the kept one */
+		left = *r_dropped - (size_t)(seq - *r_seq);
+		*r_dropped -= left;
+		ret = ulogger_ring_read_drop_summary(&keep->ring, name, *k_off,
+						     r_ver, r_dropped, r_seq,
+						     buf, count);
+		*r_dropped += left;
+		return ret;
+	}
+
+	/* the kept entry, numbered as in the log; or its names first */
+	off = *k_off;
+	n = seq;
+	ret = ulogger_ring_read_record(&keep->ring, &off, r_ver, names, &n,
+				       buf, count);
+	if (ret > 0 && n != seq) {
+		*k_off = off;
+		*k_seq += *k_dropped + 1;
+		*k_dropped = 0;
+		(*r_seq)++;
+		(*r_dropped)--;
+	}
+	return ret;
+}
+
+/*
+ * ulogger_ring_mmap_pos - returns the position of the write head, given the
+ * status page 'st' of readers mapping the ring. Positions are byte counters
+ * which never wrap: position 'pos' is at offset (pos & (size-1)) in the ring.
+ */
+static inline unsigned long long
+ulogger_ring_mmap_pos(const struct ulogger_ring *ring,
+		      const struct ulogger_mmap_status *st)
+{
+	return st->w_pos + ulogger_ring_offset(ring, ring->w_off -
+					       (size_t)st->w_pos);
+}
+
+/*
+ * ulogger_ring_mmap_begin - tells readers mapping the ring that 'len' bytes
+ * are about to be written at the write head. This must be called before
+ * ulogger_ring_fix_up() for the write.
+ */
+static inline void ulogger_ring_mmap_begin(const struct ulogger_ring *ring,
+					   struct ulogger_mmap_status *st,
+					   size_t len)
+{
+	unsigned long long next = ulogger_ring_mmap_pos(ring, st) + len;
+
+	if (next > st->w_next) {
+		ulogger_ring_write_once(st->w_next, next);
+		/* readers must see 'w_next' before any overwritten data */
+		ulogger_ring_wmb();
+	}
+}
+
+/*
+ * ulogger_ring_mmap_end - publishes entries written since the last call, and
+ * the start head, to readers mapping the ring.
+ */
+static inline void ulogger_ring_mmap_end(const struct ulogger_ring *ring,
+					 struct ulogger_mmap_status *st)
+{
+	unsigned long long w_pos = ulogger_ring_mmap_pos(ring, st);
+
+	/* readers must see entries before the position covering them */
+	ulogger_ring_wmb();
+	ulogger_ring_write_once(st->w_pos, w_pos);
+	ulogger_ring_write_once(st->head, w_pos -
+				ulogger_ring_readable(ring, ring->head));
+}
+
+#endif /* _ULOGGER_RING_H */
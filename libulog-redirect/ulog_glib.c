@@ -53,7 +53,7 @@ static void glog_func(const gchar *domain, GLogLevelFlags level,
 		uloglevel = ULOG_DEBUG;
 
 	/* master cookie level, this should have been initialized */
-	masterlevel = (__ULOG_REF(ulog_glib)).level;
+	masterlevel = ulog_get_level(&__ULOG_REF(ulog_glib));
 
 	if ((uloglevel != -1) && (masterlevel >= 0)) {
 		/* use temporary cookie */
@@ -112,7 +112,7 @@ static void gst_log_func(GstDebugCategory *category, GstDebugLevel level,
 		uloglevel = ULOG_DEBUG;
 
 	/* master cookie level, this should have been initialized */
-	masterlevel = (__ULOG_REF(ulog_gst)).level;
+	masterlevel = ulog_get_level(&__ULOG_REF(ulog_gst));
 
 	if ((uloglevel != -1) && (masterlevel >= 0)) {
 		const char *filename;
@@ -9,7 +9,7 @@ LOCAL_EXPORT_CUSTOM_VARIABLES := LIBULOG_HEADERS=$\
 	$(LOCAL_PATH)/include/ulog.h:$(LOCAL_PATH)/include/ulograw.h;
 LOCAL_CFLAGS := -fvisibility=hidden
 
-LOCAL_SRC_FILES := ulog_read.c ulog_write.c
+LOCAL_SRC_FILES := ulog_read.c ulog_write.c ulog_deferred.c
 
 ifeq ("$(TARGET_OS)","windows")
   LOCAL_SRC_FILES += ulog.cpp
@@ -17,9 +17,11 @@ ifeq ("$(TARGET_OS)","windows")
 else ifeq ("$(TARGET_OS)","hexagon")
   LOCAL_SRC_FILES += ulog.cpp ulog_write_hexagon.c
 else ifeq ("$(TARGET_CPU)","hi3559-m7")
-  LOCAL_SRC_FILES += ulog_write_bin.c ulog_write_raw.c
+  LOCAL_SRC_FILES += ulog_write_async.c ulog_write_bin.c ulog_write_flight.c \
+	ulog_write_raw.c ulog_write_shm.c
 else
-  LOCAL_SRC_FILES += ulog.cpp ulog_write_android.c ulog_write_bin.c ulog_write_raw.c
+  LOCAL_SRC_FILES += ulog.cpp ulog_write_android.c ulog_write_async.c \
+	ulog_write_bin.c ulog_write_flight.c ulog_write_raw.c ulog_write_shm.c
 endif
 
 ifeq ("$(TARGET_OS)-$(TARGET_OS_FLAVOUR)","linux-android")
@@ -65,6 +67,19 @@ LOCAL_LIBRARIES := libulog libulog-stdcerr
 include $(BUILD_EXECUTABLE)
 
 
+include $(CLEAR_VARS)
+LOCAL_MODULE := libulog-bench
+LOCAL_DESCRIPTION := libulog write path microbenchmarks
+LOCAL_CATEGORY_PATH := test
+LOCAL_SRC_FILES := tests/ulogbench.c tests/ulogbench_cpp.cpp
+LOCAL_CXXFLAGS := -std=c++17
+LOCAL_LDLIBS := -lpthread
+
+LOCAL_LIBRARIES := libulog
+
+include $(BUILD_EXECUTABLE)
+
+
 include $(CLEAR_VARS)
 LOCAL_MODULE := ulog_shell_api
 LOCAL_DESCRIPTION := shell functions to ease the usage of ulog's API
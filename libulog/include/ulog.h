@@ -126,6 +126,86 @@
  *
  * To enable printing a copy of each message to stderr:
  * ULOG_STDERR=y
+ *
+ * HOW TO ENABLE ASYNCHRONOUS LOGGING
+ * ----------------------------------
+ * By default, each message is written to the kernel device by the logging
+ * thread itself. To move this system call out of the caller's path, set:
+ *
+ * ULOG_ASYNC=y     (or ULOG_ASYNC=<kB> to size the per-thread ring)
+ *
+ * Each thread then stages its messages (with their original timestamp and
+ * thread id) in a private ring buffer of 64kB by default, and a background
+ * thread forwards them to the kernel device. Messages are dropped and counted
+ * when a ring is full. Pending messages are flushed at exit, before fork() and
+ * on fatal signals (unless the application installed its own handlers); they
+ * can also be flushed explicitly with ulog_async_flush(). Asynchronous mode
+ * requires the ulogger raw mode, and silently falls back to synchronous
+ * logging when it is not available.
+ *
+ * HOW TO LOG TO SHARED MEMORY
+ * ---------------------------
+ * Instead of the kernel device, messages can be appended to a ring buffer
+ * shared by all processes, the file /dev/shm/ulog_<device>, with:
+ *
+ * ULOG_SHM=y       (or ULOG_SHM=<kB> to size the ring, 256kB by default)
+ *
+ * The ring is created by the first process logging to it; its size cannot
+ * change afterwards. Logging then costs no system call, unless a reader is
+ * waiting for new messages; the oldest messages are overwritten when the ring
+ * is full. Use 'ulogcat -b shm:<device>' to read them (see ulogshm.h for the
+ * buffer layout). The kernel device is used if the ring cannot be mapped.
+ *
+ * HOW TO USE THE FLIGHT RECORDER
+ * ------------------------------
+ * Messages above the logging level of their tag can be kept in memory, and
+ * only logged when something goes wrong. To capture them up to a given level
+ * (same syntax as ULOG_LEVEL), set for instance:
+ *
+ * ULOG_FLIGHT=D
+ *
+ * Captured messages are stored unformatted, with their timestamp and thread
+ * id, in a ring buffer of 64kB by default (ULOG_FLIGHT_SIZE=<kB>) where they
+ * overwrite the oldest ones. The ring is written out, before the message
+ * itself, when an error or critical message is logged or a message uses tag
+ * ULOG_FLIGHT_TRIGGER=<tag>, and on fatal signals (unless the application
+ * installed its own handlers). Messages keep their original timestamp if the
+ * ulogger raw mode is available. ULOG_GET_LEVEL() still returns the logging
+ * level of the tag, which is unaffected.
+ *
+ * HOW TO ENABLE DEFERRED FORMATTING
+ * ---------------------------------
+ * By default, printf-style messages are formatted by the logging thread. To
+ * leave this work to log readers, set:
+ *
+ * ULOG_DEFERRED=y
+ *
+ * The format string and the raw argument values are then logged as a binary
+ * entry, which readers decode with ulog_deferred_format() (see ulogprint.h);
+ * ulogcat does this transparently, while older readers simply ignore these
+ * entries. Messages using unsupported conversions (%n, wide strings,
+ * positional arguments) or too large to be encoded are formatted as usual.
+ * Deferred formatting only applies to the kernel device and shared memory
+ * writers, and is disabled when messages are copied to stderr or a custom
+ * write function is installed.
+ *
+ * HOW TO USE THE FORMAT STRING REGISTRY
+ * -------------------------------------
+ * To avoid logging format strings with each deferred message, define
+ * ULOG_FMT_REGISTRY before including "ulog.h" (C code only, on ELF targets):
+ *
+ * #define ULOG_FMT_REGISTRY
+ * #include "ulog.h"
+ *
+ * Each ULOG_PRI() call site then records its level, tag, location and format
+ * string (which must be a string literal) in the '__ulog_fmt' ELF section.
+ * Messages are identified by a 32-bit hash of their format string, see
+ * ulog_fmt_id(). Identifiers are used instead of format strings when:
+ *
+ * ULOG_DEFERRED=id
+ *
+ * The 'ulogfmt' tool extracts the registry of binaries into a dictionary,
+ * which ulogcat needs to render such messages (option -F).
  */
 
 #include <stdlib.h>
@@ -400,12 +480,14 @@ int ulog_get_time_monotonic(unsigned long long *now_ms);
 /*----------------------------------------------------------------------------*/
 /* Misc macros; useful for building custom logging macros */
 
-#define ULOG_PRI(_prio, ...)        ulog_log(_prio, &__ULOG_COOKIE, __VA_ARGS__)
+#define ULOG_PRI(_prio, ...)        \
+	__ULOG_LOG(_prio, &__ULOG_COOKIE, __VA_ARGS__)
 #define ULOG_PRI_VA(_prio, _f, _a)  ulog_vlog(_prio, &__ULOG_COOKIE, _f, _a)
 #define ULOG_PRI_ERRNO(_err, _pri, _fmt, ...)	\
 	do { \
 		int __ulog_errno__err = (_err); \
-		ulog_log((_pri), &__ULOG_COOKIE, "%s:%d: " _fmt " err=%d(%s)", \
+		__ULOG_LOG((_pri), &__ULOG_COOKIE, \
+		      "%s:%d: " _fmt " err=%d(%s)", \
 		      __func__, __LINE__, ##__VA_ARGS__, \
 		      __ulog_errno__err, strerror(__ulog_errno__err)); \
 	} while (0)
@@ -440,9 +522,22 @@ int ulog_get_time_monotonic(unsigned long long *now_ms);
 
 #ifndef ULOG_TAG
 #define __ULOG_COOKIE __ulog_default_cookie
+#define __ULOG_FMT_TAG ""
 #else
 __ULOG_USE_TAG(ULOG_TAG);
 #define __ULOG_COOKIE __ULOG_REF2(ULOG_TAG)
+#define __ULOG_FMT_TAG __ULOG_STR2(ULOG_TAG)
+#endif
+
+#define __ULOG_STR(_x)     #_x
+#define __ULOG_STR2(_x)    __ULOG_STR(_x)
+
+#if defined(ULOG_FMT_REGISTRY) && !defined(__cplusplus) && defined(__ELF__)
+#define __ULOG_LOG(_prio, _cookie, ...) \
+	ulog_log_fmt(_prio, _cookie, __VA_ARGS__)
+#else
+#define __ULOG_LOG(_prio, _cookie, ...) \
+	ulog_log(_prio, _cookie, __VA_ARGS__)
 #endif
 
 #ifdef __cplusplus
@@ -481,6 +576,14 @@ void ulog_log_write(uint32_t prio, struct ulog_cookie *cookie,
 	__attribute__ ((format (printf, 3, 4)));
 #endif
 
+void ulog_log_write_fmt(uint32_t prio, struct ulog_cookie *cookie,
+			uint32_t *id, const char *fmt, ...)
+#if defined(__MINGW32__) && !defined(__clang__)
+	__attribute__ ((format (gnu_printf, 4, 5)));
+#else
+	__attribute__ ((format (printf, 4, 5)));
+#endif
+
 /* force inlining of priority filtering for better performance */
 #define ulog_vlog(_prio, _cookie, _fmt, _ap)				\
 	do {								\
@@ -507,6 +610,49 @@ void ulog_log_write(uint32_t prio, struct ulog_cookie *cookie,
 			ulog_log_write(__p, (_cookie), __VA_ARGS__);	\
 	} while (0)
 
+/* Format string registry record, see ULOG_FMT_REGISTRY */
+#define ULOG_FMT_SECTION       "__ulog_fmt"
+#define ULOG_FMT_MAGIC         "\xffUF1"
+#define ULOG_FMT_LEVEL_UNKNOWN 0xff
+
+/*
+ * Record call site in registry section: magic, level, then null-terminated
+ * tag, location and format strings. Records are byte-aligned, but may be
+ * separated by null padding.
+ */
+#define __ULOG_FMT_SITE(_prio, _fmt)					\
+	static const struct __attribute__((packed)) {			\
+		char magic[4];						\
+		unsigned char level;					\
+		char tag[sizeof(__ULOG_FMT_TAG)];			\
+		char loc[sizeof(__FILE__ ":" __ULOG_STR2(__LINE__))];	\
+		char fmt[sizeof(_fmt)];					\
+	} __ulog_fmt_site						\
+	__attribute__((section(ULOG_FMT_SECTION), used, aligned(1))) = { \
+		ULOG_FMT_MAGIC,						\
+		__builtin_constant_p(_prio) ?				\
+			((_prio) & ULOG_PRIO_LEVEL_MASK) :		\
+			ULOG_FMT_LEVEL_UNKNOWN,				\
+		__ULOG_FMT_TAG,						\
+		__FILE__ ":" __ULOG_STR2(__LINE__),			\
+		_fmt,							\
+	}
+
+/* same as ulog_log(), registering format string (see ULOG_FMT_REGISTRY) */
+#define ulog_log_fmt(_prio, _cookie, _fmt, ...)				\
+	do {								\
+		uint32_t __p = (_prio);					\
+		static uint32_t __ulog_fmt_id;				\
+		__ULOG_FMT_SITE(_prio, _fmt);				\
+		if (ULOG_UNLIKELY((_cookie)->level < 0))		\
+			ulog_init_cookie((_cookie));			\
+		if ((int)(__p & ULOG_PRIO_LEVEL_MASK) <=		\
+				(_cookie)->level)			\
+			ulog_log_write_fmt(__p, (_cookie),		\
+					   &__ulog_fmt_id, _fmt,	\
+					   ##__VA_ARGS__);		\
+	} while (0)
+
 /* Log only if last message was logged at least _ms milliseconds ago */
 #define ULOG_THROTTLE(_ms, _prio, ...)					\
 	ulog_log_throttle(_ms, _prio, &__ULOG_COOKIE, __VA_ARGS__)
@@ -635,6 +781,22 @@ int ulog_foreach(void (*cb) (struct ulog_cookie *cookie, void *userdata),
  */
 int ulog_set_log_device(const char *ulog_device);
 
+/**
+ * Flush messages staged by asynchronous logging (see ULOG_ASYNC).
+ *
+ * Messages logged by the calling thread before this call are in the kernel
+ * device when it returns. Does nothing if asynchronous logging is disabled.
+ */
+void ulog_async_flush(void);
+
+/**
+ * Get the number of messages dropped by asynchronous logging because a
+ * thread ring was full.
+ *
+ * @return The number of dropped messages since the process started.
+ */
+unsigned int ulog_async_get_dropped(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,298 @@
+/**
+ * Copyright (C) 2024 Parrot S.A.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * @brief   header-only, allocation-free C++17 frontend for libulog
+ *
+ *   Usage:
+ *   #define ULOG_TAG mytag
+ *   #include "ulog_fmt.hpp"
+ *
+ *   ULOGI_FMT("opened {} in {} ms (flags {:x})", std::string_view(path),
+ *             elapsed, flags);
+ *
+ *   Each '{}' (or '{:x}', '{:X}' for hexadecimal integers) placeholder is
+ *   replaced with the next argument; '{{' and '}}' output literal braces.
+ *   The format string must be a string literal: the placeholder count is
+ *   checked against the argument count at compile time.
+ *
+ *   Messages are rendered into a stack buffer of ULOG_BUF_SIZE bytes (longer
+ *   messages are truncated) and handed to ulog_log_buf(): unlike the
+ *   iostream-based API of ulog.hpp, this involves no heap allocation, no
+ *   thread-specific data lookup and no locale. Arguments are not evaluated
+ *   if the message is filtered out by the tag level, and messages above
+ *   ULOG_FMT_MAX_LEVEL (if defined) are removed at compile time.
+ *
+ *   Supported argument types: integers, bool, char, floating point numbers,
+ *   enums, pointers, C strings, std::string and std::string_view. Other types
+ *   can be supported by specializing ulog::fmt::formatter:
+ *
+ *   template <> struct ulog::fmt::formatter<Vec3> {
+ *       static void format(ulog::fmt::Buffer &buf, const Vec3 &v) {
+ *           buf.append("(", v.x, ",", v.y, ",", v.z, ")");
+ *       }
+ *   };
+ */
+
+#ifndef _PARROT_ULOG_FMT_HPP
+#define _PARROT_ULOG_FMT_HPP
+
+#if __cplusplus < 201703L
+#error "ulog_fmt.hpp requires C++17"
+#endif
+
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+
+#include "ulog.h"
+
+/* messages with a higher (less important) level are compiled out */
+#ifndef ULOG_FMT_MAX_LEVEL
+#define ULOG_FMT_MAX_LEVEL ULOG_DEBUG
+#endif
+
+#define ULOGC_FMT(...)      ULOG_PRI_FMT(ULOG_CRIT,   __VA_ARGS__)
+#define ULOGE_FMT(...)      ULOG_PRI_FMT(ULOG_ERR,    __VA_ARGS__)
+#define ULOGW_FMT(...)      ULOG_PRI_FMT(ULOG_WARN,   __VA_ARGS__)
+#define ULOGN_FMT(...)      ULOG_PRI_FMT(ULOG_NOTICE, __VA_ARGS__)
+#define ULOGI_FMT(...)      ULOG_PRI_FMT(ULOG_INFO,   __VA_ARGS__)
+#define ULOGD_FMT(...)      ULOG_PRI_FMT(ULOG_DEBUG,  __VA_ARGS__)
+
+#define ULOG_PRI_FMT(_prio, _fmt, ...) \
+    ulog_log_fmt_cpp(_prio, __ULOG_COOKIE, _fmt, ##__VA_ARGS__)
+
+#define ulog_log_fmt_cpp(_prio, _cookie, _fmt, ...) \
+    do { \
+        static_assert(ulog::fmt::internal::check(_fmt) == \
+            std::tuple_size<decltype( \
+                std::make_tuple(__VA_ARGS__))>::value, \
+            "ulog: invalid format string or argument count mismatch"); \
+        const uint32_t __p = (_prio); \
+        if ((int)(__p & ULOG_PRIO_LEVEL_MASK) <= ULOG_FMT_MAX_LEVEL) { \
+            if (ULOG_UNLIKELY((_cookie).level < 0)) \
+                ulog_init_cookie(&(_cookie)); \
+            if ((int)(__p & ULOG_PRIO_LEVEL_MASK) <= (_cookie).level) \
+                ulog::fmt::log(__p, (_cookie), _fmt, ##__VA_ARGS__); \
+        } \
+    } while (0)
+
+namespace ulog
+{
+namespace fmt
+{
+
+// fixed-size output buffer; silently truncates
+class Buffer
+{
+    private:
+    char    mData[ULOG_BUF_SIZE];
+    size_t  mLen = 0;
+
+    public:
+    const char *data() const { return mData; }
+    size_t size() const { return mLen; }
+    size_t room() const { return sizeof(mData) - 1 - mLen; }
+
+    void write(const char *s, size_t n)
+    {
+        n = n < room() ? n : room();
+        std::memcpy(mData + mLen, s, n);
+        mLen += n;
+    }
+
+    void put(char c)
+    {
+        if (room())
+            mData[mLen++] = c;
+    }
+
+    // null-terminate contents, return length including null character
+    size_t finish()
+    {
+        mData[mLen] = '\0';
+        return mLen + 1;
+    }
+
+    template <typename T>
+    void appendInt(T v, int base = 10, bool upper = false)
+    {
+        char tmp[68];
+        auto r = std::to_chars(tmp, tmp + sizeof(tmp), v, base);
+        if (upper)
+            for (char *p = tmp; p < r.ptr; p++)
+                *p = (*p >= 'a' && *p <= 'f') ? *p - 'a' + 'A' : *p;
+        write(tmp, r.ptr - tmp);
+    }
+
+    template <typename... Args>
+    inline void append(const Args &... args);
+};
+
+// formatting of user types: specialize this template
+template <typename T, typename Enable = void>
+struct formatter;
+
+namespace internal
+{
+
+// placeholder specification
+enum class Spec { Default, Hex, HexUpper };
+
+// returns number of placeholders, or -1 if format string is invalid
+constexpr long check(std::string_view fmt)
+{
+    long count = 0;
+    for (size_t i = 0; i < fmt.size(); i++) {
+        if (fmt[i] == '}') {
+            if (i + 1 >= fmt.size() || fmt[i + 1] != '}')
+                return -1;
+            i++;
+        } else if (fmt[i] == '{') {
+            if (i + 1 < fmt.size() && fmt[i + 1] == '{') {
+                i++;
+                continue;
+            }
+            size_t end = fmt.find('}', i);
+            if (end == std::string_view::npos)
+                return -1;
+            std::string_view spec = fmt.substr(i + 1, end - i - 1);
+            if (spec != "" && spec != ":x" && spec != ":X")
+                return -1;
+            count++;
+            i = end;
+        }
+    }
+    return count;
+}
+
+template <typename T>
+void formatArg(Buffer &buf, const T &v, Spec spec)
+{
+    using U = std::decay_t<T>;
+
+    if constexpr (std::is_same_v<U, bool>) {
+        buf.append(v ? "true" : "false");
+    } else if constexpr (std::is_same_v<U, char>) {
+        buf.put(v);
+    } else if constexpr (std::is_integral_v<U>) {
+        if (spec == Spec::Default)
+            buf.appendInt(v);
+        else
+            buf.appendInt(static_cast<std::make_unsigned_t<U>>(v), 16,
+                          spec == Spec::HexUpper);
+    } else if constexpr (std::is_enum_v<U>) {
+        formatArg(buf, static_cast<std::underlying_type_t<U>>(v), spec);
+    } else if constexpr (std::is_floating_point_v<U>) {
+        // same rendering as default ostream precision
+        char tmp[32];
+        int n = std::snprintf(tmp, sizeof(tmp), "%g", (double)v);
+        if (n > 0)
+            buf.write(tmp, (size_t)n < sizeof(tmp) ? n : sizeof(tmp) - 1);
+    } else if constexpr (std::is_null_pointer_v<U>) {
+        buf.write("0x0", 3);
+    } else if constexpr (std::is_convertible_v<const U &, std::string_view>) {
+        std::string_view sv;
+        if constexpr (std::is_pointer_v<U>) {
+            // character arrays decay here
+            const char *p = v;
+            sv = p ? std::string_view(p) : std::string_view("(null)");
+        } else {
+            sv = v;
+        }
+        buf.write(sv.data(), sv.size());
+    } else if constexpr (std::is_pointer_v<U>) {
+        const void *p = v;
+        buf.write("0x", 2);
+        buf.appendInt(reinterpret_cast<uintptr_t>(p), 16,
+                      spec == Spec::HexUpper);
+    } else {
+        formatter<U>::format(buf, v);
+    }
+}
+
+// output literal text up to the next placeholder, return its specification
+inline bool nextPlaceholder(Buffer &buf, std::string_view &fmt, Spec &spec)
+{
+    while (!fmt.empty()) {
+        size_t pos = fmt.find_first_of("{}");
+        buf.write(fmt.data(), pos == std::string_view::npos ?
+                  fmt.size() : pos);
+        if (pos == std::string_view::npos) {
+            fmt = std::string_view();
+            break;
+        }
+        if (pos + 1 < fmt.size() && fmt[pos + 1] == fmt[pos]) {
+            // escaped brace
+            buf.put(fmt[pos]);
+            fmt.remove_prefix(pos + 2);
+            continue;
+        }
+        size_t end = fmt.find('}', pos);
+        if (end == std::string_view::npos)
+            end = fmt.size() - 1;
+        std::string_view s = fmt.substr(pos + 1, end - pos - 1);
+        spec = (s == ":x") ? Spec::Hex :
+               (s == ":X") ? Spec::HexUpper : Spec::Default;
+        fmt.remove_prefix(end + 1);
+        return true;
+    }
+    return false;
+}
+
+inline void render(Buffer &buf, std::string_view fmt)
+{
+    Spec spec;
+    // remaining placeholders (if any) have no argument: drop them
+    while (nextPlaceholder(buf, fmt, spec))
+        ;
+}
+
+template <typename T, typename... Args>
+void render(Buffer &buf, std::string_view fmt, const T &arg,
+            const Args &... args)
+{
+    Spec spec = Spec::Default;
+    if (nextPlaceholder(buf, fmt, spec))
+        formatArg(buf, arg, spec);
+    render(buf, fmt, args...);
+}
+
+} // namespace internal
+
+template <typename... Args>
+inline void Buffer::append(const Args &... args)
+{
+    (internal::formatArg(*this, args, internal::Spec::Default), ...);
+}
+
+// render and log a message; level filtering is done by the caller
+template <typename... Args>
+void log(uint32_t prio, struct ulog_cookie &cookie, std::string_view fmt,
+         const Args &... args)
+{
+    Buffer buf;
+    internal::render(buf, fmt, args...);
+    size_t len = buf.finish();
+    ulog_log_buf(prio, &cookie, buf.data(), (int)len);
+}
+
+} // namespace fmt
+} // namespace ulog
+
+#endif
@@ -85,6 +85,28 @@ int ulog_bin_writev(int fd,
 	const struct iovec *iov,
 	int iovcnt);
 
+/**
+ * Log several binary ulog entries with the same tag at once. The priority
+ * will be set to INFO and always logged
+ *
+ * Entries are written with as few system calls as possible (see
+ * ULOGGER_WRITE_BATCH); with older drivers, this falls back to one write per
+ * entry. Each element of @iov is the payload of one entry, truncated to the
+ * maximum entry size.
+ *
+ * @param fd      A descriptor returned by @ulog_bin_open().
+ * @param tag     tag associated with the logs.
+ * @param tagsize tag length + 1 (so including nul byte).
+ * @param iov     array of entry payloads.
+ * @param count   number of entries in iovec array.
+ * @return        0 if successful, -errno upon failure.
+ */
+int ulog_bin_write_batch(int fd,
+	const char *tag,
+	size_t tagsize,
+	const struct iovec *iov,
+	int count);
+
 /**
  * Similar to ulog_bin_write, but the payload data will be split into chunks
  * to avoid truncation. the provided header (optional) will be written for all
@@ -54,6 +54,82 @@ struct ulogger_entry {
 	char		msg[0];		/* the entry's payload */
 };
 
+/*
+ * The structure for version 3 of the ulogger_entry ABI.
+ * This structure is returned to userspace if ioctl(ULOGGER_SET_VERSION)
+ * is called with version 3. Each record is either a log entry, numbered
+ * with a per-log sequence number, or the names of a thread.
+ *
+ * Entries (ULOGGER_RECORD_ENTRY) do not carry process and thread names: their
+ * payload is <priority:4><tag>\0<message>. Instead, a names record
+ * (ULOGGER_RECORD_NAMES) with payload <pname>\0[<tname>\0] (thread name only
+ * if pid != tid) precedes the first entry of a thread, and the first entry
+ * read after its names changed. A reader needs to remember names of
+ * ULOGGER_NAMES_SLOTS threads only: names are also sent again for a thread
+ * whose slot (tid % ULOGGER_NAMES_SLOTS) was used by another thread since.
+ *
+ * The sequence number of a names record is the one of the entry it precedes.
+ * Sequence numbers start at 1; a gap means that entries were dropped, or
+ * could not be read by the caller. A summary of dropped entries (pid and tid
+ * of -1) is numbered with the first dropped entry. In logs with a keep ring,
+ * high priority entries still kept there are read among dropped ones, with
+ * their own number, so that a summary only covers the entries up to the next
+ * kept one. Logs split into per-CPU sub-rings do not support version 3.
+ */
+struct ulogger_entry_v3 {
+	uint16_t	len;		/* length of the payload */
+	uint16_t	hdr_size;	/* sizeof(struct ulogger_entry_v3) */
+	uint16_t	type;		/* record type, ULOGGER_RECORD_* */
+	uint16_t	__pad;
+	int32_t		pid;		/* generating process's pid */
+	int32_t		tid;		/* generating process's tid */
+	int32_t		sec;		/* seconds since Epoch */
+	int32_t		nsec;		/* nanoseconds */
+	uint64_t	seq;		/* sequence number in log */
+	char		msg[0];		/* the record's payload */
+};
+
+#define ULOGGER_RECORD_ENTRY	0	/* a log entry, without names */
+#define ULOGGER_RECORD_NAMES	1	/* process and thread names */
+
+#define ULOGGER_NAMES_SLOTS	256
+
+/*
+ * Argument of ioctl(ULOGGER_WRITE_BATCH): 'count' records packed back to back
+ * in buffer 'buf' of 'len' bytes. Each record is a struct ulogger_entry header
+ * followed by 'entry.len' payload bytes. In raw mode, the payload and header
+ * fields are the same as for a raw write(); otherwise only 'entry.len' is used
+ * and the payload is <priority:4><tag>\0<message>, as for write().
+ */
+struct ulogger_batch {
+	uint64_t	buf;	/* pointer to packed records */
+	uint32_t	len;	/* size of buffer, <= ULOGGER_BATCH_MAX_LEN */
+	uint32_t	count;	/* number of records in buffer */
+};
+
+/*
+ * Status page of a log mapped by a reader with mmap(): the mapping is
+ * 'offset' bytes of status (one page), followed by the ring buffer of 'size'
+ * bytes, read-only. Positions are byte counters which never wrap; position
+ * 'pos' is at offset (pos & (size-1)) in the ring buffer.
+ *
+ * Entries are stored as struct ulogger_entry headers (version 2) followed by
+ * their payload, and may wrap. Complete entries lie between 'head' and
+ * 'w_pos'; a writer may be overwriting data up to position 'w_next'. A reader
+ * copies the entry at its position, then reads 'w_next' (after a read
+ * barrier): if it is more than 'size' bytes past the entry, the copy may be
+ * corrupted and the reader restarts from 'head'. Once it has caught up with
+ * 'w_pos', a reader moves its file position there with
+ * ioctl(ULOGGER_SET_READ_POS, &pos), then waits for new entries with poll().
+ */
+struct ulogger_mmap_status {
+	uint32_t	size;	/* size of the ring buffer */
+	uint32_t	offset;	/* offset of the ring buffer in the mapping */
+	uint64_t	head;	/* position of the oldest entry */
+	uint64_t	w_pos;	/* position after the last complete entry */
+	uint64_t	w_next;	/* position after data being written */
+};
+
 #define ULOGGER_LOG_MAIN	"ulog_main"	/* everything else */
 
 /*
@@ -71,6 +147,39 @@ struct ulogger_entry {
  */
 #define ULOGGER_ENTRY_MAX_LEN		(5*1024)
 
+/*
+ * After ioctl(ULOGGER_SET_BULK_READ) with a non-zero int argument, read()
+ * returns as many whole entries as fit in the buffer, back to back, instead
+ * of exactly one.
+ */
+
+/*
+ * ioctl(ULOGGER_SET_READ_SEQ) with a uint64_t argument moves the reader to the
+ * entry with that sequence number (see struct ulogger_entry_v3), or after the
+ * last entry if it is not written yet. If entries from there on were
+ * overwritten, reading starts with a summary of dropped entries. Logs split
+ * into per-CPU sub-rings do not support it.
+ */
+
+/*
+ * Argument of ioctl(ULOGGER_SET_WATERMARK): poll() and blocking read() only
+ * wake up the reader when at least 'bytes' bytes are readable, when entries
+ * were dropped, or 'latency_ms' milliseconds after entries became pending
+ * (0 for no such bound). The default 'bytes' of 0 or 1 wakes up the reader
+ * for each entry; it is capped to half of the log. Non-blocking read() still
+ * returns any entry. Logs split into per-CPU sub-rings do not support it.
+ */
+struct ulogger_watermark {
+	uint32_t	bytes;		/* bytes readable */
+	uint32_t	latency_ms;	/* maximum delay of pending entries */
+};
+
+/*
+ * The maximum size of a buffer of records written with a single
+ * ioctl(ULOGGER_WRITE_BATCH).
+ */
+#define ULOGGER_BATCH_MAX_LEN		(64*1024)
+
 #define __ULOGGERIO	0xAE
 
 #define ULOGGER_GET_LOG_BUF_SIZE	_IO(__ULOGGERIO, 21) /* size of log */
@@ -80,5 +189,10 @@ struct ulogger_entry {
 #define ULOGGER_GET_VERSION		_IO(__ULOGGERIO, 25) /* abi version */
 #define ULOGGER_SET_VERSION		_IO(__ULOGGERIO, 26) /* abi version */
 #define ULOGGER_SET_RAW_MODE		_IO(__ULOGGERIO, 27) /* write raw logs*/
+#define ULOGGER_WRITE_BATCH		_IO(__ULOGGERIO, 28) /* write N logs */
+#define ULOGGER_SET_READ_POS		_IO(__ULOGGERIO, 29) /* mmap reader */
+#define ULOGGER_SET_BULK_READ		_IO(__ULOGGERIO, 30) /* read N logs */
+#define ULOGGER_SET_READ_SEQ		_IO(__ULOGGERIO, 31) /* seek to entry */
+#define ULOGGER_SET_WATERMARK		_IO(__ULOGGERIO, 32) /* batch wakeups */
 
 #endif /* _PARROT_ULOGGER_H */
@@ -49,8 +49,13 @@ struct ulog_entry {
  * entry allocated by caller. Pointers will point directly into log buffer.
  * @buf should be at least of size ULOGGER_ENTRY_MAX_LEN+1.
  *
- * Returns 0 on success and -1 on invalid wire format (entry will be
- * in unspecified state)
+ * Records of version 3 of the ABI (struct ulogger_entry_v3, with field
+ * 'hdr_size' telling versions apart) are parsed as well: entries get empty
+ * process and thread names, which are given by names records instead. For
+ * a names record, only timestamp, pid, tid, pname and tname are meaningful.
+ *
+ * Returns 0 on success, 1 for a names record, and -1 on invalid wire format
+ * (entry will be in unspecified state)
  */
 int ulog_parse_buf(struct ulogger_entry *buf, struct ulog_entry *entry);
 
@@ -63,11 +68,62 @@ int ulog_parse_buf(struct ulogger_entry *buf, struct ulog_entry *entry);
  * @param len:   raw buffer length in bytes
  * @param entry: output structure
  *
- * @return: 0 on success, -1 on invalid buffer (entry will be left in an
- * unspecified state)
+ * @return: 0 on success, 1 for a names record (see ulog_parse_buf()), -1 on
+ * invalid buffer (entry will be left in an unspecified state)
  */
 int ulog_parse_raw(void *buf, size_t len, struct ulog_entry *entry);
 
+/* Deferred formatting payload (see ULOG_DEFERRED in ulog.h) */
+#define ULOG_DEFERRED_MAGIC  "\xffUD1"
+#define ULOG_DEFERRED_INLINE 0  /* null-terminated format string follows */
+#define ULOG_DEFERRED_ID     1  /* 32-bit format identifier follows */
+
+/**
+ * Compute the identifier of a format string, as used by the format string
+ * registry (see ULOG_FMT_REGISTRY in ulog.h): 32-bit FNV-1a hash, never 0.
+ */
+static inline uint32_t ulog_fmt_id(const char *fmt)
+{
+	uint32_t h = 2166136261U;
+
+	while (*fmt)
+		h = (h ^ (uint8_t)*fmt++) * 16777619U;
+	return h ? h : 1;
+}
+
+/**
+ * Format string lookup callback, for deferred entries referring to a format
+ * by identifier. Returns NULL if identifier is unknown.
+ */
+typedef const char *(*ulog_fmt_lookup_func_t)(uint32_t id, void *userdata);
+
+/**
+ * Check whether a parsed entry holds a message with deferred formatting.
+ *
+ * @param entry: entry parsed with ulog_parse_buf() or ulog_parse_raw()
+ *
+ * @return: 1 if message needs ulog_deferred_format(), 0 otherwise
+ */
+int ulog_entry_is_deferred(const struct ulog_entry *entry);
+
+/**
+ * Format the message of a deferred entry. Output is truncated to fit in
+ * the provided buffer, and always null-terminated. Arguments which do not
+ * match the format string are replaced with a '<bad arguments>' marker.
+ *
+ * @param entry:    deferred entry
+ * @param lookup:   format string lookup callback (may be NULL)
+ * @param userdata: lookup callback user data
+ * @param buf:      output buffer
+ * @param size:     output buffer size
+ *
+ * @return: formatted message length (excluding null character), -EINVAL if
+ * entry is invalid, -ENOENT if format identifier is unknown
+ */
+int ulog_deferred_format(const struct ulog_entry *entry,
+			 ulog_fmt_lookup_func_t lookup, void *userdata,
+			 char *buf, size_t size);
+
 #ifdef __cplusplus
 }
 #endif
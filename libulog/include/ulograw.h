@@ -32,7 +32,10 @@ extern "C" {
 /**
  * ulogger raw log entry.
  *
- * All const char * fields should be null-terminated.
+ * All const char * fields should be null-terminated. A null byte is appended
+ * to process and thread names whose length does not include one, so that
+ * readers of version 3 of the ABI (see struct ulogger_entry_v3) get them
+ * apart from the message.
  *
  * NOTE:
  * You do not need to fill the following fields, their values are ignored:
@@ -97,6 +100,21 @@ int ulog_raw_logv(int fd, const struct ulog_raw_entry *raw,
 		const struct iovec *iov,
 		int iovcnt);
 
+/**
+ * Log several raw ulog entries at once.
+ *
+ * Entries are packed and written with as few system calls as possible
+ * (see ULOGGER_WRITE_BATCH); with older drivers, this falls back to one write
+ * per entry. Each message is truncated to ULOGGER_ENTRY_MAX_PAYLOAD bytes
+ * of total payload, as the kernel would do.
+ *
+ * @param fd     A descriptor returned by @ulog_raw_open().
+ * @param raws   An array of raw ulog entries.
+ * @param count  The number of entries in @raws.
+ * @return       0 if successful, -errno upon failure.
+ */
+int ulog_raw_log_batch(int fd, const struct ulog_raw_entry *raws, int count);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,91 @@
+/**
+ * Copyright (C) 2024 Parrot S.A.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * libulog: a minimalistic logging library derived from Android logger
+ *
+ * Layout of shared memory log buffers (see ULOG_SHM in ulog.h).
+ *
+ * A log buffer is a file ULOG_SHM_DIR "ulog_<name>" made of a header page,
+ * followed by a ring buffer of 'size' bytes (a power of two). Positions in
+ * the ring are 64-bit byte counters which never wrap; the offset of position
+ * 'pos' in the ring is (pos & (size-1)).
+ *
+ * Writers reserve space for a record by atomically adding its length to
+ * 'tail', fill it, and publish it by storing (pos+1) in the 'seq' field of the
+ * record header with release semantics. Records are aligned on ULOG_SHM_ALIGN
+ * bytes, so that record headers never wrap; record data may wrap. The data of
+ * a record is a ulogger entry, exactly as returned by read() on a ulogger
+ * device with ABI version 2. Writers never wait for readers: old records are
+ * overwritten.
+ *
+ * Readers keep their own position. A record at position 'pos' is readable
+ * once its 'seq' is (pos+1); its data is valid if, after it was copied, 'tail'
+ * is still at most (pos + size). Otherwise the reader was lapped by writers,
+ * and looks for the next valid record header. Blocked readers set 'waiters'
+ * and wait on futex 'futex'. After publishing a record, a writer which finds
+ * 'waiters' set clears it, then increments and wakes up 'futex'; a reader
+ * killed while waiting thus costs at most one spurious wake-up.
+ */
+
+#ifndef _PARROT_ULOGSHM_H
+#define _PARROT_ULOGSHM_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ULOG_SHM_DIR        "/dev/shm/"
+#define ULOG_SHM_MAGIC      0x4d485355 /* "USHM" */
+#define ULOG_SHM_VERSION    1
+#define ULOG_SHM_HDR_SIZE   4096
+#define ULOG_SHM_ALIGN      16
+
+/* size limits of a ring buffer, as for ulogger devices */
+#define ULOG_SHM_MIN_SIZE   (16*1024)
+#define ULOG_SHM_MAX_SIZE   (16*1024*1024)
+
+struct ulog_shm_header {
+	uint32_t magic;      /* ULOG_SHM_MAGIC, set once initialized */
+	uint32_t version;    /* ULOG_SHM_VERSION */
+	uint32_t size;       /* ring buffer size */
+	uint32_t hdr_size;   /* offset of ring buffer in file */
+	uint64_t head;       /* new readers start at or after this position */
+	/* written by all writers */
+	uint64_t tail __attribute__((aligned(64)));
+	/* set by blocked readers, cleared by writers waking them up */
+	uint32_t waiters __attribute__((aligned(64)));
+	uint32_t futex;
+};
+
+struct ulog_shm_record {
+	uint64_t seq;        /* record position + 1, once published */
+	uint32_t len;        /* length of data (ulogger entry) that follows */
+	uint32_t __pad;
+};
+
+/* total length of a record holding 'len' bytes of data */
+static inline uint32_t ulog_shm_record_len(uint32_t len)
+{
+	return (sizeof(struct ulog_shm_record) + len + ULOG_SHM_ALIGN - 1) &
+		~(uint32_t)(ULOG_SHM_ALIGN - 1);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _PARROT_ULOGSHM_H */
@@ -0,0 +1,439 @@
+/**
+ * Copyright (C) 2024 Parrot S.A.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * libulog write path microbenchmarks: each case is run with 1, 2, 4, ... up
+ * to N threads; every thread performs the same number of operations, and
+ * one operation out of BENCH_SAMPLE_PERIOD is individually timed to compute
+ * latency percentiles. Reported ns/op is the wall-clock time of a run divided
+ * by the total number of operations of all threads.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define ULOG_TAG ulogbench
+#include "ulog.h"
+#include "ulogshm.h"
+
+#include "ulogbench.h"
+
+ULOG_DECLARE_TAG(ulogbench);
+
+#define BENCH_SAMPLE_PERIOD     16
+#define BENCH_DEFAULT_ITER      100000
+#define BENCH_DEFAULT_THREADS   4
+
+enum sink {
+	SINK_NONE,     /* keep current writer */
+	SINK_NULL,     /* custom write function doing nothing */
+	SINK_STDERR,   /* stderr copy (redirected to /dev/null) + null sink */
+	SINK_CUSTOM,   /* custom write function copying messages */
+	SINK_DEVICE,   /* default writer, i.e. kernel device */
+	SINK_SHM,      /* private shared memory ring (see ULOG_SHM) */
+};
+
+struct bench_case {
+	const char *name;
+	enum sink   sink;
+	void      (*op)(unsigned int i);
+};
+
+struct bench_thread {
+	pthread_t                 thread;
+	const struct bench_case  *bc;
+	unsigned int              iter;
+	uint64_t                 *samples;
+	unsigned int              nsamples;
+	uint64_t                  start;
+	uint64_t                  end;
+};
+
+static struct {
+	unsigned int       iter;
+	unsigned int       max_threads;
+	int                json;
+	const char        *filter;
+	pthread_barrier_t  barrier;
+	uint64_t           timer_overhead;
+	int                first_result;
+	char               shm_name[32];
+} bench;
+
+static __thread char sink_buf[ULOG_BUF_SIZE];
+static __thread unsigned int sink_count;
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static void null_write(uint32_t prio, struct ulog_cookie *cookie,
+		       const char *buf, int len)
+{
+}
+
+static void custom_write(uint32_t prio, struct ulog_cookie *cookie,
+			 const char *buf, int len)
+{
+	if (len > (int)sizeof(sink_buf))
+		len = sizeof(sink_buf);
+	memcpy(sink_buf, buf, len);
+	sink_count++;
+}
+
+/* benchmark operations */
+
+static void op_debug_filtered(unsigned int i)
+{
+	ULOGD("filtered message %u", i);
+}
+
+static void op_info(unsigned int i)
+{
+	ULOGI("benchmark message %u: %s", i, "some string argument");
+}
+
+static void op_bin(unsigned int i)
+{
+	uint8_t data[64];
+
+	memset(data, i & 0xff, sizeof(data));
+	ULOG_BIN(ULOG_INFO, data, sizeof(data));
+}
+
+static void op_throttle(unsigned int i)
+{
+	ULOGI_THROTTLE(1000, "throttled message %u", i);
+}
+
+static void op_change(unsigned int i)
+{
+	ULOGI_CHANGE(i >> 30, "changed value %u", i >> 30);
+}
+
+static const struct bench_case cases[] = {
+	{ "debug_filtered", SINK_NULL,   op_debug_filtered },
+	{ "info_null",      SINK_NULL,   op_info },
+	{ "info_stderr",    SINK_STDERR, op_info },
+	{ "info_custom",    SINK_CUSTOM, op_info },
+	{ "info_device",    SINK_DEVICE, op_info },
+	{ "info_shm",       SINK_SHM,    op_info },
+	{ "bin_custom",     SINK_CUSTOM, op_bin },
+	{ "throttle",       SINK_CUSTOM, op_throttle },
+	{ "change",         SINK_CUSTOM, op_change },
+	{ "cpp_stream",     SINK_CUSTOM, bench_op_cpp_stream },
+	{ "cpp_fmt",        SINK_CUSTOM, bench_op_cpp_fmt },
+};
+
+static int setup_sink(enum sink sink)
+{
+	int ret = 0, fd;
+
+	unsetenv("ULOG_STDERR");
+	unsetenv("ULOG_SHM");
+	switch (sink) {
+	case SINK_NONE:
+		break;
+	case SINK_NULL:
+		ret = ulog_set_write_func(null_write);
+		break;
+	case SINK_STDERR:
+		setenv("ULOG_STDERR", "y", 1);
+		ret = ulog_set_write_func(null_write);
+		break;
+	case SINK_CUSTOM:
+		ret = ulog_set_write_func(custom_write);
+		break;
+	case SINK_DEVICE:
+		/*
+		 * re-initialize default writer, skip if there is no device;
+		 * probe with open() so that emulated devices also qualify
+		 */
+		fd = open("/dev/ulog_main", O_WRONLY|O_CLOEXEC);
+		if (fd < 0)
+			return -ENODEV;
+		close(fd);
+		ret = ulog_set_log_device("main");
+		break;
+	case SINK_SHM:
+		/*
+		 * writer is re-initialized on next message; use a buffer of
+		 * our own, readers would pick up "main" as real logs
+		 */
+		setenv("ULOG_SHM", "y", 1);
+		snprintf(bench.shm_name, sizeof(bench.shm_name),
+			 "ulogbench-%d", (int)getpid());
+		ret = ulog_set_log_device(bench.shm_name);
+		break;
+	}
+	return ret;
+}
+
+static void cleanup_sink(enum sink sink)
+{
+	char path[64];
+
+	if (sink != SINK_SHM)
+		return;
+	snprintf(path, sizeof(path), ULOG_SHM_DIR "ulog_%s", bench.shm_name);
+	(void)unlink(path);
+}
+
+static void *bench_thread(void *arg)
+{
+	struct bench_thread *bt = arg;
+	void (*op)(unsigned int) = bt->bc->op;
+	unsigned int i;
+	uint64_t t;
+
+	pthread_barrier_wait(&bench.barrier);
+	bt->start = now_ns();
+
+	for (i = 0; i < bt->iter; i++) {
+		if (i % BENCH_SAMPLE_PERIOD) {
+			(*op)(i);
+			continue;
+		}
+		t = now_ns();
+		(*op)(i);
+		bt->samples[bt->nsamples++] = now_ns() - t;
+	}
+
+	bt->end = now_ns();
+	return NULL;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t ua = *(const uint64_t *)a, ub = *(const uint64_t *)b;
+
+	return (ua > ub) - (ua < ub);
+}
+
+static uint64_t percentile(const uint64_t *v, size_t n, double p)
+{
+	size_t idx = (size_t)(p * (n - 1) + 0.5);
+
+	return n ? v[idx] : 0;
+}
+
+static void print_result(const struct bench_case *bc, unsigned int nthreads,
+			 uint64_t elapsed, uint64_t *samples, size_t nsamples)
+{
+	double ops = (double)bench.iter * nthreads;
+	double ns_per_op = (double)elapsed / ops;
+	double ops_per_sec = ops * 1e9 / (double)elapsed;
+	uint64_t p50, p90, p99, p999, max;
+
+	qsort(samples, nsamples, sizeof(*samples), compare_u64);
+	p50 = percentile(samples, nsamples, 0.5);
+	p90 = percentile(samples, nsamples, 0.9);
+	p99 = percentile(samples, nsamples, 0.99);
+	p999 = percentile(samples, nsamples, 0.999);
+	max = nsamples ? samples[nsamples-1] : 0;
+
+	if (!bench.json) {
+		printf("%-16s %3u %10.1f %12.0f %8llu %8llu %8llu %8llu "
+		       "%10llu\n", bc->name, nthreads, ns_per_op, ops_per_sec,
+		       (unsigned long long)p50, (unsigned long long)p90,
+		       (unsigned long long)p99, (unsigned long long)p999,
+		       (unsigned long long)max);
+		return;
+	}
+
+	printf("%s\n    {\"name\": \"%s\", \"threads\": %u, "
+	       "\"ns_per_op\": %.1f, \"ops_per_sec\": %.0f, "
+	       "\"p50_ns\": %llu, \"p90_ns\": %llu, \"p99_ns\": %llu, "
+	       "\"p999_ns\": %llu, \"max_ns\": %llu}",
+	       bench.first_result ? "" : ",", bc->name, nthreads, ns_per_op,
+	       ops_per_sec, (unsigned long long)p50, (unsigned long long)p90,
+	       (unsigned long long)p99, (unsigned long long)p999,
+	       (unsigned long long)max);
+	bench.first_result = 0;
+}
+
+static int run_case(const struct bench_case *bc, unsigned int nthreads)
+{
+	struct bench_thread *bt;
+	uint64_t *samples, start = UINT64_MAX, end = 0;
+	unsigned int i, per_thread;
+	size_t nsamples = 0;
+	int ret = 0;
+
+	per_thread = bench.iter / BENCH_SAMPLE_PERIOD + 1;
+	bt = calloc(nthreads, sizeof(*bt));
+	samples = malloc((size_t)nthreads * per_thread * sizeof(*samples));
+	if (!bt || !samples) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	pthread_barrier_init(&bench.barrier, NULL, nthreads + 1);
+	for (i = 0; i < nthreads; i++) {
+		bt[i].bc = bc;
+		bt[i].iter = bench.iter;
+		bt[i].samples = &samples[(size_t)i * per_thread];
+		ret = pthread_create(&bt[i].thread, NULL, bench_thread, &bt[i]);
+		if (ret != 0) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* all threads start together, elapsed time ends with the last one */
+	pthread_barrier_wait(&bench.barrier);
+
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(bt[i].thread, NULL);
+		if (bt[i].start < start)
+			start = bt[i].start;
+		if (bt[i].end > end)
+			end = bt[i].end;
+		/* compact samples */
+		memmove(&samples[nsamples], bt[i].samples,
+			bt[i].nsamples * sizeof(*samples));
+		nsamples += bt[i].nsamples;
+	}
+	pthread_barrier_destroy(&bench.barrier);
+
+	print_result(bc, nthreads, (end > start) ? end - start : 1, samples,
+		     nsamples);
+out:
+	free(samples);
+	free(bt);
+	return ret;
+}
+
+static uint64_t measure_timer_overhead(void)
+{
+	uint64_t t, min = UINT64_MAX;
+	int i;
+
+	for (i = 0; i < 1000; i++) {
+		t = now_ns();
+		t = now_ns() - t;
+		if (t < min)
+			min = t;
+	}
+	return min;
+}
+
+static void show_usage(const char *cmd)
+{
+	fprintf(stderr, "Usage: %s [options]\n", cmd);
+
+	fprintf(stderr, "options include:\n"
+		"  -n <n>          Operations per thread (default %d)\n"
+		"  -t <n>          Maximum number of threads (default %d)\n"
+		"  -f <name>       Only run cases whose name contains <name>\n"
+		"  -j              Output results in JSON format\n"
+		"  -h              Show this help\n"
+		"\n", BENCH_DEFAULT_ITER, BENCH_DEFAULT_THREADS);
+}
+
+int main(int argc, char *argv[])
+{
+	int c, stderr_fd, null_fd;
+	unsigned int i, nthreads;
+	const struct bench_case *bc;
+
+	bench.iter = BENCH_DEFAULT_ITER;
+	bench.max_threads = BENCH_DEFAULT_THREADS;
+	bench.first_result = 1;
+
+	while ((c = getopt(argc, argv, "f:hjn:t:")) != -1) {
+		switch (c) {
+		case 'f':
+			bench.filter = optarg;
+			break;
+		case 'j':
+			bench.json = 1;
+			break;
+		case 'n':
+			bench.iter = (unsigned int)atoi(optarg);
+			break;
+		case 't':
+			bench.max_threads = (unsigned int)atoi(optarg);
+			break;
+		case 'h':
+			show_usage(argv[0]);
+			return 0;
+		default:
+			show_usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (bench.iter == 0 || bench.max_threads == 0) {
+		show_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	/* stderr copies of messages should not cost terminal output */
+	stderr_fd = dup(STDERR_FILENO);
+	null_fd = open("/dev/null", O_WRONLY);
+	if (stderr_fd < 0 || null_fd < 0) {
+		perror("/dev/null");
+		return EXIT_FAILURE;
+	}
+
+	ULOG_SET_LEVEL(ULOG_INFO);
+	bench.timer_overhead = measure_timer_overhead();
+
+	if (bench.json)
+		printf("{\n  \"iterations\": %u,\n  \"sample_period\": %d,\n"
+		       "  \"timer_overhead_ns\": %llu,\n  \"results\": [",
+		       bench.iter, BENCH_SAMPLE_PERIOD,
+		       (unsigned long long)bench.timer_overhead);
+	else
+		printf("%-16s %3s %10s %12s %8s %8s %8s %8s %10s\n", "case",
+		       "thr", "ns/op", "ops/s", "p50", "p90", "p99", "p99.9",
+		       "max");
+
+	for (i = 0; i < sizeof(cases)/sizeof(cases[0]); i++) {
+		bc = &cases[i];
+		if (bench.filter && !strstr(bc->name, bench.filter))
+			continue;
+		if (setup_sink(bc->sink) < 0)
+			continue;
+
+		for (nthreads = 1; nthreads <= bench.max_threads;
+		     nthreads = (nthreads*2 > bench.max_threads &&
+				 nthreads < bench.max_threads) ?
+				bench.max_threads : nthreads*2) {
+			fflush(stdout);
+			dup2(null_fd, STDERR_FILENO);
+			run_case(bc, nthreads);
+			dup2(stderr_fd, STDERR_FILENO);
+		}
+		cleanup_sink(bc->sink);
+	}
+
+	if (bench.json)
+		printf("\n  ]\n}\n");
+
+	close(null_fd);
+	close(stderr_fd);
+	return 0;
+}
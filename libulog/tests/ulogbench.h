@@ -0,0 +1,32 @@
+/**
+ * Copyright (C) 2024 Parrot S.A.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _ULOGBENCH_H
+#define _ULOGBENCH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* C++ API benchmark operations */
+void bench_op_cpp_stream(unsigned int i);
+void bench_op_cpp_fmt(unsigned int i);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _ULOGBENCH_H */
@@ -0,0 +1,38 @@
+/**
+ * Copyright (C) 2024 Parrot S.A.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define ULOG_TAG ulogbench
+#include "ulog.hpp"
+#if __cplusplus >= 201703L
+#include "ulog_fmt.hpp"
+#endif
+
+#include "ulogbench.h"
+
+void bench_op_cpp_stream(unsigned int i)
+{
+    UlogI << "benchmark message " << i << ": " << "some string argument"
+          << std::endl;
+}
+
+void bench_op_cpp_fmt(unsigned int i)
+{
+#if __cplusplus >= 201703L
+    ULOGI_FMT("benchmark message {}: {}", i, "some string argument");
+#else
+    (void)i;
+#endif
+}
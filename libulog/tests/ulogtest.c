@@ -198,6 +198,18 @@ static void custom_write_func(uint32_t prio, struct ulog_cookie *cookie,
 			cookie->name, buf);
 }
 
+/* only meaningful with ULOG_ASYNC=y and a ulogger device */
+static void test_async(void)
+{
+	int i;
+
+	for (i = 0; i < 100; i++)
+		ULOGD("async message #%d", i);
+
+	ulog_async_flush();
+	ULOGI("async: %u messages dropped", ulog_async_get_dropped());
+}
+
 static void test_custom_write_func(void)
 {
 	ulog_set_write_func(&custom_write_func);
@@ -349,6 +361,7 @@ int main(void)
 	test_throttling();
 	test_change();
 	test_change_threads();
+	test_async();
 	test_custom_write_func();
 
 	return 0;
@@ -21,6 +21,9 @@
 #define  ULOG_TAG pulsarsoca
 #include "ulog.hpp"
 #include "ulog_stdcerr.h"
+#if __cplusplus >= 201703L
+#include "ulog_fmt.hpp"
+#endif
 
 ULOG_DECLARE_TAG(pulsarsoca);
 ULOG_DECLARE_TAG(foo);
@@ -79,5 +82,13 @@ int main(int argc, char* argv[])
 
     UlogNull << "this shall do nothing" << endl;
 
+#if __cplusplus >= 201703L
+    std::string str("string");
+    ULOGI_FMT("fmt: {} {} {} {} {:x} {:X} {{}}", 42, -1.5, str,
+              std::string_view("view"), 255u, (uint64_t)0xdeadbeef);
+    ULOGW_FMT("fmt: {} {} {}", true, 'c', (const char *)NULL);
+    ULOGD_FMT("fmt: no argument");
+#endif
+
     return 0;
 }
@@ -41,4 +41,59 @@ static inline int ulog_is_android(void) { return 0; }
 void ulog_writer_android(uint32_t prio, struct ulog_cookie *cookie,
 			 const char *buf, int len __unused);
 
+/* write 'count' records packed for ioctl(ULOGGER_WRITE_BATCH) */
+int ulog_write_batch(int fd, const void *buf, size_t len, int count, int raw);
+
+/* asynchronous writer (see ULOG_ASYNC) */
+int ulog_async_init(const char *dev);
+void ulog_async_close(void);
+void ulog_writer_async(uint32_t prio, struct ulog_cookie *cookie,
+		       const char *buf, int len);
+void ulog_async_signal_flush(void);
+
+/* shared memory writer (see ULOG_SHM) */
+int ulog_shm_init(const char *name);
+void ulog_writer_shm(uint32_t prio, struct ulog_cookie *cookie,
+		     const char *buf, int len);
+
+/* flight recorder (see ULOG_FLIGHT) */
+#ifndef _WIN32
+extern int ulog_flight_on;
+int ulog_flight_set_level(struct ulog_cookie *cookie, int level);
+int ulog_flight_get_level(struct ulog_cookie *cookie, int level);
+void ulog_flight_set_writer(const char *dev, ulog_write_func_t writer,
+			    int deferred);
+int ulog_flight_vrecord(uint32_t prio, struct ulog_cookie *cookie,
+			const char *fmt, va_list ap);
+int ulog_flight_record(uint32_t prio, struct ulog_cookie *cookie,
+		       const char *buf, int len);
+void ulog_flight_trigger(uint32_t prio, struct ulog_cookie *cookie);
+#else
+#define ulog_flight_on 0
+static inline int ulog_flight_set_level(struct ulog_cookie *cookie __unused,
+					int level) { return level; }
+static inline int ulog_flight_get_level(struct ulog_cookie *cookie __unused,
+					int level) { return level; }
+static inline void ulog_flight_set_writer(const char *dev __unused,
+					  ulog_write_func_t writer __unused,
+					  int deferred __unused) {}
+static inline int ulog_flight_vrecord(uint32_t prio __unused,
+				      struct ulog_cookie *cookie __unused,
+				      const char *fmt __unused,
+				      va_list ap __unused) { return 0; }
+static inline int ulog_flight_record(uint32_t prio __unused,
+				     struct ulog_cookie *cookie __unused,
+				     const char *buf __unused,
+				     int len __unused) { return 0; }
+static inline void ulog_flight_trigger(uint32_t prio __unused,
+				       struct ulog_cookie *cookie __unused) {}
+#endif
+
+/* parse a log level description (letter or digit) */
+int ulog_parse_level(int c);
+
+/* deferred formatting (see ULOG_DEFERRED) */
+int ulog_deferred_encode(char *buf, size_t size, uint32_t id,
+			 const char *fmt, va_list ap);
+
 #endif /* _PARROT_ULOG_COMMON_H */
@@ -0,0 +1,547 @@
+/**
+ * Copyright (C) 2024 Parrot S.A.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * libulog: a minimalistic logging library derived from Android logger
+ *
+ * Deferred formatting: printf arguments are encoded in binary form by the
+ * writer, and formatted by the reader. Encoded payload layout (host order):
+ *
+ * <magic:4><kind:1><format>[<type:1><value>]...
+ *
+ * where <format> is a null-terminated format string (kind 0) or a 32-bit
+ * format identifier (kind 1), and each argument value is encoded as:
+ *
+ *  'i': 32-bit integer       'd': double
+ *  'l': 64-bit integer       'p': 64-bit pointer value
+ *  's': 16-bit size followed by null-terminated string of that size
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#include "ulog.h"
+#include "ulogprint.h"
+#include "ulogger.h"
+#include "ulog_common.h"
+
+#define DEFERRED_SPEC_MAX 32
+
+/* length modifiers */
+enum {
+	LEN_NONE,
+	LEN_SHORT,    /* h, hh */
+	LEN_LONG,     /* l */
+	LEN_LLONG,    /* ll, q, j (intmax_t) */
+	LEN_SIZE,     /* z, Z, t (size_t, ptrdiff_t) */
+	LEN_LDOUBLE,  /* L */
+};
+
+/* a parsed conversion specification */
+struct spec {
+	const char *start;   /* '%' character */
+	const char *lenmod;  /* first length modifier character */
+	const char *end;     /* after conversion character */
+	int         nstar;   /* number of '*' width/precision arguments */
+	int         prec;    /* precision, -1 if none */
+	int         pstar;   /* precision is the last '*' argument */
+	int         len;     /* length modifier */
+	char        conv;    /* conversion character */
+};
+
+/*
+ * Parse a conversion specification starting at '%'.
+ * Returns 0 if successful, -1 if unsupported (positional arguments, ...).
+ */
+static int parse_spec(const char *p, struct spec *s)
+{
+	s->start = p++;
+	s->nstar = 0;
+	s->prec = -1;
+	s->pstar = 0;
+	s->len = LEN_NONE;
+
+	/* flags */
+	while (*p && strchr("-+ #0'I", *p))
+		p++;
+
+	/* width */
+	if (*p == '*') {
+		s->nstar++;
+		p++;
+	}
+	while (*p >= '0' && *p <= '9')
+		p++;
+	if (*p == '$')
+		return -1;
+
+	/* precision */
+	if (*p == '.') {
+		p++;
+		if (*p == '*') {
+			s->nstar++;
+			s->pstar = 1;
+			p++;
+		} else {
+			s->prec = 0;
+			for (; *p >= '0' && *p <= '9'; p++)
+				if (s->prec < UINT16_MAX)
+					s->prec = s->prec*10 + (*p - '0');
+		}
+		if (*p == '$')
+			return -1;
+	}
+
+	/* length modifiers */
+	s->lenmod = p;
+	while (*p && strchr("hlqjzZtL", *p)) {
+		switch (*p) {
+		case 'h':
+			s->len = LEN_SHORT;
+			break;
+		case 'l':
+			s->len = (s->len == LEN_LONG) ? LEN_LLONG : LEN_LONG;
+			break;
+		case 'q':
+		case 'j':
+			s->len = LEN_LLONG;
+			break;
+		case 'L':
+			s->len = LEN_LDOUBLE;
+			break;
+		default:
+			s->len = LEN_SIZE;
+			break;
+		}
+		p++;
+	}
+
+	s->conv = *p;
+	if (!s->conv || s->nstar > 2)
+		return -1;
+	s->end = p+1;
+	return 0;
+}
+
+struct encoder {
+	char   *buf;
+	size_t  size;
+	size_t  off;
+};
+
+static int put(struct encoder *e, char type, const void *data, size_t len)
+{
+	if (e->off + 1 + len > e->size)
+		return -1;
+	e->buf[e->off++] = type;
+	memcpy(&e->buf[e->off], data, len);
+	e->off += len;
+	return 0;
+}
+
+static int put_int(struct encoder *e, int32_t v)
+{
+	return put(e, 'i', &v, sizeof(v));
+}
+
+static int put_llong(struct encoder *e, int64_t v)
+{
+	return put(e, 'l', &v, sizeof(v));
+}
+
+/* encode a string, which need not be null-terminated past its precision */
+static int put_str(struct encoder *e, const char *str, int prec)
+{
+	size_t len;
+	uint16_t size;
+
+	if (!str)
+		str = "(null)";
+	len = (prec < 0) ? strlen(str) : strnlen(str, (size_t)prec);
+	if (len >= e->size)
+		return -1;
+
+	size = (uint16_t)(len+1);
+	if (put(e, 's', &size, sizeof(size)) < 0 ||
+	    e->off + size > e->size)
+		return -1;
+	memcpy(&e->buf[e->off], str, len);
+	e->buf[e->off + len] = '\0';
+	e->off += size;
+	return 0;
+}
+
+/* encode one argument according to its conversion specification */
+static int encode_arg(struct encoder *e, const struct spec *s, va_list *ap,
+		      int err)
+{
+	int is_signed = 0;
+	int64_t v;
+	double d;
+	void *ptr;
+
+	switch (s->conv) {
+	case 'd':
+	case 'i':
+		is_signed = 1;
+		/* fall through */
+	case 'o':
+	case 'u':
+	case 'x':
+	case 'X':
+		switch (s->len) {
+		case LEN_NONE:
+		case LEN_SHORT:
+			return put_int(e, va_arg(*ap, int));
+		case LEN_LONG:
+			v = is_signed ? (int64_t)va_arg(*ap, long) :
+				(int64_t)va_arg(*ap, unsigned long);
+			break;
+		case LEN_SIZE:
+			v = is_signed ? (int64_t)va_arg(*ap, ssize_t) :
+				(int64_t)va_arg(*ap, size_t);
+			break;
+		case LEN_LLONG:
+			v = (int64_t)va_arg(*ap, long long);
+			break;
+		default:
+			return -1;
+		}
+		return put_llong(e, v);
+	case 'c':
+		if (s->len != LEN_NONE)
+			return -1;
+		return put_int(e, va_arg(*ap, int));
+	case 'e':
+	case 'E':
+	case 'f':
+	case 'F':
+	case 'g':
+	case 'G':
+	case 'a':
+	case 'A':
+		if (s->len == LEN_LDOUBLE)
+			d = (double)va_arg(*ap, long double);
+		else
+			d = va_arg(*ap, double);
+		return put(e, 'd', &d, sizeof(d));
+	case 's':
+		if (s->len != LEN_NONE)
+			return -1;
+		return put_str(e, va_arg(*ap, const char *), s->prec);
+	case 'p':
+		ptr = va_arg(*ap, void *);
+		v = (int64_t)(uintptr_t)ptr;
+		return put(e, 'p', &v, sizeof(v));
+	case 'm':
+		return put_str(e, strerror(err), s->prec);
+	default:
+		/* %n and unknown conversions */
+		return -1;
+	}
+}
+
+int ulog_deferred_encode(char *buf, size_t size, uint32_t id,
+			 const char *fmt, va_list ap)
+{
+	struct encoder e = { .buf = buf, .size = size, .off = 0 };
+	struct spec s;
+	const char *p;
+	va_list aq;
+	int i, star = 0, ret, err = errno;
+
+	if (size < sizeof(ULOG_DEFERRED_MAGIC) + 1)
+		return -1;
+
+	memcpy(e.buf, ULOG_DEFERRED_MAGIC, sizeof(ULOG_DEFERRED_MAGIC)-1);
+	e.off = sizeof(ULOG_DEFERRED_MAGIC)-1;
+	if (id)
+		ret = put(&e, ULOG_DEFERRED_ID, &id, sizeof(id));
+	else
+		ret = put(&e, ULOG_DEFERRED_INLINE, fmt, strlen(fmt)+1);
+	if (ret < 0)
+		return -1;
+
+	va_copy(aq, ap);
+	for (p = strchr(fmt, '%'); p; p = strchr(p, '%')) {
+		if (p[1] == '%') {
+			p += 2;
+			continue;
+		}
+		if (parse_spec(p, &s) < 0)
+			goto out;
+		for (i = 0; i < s.nstar; i++) {
+			star = va_arg(aq, int);
+			if (put_int(&e, star) < 0)
+				goto out;
+		}
+		/* a negative '*' precision is taken as if omitted */
+		if (s.pstar)
+			s.prec = (star < 0) ? -1 : star;
+		if (encode_arg(&e, &s, &aq, err) < 0)
+			goto out;
+		p = s.end;
+	}
+	ret = (int)e.off;
+	goto done;
+out:
+	ret = -1;
+done:
+	va_end(aq);
+	errno = err;
+	return ret;
+}
+
+struct decoder {
+	const char *p;
+	size_t      left;
+};
+
+static int get(struct decoder *d, char type, void *data, size_t len)
+{
+	if (d->left < 1 + len || d->p[0] != type)
+		return -1;
+	memcpy(data, d->p + 1, len);
+	d->p += 1 + len;
+	d->left -= 1 + len;
+	return 0;
+}
+
+static const char *get_str(struct decoder *d)
+{
+	uint16_t size;
+	const char *str;
+
+	if (get(d, 's', &size, sizeof(size)) < 0 || size == 0 ||
+	    d->left < size || d->p[size-1] != '\0')
+		return NULL;
+	str = d->p;
+	d->p += size;
+	d->left -= size;
+	return str;
+}
+
+/* clamp snprintf() result to what was actually written */
+static size_t written(int ret, size_t size)
+{
+	if (ret < 0)
+		return 0;
+	return ((size_t)ret < size) ? (size_t)ret : size - 1;
+}
+
+/* format one decoded argument; returns snprintf()-like result */
+static int format_arg(char *out, size_t size, const char *spec,
+		      const int *star, int nstar, char type, const void *val)
+{
+	int32_t i = 0;
+	int64_t l = 0;
+	double d = 0.;
+	const char *s = NULL;
+
+	switch (type) {
+	case 'i':
+		memcpy(&i, val, sizeof(i));
+		break;
+	case 'l':
+	case 'p':
+		memcpy(&l, val, sizeof(l));
+		break;
+	case 'd':
+		memcpy(&d, val, sizeof(d));
+		break;
+	default:
+		s = val;
+		break;
+	}
+
+#define FORMAT_ARG(_v) \
+	((nstar == 0) ? snprintf(out, size, spec, _v) : \
+	 (nstar == 1) ? snprintf(out, size, spec, star[0], _v) : \
+	 snprintf(out, size, spec, star[0], star[1], _v))
+
+	switch (type) {
+	case 'i':
+		return FORMAT_ARG((int)i);
+	case 'l':
+		return FORMAT_ARG((long long)l);
+	case 'p':
+		return FORMAT_ARG((void *)(uintptr_t)l);
+	case 'd':
+		return FORMAT_ARG(d);
+	default:
+		return FORMAT_ARG(s);
+	}
+#undef FORMAT_ARG
+}
+
+/* build the specification used to format a decoded argument */
+static int build_spec(char *spec, const struct spec *s, char type)
+{
+	size_t len = s->lenmod - s->start;
+	char conv = (s->conv == 'm') ? 's' : s->conv;
+
+	if (len + 4 > DEFERRED_SPEC_MAX)
+		return -1;
+
+	memcpy(spec, s->start, len);
+	if (type == 'i') {
+		/* keep original h/hh modifiers, the value is an int */
+		if (s->len == LEN_SHORT) {
+			spec[len++] = 'h';
+			if (s->lenmod[1] == 'h')
+				spec[len++] = 'h';
+		}
+	} else if (type == 'l') {
+		spec[len++] = 'l';
+		spec[len++] = 'l';
+	}
+	spec[len++] = conv;
+	spec[len] = '\0';
+	return 0;
+}
+
+/* expected argument types of a conversion character */
+static const char *spec_types(char conv)
+{
+	switch (conv) {
+	case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+		return "il";
+	case 'c':
+		return "i";
+	case 'e': case 'E': case 'f': case 'F':
+	case 'g': case 'G': case 'a': case 'A':
+		return "d";
+	case 's': case 'm':
+		return "s";
+	case 'p':
+		return "p";
+	default:
+		return "";
+	}
+}
+
+ULOG_EXPORT int ulog_entry_is_deferred(const struct ulog_entry *entry)
+{
+	const size_t len = sizeof(ULOG_DEFERRED_MAGIC)-1;
+
+	return entry->is_binary && entry->len > (int)len &&
+		memcmp(entry->message, ULOG_DEFERRED_MAGIC, len) == 0;
+}
+
+ULOG_EXPORT int ulog_deferred_format(const struct ulog_entry *entry,
+				     ulog_fmt_lookup_func_t lookup,
+				     void *userdata, char *buf, size_t size)
+{
+	struct decoder d;
+	struct spec s;
+	const char *fmt, *p, *q;
+	char spec[DEFERRED_SPEC_MAX], type;
+	int star[2], ret, i;
+	uint32_t id;
+	size_t off = 0, len;
+	union {
+		int64_t l;
+		double d;
+	} val;
+	const void *arg;
+
+	if (!ulog_entry_is_deferred(entry) || !buf || !size)
+		return -EINVAL;
+
+	d.p = entry->message + sizeof(ULOG_DEFERRED_MAGIC)-1;
+	d.left = entry->len - (sizeof(ULOG_DEFERRED_MAGIC)-1);
+
+	if (d.p[0] == ULOG_DEFERRED_INLINE) {
+		fmt = d.p + 1;
+		len = strnlen(fmt, d.left - 1);
+		if (len == d.left - 1)
+			return -EINVAL;
+		d.p += len + 2;
+		d.left -= len + 2;
+	} else if (d.p[0] == ULOG_DEFERRED_ID) {
+		if (get(&d, ULOG_DEFERRED_ID, &id, sizeof(id)) < 0)
+			return -EINVAL;
+		fmt = lookup ? (*lookup)(id, userdata) : NULL;
+		if (!fmt)
+			return -ENOENT;
+	} else {
+		return -EINVAL;
+	}
+
+	buf[0] = '\0';
+	for (p = fmt; *p && off < size - 1; p = q) {
+		/* literal text */
+		q = strchr(p, '%');
+		if (!q)
+			q = p + strlen(p);
+		len = q - p;
+		if (len > size - 1 - off)
+			len = size - 1 - off;
+		memcpy(&buf[off], p, len);
+		off += len;
+		buf[off] = '\0';
+		if (!*q)
+			break;
+
+		if (q[1] == '%') {
+			ret = snprintf(&buf[off], size - off, "%%");
+			off += written(ret, size - off);
+			q += 2;
+			continue;
+		}
+
+		/* conversion: widths/precisions first, then argument */
+		if (parse_spec(q, &s) < 0)
+			goto bad_args;
+		for (i = 0; i < s.nstar; i++)
+			if (get(&d, 'i', &star[i], sizeof(star[i])) < 0)
+				goto bad_args;
+
+		type = d.left ? d.p[0] : '\0';
+		if (!type || !strchr(spec_types(s.conv), type))
+			goto bad_args;
+
+		if (type == 's') {
+			arg = get_str(&d);
+			if (!arg)
+				goto bad_args;
+		} else {
+			if (get(&d, type, &val, (type == 'i') ? 4 : 8) < 0)
+				goto bad_args;
+			arg = &val;
+		}
+
+		if (build_spec(spec, &s, type) < 0)
+			goto bad_args;
+
+		ret = format_arg(&buf[off], size - off, spec, star, s.nstar,
+				 type, arg);
+		if (ret < 0)
+			goto bad_args;
+		off += written(ret, size - off);
+		q = s.end;
+	}
+
+	return (int)off;
+
+bad_args:
+	ret = snprintf(&buf[off], size - off, "<bad arguments>");
+	off += written(ret, size - off);
+	return (int)off;
+}
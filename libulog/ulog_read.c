@@ -73,29 +73,15 @@ static int ulog_parse_payload_unformatted(char *p, size_t size,
 }
 
 /**
- * Parse a ulog payload as formatted by the kernel driver:
+ * Parse the message part of a ulog payload:
  *
- * <pname:N>\0<tname:N>\0<priority:4><tag:N>\0<message:N>
+ * <priority:4><tag:N>\0<message:N>
  *
  * The payload may have been truncated by the kernel log driver.
  * When that happens, we must null-terminate the message ourselves.
  */
-static int ulog_parse_payload(char *p, size_t size, struct ulog_entry *entry)
+static int ulog_parse_message(char *p, size_t size, struct ulog_entry *entry)
 {
-	/* process name */
-	entry->pname = get_token((const char **)&p, &size);
-	if (!entry->pname)
-		return ulog_parse_payload_unformatted(p, size, entry);
-
-	/* thread name */
-	if (entry->pid != entry->tid) {
-		entry->tname = get_token((const char **)&p, &size);
-		if (!entry->tname)
-			return ulog_parse_payload_unformatted(p, size, entry);
-	} else {
-		entry->tname = entry->pname;
-	}
-
 	/* priority, color, binary flag */
 	if (size < 4)
 		return ulog_parse_payload_unformatted(p, size, entry);
@@ -134,9 +120,79 @@ static int ulog_parse_payload(char *p, size_t size, struct ulog_entry *entry)
 	return 0;
 }
 
+/* parse null-terminated process and thread names (if pid != tid) */
+static int ulog_parse_names(char **p, size_t *size, struct ulog_entry *entry)
+{
+	/* process name */
+	entry->pname = get_token((const char **)p, size);
+	if (!entry->pname)
+		return -1;
+
+	/* thread name */
+	if (entry->pid != entry->tid) {
+		entry->tname = get_token((const char **)p, size);
+		if (!entry->tname)
+			return -1;
+	} else {
+		entry->tname = entry->pname;
+	}
+
+	return 0;
+}
+
+/**
+ * Parse a ulog payload as formatted by the kernel driver:
+ *
+ * <pname:N>\0<tname:N>\0<priority:4><tag:N>\0<message:N>
+ */
+static int ulog_parse_payload(char *p, size_t size, struct ulog_entry *entry)
+{
+	if (ulog_parse_names(&p, &size, entry) < 0)
+		return ulog_parse_payload_unformatted(p, size, entry);
+
+	return ulog_parse_message(p, size, entry);
+}
+
+/* parse a record of version 3 of the ulogger ABI, with 'hdr' aligned */
+static int ulog_parse_v3(const struct ulogger_entry_v3 *hdr, char *p,
+			 struct ulog_entry *entry)
+{
+	size_t size = hdr->len;
+
+	entry->tv_sec  = hdr->sec;
+	entry->tv_nsec = hdr->nsec;
+	entry->pid     = hdr->pid;
+	entry->tid     = hdr->tid;
+
+	switch (hdr->type) {
+	case ULOGGER_RECORD_ENTRY:
+		/* names were sent in a previous record */
+		entry->pname = "";
+		entry->tname = "";
+		return ulog_parse_message(p, size, entry);
+	case ULOGGER_RECORD_NAMES:
+		if (ulog_parse_names(&p, &size, entry) < 0)
+			return -1;
+		entry->priority = ULOG_INFO;
+		entry->is_binary = 0;
+		entry->color = 0;
+		entry->tag = "";
+		entry->message = "";
+		entry->len = 1;
+		return 1;
+	default:
+		return -1;
+	}
+}
+
 ULOG_EXPORT int ulog_parse_buf(struct ulogger_entry *buf,
 			       struct ulog_entry *entry)
 {
+	/* version 3 records have a larger header */
+	if (buf->hdr_size == sizeof(struct ulogger_entry_v3))
+		return ulog_parse_v3((struct ulogger_entry_v3 *)buf,
+				     (char *)buf + buf->hdr_size, entry);
+
 	entry->tv_sec  = buf->sec;
 	entry->tv_nsec = buf->nsec;
 	entry->pid     = buf->pid;
@@ -163,6 +219,13 @@ ULOG_EXPORT int ulog_parse_raw(void *buf, size_t len, struct ulog_entry *entry)
 		/* unexpected length */
 		return -1;
 
+	if (raw.hdr_size == sizeof(struct ulogger_entry_v3)) {
+		struct ulogger_entry_v3 rec;
+
+		memcpy(&rec, buf, sizeof(rec));
+		return ulog_parse_v3(&rec, (char *)buf + rec.hdr_size, entry);
+	}
+
 	entry->tv_sec  = raw.sec;
 	entry->tv_nsec = raw.nsec;
 	entry->pid     = raw.pid;
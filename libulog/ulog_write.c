@@ -33,6 +33,7 @@
 
 #include "ulog.h"
 #include "ulogger.h"
+#include "ulogprint.h"
 #include "ulog_common.h"
 
 /* this cookie is used when ULOG_TAG is undefined */
@@ -47,6 +48,11 @@ ULOG_EXPORT struct ulog_cookie __ulog_default_cookie = {
 static void __writer_init(uint32_t prio, struct ulog_cookie *cookie,
 			  const char *buf, int len);
 
+/* deferred formatting modes (see ULOG_DEFERRED) */
+#define DEFERRED_OFF    0  /* format messages in caller's context */
+#define DEFERRED_INLINE 1  /* encode arguments along with format string */
+#define DEFERRED_ID     2  /* use format identifiers when available */
+
 static struct {
 	pthread_mutex_t     lock;    /* protect against init race conditions */
 	int                 fd;      /* kernel logger file descriptor */
@@ -56,6 +62,7 @@ static struct {
 	ulog_cookie_register_func_t cookie_register_hook;
 	struct ulog_cookie *cookie_list;
 	char *device; /* ulog_device to use */
+	int                 deferred; /* see DEFERRED_* */
 	int                 replay_timestamp_set;
 	struct timespec     replay_timestamp; /* for stderr replayer log */
 } ctrl = {
@@ -66,6 +73,7 @@ static struct {
 	.cookie_register_hook = NULL,
 	.cookie_list = NULL,
 	.device      = NULL,
+	.deferred    = DEFERRED_OFF,
 	.replay_timestamp_set = 0,
 };
 
@@ -184,6 +192,12 @@ static void __ctrl_init(void)
 		dev = devbuf;
 	}
 
+	/* optionally log to a shared memory ring instead of the device */
+	if (ulog_shm_init(dev + strlen(DEV_PREFIX)) == 0) {
+		writer = ulog_writer_shm;
+		goto deferred;
+	}
+
 	ctrl.fd = open(dev, O_WRONLY|O_CLOEXEC);
 	if ((ctrl.fd >= 0) &&
 			/* sanity check: /dev/ulog_* must be device files */
@@ -192,12 +206,24 @@ static void __ctrl_init(void)
 		ctrl.fd = -1;
 	}
 
-	if (ctrl.fd >= 0)
+	if (ctrl.fd >= 0) {
 		writer = __writer_kernel;
-	else if (ulog_is_android())
+		/* optionally defer writes to a background flusher */
+		if (ulog_async_init(dev) == 0)
+			writer = ulog_writer_async;
+	} else if (ulog_is_android())
 		writer = ulog_writer_android;
 	else
 		writer = __writer_null;
+deferred:
+	/* only ulogger readers know how to format deferred entries */
+	ctrl.deferred = DEFERRED_OFF;
+	prop = getenv("ULOG_DEFERRED");
+	if (prop && !getenv("ULOG_STDERR") &&
+	    (writer == __writer_kernel || writer == ulog_writer_async ||
+	     writer == ulog_writer_shm))
+		ctrl.deferred = (strcmp(prop, "id") == 0) ?
+			DEFERRED_ID : DEFERRED_INLINE;
 #endif
 
 	/* optionally output a copy of messages to stderr */
@@ -207,6 +233,10 @@ static void __ctrl_init(void)
 		if (getenv("ULOG_STDERR_COLOR"))
 			writer = __writer_stderr_wrapper_color;
 	}
+	/* recorded entries go to the device in raw mode if possible */
+	ulog_flight_set_writer((ctrl.fd >= 0) ? dev : NULL, writer,
+			       ctrl.deferred != DEFERRED_OFF);
+
 	/* here we rely on the following assignment being atomic... */
 	ctrl.writer = writer;
 }
@@ -244,6 +274,9 @@ ULOG_EXPORT int ulog_set_write_func(ulog_write_func_t func)
 		writer = func;
 	}
 
+	ctrl.deferred = DEFERRED_OFF;
+	ulog_flight_set_writer(NULL, writer, 0);
+
 	/* here we rely on the following assignment being atomic... */
 	ctrl.writer = writer;
 
@@ -331,6 +364,10 @@ ULOG_EXPORT int ulog_set_log_device(const char *ulog_device)
 			close(ctrl.fd);
 			ctrl.fd = -1;
 		}
+#ifndef _WIN32
+		/* pending asynchronous entries go to the previous device */
+		ulog_async_close();
+#endif
 		ctrl.writer = __writer_init;
 	}
 exit:
@@ -339,7 +376,7 @@ exit:
 }
 
 /* parse a log level description (letter or digit) */
-static int parse_level(int c)
+int ulog_parse_level(int c)
 {
 	int level;
 	static const unsigned char tab['Z'-'A'+1] = {
@@ -379,23 +416,27 @@ ULOG_EXPORT void ulog_init_cookie(struct ulog_cookie *cookie)
 		prop = getenv(buf);
 		if (prop)
 			/* coverity[tainted_data] */
-			level = parse_level(prop[0]);
+			level = ulog_parse_level(prop[0]);
 	}
 	if (level < 0) {
 		/* fallback to global level */
 		prop = getenv("ULOG_LEVEL");
 		if (prop)
 			/* coverity[tainted_data] */
-			level = parse_level(prop[0]);
+			level = ulog_parse_level(prop[0]);
 	}
 	if ((level < 0) && (__ulog_default_cookie.level >= 0))
 		/* fallback to empty tag level */
-		level = __ulog_default_cookie.level;
+		level = ulog_flight_get_level(&__ulog_default_cookie,
+					      __ulog_default_cookie.level);
 
 	if (level < 0)
 		/* fallback to default level */
 		level = ULOG_INFO;
 
+	/* let messages to be captured by the flight recorder through */
+	level = ulog_flight_set_level(cookie, level);
+
 	pthread_mutex_lock(&ctrl.lock);
 
 	if (cookie->level < 0) {
@@ -419,13 +460,62 @@ ULOG_EXPORT void ulog_init_cookie(struct ulog_cookie *cookie)
 	errno = olderrno;
 }
 
-ULOG_EXPORT void ulog_vlog_write(uint32_t prio, struct ulog_cookie *cookie,
-				 const char *fmt, va_list ap)
+/* set up writer now, rather than upon the first write */
+static void __ctrl_init_once(void)
+{
+	if (ctrl.writer == __writer_init) {
+		pthread_mutex_lock(&ctrl.lock);
+		if (ctrl.writer == __writer_init)
+			__ctrl_init();
+		pthread_mutex_unlock(&ctrl.lock);
+	}
+}
+
+/*
+ * Flight recorder (see ULOG_FLIGHT): write out recorded messages if needed,
+ * before the message which triggers it.
+ */
+static void __flight_trigger(uint32_t prio, struct ulog_cookie *cookie)
+{
+	/* make sure recorded messages can be written */
+	__ctrl_init_once();
+
+	ulog_flight_trigger(prio, cookie);
+}
+
+static void __vlog_write(uint32_t prio, struct ulog_cookie *cookie,
+			 uint32_t *id, const char *fmt, va_list ap)
 {
 	int ret;
+	uint32_t fmt_id = 0;
 	char buf[ULOG_BUF_SIZE];
 	const int bufsize = (int)sizeof(buf);
 
+	if (ULOG_UNLIKELY(ulog_flight_on)) {
+		ret = ulog_flight_vrecord(prio, cookie, fmt, ap);
+		__flight_trigger(prio, cookie);
+		if (ret)
+			return;
+	}
+
+	/* deferred formatting is only known once the writer is set up */
+	__ctrl_init_once();
+
+	if (ctrl.deferred != DEFERRED_OFF) {
+		if (id && ctrl.deferred == DEFERRED_ID) {
+			/* benign race: all threads compute the same value */
+			if (*id == 0)
+				*id = ulog_fmt_id(fmt);
+			fmt_id = *id;
+		}
+		ret = ulog_deferred_encode(buf, bufsize, fmt_id, fmt, ap);
+		if (ret > 0) {
+			ctrl.writer(prio | (1U << ULOG_PRIO_BINARY_SHIFT),
+				    cookie, buf, ret);
+			return;
+		}
+	}
+
 	ret = vsnprintf(buf, bufsize, fmt, ap);
 	if (ret >= bufsize)
 		/* truncated output */
@@ -434,34 +524,72 @@ ULOG_EXPORT void ulog_vlog_write(uint32_t prio, struct ulog_cookie *cookie,
 		ctrl.writer(prio, cookie, buf, ret+1);
 }
 
+ULOG_EXPORT void ulog_vlog_write(uint32_t prio, struct ulog_cookie *cookie,
+				 const char *fmt, va_list ap)
+{
+	__vlog_write(prio, cookie, NULL, fmt, ap);
+}
+
 ULOG_EXPORT void ulog_log_write(uint32_t prio, struct ulog_cookie *cookie,
 				const char *fmt, ...)
 {
 	va_list ap;
 
 	va_start(ap, fmt);
-	ulog_vlog_write(prio, cookie, fmt, ap);
+	__vlog_write(prio, cookie, NULL, fmt, ap);
+	va_end(ap);
+}
+
+ULOG_EXPORT void ulog_log_write_fmt(uint32_t prio, struct ulog_cookie *cookie,
+				    uint32_t *id, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	__vlog_write(prio, cookie, id, fmt, ap);
 	va_end(ap);
 }
 
 ULOG_EXPORT void ulog_log_str(uint32_t prio, struct ulog_cookie *cookie,
 			      const char *str)
 {
+	int ret;
+
 	if (cookie->level < 0)
 		ulog_init_cookie(cookie);
 
-	if ((int)(prio & ULOG_PRIO_LEVEL_MASK) <= cookie->level)
-		ctrl.writer(prio, cookie, str, strlen(str)+1);
+	if ((int)(prio & ULOG_PRIO_LEVEL_MASK) > cookie->level)
+		return;
+
+	if (ULOG_UNLIKELY(ulog_flight_on)) {
+		ret = ulog_flight_record(prio, cookie, str, strlen(str)+1);
+		__flight_trigger(prio, cookie);
+		if (ret)
+			return;
+	}
+
+	ctrl.writer(prio, cookie, str, strlen(str)+1);
 }
 
 ULOG_EXPORT void ulog_log_buf(uint32_t prio, struct ulog_cookie *cookie,
 			      const void *data, int len)
 {
+	int ret;
+
 	if (cookie->level < 0)
 		ulog_init_cookie(cookie);
 
-	if ((int)(prio & ULOG_PRIO_LEVEL_MASK) <= cookie->level)
-		ctrl.writer(prio, cookie, data, len);
+	if ((int)(prio & ULOG_PRIO_LEVEL_MASK) > cookie->level)
+		return;
+
+	if (ULOG_UNLIKELY(ulog_flight_on)) {
+		ret = ulog_flight_record(prio, cookie, data, len);
+		__flight_trigger(prio, cookie);
+		if (ret)
+			return;
+	}
+
+	ctrl.writer(prio, cookie, data, len);
 }
 
 ULOG_EXPORT void ulog_init(struct ulog_cookie *cookie)
@@ -482,13 +610,13 @@ ULOG_EXPORT void ulog_set_level(struct ulog_cookie *cookie, int level)
 	ulog_init(cookie);
 
 	/* this last assignment is racy, but in a harmless way */
-	cookie->level = level;
+	cookie->level = ulog_flight_set_level(cookie, level);
 }
 
 ULOG_EXPORT int ulog_get_level(struct ulog_cookie *cookie)
 {
 	ulog_init(cookie);
-	return cookie->level;
+	return ulog_flight_get_level(cookie, cookie->level);
 }
 
 ULOG_EXPORT int ulog_set_tag_level(const char *name, int level)
@@ -0,0 +1,573 @@
+/**
+ * Copyright (C) 2024 Parrot S.A.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * libulog: a minimalistic logging library derived from Android logger
+ *
+ * Asynchronous writer: each logging thread appends pre-framed entries to its
+ * own single-producer/single-consumer ring, and a background flusher thread
+ * forwards them to the kernel device in raw mode, preserving the original
+ * timestamp, pid and tid of each entry.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <sys/types.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "ulog.h"
+#include "ulograw.h"
+#include "ulogger.h"
+#include "ulog_common.h"
+
+/* default per-thread ring size, in kB */
+#define ASYNC_RING_DEFAULT_KB      64
+/* flusher wakes up at least this often, in ms */
+#define ASYNC_FLUSH_PERIOD_MS      50
+/* maximum number of entries forwarded with a single batch write */
+#define ASYNC_BATCH_MAX            64
+
+#define ASYNC_ALIGN(x)             (((x) + 7U) & ~7U)
+#define ASYNC_PADDING              0xffffffffU
+
+/* fixed-size header of an entry staged in a thread ring */
+struct async_record {
+	uint32_t size;      /* total record size, aligned */
+	uint32_t prio;      /* priority and flags, ASYNC_PADDING for padding */
+	int32_t  tid;       /* thread id of the writer */
+	int32_t  sec;       /* CLOCK_MONOTONIC timestamp, as used by ulogger */
+	int32_t  nsec;
+	uint16_t tag_len;   /* including null byte */
+	uint16_t msg_len;
+	char     data[0];   /* tag followed by payload */
+};
+
+struct async_ring {
+	uint8_t           *buf;
+	uint32_t           size;     /* power of two */
+	uint32_t           head;     /* written by producer only */
+	uint32_t           tail;     /* written by flusher only */
+	uint32_t           dropped;  /* entries dropped because ring was full */
+	int                orphan;   /* owner thread has exited */
+	char               tname[17];
+	unsigned int       tname_len;
+	struct async_ring *next;
+};
+
+static struct {
+	pthread_mutex_t    lock;     /* protects ring list and thread state */
+	pthread_mutex_t    flush;    /* serializes ring draining */
+	pthread_cond_t     cond;     /* flusher wake-up */
+	pthread_key_t      key;      /* per-thread ring destructor */
+	pthread_t          thread;
+	int                started;
+	int                fd;       /* raw mode ulogger descriptor */
+	uint32_t           ring_size;
+	uint32_t           kick;     /* flusher wake-up already requested */
+	uint32_t           dropped;  /* total dropped entries, for stats */
+	pid_t              pid;
+	char               pname[17];
+	unsigned int       pname_len;
+	struct async_ring *rings;
+	struct ulog_raw_entry batch[ASYNC_BATCH_MAX]; /* protected by flush */
+} async = {
+	.lock    = PTHREAD_MUTEX_INITIALIZER,
+	.flush   = PTHREAD_MUTEX_INITIALIZER,
+	.cond    = PTHREAD_COND_INITIALIZER,
+	.started = 0,
+	.fd      = -1,
+};
+
+static __thread struct async_ring *tls_ring;
+static __thread pid_t tls_tid;
+
+static const int async_signals[] = {
+	SIGABRT, SIGSEGV, SIGBUS, SIGFPE, SIGILL,
+};
+static struct sigaction async_oldact[sizeof(async_signals)/sizeof(int)];
+
+static void async_load_pname(void)
+{
+	int fd;
+	ssize_t ret;
+
+	async.pid = getpid();
+	async.pname[0] = '\0';
+
+	fd = open("/proc/self/comm", O_RDONLY|O_CLOEXEC);
+	if (fd >= 0) {
+		ret = read(fd, async.pname, sizeof(async.pname)-1);
+		if (ret > 0 && async.pname[ret-1] == '\n')
+			ret--;
+		async.pname[ret > 0 ? ret : 0] = '\0';
+		close(fd);
+	}
+	async.pname_len = strlen(async.pname)+1;
+}
+
+static pid_t async_gettid(void)
+{
+	if (tls_tid == 0)
+		tls_tid = (pid_t)syscall(SYS_gettid);
+	return tls_tid;
+}
+
+/* forward staged entries; caller holds async.flush */
+static void async_write_batch(int n)
+{
+	if (n > 0 && async.fd >= 0)
+		(void)ulog_raw_log_batch(async.fd, async.batch, n);
+}
+
+/* drain one ring to the kernel device; caller holds async.flush */
+static void async_drain_ring(struct async_ring *ring, int32_t euid)
+{
+	uint32_t head, tail, dropped;
+	const struct async_record *rec;
+	struct ulog_raw_entry *raw;
+	struct timespec ts;
+	char msg[64];
+	int n = 0;
+
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	tail = ring->tail;
+
+	while (tail != head) {
+		rec = (const struct async_record *)
+			&ring->buf[tail & (ring->size-1)];
+		tail += rec->size;
+		if (rec->prio == ASYNC_PADDING)
+			continue;
+
+		raw = &async.batch[n++];
+		raw->entry.pid = async.pid;
+		raw->entry.tid = rec->tid;
+		raw->entry.sec = rec->sec;
+		raw->entry.nsec = rec->nsec;
+		raw->entry.euid = euid;
+		raw->pname = async.pname;
+		raw->pname_len = async.pname_len;
+		raw->tname = ring->tname;
+		raw->tname_len = ring->tname_len;
+		raw->prio = rec->prio;
+		raw->tag = rec->data;
+		raw->tag_len = rec->tag_len;
+		raw->message = rec->data + rec->tag_len;
+		raw->message_len = rec->msg_len;
+
+		/* records are only released once they have been written */
+		if (n == ASYNC_BATCH_MAX) {
+			async_write_batch(n);
+			n = 0;
+			__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+		}
+	}
+	async_write_batch(n);
+	__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+	/* report entries lost because the ring was full */
+	dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_ACQ_REL);
+	if (dropped) {
+		(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+		raw = &async.batch[0];
+		raw->entry.pid = async.pid;
+		raw->entry.tid = async.pid;
+		raw->entry.sec = (int32_t)ts.tv_sec;
+		raw->entry.nsec = (int32_t)ts.tv_nsec;
+		raw->entry.euid = euid;
+		raw->pname = async.pname;
+		raw->pname_len = async.pname_len;
+		/* no thread name: the ring may be gone, and pid == tid */
+		raw->tname = NULL;
+		raw->tname_len = 0;
+		raw->prio = ULOG_WARN;
+		raw->tag = "ulog";
+		raw->tag_len = sizeof("ulog");
+		raw->message = msg;
+		raw->message_len = snprintf(msg, sizeof(msg),
+			"%u log entries dropped (async ring full)",
+			dropped) + 1;
+		async_write_batch(1);
+	}
+}
+
+/*
+ * Drain all rings, and release those of exited threads if asked to;
+ * caller holds async.flush and async.lock.
+ */
+static void async_drain_rings(int release)
+{
+	struct async_ring *ring, **pring;
+	int32_t euid = (int32_t)geteuid();
+
+	pring = &async.rings;
+	while ((ring = *pring) != NULL) {
+		async_drain_ring(ring, euid);
+		if (release &&
+		    __atomic_load_n(&ring->orphan, __ATOMIC_ACQUIRE) &&
+		    __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) ==
+		    ring->tail) {
+			*pring = ring->next;
+			free(ring->buf);
+			free(ring);
+			continue;
+		}
+		pring = &ring->next;
+	}
+}
+
+/* drain all rings and release those of exited threads */
+static void async_drain(void)
+{
+	pthread_mutex_lock(&async.lock);
+	async_drain_rings(1);
+	pthread_mutex_unlock(&async.lock);
+}
+
+static void *async_flusher(void *arg __unused)
+{
+	struct timespec ts;
+
+	pthread_mutex_lock(&async.flush);
+	for (;;) {
+		/* default condition clock */
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += ASYNC_FLUSH_PERIOD_MS * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		(void)pthread_cond_timedwait(&async.cond, &async.flush, &ts);
+		__atomic_store_n(&async.kick, 0, __ATOMIC_RELAXED);
+		async_drain();
+	}
+	return NULL;
+}
+
+/* thread exit: the flusher releases the ring once it is empty */
+static void async_thread_exit(void *arg)
+{
+	struct async_ring *ring = arg;
+
+	__atomic_store_n(&ring->orphan, 1, __ATOMIC_RELEASE);
+	tls_ring = NULL;
+}
+
+static struct async_ring *async_ring_create(void)
+{
+	struct async_ring *ring;
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return NULL;
+
+	ring->size = async.ring_size;
+	ring->buf = malloc(ring->size);
+	if (!ring->buf) {
+		free(ring);
+		return NULL;
+	}
+
+	/* thread name is sampled once, on first log */
+	if (prctl(PR_GET_NAME, ring->tname) < 0)
+		ring->tname[0] = '\0';
+	ring->tname[sizeof(ring->tname)-1] = '\0';
+	ring->tname_len = strlen(ring->tname)+1;
+
+	pthread_mutex_lock(&async.lock);
+	ring->next = async.rings;
+	async.rings = ring;
+	pthread_mutex_unlock(&async.lock);
+
+	(void)pthread_setspecific(async.key, ring);
+	return ring;
+}
+
+/* flush pending entries from a fatal signal handler */
+void ulog_async_signal_flush(void)
+{
+	/*
+	 * Best effort: skip if the flusher is busy, or if the ring list is
+	 * being updated (we may have crashed in either). Rings are not
+	 * released here, free() is not async-signal-safe.
+	 */
+	if (pthread_mutex_trylock(&async.flush) != 0)
+		return;
+	if (pthread_mutex_trylock(&async.lock) == 0) {
+		async_drain_rings(0);
+		pthread_mutex_unlock(&async.lock);
+	}
+	pthread_mutex_unlock(&async.flush);
+}
+
+/* flush pending entries before the default action of a fatal signal */
+static void async_signal_handler(int sig)
+{
+	unsigned int i;
+
+	ulog_async_signal_flush();
+
+	for (i = 0; i < sizeof(async_signals)/sizeof(int); i++) {
+		if (async_signals[i] == sig) {
+			sigaction(sig, &async_oldact[i], NULL);
+			break;
+		}
+	}
+	raise(sig);
+}
+
+static void async_install_signal_handlers(void)
+{
+	unsigned int i;
+	struct sigaction act;
+
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = async_signal_handler;
+	sigemptyset(&act.sa_mask);
+	act.sa_flags = SA_RESETHAND;
+
+	for (i = 0; i < sizeof(async_signals)/sizeof(int); i++) {
+		/* never override a handler installed by the application */
+		if (sigaction(async_signals[i], NULL, &async_oldact[i]) < 0 ||
+		    async_oldact[i].sa_handler != SIG_DFL)
+			continue;
+		(void)sigaction(async_signals[i], &act, NULL);
+	}
+}
+
+static void async_atexit(void)
+{
+	ulog_async_flush();
+}
+
+static void async_atfork_prepare(void)
+{
+	pthread_mutex_lock(&async.flush);
+	async_drain();
+}
+
+static void async_atfork_parent(void)
+{
+	pthread_mutex_unlock(&async.flush);
+}
+
+static void async_atfork_child(void)
+{
+	struct async_ring *ring;
+
+	/* the flusher and all other threads are gone in the child */
+	pthread_mutex_init(&async.flush, NULL);
+	pthread_mutex_init(&async.lock, NULL);
+	pthread_cond_init(&async.cond, NULL);
+	async.started = 0;
+	async.kick = 0;
+	/*
+	 * Entries logged by other threads since the prepare handler drained
+	 * them belong to the parent: discard them, the rings are then
+	 * released by the next drain.
+	 */
+	for (ring = async.rings; ring; ring = ring->next) {
+		if (ring == tls_ring)
+			continue;
+		ring->tail = ring->head;
+		ring->dropped = 0;
+		ring->orphan = 1;
+	}
+	tls_tid = 0;
+	async_load_pname();
+}
+
+static int async_start_flusher(void)
+{
+	int ret;
+	sigset_t set, oldset;
+
+	/* flusher thread should not receive any signal */
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &oldset);
+	ret = pthread_create(&async.thread, NULL, async_flusher, NULL);
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+	if (ret != 0)
+		return -ret;
+
+	(void)pthread_setname_np(async.thread, "ulog-flush");
+	(void)pthread_detach(async.thread);
+	__atomic_store_n(&async.started, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* restart flusher in a forked child */
+static void async_restart_flusher(void)
+{
+	pthread_mutex_lock(&async.lock);
+	if (!async.started)
+		(void)async_start_flusher();
+	pthread_mutex_unlock(&async.lock);
+}
+
+void ulog_writer_async(uint32_t prio, struct ulog_cookie *cookie,
+		       const char *buf, int len)
+{
+	struct async_ring *ring = tls_ring;
+	struct async_record *rec;
+	struct timespec ts;
+	uint32_t head, tail, off, size, pad, used;
+
+	if (len < 0)
+		return;
+	if (!__atomic_load_n(&async.started, __ATOMIC_ACQUIRE))
+		async_restart_flusher();
+	if (len > ULOGGER_ENTRY_MAX_PAYLOAD)
+		len = ULOGGER_ENTRY_MAX_PAYLOAD;
+
+	if (ring == NULL) {
+		ring = async_ring_create();
+		if (ring == NULL) {
+			__atomic_add_fetch(&async.dropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		tls_ring = ring;
+	}
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	size = ASYNC_ALIGN(sizeof(*rec) + cookie->namesize + len);
+	head = ring->head;
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	off = head & (ring->size-1);
+
+	/* records never wrap: pad up to the end of the ring if needed */
+	pad = (ring->size - off < size) ? ring->size - off : 0;
+	if (ring->size - (head - tail) < pad + size) {
+		__atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&async.dropped, 1, __ATOMIC_RELAXED);
+		goto kick;
+	}
+
+	if (pad) {
+		rec = (struct async_record *)&ring->buf[off];
+		rec->size = pad;
+		rec->prio = ASYNC_PADDING;
+		head += pad;
+		off = 0;
+	}
+
+	rec = (struct async_record *)&ring->buf[off];
+	rec->size = size;
+	rec->prio = prio;
+	rec->tid = async_gettid();
+	rec->sec = (int32_t)ts.tv_sec;
+	rec->nsec = (int32_t)ts.tv_nsec;
+	rec->tag_len = cookie->namesize;
+	rec->msg_len = len;
+	memcpy(rec->data, cookie->name, cookie->namesize);
+	memcpy(rec->data + cookie->namesize, buf, len);
+
+	head += size;
+	__atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+	used = head - tail;
+	if (used < ring->size/2)
+		return;
+kick:
+	/* ring is filling up, wake up flusher early */
+	if (!__atomic_exchange_n(&async.kick, 1, __ATOMIC_ACQ_REL))
+		pthread_cond_signal(&async.cond);
+}
+
+int ulog_async_init(const char *dev)
+{
+	static int once;
+	const char *prop;
+	unsigned long kb;
+	uint32_t size;
+	int ret;
+
+	prop = getenv("ULOG_ASYNC");
+	if (!prop || prop[0] == '\0' || prop[0] == '0' || prop[0] == 'n')
+		return -ENOTSUP;
+
+	kb = strtoul(prop, NULL, 0);
+	if (kb == 0)
+		kb = ASYNC_RING_DEFAULT_KB;
+	/* round up to a power of two, between 4kB and 16MB */
+	size = 4096;
+	while (size < kb * 1024 && size < (16U << 20))
+		size <<= 1;
+
+	pthread_mutex_lock(&async.flush);
+	pthread_mutex_lock(&async.lock);
+
+	/* entries must keep their original tid/timestamp: require raw mode */
+	if (async.fd < 0) {
+		ret = ulog_raw_open(dev);
+		if (ret < 0)
+			goto out;
+		async.fd = ret;
+	}
+
+	if (!once) {
+		ret = pthread_key_create(&async.key, async_thread_exit);
+		if (ret != 0) {
+			ret = -ret;
+			goto out;
+		}
+		async.ring_size = size;
+		async_load_pname();
+		pthread_atfork(async_atfork_prepare, async_atfork_parent,
+			       async_atfork_child);
+		atexit(async_atexit);
+		async_install_signal_handlers();
+		once = 1;
+	}
+
+	ret = 0;
+	if (!async.started)
+		ret = async_start_flusher();
+out:
+	pthread_mutex_unlock(&async.lock);
+	pthread_mutex_unlock(&async.flush);
+	return ret;
+}
+
+void ulog_async_close(void)
+{
+	pthread_mutex_lock(&async.flush);
+	async_drain();
+	if (async.fd >= 0) {
+		ulog_raw_close(async.fd);
+		async.fd = -1;
+	}
+	pthread_mutex_unlock(&async.flush);
+}
+
+ULOG_EXPORT void ulog_async_flush(void)
+{
+	pthread_mutex_lock(&async.flush);
+	async_drain();
+	pthread_mutex_unlock(&async.flush);
+}
+
+ULOG_EXPORT unsigned int ulog_async_get_dropped(void)
+{
+	return __atomic_load_n(&async.dropped, __ATOMIC_RELAXED);
+}
@@ -162,6 +162,75 @@ ULOG_EXPORT int ulog_bin_writev(int fd,
 }
 
 
+ULOG_EXPORT int ulog_bin_write_batch(int fd,
+	const char *tag,
+	size_t tagsize,
+	const struct iovec *iov,
+	int count)
+{
+#if !FORCE_EXTERNAL_WRITE_FUNC
+	uint8_t buf[16*1024];
+	struct ulogger_entry entry;
+	uint32_t prio = ULOG_INFO | (1U << ULOG_PRIO_BINARY_SHIFT);
+	size_t off = 0, len, msglen;
+	int n = 0, ret;
+#endif
+	ulog_bin_write_func_t func;
+	int i;
+
+	if (!iov || (count < 0))
+		return -EINVAL;
+
+	/* Handle custom write function if any, Assume this read is atomic */
+	func = s_write_func;
+	if (func != NULL) {
+		for (i = 0; i < count; i++)
+			(*func)(tag, tagsize, &iov[i], 1);
+		return 0;
+	}
+
+#if !FORCE_EXTERNAL_WRITE_FUNC
+	len = sizeof(prio) + tagsize;
+	if (len >= ULOGGER_ENTRY_MAX_PAYLOAD)
+		return -EINVAL;
+
+	memset(&entry, 0, sizeof(entry));
+	entry.hdr_size = sizeof(entry);
+
+	for (i = 0; i < count; i++) {
+		/* truncate data as the kernel would do */
+		msglen = iov[i].iov_len;
+		if (len + msglen > ULOGGER_ENTRY_MAX_PAYLOAD)
+			msglen = ULOGGER_ENTRY_MAX_PAYLOAD - len;
+
+		if (off + sizeof(entry) + len + msglen > sizeof(buf)) {
+			ret = ulog_write_batch(fd, buf, off, n, 0);
+			if (ret < 0)
+				return ret;
+			off = 0;
+			n = 0;
+		}
+
+		/* the kernel prepends process and thread names */
+		entry.len = len + msglen;
+		memcpy(&buf[off], &entry, sizeof(entry));
+		off += sizeof(entry);
+		memcpy(&buf[off], &prio, sizeof(prio));
+		off += sizeof(prio);
+		memcpy(&buf[off], tag, tagsize);
+		off += tagsize;
+		memcpy(&buf[off], iov[i].iov_base, msglen);
+		off += msglen;
+		n++;
+	}
+
+	return n ? ulog_write_batch(fd, buf, off, n, 0) : 0;
+#else
+	/* Otherwise, we can not log */
+	return -ENOSYS;
+#endif
+}
+
 /*
  * Each entry in binary ulog is limited to ULOGGER_ENTRY_MAX_PAYLOAD
  * (4076) bytes ie 4096 minus kernel fixed header
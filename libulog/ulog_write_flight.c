@@ -0,0 +1,558 @@
+/**
+ * Copyright (C) 2024 Parrot S.A.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * libulog: a minimalistic logging library derived from Android logger
+ *
+ * Flight recorder: messages above the logging level of their tag, but within
+ * the capture level, are stored unformatted (see ulog_deferred_encode()) in a
+ * process-wide ring buffer, and written out only when an error is logged, a
+ * trigger tag is used, or a fatal signal is received.
+ *
+ * Tags are given the capture level, so that the inline priority check lets
+ * captured messages through; their actual logging level is kept in a table
+ * indexed by cookie address.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "ulog.h"
+#include "ulograw.h"
+#include "ulogprint.h"
+#include "ulogger.h"
+#include "ulog_common.h"
+
+/* default ring size, in kB */
+#define FLIGHT_RING_DEFAULT_KB     64
+/* maximum number of tags with a logging level below the capture level */
+#define FLIGHT_MAX_TAGS            1024
+/* maximum number of entries written with a single batch write */
+#define FLIGHT_BATCH_MAX           64
+
+#define FLIGHT_ALIGN(x)            (((x) + 7U) & ~7U)
+#define FLIGHT_PADDING             0xffffffffU
+
+/* header of an entry stored in the ring, never wrapped */
+struct flight_record {
+	uint32_t            size;     /* total record size, aligned */
+	uint32_t            prio;     /* priority and flags, or FLIGHT_PADDING */
+	struct ulog_cookie *cookie;   /* cookies are never released */
+	int32_t             tid;      /* thread id of the writer */
+	int32_t             sec;      /* CLOCK_MONOTONIC timestamp */
+	int32_t             nsec;
+	uint16_t            len;      /* payload length */
+	char                tname[18];
+	char                data[0];  /* payload */
+};
+
+/* logging level of a tag whose cookie was given the capture level */
+struct flight_tag {
+	struct ulog_cookie *cookie;
+	int                 level;
+};
+
+int ulog_flight_on;
+
+static struct {
+	pthread_once_t     once;
+	pthread_mutex_t    lock;     /* protects ring and tag insertions */
+	pthread_mutex_t    dump;     /* serializes dumps, protects 'copy' */
+	int                capture;  /* capture level */
+	const char        *trigger;  /* trigger tag, or NULL */
+	int                fd;       /* raw mode ulogger descriptor */
+	ulog_write_func_t  writer;   /* used if there is no raw descriptor */
+	int                deferred; /* writer accepts deferred entries */
+	uint8_t           *buf;
+	uint8_t           *copy;     /* ring contents being dumped */
+	uint32_t           size;     /* power of two */
+	uint32_t           head;
+	uint32_t           tail;
+	pid_t              pid;
+	char               pname[17];
+	unsigned int       pname_len;
+	struct flight_tag  tags[FLIGHT_MAX_TAGS];
+	struct ulog_raw_entry batch[FLIGHT_BATCH_MAX]; /* protected by dump */
+	char               text[FLIGHT_BATCH_MAX][ULOG_BUF_SIZE];
+} flight = {
+	.once    = PTHREAD_ONCE_INIT,
+	.lock    = PTHREAD_MUTEX_INITIALIZER,
+	.dump    = PTHREAD_MUTEX_INITIALIZER,
+	.fd      = -1,
+};
+
+static __thread pid_t tls_tid;
+static __thread char tls_tname[18];
+static __thread int tls_dumping;
+
+static const int flight_signals[] = {
+	SIGABRT, SIGSEGV, SIGBUS, SIGFPE, SIGILL,
+};
+static struct sigaction flight_oldact[sizeof(flight_signals)/sizeof(int)];
+
+static void flight_load_pname(void)
+{
+	int fd;
+	ssize_t ret;
+
+	flight.pid = getpid();
+	flight.pname[0] = '\0';
+
+	fd = open("/proc/self/comm", O_RDONLY|O_CLOEXEC);
+	if (fd >= 0) {
+		ret = read(fd, flight.pname, sizeof(flight.pname)-1);
+		if (ret > 0 && flight.pname[ret-1] == '\n')
+			ret--;
+		flight.pname[ret > 0 ? ret : 0] = '\0';
+		close(fd);
+	}
+	flight.pname_len = strlen(flight.pname)+1;
+}
+
+static struct flight_tag *flight_find_tag(struct ulog_cookie *cookie)
+{
+	uintptr_t h = ((uintptr_t)cookie >> 3) * 2654435761U;
+	struct flight_tag *tag;
+	struct ulog_cookie *c;
+	int i;
+
+	for (i = 0; i < FLIGHT_MAX_TAGS; i++) {
+		tag = &flight.tags[(h + i) & (FLIGHT_MAX_TAGS-1)];
+		c = __atomic_load_n(&tag->cookie, __ATOMIC_ACQUIRE);
+		if (c == cookie || c == NULL)
+			return tag;
+	}
+	return NULL;
+}
+
+/* logging level of a tag, or -1 if it is not captured */
+static int flight_tag_level(struct ulog_cookie *cookie)
+{
+	struct flight_tag *tag = flight_find_tag(cookie);
+
+	if (tag == NULL || tag->cookie != cookie)
+		return -1;
+	return __atomic_load_n(&tag->level, __ATOMIC_RELAXED);
+}
+
+/* copy the ring contents for a dump, and empty it; caller holds lock */
+static uint32_t flight_take(void)
+{
+	uint32_t off = flight.tail & (flight.size-1);
+	uint32_t len = flight.head - flight.tail;
+	uint32_t n = flight.size - off;
+
+	if (n >= len) {
+		memcpy(flight.copy, &flight.buf[off], len);
+	} else {
+		memcpy(flight.copy, &flight.buf[off], n);
+		memcpy(flight.copy + n, flight.buf, len - n);
+	}
+	flight.tail = flight.head;
+	return len;
+}
+
+/* return the message of a record, formatted unless 'deferred' is set */
+static const char *flight_message(const struct flight_record *rec,
+				  int deferred, char *text, uint32_t *prio,
+				  unsigned int *len)
+{
+	struct ulog_entry entry;
+	int ret;
+
+	*prio = rec->prio;
+	*len = rec->len;
+	memset(&entry, 0, sizeof(entry));
+	entry.message = rec->data;
+	entry.len = rec->len;
+	entry.is_binary = !!(rec->prio & (1U << ULOG_PRIO_BINARY_SHIFT));
+	if (deferred || !ulog_entry_is_deferred(&entry))
+		return rec->data;
+
+	ret = ulog_deferred_format(&entry, NULL, NULL, text, ULOG_BUF_SIZE);
+	if (ret < 0)
+		ret = snprintf(text, ULOG_BUF_SIZE, "<bad arguments>");
+	*prio &= ~(1U << ULOG_PRIO_BINARY_SHIFT);
+	*len = ret + 1;
+	return text;
+}
+
+/* write 'len' bytes of records from flight.copy; caller holds dump */
+static void flight_write(uint32_t len, int fd, ulog_write_func_t writer,
+			 int deferred)
+{
+	const struct flight_record *rec;
+	struct ulog_raw_entry *raw;
+	const char *msg;
+	int32_t euid = (int32_t)geteuid();
+	uint32_t off, prio;
+	unsigned int msg_len;
+	int n = 0;
+
+	for (off = 0; off < len; off += rec->size) {
+		rec = (const struct flight_record *)&flight.copy[off];
+		if (rec->prio == FLIGHT_PADDING)
+			continue;
+
+		msg = flight_message(rec, deferred, flight.text[n], &prio,
+				     &msg_len);
+		if (fd < 0) {
+			writer(prio, rec->cookie, msg, (int)msg_len);
+			continue;
+		}
+
+		/* keep original thread and timestamp of entries */
+		raw = &flight.batch[n++];
+		raw->entry.pid = flight.pid;
+		raw->entry.tid = rec->tid;
+		raw->entry.sec = rec->sec;
+		raw->entry.nsec = rec->nsec;
+		raw->entry.euid = euid;
+		raw->pname = flight.pname;
+		raw->pname_len = flight.pname_len;
+		raw->tname = rec->tname;
+		raw->tname_len = strlen(rec->tname)+1;
+		raw->prio = prio;
+		raw->tag = rec->cookie->name;
+		raw->tag_len = rec->cookie->namesize;
+		raw->message = msg;
+		raw->message_len = msg_len;
+		if (n == FLIGHT_BATCH_MAX) {
+			(void)ulog_raw_log_batch(fd, flight.batch, n);
+			n = 0;
+		}
+	}
+	if (n > 0)
+		(void)ulog_raw_log_batch(fd, flight.batch, n);
+}
+
+/* write out recorded entries, and empty the ring */
+static void flight_dump(void)
+{
+	ulog_write_func_t writer;
+	int fd, deferred;
+	uint32_t len;
+
+	pthread_mutex_lock(&flight.lock);
+	len = flight_take();
+	fd = flight.fd;
+	writer = flight.writer;
+	deferred = flight.deferred;
+	pthread_mutex_unlock(&flight.lock);
+
+	if (len > 0 && (fd >= 0 || writer != NULL))
+		flight_write(len, fd, writer, deferred);
+}
+
+/* write out recorded entries before the default action of a fatal signal */
+static void flight_signal_handler(int sig)
+{
+	unsigned int i;
+
+	/* best effort: skip if a dump is in progress (or we crashed in it) */
+	if (pthread_mutex_trylock(&flight.dump) == 0) {
+		if (pthread_mutex_trylock(&flight.lock) == 0) {
+			pthread_mutex_unlock(&flight.lock);
+			tls_dumping = 1;
+			flight_dump();
+			tls_dumping = 0;
+		}
+		pthread_mutex_unlock(&flight.dump);
+	}
+
+	/* asynchronous logging cannot install its own handler anymore */
+	ulog_async_signal_flush();
+
+	for (i = 0; i < sizeof(flight_signals)/sizeof(int); i++) {
+		if (flight_signals[i] == sig) {
+			sigaction(sig, &flight_oldact[i], NULL);
+			break;
+		}
+	}
+	raise(sig);
+}
+
+static void flight_install_signal_handlers(void)
+{
+	unsigned int i;
+	struct sigaction act;
+
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = flight_signal_handler;
+	sigemptyset(&act.sa_mask);
+	act.sa_flags = SA_RESETHAND;
+
+	for (i = 0; i < sizeof(flight_signals)/sizeof(int); i++) {
+		/* never override a handler installed by the application */
+		if (sigaction(flight_signals[i], NULL, &flight_oldact[i]) < 0 ||
+		    flight_oldact[i].sa_handler != SIG_DFL)
+			continue;
+		(void)sigaction(flight_signals[i], &act, NULL);
+	}
+}
+
+static void flight_atfork_prepare(void)
+{
+	pthread_mutex_lock(&flight.dump);
+	pthread_mutex_lock(&flight.lock);
+}
+
+static void flight_atfork_parent(void)
+{
+	pthread_mutex_unlock(&flight.lock);
+	pthread_mutex_unlock(&flight.dump);
+}
+
+static void flight_atfork_child(void)
+{
+	pthread_mutex_init(&flight.lock, NULL);
+	pthread_mutex_init(&flight.dump, NULL);
+	tls_tid = 0;
+	flight_load_pname();
+}
+
+static void flight_init(void)
+{
+	const char *prop;
+	unsigned long kb = FLIGHT_RING_DEFAULT_KB;
+	uint32_t size;
+
+	prop = getenv("ULOG_FLIGHT");
+	if (!prop || prop[0] == '\0')
+		return;
+	flight.capture = ulog_parse_level(prop[0]);
+	if (flight.capture <= 0)
+		return;
+
+	prop = getenv("ULOG_FLIGHT_SIZE");
+	if (prop && strtoul(prop, NULL, 0) > 0)
+		kb = strtoul(prop, NULL, 0);
+	/* round up to a power of two, between 16kB and 16MB */
+	size = 16384;
+	while (size < kb * 1024 && size < (16U << 20))
+		size <<= 1;
+
+	flight.buf = malloc(size);
+	flight.copy = malloc(size);
+	if (!flight.buf || !flight.copy) {
+		free(flight.buf);
+		free(flight.copy);
+		flight.buf = flight.copy = NULL;
+		return;
+	}
+	flight.size = size;
+
+	prop = getenv("ULOG_FLIGHT_TRIGGER");
+	if (prop && prop[0] != '\0')
+		flight.trigger = prop;
+
+	flight_load_pname();
+	pthread_atfork(flight_atfork_prepare, flight_atfork_parent,
+		       flight_atfork_child);
+	flight_install_signal_handlers();
+	__atomic_store_n(&ulog_flight_on, 1, __ATOMIC_RELEASE);
+}
+
+int ulog_flight_set_level(struct ulog_cookie *cookie, int level)
+{
+	struct flight_tag *tag;
+
+	pthread_once(&flight.once, flight_init);
+	if (!ulog_flight_on)
+		return level;
+
+	pthread_mutex_lock(&flight.lock);
+	tag = flight_find_tag(cookie);
+	if (tag == NULL || (level >= flight.capture && tag->cookie == NULL)) {
+		/* not captured, or no room left to capture */
+		pthread_mutex_unlock(&flight.lock);
+		return level;
+	}
+
+	__atomic_store_n(&tag->level, level, __ATOMIC_RELAXED);
+	if (tag->cookie == NULL)
+		__atomic_store_n(&tag->cookie, cookie, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&flight.lock);
+
+	return (level > flight.capture) ? level : flight.capture;
+}
+
+int ulog_flight_get_level(struct ulog_cookie *cookie, int level)
+{
+	int ret;
+
+	if (!ulog_flight_on)
+		return level;
+
+	ret = flight_tag_level(cookie);
+	return (ret < 0) ? level : ret;
+}
+
+void ulog_flight_set_writer(const char *dev, ulog_write_func_t writer,
+			    int deferred)
+{
+	int fd = -1, oldfd;
+
+	if (!ulog_flight_on)
+		return;
+
+	/* entries must keep their original tid/timestamp: prefer raw mode */
+	if (dev) {
+		fd = ulog_raw_open(dev);
+		if (fd < 0)
+			fd = -1;
+	}
+
+	pthread_mutex_lock(&flight.lock);
+	oldfd = flight.fd;
+	flight.fd = fd;
+	flight.writer = writer;
+	flight.deferred = deferred;
+	pthread_mutex_unlock(&flight.lock);
+
+	if (oldfd >= 0)
+		ulog_raw_close(oldfd);
+}
+
+/* store a message in the ring, overwriting the oldest ones if needed */
+static void flight_store(uint32_t prio, struct ulog_cookie *cookie,
+			 const char *buf, int len)
+{
+	struct flight_record *rec;
+	struct timespec ts;
+	uint32_t off, size, pad;
+
+	if (len < 0)
+		return;
+	if (len > ULOGGER_ENTRY_MAX_PAYLOAD)
+		len = ULOGGER_ENTRY_MAX_PAYLOAD;
+
+	if (tls_tid == 0) {
+		tls_tid = (pid_t)syscall(SYS_gettid);
+		/* thread name is sampled once, on first capture */
+		if (prctl(PR_GET_NAME, tls_tname) < 0)
+			tls_tname[0] = '\0';
+		tls_tname[sizeof(tls_tname)-1] = '\0';
+	}
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	size = FLIGHT_ALIGN(sizeof(*rec) + len);
+
+	pthread_mutex_lock(&flight.lock);
+
+	/* records never wrap: pad up to the end of the ring if needed */
+	off = flight.head & (flight.size-1);
+	pad = (flight.size - off < size) ? flight.size - off : 0;
+	while (flight.size - (flight.head - flight.tail) < pad + size) {
+		rec = (struct flight_record *)
+			&flight.buf[flight.tail & (flight.size-1)];
+		flight.tail += rec->size;
+	}
+
+	if (pad) {
+		rec = (struct flight_record *)&flight.buf[off];
+		rec->size = pad;
+		rec->prio = FLIGHT_PADDING;
+		flight.head += pad;
+		off = 0;
+	}
+
+	rec = (struct flight_record *)&flight.buf[off];
+	rec->size = size;
+	rec->prio = prio;
+	rec->cookie = cookie;
+	rec->tid = tls_tid;
+	rec->sec = (int32_t)ts.tv_sec;
+	rec->nsec = (int32_t)ts.tv_nsec;
+	rec->len = (uint16_t)len;
+	memcpy(rec->tname, tls_tname, sizeof(rec->tname));
+	memcpy(rec->data, buf, len);
+	flight.head += size;
+
+	pthread_mutex_unlock(&flight.lock);
+}
+
+/* should a message of tag 'cookie' be captured rather than written ? */
+static int flight_captured(uint32_t prio, struct ulog_cookie *cookie)
+{
+	int level = flight_tag_level(cookie);
+
+	/* messages of a dump are written as is */
+	return level >= 0 && (int)(prio & ULOG_PRIO_LEVEL_MASK) > level &&
+		!tls_dumping;
+}
+
+int ulog_flight_vrecord(uint32_t prio, struct ulog_cookie *cookie,
+			const char *fmt, va_list ap)
+{
+	char buf[ULOG_BUF_SIZE];
+	int ret;
+
+	if (!flight_captured(prio, cookie))
+		return 0;
+
+	/* arguments are formatted only if entries are dumped */
+	ret = ulog_deferred_encode(buf, sizeof(buf), 0, fmt, ap);
+	if (ret > 0) {
+		flight_store(prio | (1U << ULOG_PRIO_BINARY_SHIFT), cookie,
+			     buf, ret);
+		return 1;
+	}
+
+	ret = vsnprintf(buf, sizeof(buf), fmt, ap);
+	if (ret >= (int)sizeof(buf))
+		/* truncated output */
+		ret = sizeof(buf)-1;
+	if (ret >= 0)
+		flight_store(prio, cookie, buf, ret+1);
+	return 1;
+}
+
+int ulog_flight_record(uint32_t prio, struct ulog_cookie *cookie,
+		       const char *buf, int len)
+{
+	if (!flight_captured(prio, cookie))
+		return 0;
+
+	flight_store(prio, cookie, buf, len);
+	return 1;
+}
+
+void ulog_flight_trigger(uint32_t prio, struct ulog_cookie *cookie)
+{
+	/* errors, critical messages and trigger tag write out the ring */
+	if ((int)(prio & ULOG_PRIO_LEVEL_MASK) > ULOG_ERR &&
+	    (!flight.trigger || strcmp(cookie->name, flight.trigger) != 0))
+		return;
+
+	/* messages logged by the writer itself must not dump again */
+	if (tls_dumping)
+		return;
+
+	pthread_mutex_lock(&flight.dump);
+	tls_dumping = 1;
+	flight_dump();
+	tls_dumping = 0;
+	pthread_mutex_unlock(&flight.dump);
+}
@@ -33,6 +33,19 @@
 #include "ulogger.h"
 #include "ulog_common.h"
 
+/* size of the local buffer in which batched entries are packed */
+#define BATCH_BUF_SIZE (16*1024)
+
+/*
+ * Process and thread names must be null-terminated in the payload, so that
+ * the driver can tell them from the message when it sends them apart to
+ * readers of version 3 of the ABI (see struct ulogger_entry_v3).
+ */
+static int name_needs_null(const char *name, unsigned int len)
+{
+	return (len == 0) || (name[len-1] != '\0');
+}
+
 ULOG_EXPORT int ulog_raw_open(const char *dev)
 {
 	const char *prop;
@@ -110,7 +123,8 @@ ULOG_EXPORT int ulog_raw_logv(int fd, const struct ulog_raw_entry *raw,
 {
 	int i = 0, j;
 	ssize_t ret;
-	struct iovec vec[6 + iovcnt];
+	static const char null;
+	struct iovec vec[8 + iovcnt];
 	const struct ulogger_entry *entry;
 	const size_t prefix = sizeof((*entry).len) + sizeof((*entry).hdr_size);
 
@@ -137,15 +151,25 @@ ULOG_EXPORT int ulog_raw_logv(int fd, const struct ulog_raw_entry *raw,
 	vec[i].iov_len = sizeof(*entry) - prefix;
 	i++;
 
-	/* process name, must be null-terminated */
+	/* process name, null-terminated */
 	vec[i].iov_base = (void *)raw->pname;
 	vec[i].iov_len = raw->pname_len;
 	i++;
+	if (name_needs_null(raw->pname, raw->pname_len)) {
+		vec[i].iov_base = (void *)&null;
+		vec[i].iov_len = 1;
+		i++;
+	}
 	if (entry->pid != entry->tid) {
-		/* thread name, must be null-terminated */
+		/* thread name, null-terminated */
 		vec[i].iov_base = (void *)raw->tname;
 		vec[i].iov_len = raw->tname_len;
 		i++;
+		if (name_needs_null(raw->tname, raw->tname_len)) {
+			vec[i].iov_base = (void *)&null;
+			vec[i].iov_len = 1;
+			i++;
+		}
 	}
 
 	/* priority, color, binary flags, ... */
@@ -172,3 +196,122 @@ ULOG_EXPORT int ulog_raw_logv(int fd, const struct ulog_raw_entry *raw,
 
 	return (ret < 0) ? -errno : 0;
 }
+
+int ulog_write_batch(int fd, const void *buf, size_t len, int count, int raw)
+{
+	static int unsupported;
+	struct ulogger_batch batch;
+	const uint8_t *rec = buf;
+	const size_t prefix = offsetof(struct ulogger_entry, pid);
+	const size_t hdrlen = sizeof(struct ulogger_entry);
+	const size_t skip = raw ? prefix : hdrlen;
+	uint16_t reclen;
+	ssize_t ret;
+	int i;
+
+	if (!unsupported) {
+		batch.buf = (uintptr_t)buf;
+		batch.len = len;
+		batch.count = count;
+		ret = ioctl(fd, ULOGGER_WRITE_BATCH, &batch);
+		if (ret >= 0)
+			return 0;
+		if ((errno != ENOTTY) && (errno != EINVAL))
+			return -errno;
+		/*
+		 * Older drivers also fail unknown commands with EINVAL: tell
+		 * them from a malformed batch with an empty one, which the
+		 * ioctl accepts.
+		 */
+		if (errno == EINVAL) {
+			memset(&batch, 0, sizeof(batch));
+			if (ioctl(fd, ULOGGER_WRITE_BATCH, &batch) >= 0)
+				return -EINVAL;
+		}
+		/* feature is not present in driver */
+		unsupported = 1;
+	}
+
+	/* fall back to one write per record, skipping (part of) its header */
+	for (i = 0; i < count; i++) {
+		memcpy(&reclen, rec, sizeof(reclen));
+		do {
+			ret = write(fd, rec + skip, hdrlen - skip + reclen);
+		} while ((ret < 0) && (errno == EINTR));
+		if (ret < 0)
+			return -errno;
+		rec += hdrlen + reclen;
+	}
+	return 0;
+}
+
+ULOG_EXPORT int ulog_raw_log_batch(int fd, const struct ulog_raw_entry *raws,
+		int count)
+{
+	uint8_t buf[BATCH_BUF_SIZE];
+	struct ulogger_entry entry;
+	const struct ulog_raw_entry *raw;
+	size_t off = 0, len, msglen, namelen;
+	int i, n = 0, ret, pnull, tnull;
+
+	if ((fd < 0) || !raws || (count < 0))
+		return -EINVAL;
+
+	for (i = 0; i < count; i++) {
+		raw = &raws[i];
+		entry = raw->entry;
+
+		/* see ulog_raw_logv() */
+		if ((entry.pid == -1) && (entry.tid == -1))
+			return -EINVAL;
+
+		/* see name_needs_null() */
+		pnull = name_needs_null(raw->pname, raw->pname_len);
+		tnull = (entry.pid != entry.tid) &&
+			name_needs_null(raw->tname, raw->tname_len);
+		namelen = raw->pname_len + pnull;
+		if (entry.pid != entry.tid)
+			namelen += raw->tname_len + tnull;
+		len = namelen + sizeof(raw->prio) + raw->tag_len;
+		if (len >= ULOGGER_ENTRY_MAX_PAYLOAD)
+			return -EINVAL;
+
+		/* truncate message as the kernel would do */
+		msglen = raw->message_len;
+		if (len + msglen > ULOGGER_ENTRY_MAX_PAYLOAD)
+			msglen = ULOGGER_ENTRY_MAX_PAYLOAD - len;
+		len += msglen;
+
+		if (off + sizeof(entry) + len > sizeof(buf)) {
+			ret = ulog_write_batch(fd, buf, off, n, 1);
+			if (ret < 0)
+				return ret;
+			off = 0;
+			n = 0;
+		}
+
+		entry.len = len;
+		entry.hdr_size = sizeof(entry);
+		memcpy(&buf[off], &entry, sizeof(entry));
+		off += sizeof(entry);
+		memcpy(&buf[off], raw->pname, raw->pname_len);
+		off += raw->pname_len;
+		if (pnull)
+			buf[off++] = '\0';
+		if (entry.pid != entry.tid) {
+			memcpy(&buf[off], raw->tname, raw->tname_len);
+			off += raw->tname_len;
+			if (tnull)
+				buf[off++] = '\0';
+		}
+		memcpy(&buf[off], &raw->prio, sizeof(raw->prio));
+		off += sizeof(raw->prio);
+		memcpy(&buf[off], raw->tag, raw->tag_len);
+		off += raw->tag_len;
+		memcpy(&buf[off], raw->message, msglen);
+		off += msglen;
+		n++;
+	}
+
+	return n ? ulog_write_batch(fd, buf, off, n, 1) : 0;
+}
@@ -0,0 +1,334 @@
+/**
+ * Copyright (C) 2024 Parrot S.A.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * libulog: a minimalistic logging library derived from Android logger
+ *
+ * Shared memory writer: entries are framed exactly as the ulogger driver
+ * would store them, and appended to a memory-mapped multi-producer ring (see
+ * ulogshm.h). Space is reserved with a single atomic addition, so that the
+ * fast path involves no lock and no system call, unless a reader is blocked
+ * waiting for new entries.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "ulog.h"
+#include "ulogger.h"
+#include "ulogshm.h"
+#include "ulog_common.h"
+
+/* default ring size, in kB */
+#define SHM_RING_DEFAULT_KB   256
+/* how long to wait for another process to initialize a new ring, in ms */
+#define SHM_INIT_TIMEOUT_MS   100
+
+/* a mapped log buffer; never unmapped, see ulog_shm_init() */
+struct shm_log {
+	struct ulog_shm_header *hdr;
+	uint8_t                *ring;
+	uint32_t                mask;
+	char                    name[32];
+};
+
+static struct {
+	pthread_mutex_t  lock;
+	struct shm_log  *log;       /* current log buffer */
+	uint32_t         gen;       /* incremented on fork */
+	int32_t          pid;
+	int32_t          euid;
+	char             pname[17];
+	unsigned int     pname_len;
+} shm = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.gen  = 1,
+};
+
+static __thread uint32_t tls_gen;
+static __thread int32_t tls_tid;
+static __thread char tls_tname[17];
+static __thread unsigned int tls_tname_len;
+
+static void shm_load_pname(void)
+{
+	int fd;
+	ssize_t ret;
+
+	shm.pid = getpid();
+	shm.euid = (int32_t)geteuid();
+	shm.pname[0] = '\0';
+
+	fd = open("/proc/self/comm", O_RDONLY|O_CLOEXEC);
+	if (fd >= 0) {
+		ret = read(fd, shm.pname, sizeof(shm.pname)-1);
+		if (ret > 0 && shm.pname[ret-1] == '\n')
+			ret--;
+		shm.pname[ret > 0 ? ret : 0] = '\0';
+		close(fd);
+	}
+	shm.pname_len = strlen(shm.pname)+1;
+}
+
+/* thread identity is sampled on first log, and again after a fork */
+static void shm_load_thread(void)
+{
+	tls_tid = (int32_t)syscall(SYS_gettid);
+	tls_tname_len = 0;
+	if (tls_tid != shm.pid) {
+		if (prctl(PR_GET_NAME, tls_tname) < 0)
+			tls_tname[0] = '\0';
+		tls_tname[sizeof(tls_tname)-1] = '\0';
+		tls_tname_len = strlen(tls_tname)+1;
+	}
+	tls_gen = __atomic_load_n(&shm.gen, __ATOMIC_ACQUIRE);
+}
+
+static void shm_atfork_child(void)
+{
+	shm_load_pname();
+	__atomic_add_fetch(&shm.gen, 1, __ATOMIC_RELEASE);
+}
+
+/* copy 'len' bytes at ring position 'pos', return the next position */
+static inline uint64_t shm_copy(const struct shm_log *log, uint64_t pos,
+				const void *src, size_t len)
+{
+	uint32_t off = (uint32_t)pos & log->mask;
+	size_t n = log->mask + 1 - off;
+
+	if (n >= len) {
+		memcpy(log->ring + off, src, len);
+	} else {
+		memcpy(log->ring + off, src, n);
+		memcpy(log->ring, (const char *)src + n, len - n);
+	}
+	return pos + len;
+}
+
+void ulog_writer_shm(uint32_t prio, struct ulog_cookie *cookie,
+		     const char *buf, int len)
+{
+	struct shm_log *log = __atomic_load_n(&shm.log, __ATOMIC_ACQUIRE);
+	struct ulog_shm_header *hdr = log->hdr;
+	struct ulog_shm_record *rec;
+	struct ulogger_entry entry;
+	struct timespec ts;
+	uint32_t prefix;
+	uint64_t pos, p;
+
+	if (len < 0)
+		return;
+	if (tls_gen != __atomic_load_n(&shm.gen, __ATOMIC_RELAXED))
+		shm_load_thread();
+
+	/* same truncation as the ulogger driver */
+	prefix = shm.pname_len + tls_tname_len + 4 + cookie->namesize;
+	if (prefix >= ULOGGER_ENTRY_MAX_PAYLOAD)
+		return;
+	if (prefix + len > ULOGGER_ENTRY_MAX_PAYLOAD)
+		len = ULOGGER_ENTRY_MAX_PAYLOAD - prefix;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	entry.len = (uint16_t)(prefix + len);
+	entry.hdr_size = sizeof(entry);
+	entry.pid = shm.pid;
+	entry.tid = tls_tid;
+	entry.sec = (int32_t)ts.tv_sec;
+	entry.nsec = (int32_t)ts.tv_nsec;
+	entry.euid = shm.euid;
+
+	pos = __atomic_fetch_add(&hdr->tail,
+				 ulog_shm_record_len(sizeof(entry) + entry.len),
+				 __ATOMIC_RELAXED);
+	/* readers must see the reservation before any overwritten data */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	/* record headers are aligned and never wrap */
+	rec = (struct ulog_shm_record *)
+		(log->ring + ((uint32_t)pos & log->mask));
+	rec->len = sizeof(entry) + entry.len;
+
+	p = shm_copy(log, pos + sizeof(*rec), &entry, sizeof(entry));
+	p = shm_copy(log, p, shm.pname, shm.pname_len);
+	if (tls_tname_len)
+		p = shm_copy(log, p, tls_tname, tls_tname_len);
+	p = shm_copy(log, p, &prio, 4);
+	p = shm_copy(log, p, cookie->name, cookie->namesize);
+	(void)shm_copy(log, p, buf, len);
+
+	__atomic_store_n(&rec->seq, pos + 1, __ATOMIC_RELEASE);
+
+	/* pairs with the barrier of readers between 'waiters' and 'seq' */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&hdr->waiters, __ATOMIC_RELAXED) &&
+	    __atomic_exchange_n(&hdr->waiters, 0, __ATOMIC_RELAXED)) {
+		__atomic_add_fetch(&hdr->futex, 1, __ATOMIC_RELAXED);
+		(void)syscall(SYS_futex, &hdr->futex, FUTEX_WAKE, INT_MAX,
+			      NULL, NULL, 0);
+	}
+}
+
+/* map a log buffer file, creating and initializing it if needed */
+static int shm_map(struct shm_log *log, const char *path, uint32_t size)
+{
+	int fd, i, ret, created = 0;
+	struct ulog_shm_header *hdr;
+	struct stat st;
+	void *addr;
+
+	fd = open(path, O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC, 0666);
+	if (fd >= 0) {
+		created = 1;
+		/* all processes may log, whatever their umask */
+		if (fchmod(fd, 0666) < 0 ||
+		    ftruncate(fd, ULOG_SHM_HDR_SIZE + size) < 0) {
+			ret = -errno;
+			unlink(path);
+			goto out;
+		}
+	} else if (errno == EEXIST) {
+		fd = open(path, O_RDWR|O_CLOEXEC);
+	}
+	if (fd < 0)
+		return -errno;
+
+	/* wait for the creator to size the file */
+	for (i = 0; ; i++) {
+		if (fstat(fd, &st) < 0) {
+			ret = -errno;
+			goto out;
+		}
+		if (st.st_size >= ULOG_SHM_HDR_SIZE + ULOG_SHM_MIN_SIZE)
+			break;
+		if (i == SHM_INIT_TIMEOUT_MS) {
+			ret = -EAGAIN;
+			goto out;
+		}
+		usleep(1000);
+	}
+
+	addr = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED) {
+		ret = -errno;
+		goto out;
+	}
+	hdr = addr;
+
+	if (created) {
+		hdr->version = ULOG_SHM_VERSION;
+		hdr->size = size;
+		hdr->hdr_size = ULOG_SHM_HDR_SIZE;
+		__atomic_store_n(&hdr->magic, ULOG_SHM_MAGIC, __ATOMIC_RELEASE);
+	}
+
+	/* wait for the creator to initialize the header */
+	for (i = 0; __atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) !=
+		    ULOG_SHM_MAGIC; i++) {
+		if (i == SHM_INIT_TIMEOUT_MS)
+			break;
+		usleep(1000);
+	}
+
+	if (hdr->magic != ULOG_SHM_MAGIC ||
+	    hdr->version != ULOG_SHM_VERSION ||
+	    hdr->hdr_size != ULOG_SHM_HDR_SIZE ||
+	    hdr->size < ULOG_SHM_MIN_SIZE || hdr->size > ULOG_SHM_MAX_SIZE ||
+	    (hdr->size & (hdr->size - 1)) ||
+	    (off_t)hdr->hdr_size + hdr->size > st.st_size) {
+		munmap(addr, st.st_size);
+		ret = -EPROTO;
+		goto out;
+	}
+
+	log->hdr = hdr;
+	log->ring = (uint8_t *)addr + hdr->hdr_size;
+	log->mask = hdr->size - 1;
+	ret = 0;
+out:
+	close(fd);
+	return ret;
+}
+
+int ulog_shm_init(const char *name)
+{
+	static int once;
+	const char *prop;
+	char path[64];
+	struct shm_log *log;
+	unsigned long kb;
+	uint32_t size;
+	int ret;
+
+	prop = getenv("ULOG_SHM");
+	if (!prop || prop[0] == '\0' || prop[0] == '0' || prop[0] == 'n')
+		return -ENOTSUP;
+
+	kb = strtoul(prop, NULL, 0);
+	if (kb == 0)
+		kb = SHM_RING_DEFAULT_KB;
+	/* round up to a power of two, within ulogger limits */
+	size = ULOG_SHM_MIN_SIZE;
+	while (size < kb * 1024 && size < ULOG_SHM_MAX_SIZE)
+		size <<= 1;
+
+	pthread_mutex_lock(&shm.lock);
+
+	if (!once) {
+		shm_load_pname();
+		pthread_atfork(NULL, NULL, shm_atfork_child);
+		once = 1;
+	}
+
+	/* keep using the current buffer if the device did not change */
+	ret = 0;
+	if (shm.log && strcmp(shm.log->name, name) == 0)
+		goto out;
+
+	log = calloc(1, sizeof(*log));
+	if (!log) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	snprintf(log->name, sizeof(log->name), "%s", name);
+	snprintf(path, sizeof(path), ULOG_SHM_DIR "ulog_%s", name);
+
+	ret = shm_map(log, path, size);
+	if (ret < 0) {
+		free(log);
+		goto out;
+	}
+
+	/*
+	 * Other threads may still be writing to the previous buffer without
+	 * holding any lock: it is deliberately leaked.
+	 */
+	__atomic_store_n(&shm.log, log, __ATOMIC_RELEASE);
+out:
+	pthread_mutex_unlock(&shm.lock);
+	return ret;
+}
@@ -125,7 +125,7 @@ static void send_tag_info_cb(struct ulog_cookie *cookie, void *userdata)
 	res = pomp_msg_write(msg, ULOGCTL_MSG_ID_TAG_INFO,
 			ULOGCTL_MSG_FMT_ENC_TAG_INFO,
 			cookie->name,
-			cookie->level);
+			ulog_get_level(cookie));
 	if (res < 0) {
 		LOG_ERRNO("pomp_msg_write", -res);
 		goto error;
@@ -52,6 +52,7 @@ static struct {
 	struct pomp_timer *timer;
 	int ulogfd;
 	struct ulog_raw_entry raw;
+	struct ulog_raw_entry *raws;
 	struct {
 		struct shd_ctx *ctx;
 		struct shd_revision *rev;
@@ -69,6 +70,7 @@ static struct {
 	.loop = NULL,
 	.timer = NULL,
 	.ulogfd = -1,
+	.raws = NULL,
 	.raw = {
 		.entry = {
 			.pid = SHDLOGD_DEFAULT_PID,
@@ -175,11 +177,12 @@ static int read_samples()
 	if (ret < 0)
 		return ret;
 
-	/* Send samples to ulog */
+	/* Prepare samples for ulog */
 	for (i = 0; i < result.nb_matches; i++) {
 
-		fill_raw_entry(&ctx.raw, &ctx.shd.blobs[i], &ctx.shd.ts[i]);
-		ret = ulog_raw_log(ctx.ulogfd, &ctx.raw);
+		ctx.raws[i] = ctx.raw;
+		fill_raw_entry(&ctx.raws[i], &ctx.shd.blobs[i],
+				&ctx.shd.ts[i]);
 
 		/* check index vs previous index */
 		d = ctx.shd.blobs[i].index - ctx.index - 1;
@@ -191,6 +194,11 @@ static int read_samples()
 		ctx.index = ctx.shd.blobs[i].index;
 	}
 
+	/* Send all samples to ulog at once */
+	ret = ulog_raw_log_batch(ctx.ulogfd, ctx.raws, result.nb_matches);
+	if (ret < 0)
+		ULOGE("ulog_raw_log_batch failed: %s", strerror(-ret));
+
 	/* add 1ns to the last received sample timestamp to get the next ones */
 	time_timespec_add_ns(&ctx.shd.ts[result.nb_matches - 1], 1,
 							&ctx.shd.search.date);
@@ -327,6 +335,14 @@ int main(int argc, char **argv)
 		goto finish;
 	}
 
+	ctx.raws =
+		malloc(sizeof(struct ulog_raw_entry) * ULOG_SHD_NB_SAMPLES);
+	if (!ctx.raws) {
+		ULOGE("can't allocate memory for raw entries");
+		ret = -ENOMEM;
+		goto finish;
+	}
+
 	/* Read oldest sample to get a timestamp reference */
 	do {
 		ret = read_samples();
@@ -348,6 +364,7 @@ int main(int argc, char **argv)
 	}
 
 finish:
+	free(ctx.raws);
 	free(ctx.shd.ts);
 	free(ctx.shd.blobs);
 
@@ -10,12 +10,21 @@ LOCAL_CATEGORY_PATH := libs
 LOCAL_EXPORT_C_INCLUDES := $(LOCAL_PATH)/include
 LOCAL_CFLAGS := -Wextra -fvisibility=hidden
 LOCAL_SRC_FILES := \
+	libulogcat_archive.c \
+	libulogcat_capture.c \
 	libulogcat_core.c \
+	libulogcat_cursor.c \
+	libulogcat_filter.c \
+	libulogcat_fmt.c \
 	libulogcat_klog.c \
+	libulogcat_lz4.c \
+	libulogcat_pipeline.c \
 	libulogcat_text.c \
 	libulogcat_compat.c \
+	libulogcat_shm.c \
 	libulogcat_ulog.c
 
+LOCAL_LDLIBS := -lpthread
 LOCAL_LIBRARIES := libulog
 include $(BUILD_SHARED_LIBRARY)
 
@@ -35,6 +44,14 @@ LOCAL_MODULE := tst-libulogcat
 LOCAL_SRC_FILES := tests/libulogcat_test.c
 LOCAL_LIBRARIES := libulogcat libulog
 include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := libulogcat-bench
+LOCAL_DESCRIPTION := libulogcat text rendering benchmark
+LOCAL_CATEGORY_PATH := test
+LOCAL_SRC_FILES := tests/ulogcatbench.c
+LOCAL_LIBRARIES := libulog
+include $(BUILD_EXECUTABLE)
 endif
 
 endif
@@ -29,6 +29,8 @@ enum ulogcat_format {
 	ULOGCAT_FORMAT_PROCESS,
 	ULOGCAT_FORMAT_LONG,
 	ULOGCAT_FORMAT_CSV,
+	ULOGCAT_FORMAT_BINARY,  /* capture file, see ulogcat3_open() */
+	ULOGCAT_FORMAT_JSON,    /* one JSON object per line, see ulogcat3_open() */
 };
 
 /* opaque structure */
@@ -39,6 +41,8 @@ struct ulogcat3_context;
 #define ULOGCAT_FLAG_SHOW_LABEL (1 << 4)  /* request label in text output */
 #define ULOGCAT_FLAG_ULOG       (1 << 5)  /* request ulog devices */
 #define ULOGCAT_FLAG_KLOG       (1 << 7)  /* request kernel messages */
+#define ULOGCAT_FLAG_LINE_BUFFERED (1 << 8) /* request line-buffered output */
+#define ULOGCAT_FLAG_PIPELINE   (1 << 9)  /* request output in a thread */
 
 struct ulogcat_opts_v3 {
 	enum ulogcat_format      opt_format;      /* output format */
@@ -62,12 +66,31 @@ struct ulogcat_opts_v3 {
  * rendered log lines.
  * Field @opt_output_fd is the fallback output descriptor; it is used only if
  * opt_output_fp is NULL.
+ * Output is line-buffered if it is a terminal or if ULOGCAT_FLAG_LINE_BUFFERED
+ * is specified; otherwise rendered entries are written in large blocks, before
+ * waiting for new entries and before ulogcat3_process_logs() returns.
+ * If ULOGCAT_FLAG_PIPELINE is specified, entries are rendered and output by a
+ * separate thread, started by the first call to ulogcat3_process_logs(), so
+ * that a slow output does not delay the reading of log buffers and entries
+ * are not lost when buffers wrap. In that case ulogcat3_process_logs() only
+ * waits for output when it returns 0 (dump done) or an error, and
+ * ulogcat3_close() waits for remaining entries to be output.
  * @param ulog_devices: array of ulog device names that should be processed; it
  * is only accessed during this call and does not need to be persistent. It
  * should contain names without the '/dev/ulog_' prefix, such as
  * 'main', 'pimp', etc. If no device name is specified (@param len = 0) and
  * flag ULOGCAT_FLAG_ULOG is specified in @param opts, then all ulog devices
  * are added.
+ * Entries rendered with format ULOGCAT_FORMAT_BINARY are written unformatted
+ * to a capture file, which can be read later by specifying a device name
+ * 'file:<path>'. Capture files are processed like other devices, and should
+ * be used with flag ULOGCAT_FLAG_DUMP.
+ * Entries rendered with format ULOGCAT_FORMAT_JSON are written as JSON
+ * objects, one per line, with fields "sec", "nsec", "prio", "tag", "pid",
+ * "pname", "tid", "tname" (except for kernel messages), "label" (with flag
+ * ULOGCAT_FLAG_SHOW_LABEL) and "msg", or "bin" with base64-encoded binary
+ * data. Event messages (see ULOG_EVT in ulog.h) also get a field "evt" (or
+ * "evts") with their type and parameters.
  * @param len: number of elements in array ulog_devices.
  * @return: context structure or NULL upon error.
  */
@@ -101,11 +124,152 @@ int ulogcat3_clear(struct ulogcat3_context *ctx);
  * @param max_entries: maximum number of processed lines, 0 means no limit
  *
  * @return: 0 if all entries have been processed
- *          1 if more entries need processing
+ *          1 if more entries need processing, or if interrupted by a signal
  *          negative value if an error occured
  */
 int ulogcat3_process_logs(struct ulogcat3_context *ctx, int max_entries);
 
+/**
+ * Load a format string dictionary.
+ *
+ * Dictionaries are generated by the 'ulogfmt' tool from binaries built with
+ * ULOG_FMT_REGISTRY, and are needed to render messages logged with
+ * ULOG_DEFERRED=id. Several dictionaries may be loaded in the same context.
+ *
+ * @param ctx: ulogcat context
+ * @param path: dictionary file path
+ * @return: 0 if successful, a negative errno value in case of error
+ */
+int ulogcat3_load_fmt_dict(struct ulogcat3_context *ctx, const char *path);
+
+/**
+ * Set a filter on log entries.
+ *
+ * Entries rejected by the filter are dropped as soon as they are read, before
+ * rendering, and do not count in tail lines. The filter expression is a list
+ * of whitespace-separated terms:
+ *
+ *  <tag>[:<level>]  show entries of <tag> up to <level> (default: all)
+ *  *:<level>        show entries of unlisted tags up to <level>
+ *  pid=<pid>        show entries of process <pid>
+ *  tid=<tid>        show entries of thread <tid>
+ *  pname=<name>     show entries of processes named <name>
+ *  tname=<name>     show entries of threads named <name>
+ *  since=<secs>     show entries logged at or after <secs>
+ *  until=<secs>     show entries logged at or before <secs>
+ *  msg=<regex>      show entries whose message matches extended <regex>
+ *
+ * Levels are given as a digit or as one of the letters C, E, W, N, I, D (as
+ * in text output), V (all levels) or S (silent). For instance, expression
+ * "foo:D *:S" only shows messages of tag 'foo', and "*:W" only shows warnings
+ * and errors. Timestamps are given in seconds, with an optional fractional
+ * part. Terms of the same kind (except tags) are alternatives, terms of
+ * different kinds must all match.
+ *
+ * @param ctx: ulogcat context
+ * @param expr: filter expression, or NULL to remove the current filter
+ * @return: 0 if successful, a negative errno value in case of error
+ */
+int ulogcat3_set_filter(struct ulogcat3_context *ctx, const char *expr);
+
+/**
+ * Write an index of the capture file being written.
+ *
+ * The index summarizes timestamps, tags and pids of chunks of records. When
+ * reading a capture file '<path>', index '<path>.idx' is used if present to
+ * skip chunks which cannot match the filter (see ulogcat3_set_filter()),
+ * without reading them. Capture output should start at the beginning of the
+ * capture file.
+ *
+ * @param ctx: ulogcat context, with format ULOGCAT_FORMAT_BINARY
+ * @param path: index file path
+ * @return: 0 if successful, a negative errno value in case of error
+ */
+int ulogcat3_set_capture_index(struct ulogcat3_context *ctx,
+			       const char *path);
+
+/**
+ * Resume processing after the entries output by a previous context.
+ *
+ * Cursor file @path records the last entry output from each device: its
+ * sequence number (see struct ulogger_entry_v3 in ulogger.h), timestamp and
+ * a hash of its contents. If the file exists, entries up to that one are
+ * skipped: ulog readers are moved past it with ioctl(ULOGGER_SET_READ_SEQ)
+ * if the driver supports it (devices are then read with read() instead of
+ * being mapped), other entries are skipped by sequence number, or else by
+ * timestamp and hash. Cursors recorded during another boot are ignored.
+ *
+ * The cursor file is updated once entries have been written to the output
+ * (or archive, see ulogcat3_set_archive()), at most once per second, and
+ * when the context is closed. Entries output after the last update are
+ * output again by the next context, none are skipped. This function should
+ * be called before processing entries.
+ *
+ * @param ctx: ulogcat context
+ * @param path: cursor file path
+ * @return: 0 if successful, a negative errno value in case of error
+ */
+int ulogcat3_set_cursor(struct ulogcat3_context *ctx, const char *path);
+
+/**
+ * Batch wakeups of a non-interactive drain.
+ *
+ * Once the entries present at startup have been processed, ulog devices only
+ * wake up ulogcat3_process_logs() when at least @bytes bytes are readable, or
+ * @latency_ms milliseconds after entries became pending (0 for no such
+ * bound), using ioctl(ULOGGER_SET_WATERMARK): entries are output up to that
+ * late, with far fewer context switches under heavy logging. Devices whose
+ * driver does not support it wake up for each entry. This cannot be used with
+ * flag ULOGCAT_FLAG_DUMP.
+ *
+ * @param ctx: ulogcat context
+ * @param bytes: readable bytes to wake up for, 0 or 1 for each entry
+ * @param latency_ms: maximum delay of pending entries, 0 for no limit
+ * @return: 0 if successful, a negative errno value in case of error
+ */
+int ulogcat3_set_watermark(struct ulogcat3_context *ctx, unsigned int bytes,
+			   unsigned int latency_ms);
+
+/* archive segment synchronization policies */
+enum ulogcat_archive_sync {
+	ULOGCAT_ARCHIVE_SYNC_NONE,     /* leave it to the kernel */
+	ULOGCAT_ARCHIVE_SYNC_SEGMENT,  /* fsync() segments when rotating */
+	ULOGCAT_ARCHIVE_SYNC_WRITE,    /* fdatasync() after each write */
+};
+
+struct ulogcat_archive_opts {
+	const char              *dir;             /* segments directory */
+	const char              *prefix;          /* segment file name prefix */
+	unsigned long long       segment_size;    /* rotate size, 0 = no limit */
+	unsigned int             segment_time;    /* rotate period (s), 0 = none */
+	unsigned long long       max_size;        /* disk budget, 0 = no limit */
+	unsigned int             flush_ms;        /* maximum write delay (ms) */
+	enum ulogcat_archive_sync sync;           /* synchronization policy */
+	int                      compress;        /* set to 1 to compress */
+};
+
+/**
+ * Write captured entries to an archive of rotating segment files.
+ *
+ * Instead of being written to the context output, capture records are
+ * grouped in blocks of up to 64kB, optionally compressed (LZ4 block format),
+ * and appended to segment files '<dir>/<prefix>-<number>.ulc'. Each segment
+ * is a capture file which can be read with a 'file:<path>' device.
+ *
+ * Blocks are written in batches, at the latest @flush_ms milliseconds after
+ * their first record. A new segment is started when the current one exceeds
+ * @segment_size bytes or is older than @segment_time seconds. Oldest
+ * segments, including those left by a previous archive in @dir, are removed
+ * so that the archive does not exceed @max_size bytes. Buffered blocks are
+ * written when the context is closed.
+ *
+ * @param ctx: ulogcat context, with format ULOGCAT_FORMAT_BINARY
+ * @param opts: archive options; strings are copied
+ * @return: 0 if successful, a negative errno value in case of error
+ */
+int ulogcat3_set_archive(struct ulogcat3_context *ctx,
+			 const struct ulogcat_archive_opts *opts);
+
 /* v1 API (deprecated) */
 struct ulogcat_context;
 
@@ -0,0 +1,465 @@
+/**
+ * Copyright (C) 2014 Parrot S.A.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * libulogcat, a reader library for ulogger/kernel log buffers
+ *
+ */
+
+#include "libulogcat_private.h"
+
+/*
+ * Archives are rotating capture files (segments) with flag
+ * CAPTURE_FLAG_BLOCKS. Capture records are appended to a raw block; full
+ * blocks are compressed and queued in a batch, which is written with a
+ * single pwritev() when full, or when the oldest buffered record is older
+ * than the flush delay.
+ */
+#define ARCHIVE_SUFFIX          ".ulc"
+#define ARCHIVE_BATCH           4
+#define ARCHIVE_FLUSH_MS        1000
+
+struct archive_segment {
+	unsigned int             seq;
+	uint64_t                 size;
+};
+
+struct archive_block {
+	struct capture_block     hdr;
+	uint8_t                  data[CAPTURE_BLOCK_SIZE];
+};
+
+struct log_archive {
+	char                    *dir;
+	char                    *prefix;
+	uint64_t                 segment_size;
+	unsigned int             segment_time;  /* ms */
+	uint64_t                 max_size;
+	unsigned int             flush_ms;
+	enum ulogcat_archive_sync sync;
+	int                      compress;
+	int                      fd;          /* current segment, or -1 */
+	unsigned int             seq;         /* current or next segment */
+	uint64_t                 size;        /* current segment size */
+	uint64_t                 start;       /* current segment creation (ms) */
+	struct archive_segment  *segments;    /* closed segments, oldest first */
+	size_t                   nsegments;
+	uint64_t                 total;       /* closed segments size */
+	uint64_t                 deadline;    /* flush deadline (ms) */
+	uint8_t                 *header;      /* segment header */
+	size_t                   header_size;
+	size_t                   len;         /* raw block length */
+	uint8_t                  block[CAPTURE_BLOCK_SIZE];
+	int                      nbatch;      /* sealed blocks */
+	struct archive_block     batch[ARCHIVE_BATCH];
+};
+
+static uint64_t archive_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000ULL + ts.tv_nsec/1000000;
+}
+
+static char *segment_path(struct log_archive *a, unsigned int seq)
+{
+	char *path;
+
+	if (asprintf(&path, "%s/%s-%08u%s", a->dir, a->prefix, seq,
+		     ARCHIVE_SUFFIX) < 0)
+		return NULL;
+	return path;
+}
+
+/* Parse a segment file name, return 0 if it belongs to archive */
+static int parse_segment_name(struct log_archive *a, const char *name,
+			      unsigned int *seq)
+{
+	size_t len = strlen(a->prefix);
+	unsigned long l;
+	char *endp;
+
+	if (strncmp(name, a->prefix, len) != 0 || name[len] != '-' ||
+	    !isdigit(name[len+1]))
+		return -1;
+
+	errno = 0;
+	l = strtoul(name + len + 1, &endp, 10);
+	if (errno || l > UINT_MAX || strcmp(endp, ARCHIVE_SUFFIX) != 0)
+		return -1;
+
+	*seq = (unsigned int)l;
+	return 0;
+}
+
+static int compare_segments(const void *a, const void *b)
+{
+	const struct archive_segment *sa = a, *sb = b;
+
+	return (sa->seq > sb->seq) - (sa->seq < sb->seq);
+}
+
+static int add_segment(struct log_archive *a, unsigned int seq, uint64_t size)
+{
+	struct archive_segment *p;
+
+	p = realloc(a->segments, (a->nsegments+1)*sizeof(*p));
+	if (p == NULL)
+		return -ENOMEM;
+
+	a->segments = p;
+	a->segments[a->nsegments].seq = seq;
+	a->segments[a->nsegments].size = size;
+	a->nsegments++;
+	a->total += size;
+	return 0;
+}
+
+/* Remove oldest segments until archive fits in its disk budget */
+static void enforce_budget(struct log_archive *a)
+{
+	char *path;
+
+	while (a->max_size && (a->nsegments > 0) &&
+	       (a->total + a->size > a->max_size)) {
+		path = segment_path(a, a->segments[0].seq);
+		if (path && (unlink(path) < 0) && (errno != ENOENT))
+			INFO("cannot remove %s: %s\n", path, strerror(errno));
+		free(path);
+
+		a->total -= a->segments[0].size;
+		a->nsegments--;
+		memmove(a->segments, a->segments + 1,
+			a->nsegments*sizeof(*a->segments));
+	}
+}
+
+/* Load segments left by a previous archive */
+static int scan_segments(struct log_archive *a)
+{
+	struct dirent *de;
+	struct stat st;
+	unsigned int seq;
+	int ret = 0;
+	DIR *dir;
+
+	dir = opendir(a->dir);
+	if (dir == NULL) {
+		ret = -errno;
+		INFO("cannot open %s: %s\n", a->dir, strerror(errno));
+		return ret;
+	}
+
+	while ((de = readdir(dir)) != NULL) {
+		if (parse_segment_name(a, de->d_name, &seq) < 0)
+			continue;
+		if (fstatat(dirfd(dir), de->d_name, &st, 0) < 0)
+			continue;
+		ret = add_segment(a, seq, st.st_size);
+		if (ret < 0)
+			break;
+	}
+	closedir(dir);
+
+	if (a->nsegments > 0) {
+		qsort(a->segments, a->nsegments, sizeof(*a->segments),
+		      compare_segments);
+		a->seq = a->segments[a->nsegments-1].seq + 1;
+	}
+
+	return ret;
+}
+
+static int open_segment(struct ulogcat3_context *ctx, struct log_archive *a)
+{
+	char *path;
+	int ret;
+
+	path = segment_path(a, a->seq);
+	if (path == NULL)
+		return -ENOMEM;
+
+	a->fd = open(path, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, 0644);
+	if (a->fd < 0) {
+		ret = -errno;
+		INFO("cannot create %s: %s\n", path, strerror(errno));
+		free(path);
+		return ret;
+	}
+	free(path);
+
+	/* segments are standalone capture files */
+	a->size = capture_render_header(ctx, a->header, a->header_size,
+					CAPTURE_FLAG_BLOCKS);
+	if (pwrite(a->fd, a->header, a->size, 0) != (ssize_t)a->size) {
+		ret = -errno;
+		INFO("cannot write segment: %s\n", strerror(errno));
+		close(a->fd);
+		a->fd = -1;
+		return ret;
+	}
+
+	a->start = archive_now();
+	return 0;
+}
+
+static int close_segment(struct log_archive *a)
+{
+	int ret = 0;
+
+	if (a->fd < 0)
+		return 0;
+
+	if ((a->sync != ULOGCAT_ARCHIVE_SYNC_NONE) && (fsync(a->fd) < 0)) {
+		ret = -errno;
+		INFO("cannot sync segment: %s\n", strerror(errno));
+	}
+	close(a->fd);
+	a->fd = -1;
+
+	if (add_segment(a, a->seq, a->size) < 0)
+		ret = -ENOMEM;
+	a->seq++;
+	a->size = 0;
+	enforce_budget(a);
+
+	return ret;
+}
+
+/* Move raw block to batch, compressing it if requested */
+static void seal_block(struct log_archive *a)
+{
+	struct archive_block *b = &a->batch[a->nbatch];
+	size_t size = 0;
+
+	/* batch may be full if it could not be written */
+	if ((a->len == 0) || (a->nbatch == ARCHIVE_BATCH))
+		return;
+
+	if (a->compress)
+		size = lz4_compress(a->block, a->len, b->data, a->len - 1);
+
+	/* store uncompressible blocks */
+	if (size == 0) {
+		memcpy(b->data, a->block, a->len);
+		size = a->len;
+	}
+
+	b->hdr.raw_size = a->len;
+	b->hdr.size = size;
+	a->nbatch++;
+	a->len = 0;
+}
+
+static ssize_t pwritev_full(int fd, struct iovec *iov, int iovcnt, off_t off)
+{
+	ssize_t ret, total = 0;
+
+	while (iovcnt > 0) {
+		ret = pwritev(fd, iov, iovcnt, off);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		total += ret;
+		off += ret;
+
+		/* skip written vectors after a partial write */
+		while ((iovcnt > 0) && ((size_t)ret >= iov->iov_len)) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (uint8_t *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+	return total;
+}
+
+/* Write batch of sealed blocks to current segment, and rotate it if needed */
+static int write_batch(struct ulogcat3_context *ctx, struct log_archive *a)
+{
+	struct iovec iov[2*ARCHIVE_BATCH];
+	ssize_t ret;
+	int i;
+
+	if (a->nbatch == 0)
+		return 0;
+
+	if (a->fd < 0) {
+		ret = open_segment(ctx, a);
+		if (ret < 0)
+			return ret;
+	}
+
+	for (i = 0; i < a->nbatch; i++) {
+		iov[2*i].iov_base = &a->batch[i].hdr;
+		iov[2*i].iov_len = sizeof(a->batch[i].hdr);
+		iov[2*i+1].iov_base = a->batch[i].data;
+		iov[2*i+1].iov_len = a->batch[i].hdr.size;
+	}
+
+	ret = pwritev_full(a->fd, iov, 2*a->nbatch, (off_t)a->size);
+	if (ret < 0) {
+		ret = -errno;
+		INFO("cannot write segment: %s\n", strerror(errno));
+		return ret;
+	}
+	a->size += ret;
+	a->nbatch = 0;
+
+	if ((a->sync == ULOGCAT_ARCHIVE_SYNC_WRITE) && (fdatasync(a->fd) < 0)) {
+		ret = -errno;
+		INFO("cannot sync segment: %s\n", strerror(errno));
+		return ret;
+	}
+
+	if ((a->segment_size && (a->size >= a->segment_size)) ||
+	    (a->segment_time && (archive_now() - a->start >= a->segment_time)))
+		return close_segment(a);
+
+	enforce_budget(a);
+	return 0;
+}
+
+/* Write all buffered records, which can then be recorded in cursor */
+static int archive_flush(struct ulogcat3_context *ctx, struct log_archive *a)
+{
+	int ret;
+
+	seal_block(a);
+	ret = write_batch(ctx, a);
+	if (ret == 0)
+		cursor_sync(ctx, 0);
+	return ret;
+}
+
+int archive_write(struct ulogcat3_context *ctx, const void *buf, size_t len)
+{
+	struct log_archive *a = ctx->archive;
+	int ret;
+
+	if (a->len + len > sizeof(a->block)) {
+		seal_block(a);
+		if (a->nbatch == ARCHIVE_BATCH) {
+			ret = write_batch(ctx, a);
+			if (ret < 0)
+				return ret;
+		}
+	}
+
+	if ((a->len == 0) && (a->nbatch == 0))
+		a->deadline = archive_now() + a->flush_ms;
+
+	memcpy(a->block + a->len, buf, len);
+	a->len += len;
+	return 0;
+}
+
+/* Shorten poll() timeout so that buffered records are written in time */
+int archive_timeout(struct ulogcat3_context *ctx, int timeout_ms)
+{
+	struct log_archive *a = ctx->archive;
+	uint64_t now;
+	int delay;
+
+	if ((a->len == 0) && (a->nbatch == 0))
+		return timeout_ms;
+
+	now = archive_now();
+	delay = (a->deadline > now) ? (int)(a->deadline - now) : 0;
+	return ((timeout_ms < 0) || (delay < timeout_ms)) ? delay : timeout_ms;
+}
+
+int archive_tick(struct ulogcat3_context *ctx)
+{
+	struct log_archive *a = ctx->archive;
+
+	if (((a->len == 0) && (a->nbatch == 0)) ||
+	    (archive_now() < a->deadline))
+		return 0;
+
+	return archive_flush(ctx, a);
+}
+
+int archive_open(struct ulogcat3_context *ctx,
+		 const struct ulogcat_archive_opts *opts)
+{
+	struct log_archive *a;
+	int ret;
+
+	if (opts->dir == NULL)
+		return -EINVAL;
+
+	a = calloc(1, sizeof(*a));
+	if (a == NULL)
+		return -ENOMEM;
+
+	a->fd = -1;
+	a->dir = strdup(opts->dir);
+	a->prefix = strdup(opts->prefix ? opts->prefix : "ulog");
+	a->header_size = ctx->render_size;
+	a->header = malloc(a->header_size);
+	if (!a->dir || !a->prefix || !a->header) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+
+	a->segment_size = opts->segment_size;
+	a->segment_time = opts->segment_time*1000;
+	a->max_size = opts->max_size;
+	a->flush_ms = opts->flush_ms ? opts->flush_ms : ARCHIVE_FLUSH_MS;
+	a->sync = opts->sync;
+	a->compress = opts->compress;
+
+	ret = scan_segments(a);
+	if (ret < 0)
+		goto fail;
+
+	enforce_budget(a);
+	ctx->archive = a;
+	return 0;
+
+fail:
+	free(a->segments);
+	free(a->header);
+	free(a->prefix);
+	free(a->dir);
+	free(a);
+	return ret;
+}
+
+void archive_close(struct ulogcat3_context *ctx)
+{
+	struct log_archive *a = ctx->archive;
+
+	if (a == NULL)
+		return;
+
+	/* entries which could not be written must not be recorded */
+	if (archive_flush(ctx, a) < 0)
+		ctx->output_error = 1;
+	close_segment(a);
+
+	free(a->segments);
+	free(a->header);
+	free(a->prefix);
+	free(a->dir);
+	free(a);
+	ctx->archive = NULL;
+}
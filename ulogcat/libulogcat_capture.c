@@ -0,0 +1,690 @@
+/**
+ * Copyright (C) 2014 Parrot S.A.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * libulogcat, a reader library for ulogger/kernel log buffers
+ *
+ */
+
+#include "libulogcat_private.h"
+
+/*
+ * Capture files (see ULOGCAT_FORMAT_BINARY) contain log entries in the format
+ * used by ulogger devices, so that they can be rendered later, on another
+ * host. A file is made of:
+ *
+ *  - a struct capture_header;
+ *  - the null-terminated, comma-separated names of captured buffers;
+ *  - records: a struct capture_record, followed by a struct ulogger_entry
+ *    and its payload.
+ *
+ * Multi-byte fields are in host byte order, like ulogger entries. Archive
+ * segments (see libulogcat_archive.c) group records in possibly compressed
+ * blocks, see CAPTURE_FLAG_BLOCKS.
+ *
+ * An optional index file (see struct capture_chunk) lets readers skip chunks
+ * of records which cannot match their filter, without reading them.
+ */
+#define CAPTURE_MAGIC           "ULCB"
+#define CAPTURE_VERSION         1
+
+struct capture_header {
+	char                     magic[4];    /* CAPTURE_MAGIC */
+	uint16_t                 version;     /* CAPTURE_VERSION */
+	uint16_t                 hdr_size;    /* sizeof(struct capture_header) */
+	uint16_t                 entry_hdr_size; /* sizeof(ulogger_entry) */
+	uint16_t                 names_len;   /* including null character */
+	uint32_t                 flags;       /* CAPTURE_FLAG_* */
+};
+
+struct capture_record {
+	uint8_t                  label;       /* 'U' or 'K' */
+	uint8_t                  reserved;
+	uint16_t                 len;         /* entry header and payload */
+};
+
+#define CAPTURE_INDEX_MAGIC     "ULCI"
+#define CAPTURE_INDEX_VERSION   1
+#define CAPTURE_INDEX_SUFFIX    ".idx"
+
+struct capture_index_header {
+	char                     magic[4];    /* CAPTURE_INDEX_MAGIC */
+	uint16_t                 version;     /* CAPTURE_INDEX_VERSION */
+	uint16_t                 hdr_size;    /* sizeof(capture_index_header) */
+	uint32_t                 chunk_size;  /* sizeof(struct capture_chunk) */
+	uint32_t                 reserved;
+};
+
+/* a chunk is summarized every 256 records or 64kB, whichever comes first */
+#define CAPTURE_CHUNK_RECORDS   256
+#define CAPTURE_CHUNK_SIZE      (64*1024)
+
+struct capture_index {
+	int                      fd;
+	struct capture_chunk     chunk;       /* chunk being summarized */
+};
+
+/*
+ * Entries are read from files in large chunks; the buffer can hold a whole
+ * block besides a partially read record.
+ */
+#define CAPTURE_BUFSIZE (2*CAPTURE_BLOCK_SIZE)
+
+struct capture_reader {
+	size_t                   len;         /* bytes read */
+	size_t                   off;         /* next record */
+	uint64_t                 base;        /* file offset of buffer */
+	uint32_t                 flags;       /* CAPTURE_FLAG_* */
+	uint8_t                 *zbuf;        /* compressed block data */
+	struct capture_chunk    *chunks;      /* index, if any */
+	size_t                   nchunks;
+	size_t                   chunk;       /* next chunk */
+	uint8_t                  buf[CAPTURE_BUFSIZE];
+};
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+	ssize_t ret;
+	const uint8_t *p = buf;
+
+	while (len > 0) {
+		ret = write(fd, p, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static void capture_index_flush(struct capture_index *idx)
+{
+	if (idx->chunk.count == 0)
+		return;
+
+	if ((idx->fd >= 0) &&
+	    (write_full(idx->fd, &idx->chunk, sizeof(idx->chunk)) < 0)) {
+		INFO("cannot write capture index: %s\n", strerror(errno));
+		close(idx->fd);
+		idx->fd = -1;
+	}
+	idx->chunk.count = 0;
+}
+
+/* Summarize a record rendered in render buffer */
+static void capture_index_add(struct ulogcat3_context *ctx,
+			      const struct frame *frame)
+{
+	struct capture_index *idx = ctx->capture_index;
+	struct capture_chunk *chunk;
+
+	if (idx == NULL)
+		return;
+
+	chunk = &idx->chunk;
+	if (chunk->count == 0) {
+		memset(chunk, 0, sizeof(*chunk));
+		chunk->offset = ctx->capture_offset;
+		chunk->first = frame->stamp;
+		chunk->last = frame->stamp;
+	}
+
+	/* merged records are not strictly ordered */
+	if (frame->stamp < chunk->first)
+		chunk->first = frame->stamp;
+	if (frame->stamp > chunk->last)
+		chunk->last = frame->stamp;
+
+	capture_bloom_add(chunk->tags, capture_tag_hash(frame->entry.tag));
+	capture_bloom_add(chunk->pids, capture_pid_hash(frame->entry.pid));
+	chunk->size += ctx->render_len;
+	chunk->count++;
+
+	if ((chunk->count >= CAPTURE_CHUNK_RECORDS) ||
+	    (chunk->size >= CAPTURE_CHUNK_SIZE))
+		capture_index_flush(idx);
+}
+
+int capture_index_open(struct ulogcat3_context *ctx, const char *path)
+{
+	int ret;
+	struct capture_index *idx;
+	struct capture_index_header hdr;
+
+	/* archive segments are not indexed */
+	if (ctx->log_format != ULOGCAT_FORMAT_BINARY || ctx->archive)
+		return -EINVAL;
+
+	idx = calloc(1, sizeof(*idx));
+	if (idx == NULL)
+		return -ENOMEM;
+
+	idx->fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	if (idx->fd < 0) {
+		ret = -errno;
+		INFO("cannot open %s: %s\n", path, strerror(errno));
+		free(idx);
+		return ret;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CAPTURE_INDEX_MAGIC, sizeof(hdr.magic));
+	hdr.version = CAPTURE_INDEX_VERSION;
+	hdr.hdr_size = sizeof(hdr);
+	hdr.chunk_size = sizeof(struct capture_chunk);
+
+	if (write_full(idx->fd, &hdr, sizeof(hdr)) < 0) {
+		ret = -errno;
+		INFO("cannot write %s: %s\n", path, strerror(errno));
+		close(idx->fd);
+		free(idx);
+		return ret;
+	}
+
+	capture_index_close(ctx);
+	ctx->capture_index = idx;
+	return 0;
+}
+
+void capture_index_close(struct ulogcat3_context *ctx)
+{
+	struct capture_index *idx = ctx->capture_index;
+
+	if (idx == NULL)
+		return;
+
+	/* summarize last records */
+	capture_index_flush(idx);
+	if (idx->fd >= 0)
+		close(idx->fd);
+	free(idx);
+	ctx->capture_index = NULL;
+}
+
+/* Build a capture file header, return its size */
+int capture_render_header(struct ulogcat3_context *ctx, uint8_t *buf,
+			  size_t size, uint32_t flags)
+{
+	struct capture_header hdr;
+	struct listnode *node;
+	struct log_device *dev;
+	char *names;
+	size_t len = 0;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CAPTURE_MAGIC, sizeof(hdr.magic));
+	hdr.version = CAPTURE_VERSION;
+	hdr.hdr_size = sizeof(hdr);
+	hdr.entry_hdr_size = sizeof(struct ulogger_entry);
+	hdr.flags = flags;
+
+	names = (char *)buf + sizeof(hdr);
+	size -= sizeof(hdr);
+	names[0] = '\0';
+
+	list_for_each(node, &ctx->log_devices) {
+		dev = node_to_item(node, struct log_device, dlist);
+		len += snprintf(names + len, size - len, "%s%s",
+				len ? "," : "", dev->path);
+		if (len >= size) {
+			/* too many buffers, truncate list */
+			len = size - 1;
+			break;
+		}
+	}
+
+	hdr.names_len = len + 1;
+	memcpy(buf, &hdr, sizeof(hdr));
+	return sizeof(hdr) + hdr.names_len;
+}
+
+/* Encode a parsed frame as a capture record in render buffer */
+int capture_render_frame(struct ulogcat3_context *ctx, struct frame *frame,
+			 int is_banner)
+{
+	size_t pname_len, tname_len, tag_len, msg_len, len;
+	const struct ulog_entry *entry = &frame->entry;
+	struct capture_record rec;
+	struct ulogger_entry hdr;
+	uint32_t prio;
+	uint8_t *p;
+
+	/* banners are only meaningful in text output */
+	if (is_banner)
+		return -1;
+
+	/* thread name is only present if it differs from process name */
+	pname_len = strlen(entry->pname) + 1;
+	tname_len = (entry->pid != entry->tid) ?
+		strlen(entry->tname) + 1 : 0;
+	tag_len = strlen(entry->tag) + 1;
+	msg_len = entry->len;
+
+	len = sizeof(hdr) + pname_len + tname_len + sizeof(prio) + tag_len;
+	if (len + msg_len > ULOGGER_ENTRY_MAX_LEN) {
+		/* long deferred messages may not fit, truncate them */
+		if (entry->is_binary || len + 1 > ULOGGER_ENTRY_MAX_LEN)
+			return -1;
+		msg_len = ULOGGER_ENTRY_MAX_LEN - len;
+	}
+	len += msg_len;
+
+	rec.label = frame->label;
+	rec.reserved = 0;
+	rec.len = len;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.len = len - sizeof(hdr);
+	hdr.hdr_size = sizeof(hdr);
+	hdr.pid = entry->pid;
+	hdr.tid = entry->tid;
+	hdr.sec = entry->tv_sec;
+	hdr.nsec = entry->tv_nsec;
+
+	prio = (entry->priority & ULOG_PRIO_LEVEL_MASK) |
+		(entry->is_binary << ULOG_PRIO_BINARY_SHIFT) |
+		(entry->color << ULOG_PRIO_COLOR_SHIFT);
+
+	p = ctx->render_buf;
+	memcpy(p, &rec, sizeof(rec));
+	p += sizeof(rec);
+	memcpy(p, &hdr, sizeof(hdr));
+	p += sizeof(hdr);
+	memcpy(p, entry->pname, pname_len);
+	p += pname_len;
+	memcpy(p, entry->tname, tname_len);
+	p += tname_len;
+	memcpy(p, &prio, sizeof(prio));
+	p += sizeof(prio);
+	memcpy(p, entry->tag, tag_len);
+	p += tag_len;
+	memcpy(p, entry->message, msg_len);
+	p += msg_len;
+	if (msg_len != (size_t)entry->len)
+		p[-1] = '\0';
+
+	ctx->render_len = p - ctx->render_buf;
+	capture_index_add(ctx, frame);
+	ctx->capture_offset += ctx->render_len;
+	return 0;
+}
+
+static int read_full(struct log_device *dev, void *buf, size_t len)
+{
+	ssize_t ret;
+	uint8_t *p = buf;
+
+	while (len > 0) {
+		ret = read(dev->fd, p, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			INFO("read(%s): %s\n", dev->path, strerror(errno));
+			return -1;
+		} else if (ret == 0) {
+			return -1;
+		}
+		p += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/* Append next block records to read buffer */
+static ssize_t capture_read_block(struct log_device *dev)
+{
+	struct capture_reader *r = dev->priv;
+	struct capture_block blk;
+	uint8_t *dst = r->buf + r->len;
+	ssize_t ret;
+
+	if (read_full(dev, &blk, sizeof(blk)) < 0)
+		return 0;
+
+	if ((blk.raw_size > CAPTURE_BLOCK_SIZE) || (blk.size > blk.raw_size) ||
+	    (blk.raw_size > sizeof(r->buf) - r->len)) {
+		INFO("%s: invalid block\n", dev->path);
+		return -1;
+	}
+
+	/* stored blocks are read in place */
+	if (read_full(dev, (blk.size < blk.raw_size) ? r->zbuf : dst,
+		      blk.size) < 0) {
+		INFO("%s: truncated block\n", dev->path);
+		return -1;
+	}
+
+	if (blk.size < blk.raw_size) {
+		ret = lz4_decompress(r->zbuf, blk.size, dst, blk.raw_size);
+		if (ret != (ssize_t)blk.raw_size) {
+			INFO("%s: corrupted block\n", dev->path);
+			return -1;
+		}
+	}
+
+	return blk.raw_size;
+}
+
+/* Make sure at least len bytes are available in read buffer */
+static int capture_fill(struct log_device *dev, size_t len)
+{
+	struct capture_reader *r = dev->priv;
+	ssize_t ret;
+
+	if (r->off > 0) {
+		memmove(r->buf, r->buf + r->off, r->len - r->off);
+		r->base += r->off;
+		r->len -= r->off;
+		r->off = 0;
+	}
+
+	while (r->len < len) {
+		if (r->flags & CAPTURE_FLAG_BLOCKS) {
+			ret = capture_read_block(dev);
+			if (ret <= 0)
+				break;
+		} else {
+			ret = read(dev->fd, r->buf + r->len,
+				   sizeof(r->buf) - r->len);
+			if (ret < 0) {
+				if (errno == EINTR)
+					continue;
+				INFO("read(%s): %s\n", dev->path,
+				     strerror(errno));
+				return -1;
+			} else if (ret == 0) {
+				break;
+			}
+		}
+		r->len += ret;
+	}
+
+	return (r->len >= len) ? 0 : -1;
+}
+
+/* Stop reading a capture file, all entries have been read */
+static void capture_eof(struct log_device *dev)
+{
+	struct capture_reader *r = dev->priv;
+
+	if (r->off < r->len)
+		INFO("%s: truncated record\n", dev->path);
+
+	r->off = r->len = 0;
+	dev->mark_readable = 0;
+	/* stop polling file */
+	close(dev->fd);
+	dev->fd = -1;
+}
+
+/* Skip indexed chunks which cannot match filter, starting at read position */
+static int capture_skip_chunks(struct log_device *dev)
+{
+	struct capture_reader *r = dev->priv;
+	const struct capture_chunk *chunk;
+	uint64_t pos = r->base + r->off, end;
+
+	while (r->chunk < r->nchunks) {
+		chunk = &r->chunks[r->chunk];
+		if (chunk->offset > pos)
+			/* not at a chunk boundary yet */
+			break;
+
+		r->chunk++;
+		if (chunk->offset < pos)
+			/* already started reading this chunk */
+			continue;
+
+		if (filter_match_chunk(dev->ctx->filter, chunk))
+			break;
+
+		/* skip chunk */
+		end = chunk->offset + chunk->size;
+		dev->mark_readable -= chunk->size;
+		if (end <= r->base + r->len) {
+			r->off = end - r->base;
+		} else {
+			if (lseek(dev->fd, (off_t)end, SEEK_SET) < 0) {
+				INFO("lseek(%s): %s\n", dev->path,
+				     strerror(errno));
+				return -1;
+			}
+			r->base = end;
+			r->off = r->len = 0;
+		}
+		pos = end;
+	}
+
+	return 0;
+}
+
+/*
+ * Read exactly one entry from a capture file.
+ *
+ * Returns -1 if an error occured
+ *          0 if there is no entry to read
+ *          1 if we successfully read one entry
+ */
+static int capture_receive_entry(struct log_device *dev, struct frame *frame)
+{
+	struct capture_reader *r = dev->priv;
+	struct capture_record rec;
+
+	if (dev->fd < 0)
+		return 0;
+
+	if (r->chunks && dev->ctx->filter && (capture_skip_chunks(dev) < 0)) {
+		capture_eof(dev);
+		return -1;
+	}
+
+	if (r->len - r->off < sizeof(rec) && capture_fill(dev, sizeof(rec))) {
+		capture_eof(dev);
+		return 0;
+	}
+
+	memcpy(&rec, r->buf + r->off, sizeof(rec));
+	if (rec.len < sizeof(struct ulogger_entry) ||
+	    rec.len > ULOGGER_ENTRY_MAX_LEN) {
+		INFO("%s: invalid record length %u\n", dev->path, rec.len);
+		capture_eof(dev);
+		return -1;
+	}
+
+	if (r->len - r->off < sizeof(rec) + rec.len &&
+	    capture_fill(dev, sizeof(rec) + rec.len)) {
+		capture_eof(dev);
+		return 0;
+	}
+
+	if (rec.len > frame->bufsize && frame->buf == frame->data) {
+		/* regular frame buffer is too small */
+		frame->buf = malloc(ULOGGER_ENTRY_MAX_LEN);
+		if (frame->buf == NULL) {
+			INFO("malloc: %s\n", strerror(errno));
+			frame->buf = frame->data;
+			return -1;
+		}
+		frame->bufsize = ULOGGER_ENTRY_MAX_LEN;
+	}
+
+	memcpy(frame->buf, r->buf + r->off + sizeof(rec), rec.len);
+	r->off += sizeof(rec) + rec.len;
+	dev->mark_readable -= sizeof(rec);
+	frame->label = rec.label;
+
+	return ulog_process_entry(dev, frame, rec.len);
+}
+
+static int capture_parse_entry(struct frame *frame)
+{
+	/* no-op, parsing is done upon entry read */
+	return 0;
+}
+
+static void capture_destroy(struct log_device *dev)
+{
+	struct capture_reader *r = dev->priv;
+
+	free(r->chunks);
+	free(r->zbuf);
+}
+
+/* Load index of capture file, if any */
+static void capture_load_index(struct log_device *dev, const char *path)
+{
+	struct capture_reader *r = dev->priv;
+	struct capture_index_header hdr;
+	struct stat st;
+	char *name;
+	ssize_t ret;
+	int fd;
+
+	if (asprintf(&name, "%s%s", path, CAPTURE_INDEX_SUFFIX) < 0)
+		return;
+
+	fd = open(name, O_RDONLY|O_CLOEXEC);
+	free(name);
+	if (fd < 0)
+		return;
+
+	if ((fstat(fd, &st) < 0) ||
+	    (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) ||
+	    (memcmp(hdr.magic, CAPTURE_INDEX_MAGIC, sizeof(hdr.magic)) != 0) ||
+	    (hdr.version != CAPTURE_INDEX_VERSION) ||
+	    (hdr.hdr_size != sizeof(hdr)) ||
+	    (hdr.chunk_size != sizeof(struct capture_chunk))) {
+		INFO("%s: ignoring invalid index\n", path);
+		goto out;
+	}
+
+	/* a partial last chunk summary is ignored */
+	r->nchunks = (st.st_size - sizeof(hdr))/sizeof(struct capture_chunk);
+	if (r->nchunks == 0)
+		goto out;
+
+	r->chunks = malloc(r->nchunks*sizeof(struct capture_chunk));
+	if (r->chunks == NULL)
+		goto fail;
+
+	ret = pread(fd, r->chunks, r->nchunks*sizeof(struct capture_chunk),
+		    sizeof(hdr));
+	if (ret != (ssize_t)(r->nchunks*sizeof(struct capture_chunk)))
+		goto fail;
+
+out:
+	close(fd);
+	return;
+fail:
+	INFO("%s: cannot load index\n", path);
+	free(r->chunks);
+	r->chunks = NULL;
+	r->nchunks = 0;
+	close(fd);
+}
+
+static int capture_clear_buffer(struct log_device *dev)
+{
+	/* capture files are never modified */
+	return 0;
+}
+
+int add_file_device(struct ulogcat3_context *ctx, const char *path)
+{
+	struct log_device *dev = NULL;
+	struct capture_reader *r;
+	struct capture_header hdr;
+	struct stat st;
+
+	dev = log_device_create(ctx);
+	if (dev == NULL)
+		goto fail;
+
+	snprintf(dev->path, sizeof(dev->path), "%s", path);
+
+	dev->fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (dev->fd < 0) {
+		INFO("cannot open %s: %s\n", path, strerror(errno));
+		goto fail;
+	}
+
+	r = calloc(1, sizeof(*r));
+	if (r == NULL)
+		goto fail;
+	dev->priv = r;
+
+	if (pread(dev->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    memcmp(hdr.magic, CAPTURE_MAGIC, sizeof(hdr.magic)) != 0 ||
+	    hdr.hdr_size < sizeof(hdr)) {
+		INFO("%s: not a capture file\n", path);
+		goto fail;
+	}
+
+	if (hdr.version != CAPTURE_VERSION ||
+	    (hdr.flags & ~CAPTURE_FLAG_BLOCKS)) {
+		INFO("%s: unsupported capture version %u\n", path,
+		     hdr.version);
+		goto fail;
+	}
+
+	/* skip header and buffer names */
+	r->base = hdr.hdr_size + hdr.names_len;
+	if (lseek(dev->fd, (off_t)r->base, SEEK_SET) < 0) {
+		INFO("lseek(%s): %s\n", path, strerror(errno));
+		goto fail;
+	}
+	r->flags = hdr.flags;
+
+	dev->receive_entry = capture_receive_entry;
+	dev->parse_entry = capture_parse_entry;
+	dev->clear_buffer = capture_clear_buffer;
+	dev->destroy = capture_destroy;
+	dev->label = 'U';
+
+	if (r->flags & CAPTURE_FLAG_BLOCKS) {
+		r->zbuf = malloc(CAPTURE_BLOCK_SIZE);
+		if (r->zbuf == NULL)
+			goto fail;
+		/*
+		 * Records size is unknown until blocks are decompressed, read
+		 * the whole file; indexes only apply to plain capture files.
+		 */
+		dev->mark_readable = SSIZE_MAX;
+	} else {
+		capture_load_index(dev, path);
+
+		/* the whole file should be read in dump mode */
+		if (fstat(dev->fd, &st) < 0) {
+			INFO("fstat(%s): %s\n", path, strerror(errno));
+			goto fail;
+		}
+		dev->mark_readable = (ssize_t)(st.st_size - r->base);
+	}
+
+	ctx->ulog_device_count++;
+	return 0;
+
+fail:
+	log_device_destroy(dev);
+	return -1;
+}
+
+LIBULOGCAT_API int ulogcat3_set_capture_index(struct ulogcat3_context *ctx,
+					      const char *path)
+{
+	return capture_index_open(ctx, path);
+}
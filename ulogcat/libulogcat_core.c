@@ -19,28 +19,104 @@
 
 #include "libulogcat_private.h"
 
-static void output_rendered(struct ulogcat3_context *ctx)
+static uint64_t output_now(void)
 {
-	ssize_t ret;
+	struct timespec ts;
 
-	if (ctx->output_error)
-		return;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000ULL + ts.tv_nsec/1000000;
+}
+
+static void output_write(struct ulogcat3_context *ctx, const uint8_t *buf,
+			 size_t len)
+{
+	ssize_t ret;
 
 	if (ctx->output_fp) {
-		ret = fwrite(ctx->render_buf, ctx->render_len, 1,
-			     ctx->output_fp);
-		if (ret != 1) {
+		ret = fwrite(buf, len, 1, ctx->output_fp);
+		if ((ret != 1) || (ctx->output_buf && fflush(ctx->output_fp))) {
 			INFO("cannot output frame: %s\n", strerror(errno));
 			ctx->output_error = 1;
 		}
 	} else if (ctx->output_fd >= 0) {
-		do {
-			ret = write(ctx->output_fd,
-				    ctx->render_buf, ctx->render_len);
-		} while ((ret < 0) && (errno == EINTR));
+		while (len > 0) {
+			ret = write(ctx->output_fd, buf, len);
+			if (ret < 0) {
+				if (errno == EINTR)
+					continue;
+				ctx->output_error = 1;
+				break;
+			}
+			buf += ret;
+			len -= ret;
+		}
+	}
+}
 
-		if (ret < 0)
+/* Write block-buffered output, and render next frames at buffer start */
+void output_flush(struct ulogcat3_context *ctx)
+{
+	if (ctx->output_buf && ctx->output_len) {
+		if (!ctx->output_error)
+			output_write(ctx, ctx->output_buf, ctx->output_len);
+
+		ctx->output_len = 0;
+		ctx->render_buf = ctx->output_buf;
+	}
+
+	/* archived entries are only output when blocks are written */
+	if (!ctx->archive)
+		cursor_sync(ctx, 0);
+}
+
+static void output_rendered(struct ulogcat3_context *ctx)
+{
+	if (ctx->output_error)
+		return;
+
+	if (ctx->archive) {
+		if (archive_write(ctx, ctx->render_buf, ctx->render_len) < 0)
 			ctx->output_error = 1;
+		return;
+	}
+
+	if (!ctx->output_buf) {
+		output_write(ctx, ctx->render_buf, ctx->render_len);
+		return;
+	}
+
+	/* frames are rendered in place, keep room for next one */
+	if (ctx->output_len == 0)
+		ctx->output_time = output_now();
+	ctx->output_len += ctx->render_len;
+	ctx->render_buf = ctx->output_buf + ctx->output_len;
+
+	if (ctx->output_len + ctx->render_size > ULOGCAT_OUTPUT_BUFSIZE)
+		output_flush(ctx);
+}
+
+static void free_frame(struct ulogcat3_context *ctx, struct frame *frame)
+{
+	if (frame) {
+		if (frame->buf != frame->data) {
+			/* free extra allocated memory */
+			free(frame->buf);
+			frame->buf = frame->data;
+			frame->bufsize = sizeof(frame->data);
+		}
+		frame->parsed = 0;
+		list_add_tail(&ctx->free_queue, &frame->flist);
+	}
+}
+
+/* Get back frames output by pipeline worker, optionally waiting for one */
+static void reclaim_frames(struct ulogcat3_context *ctx, int wait)
+{
+	struct frame *frame;
+
+	while ((frame = pipeline_reclaim(ctx, wait)) != NULL) {
+		free_frame(ctx, frame);
+		wait = 0;
 	}
 }
 
@@ -48,6 +124,9 @@ static struct frame *alloc_frame(struct ulogcat3_context *ctx)
 {
 	struct frame *frame;
 
+	if (list_empty(&ctx->free_queue) && ctx->pipeline)
+		reclaim_frames(ctx, 1);
+
 	if (list_empty(&ctx->free_queue))
 		/* out of frames, this should theoretically not happen */
 		return NULL;
@@ -59,40 +138,94 @@ static struct frame *alloc_frame(struct ulogcat3_context *ctx)
 	return frame;
 }
 
-static void free_frame(struct ulogcat3_context *ctx, struct frame *frame)
+/*
+ * Devices with queued frames are kept in a binary min-heap ordered by the
+ * timestamp of their oldest frame; ties are broken with the device index to
+ * get a stable merge order.
+ */
+static struct frame *device_head_frame(struct log_device *dev)
 {
-	if (frame) {
-		if (frame->buf != frame->data) {
-			/* free extra allocated memory */
-			free(frame->buf);
-			frame->buf = frame->data;
-			frame->bufsize = sizeof(frame->data);
-		}
-		list_add_tail(&ctx->free_queue, &frame->flist);
+	return node_to_item(list_head(&dev->queue), struct frame, flist);
+}
+
+static int heap_less(struct log_device *a, struct log_device *b)
+{
+	uint64_t sa = device_head_frame(a)->stamp;
+	uint64_t sb = device_head_frame(b)->stamp;
+
+	return (sa < sb) || ((sa == sb) && (a->idx < b->idx));
+}
+
+static void heap_sift_down(struct ulogcat3_context *ctx, int i)
+{
+	int child;
+	struct log_device *dev = ctx->heap[i];
+
+	while ((child = 2*i+1) < ctx->heap_count) {
+		if ((child+1 < ctx->heap_count) &&
+		    heap_less(ctx->heap[child+1], ctx->heap[child]))
+			child++;
+		if (!heap_less(ctx->heap[child], dev))
+			break;
+		ctx->heap[i] = ctx->heap[child];
+		i = child;
 	}
+	ctx->heap[i] = dev;
 }
 
-static struct frame *find_oldest_pending_frame(struct ulogcat3_context *ctx)
+static void heap_push(struct ulogcat3_context *ctx, struct log_device *dev)
 {
-	struct listnode *node;
-	struct frame *frame, *res = NULL;
-	uint64_t stamp = 0ULL;
-
-	list_for_each(node, &ctx->pending_queue) {
-		frame = node_to_item(node, struct frame, flist);
-		if ((res == NULL) || (frame->stamp < stamp)) {
-			res = frame;
-			stamp = frame->stamp;
+	int parent, i = ctx->heap_count++;
+
+	while (i > 0) {
+		parent = (i-1)/2;
+		if (!heap_less(dev, ctx->heap[parent]))
+			break;
+		ctx->heap[i] = ctx->heap[parent];
+		i = parent;
+	}
+	ctx->heap[i] = dev;
+}
+
+/*
+ * Remove the oldest pending frame from its device queue. The caller must
+ * check if the device queue is exhausted (dev->pending == 0), in which case
+ * the device should be read again before merging more frames.
+ */
+static struct frame *pull_oldest_pending_frame(struct ulogcat3_context *ctx)
+{
+	struct frame *frame;
+	struct log_device *dev;
+
+	if (ctx->heap_count == 0)
+		return NULL;
+
+	dev = ctx->heap[0];
+	frame = device_head_frame(dev);
+	list_remove(&frame->flist);
+	dev->pending--;
+	ctx->pending--;
+
+	if (dev->pending == 0) {
+		/* device queue exhausted, remove it from heap */
+		ctx->heap_count--;
+		if (ctx->heap_count > 0) {
+			ctx->heap[0] = ctx->heap[ctx->heap_count];
+			heap_sift_down(ctx, 0);
 		}
+	} else {
+		heap_sift_down(ctx, 0);
 	}
 
-	return res;
+	return frame;
 }
 
 static int render_frame(struct ulogcat3_context *ctx, struct frame *frame,
 			int is_banner)
 {
-	/* for now only text rendering is supported */
+	if (ctx->log_format == ULOGCAT_FORMAT_BINARY)
+		return capture_render_frame(ctx, frame, is_banner);
+
 	return text_render_frame(ctx, frame, is_banner);
 }
 
@@ -128,7 +261,7 @@ static void flush_banner_frame(struct frame *ref)
 }
 
 /* Render a frame and output it */
-static void flush_frame(struct ulogcat3_context *ctx, struct frame *frame)
+void flush_frame(struct ulogcat3_context *ctx, struct frame *frame)
 {
 	int ret;
 	struct log_device *dev = frame->dev;
@@ -139,13 +272,34 @@ static void flush_frame(struct ulogcat3_context *ctx, struct frame *frame)
 		dev->printed = 1;
 	}
 
-	ret = dev->parse_entry(frame);
-	if (ret < 0)
-		return;
+	if (!frame->parsed) {
+		ret = dev->parse_entry(frame);
+		if (ret < 0)
+			return;
+	}
 
 	ret = render_frame(ctx, frame, 0);
-	if (ret == 0)
+	if (ret == 0) {
 		output_rendered(ctx);
+		if (ctx->cursor)
+			cursor_update(ctx, frame);
+	}
+}
+
+/* Output a merged frame, or hand it over to pipeline worker */
+static void output_frame(struct ulogcat3_context *ctx, struct frame *frame)
+{
+	if (ctx->pipeline) {
+		if (pipeline_push(ctx, frame) == 0)
+			return;
+		/* worker owns output: drop frame rather than overflow rings */
+		INFO("pipeline: too many frames in flight\n");
+		free_frame(ctx, frame);
+		return;
+	}
+
+	flush_frame(ctx, frame);
+	free_frame(ctx, frame);
 }
 
 static void enqueue_render(struct ulogcat3_context *ctx, struct frame *frame)
@@ -170,10 +324,11 @@ static void flush_render_frame(struct ulogcat3_context *ctx, int drop)
 	if (ctx->render > 0) {
 		frame = node_to_item(list_head(&ctx->render_queue),
 				     struct frame, flist);
-		if (!drop)
-			flush_frame(ctx, frame);
 		list_remove(&frame->flist);
-		free_frame(ctx, frame);
+		if (drop)
+			free_frame(ctx, frame);
+		else
+			output_frame(ctx, frame);
 		ctx->render--;
 	}
 }
@@ -193,14 +348,12 @@ static void flush_pending_frame(struct ulogcat3_context *ctx, int drop)
 {
 	struct frame *frame;
 
-	if (ctx->pending > 0) {
-		frame = find_oldest_pending_frame(ctx);
-		if (!drop)
-			flush_frame(ctx, frame);
-		frame->dev->pending = 0;
-		list_remove(&frame->flist);
-		free_frame(ctx, frame);
-		ctx->pending--;
+	frame = pull_oldest_pending_frame(ctx);
+	if (frame) {
+		if (drop)
+			free_frame(ctx, frame);
+		else
+			output_frame(ctx, frame);
 	}
 }
 
@@ -237,6 +390,28 @@ static void update_mark_reached(struct ulogcat3_context *ctx)
 	ctx->mark_reached = 1;
 }
 
+/*
+ * Set the watermark of devices once the entries present at startup have been
+ * read: until then, poll() must report any readable device (see
+ * process_devices()).
+ */
+static void setup_watermarks(struct ulogcat3_context *ctx)
+{
+	struct listnode *node;
+	struct log_device *dev;
+
+	if (!ctx->wm_pending || !ctx->mark_reached)
+		return;
+
+	list_for_each(node, &ctx->log_devices) {
+		dev = node_to_item(node, struct log_device, dlist);
+		if (dev->set_watermark)
+			(void)dev->set_watermark(dev, ctx->wm_bytes,
+						 ctx->wm_latency_ms);
+	}
+	ctx->wm_pending = 0;
+}
+
 /*
  * Check if we are done buffering in render queue in order to comply with
  * outputting only tailing lines.
@@ -271,7 +446,73 @@ static void process_tail_flush(struct ulogcat3_context *ctx)
 }
 
 /*
- * Read entries from active device, and flush one frame.
+ * Parse a frame ahead of rendering to evaluate the filter.
+ * Returns 1 if the frame should be kept, 0 otherwise.
+ */
+static int filter_frame(struct ulogcat3_context *ctx, struct frame *frame)
+{
+	if (frame->dev->parse_entry(frame) < 0)
+		return 0;
+
+	frame->parsed = 1;
+	return filter_match(ctx->filter, frame);
+}
+
+/*
+ * Read a run of entries from a device into its queue.
+ * Returns the number of frames read, or -1 if an error occured.
+ */
+static int read_device(struct ulogcat3_context *ctx, struct log_device *dev)
+{
+	int ret, reads, frames = 0;
+	struct frame *frame = NULL;
+
+	for (reads = 0; reads < ULOGCAT_DEVICE_BATCH; reads++) {
+		if (frame == NULL) {
+			frame = alloc_frame(ctx);
+			if (frame == NULL)
+				break;
+		}
+
+		frame->parsed = 0;
+		frame->seq = 0;
+		frame->label = dev->label;
+		ret = dev->receive_entry(dev, frame);
+		if (ret < 0) {
+			free_frame(ctx, frame);
+			return ret;
+		}
+
+		/* nothing more to read for now */
+		if (ret == 0)
+			break;
+
+		/* reuse frame if entry was output by a previous context */
+		if (dev->resuming && cursor_skip_frame(dev, frame))
+			continue;
+
+		/* reuse frame if entry is filtered out */
+		if (ctx->filter && !filter_frame(ctx, frame))
+			continue;
+
+		list_add_tail(&dev->queue, &frame->flist);
+		frame = NULL;
+		dev->pending++;
+		ctx->pending++;
+		frames++;
+	}
+
+	free_frame(ctx, frame);
+
+	if (frames > 0 && dev->pending == frames)
+		heap_push(ctx, dev);
+
+	return frames;
+}
+
+/*
+ * Read runs of entries from active devices with an empty queue, and merge
+ * frames until a device queue is exhausted.
  * Returns the number of frames read.
  */
 static int process_devices(struct ulogcat3_context *ctx, int timeout_ms)
@@ -280,30 +521,61 @@ static int process_devices(struct ulogcat3_context *ctx, int timeout_ms)
 	struct frame *frame;
 	struct listnode *node;
 	struct log_device *dev;
+	int buffered = 0;
 
-	/* setup descriptors */
+	/* setup descriptors, only devices with an empty queue need reading */
 	list_for_each(node, &ctx->log_devices) {
 		dev = node_to_item(node, struct log_device, dlist);
 		ctx->fds[dev->idx].fd = dev->pending ? -1 : dev->fd;
+		if (!dev->pending && dev->buffered)
+			buffered = 1;
 	}
 
-	/* force non-blocking wait if we have pending frames */
-	if (ctx->pending > 0 || (!ctx->mark_reached && ctx->tail > 0))
+	/* force non-blocking wait if we have pending or buffered frames */
+	if (ctx->pending > 0 || buffered ||
+	    (!ctx->mark_reached && ctx->tail > 0))
 		timeout_ms = 0;
 
+	/* pipeline worker takes care of output, get back its frames */
+	if (ctx->pipeline) {
+		reclaim_frames(ctx, 0);
+		goto wait;
+	}
+
+	/* wake up in time to write buffered archive blocks */
+	if (ctx->archive)
+		timeout_ms = archive_timeout(ctx, timeout_ms);
+
+	/* write buffered output before waiting, or if it is getting old */
+	if (ctx->output_len && ((timeout_ms != 0) ||
+	    (output_now() - ctx->output_time >= ULOGCAT_OUTPUT_DELAY_MS)))
+		output_flush(ctx);
+
+wait:
 	ret = poll(ctx->fds, ctx->device_count, timeout_ms);
 	if (ret < 0) {
-		if (errno == EINTR)
+		if (errno == EINTR) {
+			ctx->interrupted = 1;
 			return 0;
+		}
 		INFO("poll: %s\n", strerror(errno));
 		return -1;
 	}
 
-	/* read one entry per active device and add it to pending queue */
+	if (ctx->archive && !ctx->pipeline && (archive_tick(ctx) < 0)) {
+		ctx->output_error = 1;
+		return -1;
+	}
+
+	/* refill queues of active devices */
 	list_for_each(node, &ctx->log_devices) {
 
 		dev = node_to_item(node, struct log_device, dlist);
-		if (!(ctx->fds[dev->idx].revents & POLLIN)) {
+		if (dev->pending)
+			continue;
+
+		/* entries already read by the device need no poll() */
+		if (!(ctx->fds[dev->idx].revents & POLLIN) && !dev->buffered) {
 			if ((ctx->fds[dev->idx].fd >= 0) &&
 			    (dev->mark_readable > 0)) {
 				/* we reached the mark for this device */
@@ -312,74 +584,88 @@ static int process_devices(struct ulogcat3_context *ctx, int timeout_ms)
 			continue;
 		}
 
-		frame = alloc_frame(ctx);
-		if (frame == NULL)
-			continue;
-
-		ret = dev->receive_entry(dev, frame);
-		if (ret <= 0) {
-			free_frame(ctx, frame);
+		ret = read_device(ctx, dev);
+		if (ret < 0)
 			return ret;
-		}
-
-		if (ret > 0) {
-			list_add_tail(&ctx->pending_queue, &frame->flist);
-			dev->pending = 1;
-			ctx->pending++;
-			frames++;
-		}
+		frames += ret;
 	}
 
-	/* pull oldest frame from pending queue */
-	frame = find_oldest_pending_frame(ctx);
-	if (frame) {
-		list_remove(&frame->flist);
-		frame->dev->pending = 0;
-		ctx->pending--;
+	/*
+	 * Merge frames in timestamp order, until a device runs out of queued
+	 * frames: it must be read again before we can tell which frame is
+	 * the next oldest one.
+	 */
+	while ((frame = pull_oldest_pending_frame(ctx)) != NULL) {
+		dev = frame->dev;
 
 		if (ctx->tail > 0) {
 			/* we only want tailing lines, push to render queue */
 			enqueue_render(ctx, frame);
 		} else {
 			/* no need to queue frame, flush it now */
-			flush_frame(ctx, frame);
-			free_frame(ctx, frame);
+			output_frame(ctx, frame);
 		}
+
+		if (dev->pending == 0)
+			break;
 	}
 
 	update_mark_reached(ctx);
 	process_tail_flush(ctx);
+	setup_watermarks(ctx);
+
+	if (ctx->pipeline)
+		pipeline_kick(ctx);
 
 	return frames;
 }
 
-/*
- * Read log entries from devices and output them.
- *
- * Returns -1 if an error occured
- *          0 if no additional work is needed
- *          1 if more work is needed
- */
-LIBULOGCAT_API int ulogcat3_process_logs(struct ulogcat3_context *ctx,
-					 int max_entries)
+static int process_logs(struct ulogcat3_context *ctx, int max_entries)
 {
 	int frames = 0, ret = -1, timeout_ms;
 
 	timeout_ms = (ctx->flags & ULOGCAT_FLAG_DUMP) ? 0 : -1;
 
+	/* capture output starts with a header, archives write their own */
+	if ((ctx->log_format == ULOGCAT_FORMAT_BINARY) &&
+	    !ctx->capture_started) {
+		ctx->capture_started = 1;
+		if (!ctx->archive) {
+			ctx->render_len = capture_render_header(ctx,
+					ctx->render_buf, ctx->render_size, 0);
+			ctx->capture_offset = ctx->render_len;
+			output_rendered(ctx);
+			if (ctx->output_error)
+				return -1;
+		}
+	}
+
+	/* worker owns output from now on */
+	if ((ctx->flags & ULOGCAT_FLAG_PIPELINE) && !ctx->pipeline) {
+		ret = pipeline_start(ctx, ctx->frame_count);
+		if (ret < 0)
+			return ret;
+	}
+
 	do {
 		ret = process_devices(ctx, timeout_ms);
 		if (ret < 0)
 			return ret;
 		frames += ret;
 
+		/* let caller handle signals */
+		if (ctx->interrupted) {
+			ctx->interrupted = 0;
+			return 1;
+		}
+
 		/* in dump mode, stop when mark is reached */
 		if ((ctx->flags & ULOGCAT_FLAG_DUMP) && ctx->mark_reached) {
 			flush_pending_queue(ctx);
 			return 0;
 		}
 
-		if (ctx->output_error)
+		if (ctx->pipeline ? pipeline_failed(ctx) : ctx->output_error)
 			return -1;
 
 	} while (!max_entries || (frames < max_entries));
@@ -387,6 +673,35 @@ LIBULOGCAT_API int ulogcat3_process_logs(struct ulogcat3_context *ctx,
 	return ret;
 }
 
+/*
+ * Read log entries from devices and output them.
+ *
+ * Returns -1 if an error occured
+ *          0 if no additional work is needed
+ *          1 if more work is needed
+ */
+LIBULOGCAT_API int ulogcat3_process_logs(struct ulogcat3_context *ctx,
+					 int max_entries)
+{
+	int ret;
+
+	ret = process_logs(ctx, max_entries);
+
+	/* pipeline worker writes on its own, wait for it once dump is done */
+	if (ctx->pipeline) {
+		if ((ret <= 0) && (pipeline_sync(ctx) < 0))
+			ret = -1;
+		return ret;
+	}
+
+	/* caller may not call us again soon */
+	output_flush(ctx);
+	if (ctx->output_error)
+		ret = -1;
+
+	return ret;
+}
+
 
 struct log_device *log_device_create(struct ulogcat3_context *ctx)
 {
@@ -395,6 +710,7 @@ struct log_device *log_device_create(struct ulogcat3_context *ctx)
 	dev = calloc(1, sizeof(*dev));
 	if (dev) {
 		dev->ctx = ctx;
+		list_init(&dev->queue);
 		list_add_tail(&ctx->log_devices, &dev->dlist);
 		dev->idx = ctx->device_count++;
 	} else {
@@ -410,6 +726,9 @@ void log_device_destroy(struct log_device *dev)
 		list_remove(&dev->dlist);
 		dev->ctx->device_count--;
 
+		if (dev->destroy)
+			dev->destroy(dev);
+
 		if (dev->fd >= 0) {
 			close(dev->fd);
 			dev->fd = -1;
@@ -424,7 +743,7 @@ LIBULOGCAT_API struct ulogcat3_context *
 ulogcat3_open(const struct ulogcat_opts_v3 *opts, const char **devices,
 	      int ndevices)
 {
-	int ret, i, nframes;
+	int ret, i, nframes, fd;
 	struct listnode *node;
 	struct log_device *dev;
 	struct ulogcat3_context *ctx;
@@ -443,17 +762,22 @@ ulogcat3_open(const struct ulogcat_opts_v3 *opts, const char **devices,
 	if ((ctx->output_fd < 0) && (ctx->output_fp == NULL))
 		ctx->output_fp = stdout;
 
-	if (ctx->output_fp)
+	/* terminals get lines as soon as they are rendered */
+	fd = ctx->output_fp ? fileno(ctx->output_fp) : ctx->output_fd;
+	if ((fd >= 0) && isatty(fd))
+		ctx->flags |= ULOGCAT_FLAG_LINE_BUFFERED;
+
+	if (ctx->output_fp && (ctx->flags & ULOGCAT_FLAG_LINE_BUFFERED))
 		/* we want a line-buffered output */
 		setlinebuf(ctx->output_fp);
 
 	list_init(&ctx->log_devices);
 	list_init(&ctx->free_queue);
 	list_init(&ctx->render_queue);
-	list_init(&ctx->pending_queue);
 
 	if (ctx->flags & ULOGCAT_FLAG_COLOR)
 		setup_colors(ctx);
+	setup_text(ctx);
 
 	/* add user specified buffers */
 	for (i = 0; i < ndevices; i++) {
@@ -504,14 +828,27 @@ ulogcat3_open(const struct ulogcat_opts_v3 *opts, const char **devices,
 		ctx->fds[dev->idx].events = POLLIN;
 	}
 
-	/* setup rendering buffer */
-	ctx->render_size = text_render_size();
-	ctx->render_buf = malloc(ctx->render_size);
+	/* setup merge heap */
+	ctx->heap = calloc(ctx->device_count, sizeof(*ctx->heap));
+	if (ctx->heap == NULL)
+		goto fail;
+
+	/* setup rendering buffer, frames are rendered in output buffer */
+	ctx->render_size = text_render_size(ctx->log_format);
+	if (!(ctx->flags & ULOGCAT_FLAG_LINE_BUFFERED)) {
+		ctx->output_buf = malloc(ULOGCAT_OUTPUT_BUFSIZE);
+		ctx->render_buf = ctx->output_buf;
+	} else {
+		ctx->render_buf = malloc(ctx->render_size);
+	}
 	if (ctx->render_buf == NULL)
 		goto fail;
 
-	/* setup frame pool: allocate enough for pending and render queues */
-	nframes = ctx->tail + ctx->device_count + 1;
+	/* setup frame pool: allocate enough for device and render queues */
+	nframes = ctx->tail + ctx->device_count*ULOGCAT_DEVICE_BATCH + 1;
+	if (ctx->flags & ULOGCAT_FLAG_PIPELINE)
+		nframes += ULOGCAT_PIPELINE_FRAMES;
+	ctx->frame_count = nframes;
 	ctx->frame_pool = calloc(1, nframes*sizeof(*ctx->frame_pool));
 	if (ctx->frame_pool == NULL)
 		goto fail;
@@ -535,10 +872,29 @@ LIBULOGCAT_API void ulogcat3_close(struct ulogcat3_context *ctx)
 	struct log_device *dev;
 
 	if (ctx) {
+		/* output remaining frames */
+		if (ctx->pipeline) {
+			pipeline_stop(ctx);
+			reclaim_frames(ctx, 0);
+			pipeline_destroy(ctx);
+		}
+
+		/* write buffered archive blocks, segments list devices */
+		archive_close(ctx);
+
+		/* write remaining buffered output, then record it in cursor */
+		output_flush(ctx);
+		cursor_close(ctx);
+
 		/* close and destroy devices */
 		while (!list_empty(&ctx->log_devices)) {
 			dev = node_to_item(list_head(&ctx->log_devices),
 					   struct log_device, dlist);
+			while (!list_empty(&dev->queue)) {
+				f = device_head_frame(dev);
+				list_remove(&f->flist);
+				free_frame(ctx, f);
+			}
 			list_remove(&dev->dlist);
 			log_device_destroy(dev);
 		}
@@ -551,12 +907,6 @@ LIBULOGCAT_API void ulogcat3_close(struct ulogcat3_context *ctx)
 			list_remove(&f->flist);
 			free_frame(ctx, f);
 		}
-		while (!list_empty(&ctx->pending_queue)) {
-			f = node_to_item(list_head(&ctx->pending_queue),
-					 struct frame, flist);
-			list_remove(&f->flist);
-			free_frame(ctx, f);
-		}
 
 		/* close descriptors */
 		if (ctx->output_fd >= 0)
@@ -565,8 +915,12 @@ LIBULOGCAT_API void ulogcat3_close(struct ulogcat3_context *ctx)
 		if (ctx->output_fp)
 			fclose(ctx->output_fp);
 
+		fmt_dict_clear(ctx);
+		filter_destroy(ctx->filter);
+		capture_index_close(ctx);
 		free(ctx->frame_pool);
-		free(ctx->render_buf);
+		free(ctx->heap);
+		free(ctx->output_buf ? ctx->output_buf : ctx->render_buf);
 		free(ctx->fds);
 		free(ctx);
 	}
@@ -589,3 +943,55 @@ LIBULOGCAT_API int ulogcat3_clear(struct ulogcat3_context *ctx)
 
 	return ret;
 }
+
+LIBULOGCAT_API int ulogcat3_set_filter(struct ulogcat3_context *ctx,
+				       const char *expr)
+{
+	int ret;
+	struct log_filter *filter = NULL;
+
+	if (expr) {
+		ret = filter_compile(expr, &filter);
+		if (ret < 0)
+			return ret;
+	}
+
+	filter_destroy(ctx->filter);
+	ctx->filter = filter;
+
+	return 0;
+}
+
+LIBULOGCAT_API int ulogcat3_set_archive(struct ulogcat3_context *ctx,
+				       const struct ulogcat_archive_opts *opts)
+{
+	/* archive must be set before capture starts */
+	if ((ctx->log_format != ULOGCAT_FORMAT_BINARY) || ctx->capture_started ||
+	    ctx->capture_index || ctx->archive)
+		return -EINVAL;
+
+	return archive_open(ctx, opts);
+}
+
+LIBULOGCAT_API int ulogcat3_set_watermark(struct ulogcat3_context *ctx,
+					  unsigned int bytes,
+					  unsigned int latency_ms)
+{
+	/* a dump ends as soon as no device is readable */
+	if (ctx->flags & ULOGCAT_FLAG_DUMP)
+		return -EINVAL;
+
+	ctx->wm_bytes = bytes;
+	ctx->wm_latency_ms = latency_ms;
+	ctx->wm_pending = 1;
+	return 0;
+}
+
+LIBULOGCAT_API int ulogcat3_set_cursor(struct ulogcat3_context *ctx,
+				      const char *path)
+{
+	if ((path == NULL) || ctx->cursor)
+		return -EINVAL;
+
+	return cursor_open(ctx, path);
+}
@@ -0,0 +1,324 @@
+/**
+ * Copyright (C) 2014 Parrot S.A.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * libulogcat, a reader library for ulogger/kernel log buffers
+ *
+ */
+
+#include "libulogcat_private.h"
+
+#include <inttypes.h>
+
+/*
+ * A cursor file records the last entry output from each device, so that a
+ * later context resumes after it:
+ *
+ *   ulogcat-cursor <version> <boot id>
+ *   <device path> <sequence number> <timestamp (usecs)> <hash>
+ *   ...
+ *
+ * Sequence numbers and timestamps only make sense until the next boot, the
+ * contents of a cursor written during another boot are ignored. The file is
+ * replaced atomically, at most every CURSOR_SYNC_MS milliseconds while
+ * entries are output, and when the context is closed.
+ */
+#define CURSOR_MAGIC            "ulogcat-cursor"
+#define CURSOR_VERSION          1
+#define CURSOR_SYNC_MS          1000
+#define CURSOR_BOOT_ID          "/proc/sys/kernel/random/boot_id"
+
+struct log_cursor {
+	char                    *path;
+	char                    *tmp_path;
+	char                     boot_id[40];
+	char                    *others;      /* lines of absent devices */
+	size_t                   others_len;
+	uint64_t                 sync_time;   /* last write (ms) */
+	int                      dirty;       /* entries output since */
+};
+
+static uint64_t cursor_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000ULL + ts.tv_nsec/1000000;
+}
+
+/* Hash of the contents of a parsed entry, to recognize it without number */
+static uint32_t cursor_hash(const struct frame *frame)
+{
+	const struct ulog_entry *e = &frame->entry;
+	const uint8_t *p;
+	uint32_t h = 2166136261U; /* FNV-1a */
+	int32_t fields[3];
+	size_t i;
+
+	fields[0] = e->pid;
+	fields[1] = e->tid;
+	fields[2] = e->priority;
+	for (i = 0, p = (const uint8_t *)fields; i < sizeof(fields); i++)
+		h = (h ^ p[i]) * 16777619U;
+
+	for (p = (const uint8_t *)e->tag; *p; p++)
+		h = (h ^ *p) * 16777619U;
+
+	for (i = 0, p = (const uint8_t *)e->message; i < (size_t)e->len; i++)
+		h = (h ^ p[i]) * 16777619U;
+
+	return h;
+}
+
+static void read_boot_id(char *buf, size_t size)
+{
+	FILE *fp;
+
+	snprintf(buf, size, "-");
+	fp = fopen(CURSOR_BOOT_ID, "r");
+	if (fp == NULL)
+		return;
+	if (fscanf(fp, "%36s", buf) != 1)
+		snprintf(buf, size, "-");
+	fclose(fp);
+}
+
+static struct log_device *find_device(struct ulogcat3_context *ctx,
+				      const char *path)
+{
+	struct listnode *node;
+	struct log_device *dev;
+
+	list_for_each(node, &ctx->log_devices) {
+		dev = node_to_item(node, struct log_device, dlist);
+		if (strcmp(dev->path, path) == 0)
+			return dev;
+	}
+	return NULL;
+}
+
+/* Keep the line of a device absent from context, to write it back */
+static int keep_line(struct log_cursor *c, const char *line)
+{
+	size_t len = strlen(line);
+	char *p;
+
+	p = realloc(c->others, c->others_len + len + 1);
+	if (p == NULL)
+		return -ENOMEM;
+
+	memcpy(p + c->others_len, line, len + 1);
+	c->others = p;
+	c->others_len += len;
+	return 0;
+}
+
+/* Set resume positions of devices, and move readers there if possible */
+static int load_cursor(struct ulogcat3_context *ctx, struct log_cursor *c)
+{
+	char line[256], path[64], boot_id[40];
+	struct cursor_pos pos;
+	struct log_device *dev;
+	unsigned int version;
+	int ret = 0;
+	FILE *fp;
+
+	fp = fopen(c->path, "r");
+	if (fp == NULL)
+		return (errno == ENOENT) ? 0 : -errno;
+
+	/* entries of another boot cannot be found again */
+	if (!fgets(line, sizeof(line), fp) ||
+	    sscanf(line, CURSOR_MAGIC " %u %39s", &version, boot_id) != 2 ||
+	    version != CURSOR_VERSION || strcmp(boot_id, c->boot_id) != 0)
+		goto out;
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "%63s %" SCNu64 " %" SCNu64 " %" SCNx32, path,
+			   &pos.seq, &pos.stamp, &pos.hash) != 4)
+			continue;
+
+		dev = find_device(ctx, path);
+		if (dev == NULL) {
+			ret = keep_line(c, line);
+			if (ret < 0)
+				break;
+			continue;
+		}
+
+		pos.valid = 1;
+		dev->resume = pos;
+		dev->last = pos;
+		dev->resuming = 1;
+
+		/* otherwise, entries are skipped as they are read */
+		if (pos.seq && dev->seek)
+			(void)dev->seek(dev, pos.seq + 1);
+	}
+
+out:
+	fclose(fp);
+	return ret;
+}
+
+int cursor_open(struct ulogcat3_context *ctx, const char *path)
+{
+	struct log_cursor *c;
+	struct listnode *node;
+	struct log_device *dev;
+	int ret;
+
+	c = calloc(1, sizeof(*c));
+	if (c == NULL)
+		return -ENOMEM;
+
+	c->path = strdup(path);
+	if ((c->path == NULL) || (asprintf(&c->tmp_path, "%s.tmp", path) < 0)) {
+		c->tmp_path = NULL;
+		ret = -ENOMEM;
+		goto fail;
+	}
+
+	read_boot_id(c->boot_id, sizeof(c->boot_id));
+	ret = load_cursor(ctx, c);
+	if (ret < 0)
+		goto fail;
+
+	/* number entries of other devices from the oldest one */
+	list_for_each(node, &ctx->log_devices) {
+		dev = node_to_item(node, struct log_device, dlist);
+		if (!dev->resuming && dev->seek)
+			(void)dev->seek(dev, 0);
+	}
+
+	ctx->cursor = c;
+	return 0;
+
+fail:
+	free(c->others);
+	free(c->tmp_path);
+	free(c->path);
+	free(c);
+	return ret;
+}
+
+/* Write cursor file, if entries were output since last time */
+void cursor_sync(struct ulogcat3_context *ctx, int force)
+{
+	struct log_cursor *c = ctx->cursor;
+	struct listnode *node;
+	struct log_device *dev;
+	uint64_t now;
+	FILE *fp;
+	int ret;
+
+	/* entries may not have been output */
+	if ((c == NULL) || !c->dirty || ctx->output_error)
+		return;
+
+	now = cursor_now();
+	if (!force && (now - c->sync_time < CURSOR_SYNC_MS))
+		return;
+
+	fp = fopen(c->tmp_path, "w");
+	if (fp == NULL) {
+		INFO("cannot write %s: %s\n", c->tmp_path, strerror(errno));
+		return;
+	}
+
+	fprintf(fp, CURSOR_MAGIC " %u %s\n", CURSOR_VERSION, c->boot_id);
+	list_for_each(node, &ctx->log_devices) {
+		dev = node_to_item(node, struct log_device, dlist);
+		if (dev->last.valid)
+			fprintf(fp, "%s %" PRIu64 " %" PRIu64 " %08" PRIx32 "\n",
+				dev->path, dev->last.seq, dev->last.stamp,
+				dev->last.hash);
+	}
+	if (c->others)
+		fputs(c->others, fp);
+
+	ret = (fflush(fp) == 0) && (fsync(fileno(fp)) == 0);
+	if ((fclose(fp) != 0) || !ret || (rename(c->tmp_path, c->path) < 0)) {
+		INFO("cannot write %s: %s\n", c->path, strerror(errno));
+		unlink(c->tmp_path);
+		return;
+	}
+
+	c->dirty = 0;
+	c->sync_time = now;
+}
+
+void cursor_close(struct ulogcat3_context *ctx)
+{
+	struct log_cursor *c = ctx->cursor;
+
+	if (c == NULL)
+		return;
+
+	cursor_sync(ctx, 1);
+
+	free(c->others);
+	free(c->tmp_path);
+	free(c->path);
+	free(c);
+	ctx->cursor = NULL;
+}
+
+/* Remember a frame which has been rendered for output */
+void cursor_update(struct ulogcat3_context *ctx, struct frame *frame)
+{
+	struct log_device *dev = frame->dev;
+
+	dev->last.seq = frame->seq;
+	dev->last.stamp = frame->stamp;
+	dev->last.hash = cursor_hash(frame);
+	dev->last.valid = 1;
+	ctx->cursor->dirty = 1;
+}
+
+/*
+ * Check whether a frame read from a device which is resuming was output by
+ * a previous context, using its sequence number if it is known, or else its
+ * timestamp, and hash if several entries have the same timestamp.
+ * Returns 1 if the frame should be skipped, 0 otherwise.
+ */
+int cursor_skip_frame(struct log_device *dev, struct frame *frame)
+{
+	const struct cursor_pos *pos = &dev->resume;
+
+	if (frame->seq && pos->seq) {
+		if (frame->seq <= pos->seq)
+			return 1;
+		dev->resuming = 0;
+		return 0;
+	}
+
+	if (frame->stamp < pos->stamp)
+		return 1;
+
+	if (frame->stamp > pos->stamp) {
+		dev->resuming = 0;
+		return 0;
+	}
+
+	if (!frame->parsed) {
+		if (dev->parse_entry(frame) < 0)
+			return 1;
+		frame->parsed = 1;
+	}
+
+	if (cursor_hash(frame) == pos->hash)
+		dev->resuming = 0;
+	return 1;
+}
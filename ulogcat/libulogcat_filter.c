@@ -0,0 +1,398 @@
+/**
+ * Copyright (C) 2014 Parrot S.A.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * libulogcat, a reader library for ulogger/kernel log buffers
+ *
+ */
+
+#include "libulogcat_private.h"
+
+#include <regex.h>
+
+/*
+ * Filter expressions are compiled once into the structure below, and
+ * evaluated on each entry before it is queued for rendering (see
+ * ulogcat3_set_filter() for the syntax).
+ */
+struct filter_tag {
+	char                    *tag;
+	int                      level;
+};
+
+struct log_filter {
+	struct filter_tag       *tags;
+	int                      ntags;
+	int                      level;       /* level of unlisted tags */
+	int                     *pids;
+	int                      npids;
+	int                     *tids;
+	int                      ntids;
+	char                   **pnames;
+	int                      npnames;
+	char                   **tnames;
+	int                      ntnames;
+	uint64_t                 since;       /* usecs */
+	uint64_t                 until;
+	regex_t                **regs;
+	int                      nregs;
+};
+
+#define FILTER_LEVEL_ALL     ULOG_DEBUG
+#define FILTER_LEVEL_SILENT  (-1)
+
+static int parse_filter_level(const char *str)
+{
+	if (str[0] == '\0' || str[1] != '\0')
+		return -EINVAL;
+
+	if (str[0] >= '0' && str[0] <= '7')
+		return str[0] - '0';
+
+	switch (toupper(str[0])) {
+	case 'C': return ULOG_CRIT;
+	case 'E': return ULOG_ERR;
+	case 'W': return ULOG_WARN;
+	case 'N': return ULOG_NOTICE;
+	case 'I': return ULOG_INFO;
+	case 'D': return ULOG_DEBUG;
+	case 'V': return FILTER_LEVEL_ALL;
+	case 'S': return FILTER_LEVEL_SILENT;
+	default:
+		break;
+	}
+	return -EINVAL;
+}
+
+/* Parse a seconds[.fraction] timestamp into microseconds */
+static int parse_filter_time(const char *str, uint64_t *usecs)
+{
+	char *endp;
+	double secs;
+
+	errno = 0;
+	secs = strtod(str, &endp);
+	if (errno || endp == str || *endp != '\0' || secs < 0.0)
+		return -EINVAL;
+
+	*usecs = (uint64_t)(secs*1000000.0);
+	return 0;
+}
+
+static int parse_filter_int(const char *str, int *val)
+{
+	char *endp;
+	long l;
+
+	errno = 0;
+	l = strtol(str, &endp, 10);
+	if (errno || endp == str || *endp != '\0')
+		return -EINVAL;
+
+	*val = (int)l;
+	return 0;
+}
+
+/* Grow an array of filter terms by one element, return the new element */
+static void *add_term(void *array_ptr, int *count, size_t size)
+{
+	char *p, **array = array_ptr;
+
+	p = realloc(*array, (*count+1)*size);
+	if (p == NULL)
+		return NULL;
+
+	*array = p;
+	p += (*count)*size;
+	memset(p, 0, size);
+	(*count)++;
+	return p;
+}
+
+static int compile_tag_term(struct log_filter *f, char *term)
+{
+	int level = FILTER_LEVEL_ALL;
+	struct filter_tag *t;
+	char *sep;
+
+	sep = strrchr(term, ':');
+	if (sep) {
+		*sep = '\0';
+		level = parse_filter_level(sep+1);
+		if (level < FILTER_LEVEL_SILENT)
+			return -EINVAL;
+	}
+
+	if (term[0] == '\0')
+		return -EINVAL;
+
+	if (strcmp(term, "*") == 0) {
+		f->level = level;
+		return 0;
+	}
+
+	t = add_term(&f->tags, &f->ntags, sizeof(*t));
+	if (t == NULL)
+		return -ENOMEM;
+
+	t->tag = strdup(term);
+	if (t->tag == NULL)
+		return -ENOMEM;
+
+	t->level = level;
+	return 0;
+}
+
+static int compile_int_term(int **array, int *count, const char *val)
+{
+	int *p;
+
+	p = add_term(array, count, sizeof(*p));
+	return p ? parse_filter_int(val, p) : -ENOMEM;
+}
+
+static int compile_string_term(char ***array, int *count, const char *val)
+{
+	char **p;
+
+	p = add_term(array, count, sizeof(*p));
+	if (p == NULL)
+		return -ENOMEM;
+
+	*p = strdup(val);
+	return *p ? 0 : -ENOMEM;
+}
+
+static int compile_regex_term(regex_t ***array, int *count, const char *val)
+{
+	regex_t **p;
+
+	p = add_term(array, count, sizeof(*p));
+	if (p == NULL)
+		return -ENOMEM;
+
+	*p = malloc(sizeof(**p));
+	if (*p == NULL)
+		return -ENOMEM;
+
+	if (regcomp(*p, val, REG_EXTENDED|REG_NOSUB) != 0) {
+		free(*p);
+		*p = NULL;
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static int compile_term(struct log_filter *f, char *term)
+{
+	char *val;
+
+	val = strchr(term, '=');
+	if (val == NULL)
+		return compile_tag_term(f, term);
+
+	*val++ = '\0';
+
+	if (strcmp(term, "pid") == 0)
+		return compile_int_term(&f->pids, &f->npids, val);
+	else if (strcmp(term, "tid") == 0)
+		return compile_int_term(&f->tids, &f->ntids, val);
+	else if (strcmp(term, "pname") == 0)
+		return compile_string_term(&f->pnames, &f->npnames, val);
+	else if (strcmp(term, "tname") == 0)
+		return compile_string_term(&f->tnames, &f->ntnames, val);
+	else if (strcmp(term, "since") == 0)
+		return parse_filter_time(val, &f->since);
+	else if (strcmp(term, "until") == 0)
+		return parse_filter_time(val, &f->until);
+	else if (strcmp(term, "msg") == 0)
+		return compile_regex_term(&f->regs, &f->nregs, val);
+
+	return -EINVAL;
+}
+
+void filter_destroy(struct log_filter *f)
+{
+	int i;
+
+	if (f == NULL)
+		return;
+
+	for (i = 0; i < f->ntags; i++)
+		free(f->tags[i].tag);
+	for (i = 0; i < f->npnames; i++)
+		free(f->pnames[i]);
+	for (i = 0; i < f->ntnames; i++)
+		free(f->tnames[i]);
+	for (i = 0; i < f->nregs; i++) {
+		if (f->regs[i]) {
+			regfree(f->regs[i]);
+			free(f->regs[i]);
+		}
+	}
+
+	free(f->tags);
+	free(f->pids);
+	free(f->tids);
+	free(f->pnames);
+	free(f->tnames);
+	free(f->regs);
+	free(f);
+}
+
+int filter_compile(const char *expr, struct log_filter **filter)
+{
+	int ret = 0;
+	char *str, *term, *orig, *saveptr = NULL;
+	struct log_filter *f;
+
+	f = calloc(1, sizeof(*f));
+	str = strdup(expr);
+	if (f == NULL || str == NULL) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+
+	f->level = FILTER_LEVEL_ALL;
+	f->until = UINT64_MAX;
+
+	for (term = strtok_r(str, " \t\n", &saveptr); term;
+	     term = strtok_r(NULL, " \t\n", &saveptr)) {
+		/* terms are split in place, keep a copy for error messages */
+		orig = strdupa(term);
+		ret = compile_term(f, term);
+		if (ret == -EINVAL)
+			INFO("invalid filter term '%s'\n", orig);
+		if (ret < 0)
+			goto fail;
+	}
+
+	free(str);
+	*filter = f;
+	return 0;
+
+fail:
+	free(str);
+	filter_destroy(f);
+	return ret;
+}
+
+static int match_int(const int *array, int count, int val)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (array[i] == val)
+			return 1;
+	}
+	return 0;
+}
+
+static int match_string(char * const *array, int count, const char *val)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (strcmp(array[i], val) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Evaluate filter on a parsed frame: terms of the same kind are alternatives,
+ * terms of different kinds must all match.
+ */
+int filter_match(const struct log_filter *f, const struct frame *frame)
+{
+	int i, level = f->level;
+	const struct ulog_entry *entry = &frame->entry;
+
+	for (i = 0; i < f->ntags; i++) {
+		if (strcmp(f->tags[i].tag, entry->tag) == 0) {
+			level = f->tags[i].level;
+			break;
+		}
+	}
+
+	if (entry->priority > level)
+		return 0;
+
+	if ((frame->stamp < f->since) || (frame->stamp > f->until))
+		return 0;
+
+	if (f->npids && !match_int(f->pids, f->npids, entry->pid))
+		return 0;
+
+	if (f->ntids && !match_int(f->tids, f->ntids, entry->tid))
+		return 0;
+
+	if (f->npnames && !match_string(f->pnames, f->npnames, entry->pname))
+		return 0;
+
+	if (f->ntnames && !match_string(f->tnames, f->ntnames, entry->tname))
+		return 0;
+
+	if (f->nregs) {
+		/* binary messages cannot match a regular expression */
+		if (entry->is_binary)
+			return 0;
+		for (i = 0; i < f->nregs; i++) {
+			if (regexec(f->regs[i], entry->message, 0, NULL, 0)
+			    == 0)
+				break;
+		}
+		if (i == f->nregs)
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Check if some records of a capture file chunk may match filter, according
+ * to its index summary.
+ */
+int filter_match_chunk(const struct log_filter *f,
+		       const struct capture_chunk *chunk)
+{
+	int i;
+
+	if ((chunk->last < f->since) || (chunk->first > f->until))
+		return 0;
+
+	if (f->npids) {
+		for (i = 0; i < f->npids; i++) {
+			if (capture_bloom_test(chunk->pids,
+					       capture_pid_hash(f->pids[i])))
+				break;
+		}
+		if (i == f->npids)
+			return 0;
+	}
+
+	/* if unlisted tags are silent, a listed tag must be present */
+	if (f->level == FILTER_LEVEL_SILENT) {
+		for (i = 0; i < f->ntags; i++) {
+			if ((f->tags[i].level != FILTER_LEVEL_SILENT) &&
+			    capture_bloom_test(chunk->tags,
+					       capture_tag_hash(f->tags[i].tag)))
+				break;
+		}
+		if (i == f->ntags)
+			return 0;
+	}
+
+	return 1;
+}
@@ -0,0 +1,202 @@
+/**
+ * Copyright (C) 2024 Parrot S.A.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * libulogcat, a reader library for ulogger/kernel log buffers
+ *
+ * Format string dictionaries, as generated by the 'ulogfmt' tool. Each line
+ * of a dictionary describes one format string:
+ *
+ * <id>\t<level>\t<tag>\t<location>\t<format>
+ *
+ * where <id> is a 32-bit hexadecimal identifier, and <format> is escaped
+ * ('\\', '\t', '\n', '\r', '\xHH'). Lines starting with '#' are ignored.
+ */
+
+#include "libulogcat_private.h"
+
+static int fmt_compare(const void *a, const void *b)
+{
+	const struct fmt_dict_entry *ea = a, *eb = b;
+
+	return (ea->id > eb->id) - (ea->id < eb->id);
+}
+
+/* unescape format string in place */
+static int fmt_unescape(char *str)
+{
+	char *w = str;
+	unsigned int c;
+
+	while (*str) {
+		if (*str != '\\') {
+			*w++ = *str++;
+			continue;
+		}
+		str++;
+		switch (*str) {
+		case '\\':
+			*w++ = '\\';
+			break;
+		case 't':
+			*w++ = '\t';
+			break;
+		case 'n':
+			*w++ = '\n';
+			break;
+		case 'r':
+			*w++ = '\r';
+			break;
+		case 'x':
+			if (sscanf(str+1, "%2x", &c) != 1 ||
+			    !isxdigit(str[1]) || !isxdigit(str[2]))
+				return -1;
+			*w++ = (char)c;
+			str += 2;
+			break;
+		default:
+			return -1;
+		}
+		str++;
+	}
+	*w = '\0';
+	return 0;
+}
+
+/* split a dictionary line and add it to context dictionary */
+static int fmt_dict_add(struct ulogcat3_context *ctx, char *line)
+{
+	struct fmt_dict_entry *entries;
+	char *field[5], *end;
+	unsigned long id;
+	int i;
+
+	for (i = 0; i < 5; i++) {
+		field[i] = line;
+		line = strchr(line, (i < 4) ? '\t' : '\n');
+		if (line)
+			*line++ = '\0';
+		else if (i < 4)
+			return -1;
+		else
+			break;
+	}
+
+	id = strtoul(field[0], &end, 16);
+	if (*end != '\0' || end == field[0] || id > UINT32_MAX)
+		return -1;
+	if (fmt_unescape(field[4]) < 0)
+		return -1;
+
+	if (ctx->fmt_dict_count == ctx->fmt_dict_size) {
+		ctx->fmt_dict_size = ctx->fmt_dict_size ?
+			2*ctx->fmt_dict_size : 256;
+		entries = realloc(ctx->fmt_dict, ctx->fmt_dict_size*
+				  sizeof(*entries));
+		if (entries == NULL)
+			return -ENOMEM;
+		ctx->fmt_dict = entries;
+	}
+
+	ctx->fmt_dict[ctx->fmt_dict_count].fmt = strdup(field[4]);
+	if (ctx->fmt_dict[ctx->fmt_dict_count].fmt == NULL)
+		return -ENOMEM;
+	ctx->fmt_dict[ctx->fmt_dict_count].id = (uint32_t)id;
+	ctx->fmt_dict_count++;
+	return 0;
+}
+
+int fmt_dict_load(struct ulogcat3_context *ctx, const char *path)
+{
+	FILE *fp;
+	char *line = NULL;
+	size_t size = 0, i, j;
+	int ret = 0, lineno = 0;
+
+	fp = fopen(path, "re");
+	if (fp == NULL) {
+		ret = -errno;
+		INFO("fopen(%s): %s\n", path, strerror(errno));
+		return ret;
+	}
+
+	while (getline(&line, &size, fp) > 0) {
+		lineno++;
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		ret = fmt_dict_add(ctx, line);
+		if (ret == -ENOMEM)
+			break;
+		if (ret < 0) {
+			INFO("%s:%d: invalid format entry\n", path, lineno);
+			ret = -EINVAL;
+			break;
+		}
+	}
+
+	free(line);
+	fclose(fp);
+
+	/* sort by id and drop duplicates, e.g. from dictionary reloads */
+	qsort(ctx->fmt_dict, ctx->fmt_dict_count, sizeof(*ctx->fmt_dict),
+	      fmt_compare);
+	for (i = 0, j = 0; i < ctx->fmt_dict_count; i++) {
+		if (j > 0 && ctx->fmt_dict[j-1].id == ctx->fmt_dict[i].id) {
+			if (strcmp(ctx->fmt_dict[j-1].fmt,
+				   ctx->fmt_dict[i].fmt) != 0)
+				INFO("format id %08x collision, ignoring "
+				     "'%s'\n", ctx->fmt_dict[i].id,
+				     ctx->fmt_dict[i].fmt);
+			free(ctx->fmt_dict[i].fmt);
+			continue;
+		}
+		ctx->fmt_dict[j++] = ctx->fmt_dict[i];
+	}
+	ctx->fmt_dict_count = j;
+
+	return ret;
+}
+
+void fmt_dict_clear(struct ulogcat3_context *ctx)
+{
+	size_t i;
+
+	for (i = 0; i < ctx->fmt_dict_count; i++)
+		free(ctx->fmt_dict[i].fmt);
+	free(ctx->fmt_dict);
+	ctx->fmt_dict = NULL;
+	ctx->fmt_dict_count = 0;
+	ctx->fmt_dict_size = 0;
+}
+
+const char *fmt_dict_lookup(uint32_t id, void *userdata)
+{
+	struct ulogcat3_context *ctx = userdata;
+	struct fmt_dict_entry key, *entry;
+
+	key.id = id;
+	entry = bsearch(&key, ctx->fmt_dict, ctx->fmt_dict_count,
+			sizeof(*ctx->fmt_dict), fmt_compare);
+
+	return entry ? entry->fmt : NULL;
+}
+
+LIBULOGCAT_API int ulogcat3_load_fmt_dict(struct ulogcat3_context *ctx,
+					  const char *path)
+{
+	if (ctx == NULL || path == NULL)
+		return -EINVAL;
+
+	return fmt_dict_load(ctx, path);
+}
@@ -0,0 +1,209 @@
+/**
+ * Copyright (C) 2014 Parrot S.A.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * libulogcat, a reader library for ulogger/kernel log buffers
+ *
+ */
+
+#include "libulogcat_private.h"
+
+/*
+ * Minimal codec for the LZ4 block format, used to compress archive blocks
+ * (see libulogcat_archive.c): a greedy single-probe compressor, which is
+ * enough for repetitive log records, and a bounds-checked decompressor.
+ * Blocks are interoperable with the reference LZ4 implementation.
+ */
+#define LZ4_MINMATCH            4
+#define LZ4_LASTLITERALS        5
+#define LZ4_MFLIMIT             12
+#define LZ4_MAX_DISTANCE        65535
+#define LZ4_HASH_BITS           12
+
+static inline uint32_t lz4_read32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t lz4_hash(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+static uint8_t *lz4_write_len(uint8_t *op, size_t len)
+{
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = (uint8_t)len;
+	return op;
+}
+
+/* worst case size of a sequence, excluding match length bytes */
+static inline size_t lz4_seq_bound(size_t lit)
+{
+	return 1 + lit/255 + 1 + lit + 2;
+}
+
+/*
+ * Compress a block; returns compressed size, or 0 if it does not fit in
+ * destination buffer.
+ */
+size_t lz4_compress(const uint8_t *src, size_t srclen, uint8_t *dst,
+		    size_t dstsize)
+{
+	uint32_t table[1 << LZ4_HASH_BITS];
+	const uint8_t *ip = src, *anchor = src, *ref;
+	const uint8_t *end = src + srclen;
+	const uint8_t *mflimit = end - LZ4_MFLIMIT;
+	const uint8_t *matchlimit = end - LZ4_LASTLITERALS;
+	uint8_t *op = dst, *token;
+	size_t lit, mlen;
+	uint32_t h;
+
+	memset(table, 0, sizeof(table));
+
+	if (srclen > LZ4_MFLIMIT) {
+		/* first byte cannot be matched */
+		ip++;
+		while (ip < mflimit) {
+			h = lz4_hash(lz4_read32(ip));
+			ref = src + table[h];
+			table[h] = (uint32_t)(ip - src);
+
+			if ((ref >= ip) || (ip - ref > LZ4_MAX_DISTANCE) ||
+			    (lz4_read32(ref) != lz4_read32(ip))) {
+				ip++;
+				continue;
+			}
+
+			/* extend match backwards, then forwards */
+			while ((ip > anchor) && (ref > src) &&
+			       (ip[-1] == ref[-1])) {
+				ip--;
+				ref--;
+			}
+
+			mlen = LZ4_MINMATCH;
+			while ((ip + mlen < matchlimit) && (ip[mlen] == ref[mlen]))
+				mlen++;
+
+			lit = ip - anchor;
+			if (lz4_seq_bound(lit) + mlen/255 + 1 >
+			    (size_t)(dst + dstsize - op))
+				return 0;
+
+			token = op++;
+			*token = (uint8_t)((lit >= 15 ? 15 : lit) << 4);
+			if (lit >= 15)
+				op = lz4_write_len(op, lit - 15);
+			memcpy(op, anchor, lit);
+			op += lit;
+
+			*op++ = (uint8_t)(ip - ref);
+			*op++ = (uint8_t)((ip - ref) >> 8);
+
+			*token |= (uint8_t)(mlen - LZ4_MINMATCH >= 15 ?
+					    15 : mlen - LZ4_MINMATCH);
+			if (mlen - LZ4_MINMATCH >= 15)
+				op = lz4_write_len(op, mlen - LZ4_MINMATCH - 15);
+
+			ip += mlen;
+			anchor = ip;
+		}
+	}
+
+	/* last literals */
+	lit = end - anchor;
+	if (lz4_seq_bound(lit) > (size_t)(dst + dstsize - op))
+		return 0;
+
+	token = op++;
+	*token = (uint8_t)((lit >= 15 ? 15 : lit) << 4);
+	if (lit >= 15)
+		op = lz4_write_len(op, lit - 15);
+	memcpy(op, anchor, lit);
+	op += lit;
+
+	return op - dst;
+}
+
+static int lz4_read_len(const uint8_t **ip, const uint8_t *iend, size_t *len)
+{
+	uint8_t s;
+
+	do {
+		if (*ip >= iend)
+			return -1;
+		s = *(*ip)++;
+		*len += s;
+	} while (s == 255);
+
+	return 0;
+}
+
+/*
+ * Decompress a block; returns decompressed size, or -1 if block is invalid
+ * or does not fit in destination buffer.
+ */
+ssize_t lz4_decompress(const uint8_t *src, size_t srclen, uint8_t *dst,
+		       size_t dstsize)
+{
+	const uint8_t *ip = src, *iend = src + srclen;
+	uint8_t *op = dst, *oend = dst + dstsize;
+	size_t lit, mlen, off, i;
+	uint8_t token;
+
+	while (ip < iend) {
+		token = *ip++;
+
+		lit = token >> 4;
+		if ((lit == 15) && (lz4_read_len(&ip, iend, &lit) < 0))
+			return -1;
+		if ((lit > (size_t)(iend - ip)) || (lit > (size_t)(oend - op)))
+			return -1;
+		memcpy(op, ip, lit);
+		op += lit;
+		ip += lit;
+
+		/* last sequence has no match */
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		off = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if ((off == 0) || (off > (size_t)(op - dst)))
+			return -1;
+
+		mlen = token & 15;
+		if ((mlen == 15) && (lz4_read_len(&ip, iend, &mlen) < 0))
+			return -1;
+		mlen += LZ4_MINMATCH;
+		if (mlen > (size_t)(oend - op))
+			return -1;
+
+		/* matches may overlap output */
+		for (i = 0; i < mlen; i++)
+			op[i] = op[i - off];
+		op += mlen;
+	}
+
+	return op - dst;
+}
@@ -0,0 +1,363 @@
+/**
+ * Copyright (C) 2026 Parrot S.A.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * libulogcat, a reader library for ulogger/kernel log buffers
+ *
+ * Pipelined processing (see ULOGCAT_FLAG_PIPELINE): the caller thread reads,
+ * filters and merges entries as usual, but merged frames are handed over to
+ * a worker thread which renders and outputs them, so that a slow output does
+ * not slow down the draining of log buffers.
+ *
+ * Frames go back and forth between threads through two single-producer,
+ * single-consumer rings which need no lock: merged frames in ring 'todo',
+ * and output frames, to be reused, in ring 'done'. Rings are large enough
+ * for the whole frame pool, so that pushing a frame never fails. A mutex and
+ * condition variables are only used by a thread to sleep on an empty ring.
+ */
+
+#include <pthread.h>
+#include <signal.h>
+
+#include "libulogcat_private.h"
+
+struct frame_ring {
+	struct frame           **slots;
+	unsigned int             mask;
+	/* consumer and producer indexes, on separate cache lines */
+	unsigned int             head __attribute__((aligned(64)));
+	unsigned int             tail __attribute__((aligned(64)));
+};
+
+struct log_pipeline {
+	struct frame_ring        todo;        /* merged frames, to output */
+	struct frame_ring        done;        /* output frames, to reuse */
+	int                      inflight;    /* frames not reclaimed yet */
+	int                      nframes;     /* frame pool size */
+	pthread_t                thread;
+	pthread_mutex_t          lock;
+	pthread_cond_t           worker_cond;
+	pthread_cond_t           reader_cond;
+	int                      worker_sleeping;
+	int                      reader_waiting;
+	int                      sync;        /* caller waits for output */
+	int                      stop;
+	int                      error;       /* output failed */
+};
+
+static int ring_init(struct frame_ring *r, int count)
+{
+	unsigned int size = 1;
+
+	while (size < (unsigned int)count)
+		size <<= 1;
+
+	r->slots = calloc(size, sizeof(*r->slots));
+	r->mask = size - 1;
+	r->head = 0;
+	r->tail = 0;
+
+	return r->slots ? 0 : -ENOMEM;
+}
+
+/*
+ * Producer side. Rings can hold the whole frame pool, and pipeline_push()
+ * keeps frames in flight, which are in either ring, within the pool size.
+ */
+static void ring_push(struct frame_ring *r, struct frame *frame)
+{
+	unsigned int tail = r->tail;
+
+	assert(tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) <= r->mask);
+	r->slots[tail & r->mask] = frame;
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_SEQ_CST);
+}
+
+/* Consumer side */
+static struct frame *ring_pop(struct frame_ring *r)
+{
+	unsigned int head = r->head;
+	struct frame *frame;
+
+	if (head == __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST))
+		return NULL;
+
+	frame = r->slots[head & r->mask];
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+	return frame;
+}
+
+static int ring_empty(struct frame_ring *r)
+{
+	return r->head == __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST);
+}
+
+static uint64_t pipeline_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000ULL + ts.tv_nsec/1000000;
+}
+
+/*
+ * Write buffered output if it is getting old, and buffered archive blocks if
+ * they are due. Returns the delay until next write, or -1 if none is needed.
+ */
+static int pipeline_tick(struct ulogcat3_context *ctx)
+{
+	int timeout_ms = -1;
+	uint64_t age;
+
+	if (ctx->output_len) {
+		age = pipeline_now() - ctx->output_time;
+		if (age >= ULOGCAT_OUTPUT_DELAY_MS)
+			output_flush(ctx);
+		else
+			timeout_ms = ULOGCAT_OUTPUT_DELAY_MS - age;
+	}
+
+	if (ctx->archive) {
+		if (archive_tick(ctx) < 0)
+			ctx->output_error = 1;
+		timeout_ms = archive_timeout(ctx, timeout_ms);
+	}
+
+	if (ctx->output_error)
+		__atomic_store_n(&ctx->pipeline->error, 1, __ATOMIC_RELAXED);
+
+	return timeout_ms;
+}
+
+static void pipeline_wait(struct log_pipeline *p, int timeout_ms)
+{
+	struct timespec ts;
+
+	if (timeout_ms < 0) {
+		pthread_cond_wait(&p->worker_cond, &p->lock);
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ts.tv_sec += timeout_ms/1000;
+	ts.tv_nsec += (timeout_ms%1000)*1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+	pthread_cond_timedwait(&p->worker_cond, &p->lock, &ts);
+}
+
+static void *pipeline_worker(void *arg)
+{
+	struct ulogcat3_context *ctx = arg;
+	struct log_pipeline *p = ctx->pipeline;
+	struct frame *frame;
+	int timeout_ms;
+
+	for (;;) {
+		frame = ring_pop(&p->todo);
+		if (frame) {
+			/* after an error, frames are only given back */
+			if (!ctx->output_error) {
+				flush_frame(ctx, frame);
+				if (ctx->output_error)
+					__atomic_store_n(&p->error, 1,
+							 __ATOMIC_RELAXED);
+			}
+			ring_push(&p->done, frame);
+
+			if (__atomic_load_n(&p->reader_waiting,
+					    __ATOMIC_SEQ_CST)) {
+				pthread_mutex_lock(&p->lock);
+				pthread_cond_broadcast(&p->reader_cond);
+				pthread_mutex_unlock(&p->lock);
+			}
+			continue;
+		}
+
+		timeout_ms = pipeline_tick(ctx);
+
+		pthread_mutex_lock(&p->lock);
+		__atomic_store_n(&p->worker_sleeping, 1, __ATOMIC_SEQ_CST);
+
+		if (!ring_empty(&p->todo)) {
+			/* frames were pushed meanwhile */
+		} else if ((p->sync || p->stop) && ctx->output_len) {
+			/* write all buffered output before syncing */
+			pthread_mutex_unlock(&p->lock);
+			output_flush(ctx);
+			pipeline_tick(ctx);
+			pthread_mutex_lock(&p->lock);
+		} else if (p->sync || p->stop) {
+			p->sync = 0;
+			pthread_cond_broadcast(&p->reader_cond);
+			if (p->stop) {
+				pthread_mutex_unlock(&p->lock);
+				break;
+			}
+			pipeline_wait(p, timeout_ms);
+		} else {
+			pipeline_wait(p, timeout_ms);
+		}
+
+		__atomic_store_n(&p->worker_sleeping, 0, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&p->lock);
+	}
+
+	return NULL;
+}
+
+/* Wake up worker if it sleeps, after frames have been pushed */
+void pipeline_kick(struct ulogcat3_context *ctx)
+{
+	struct log_pipeline *p = ctx->pipeline;
+
+	if (__atomic_load_n(&p->worker_sleeping, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&p->lock);
+		pthread_cond_signal(&p->worker_cond);
+		pthread_mutex_unlock(&p->lock);
+	}
+}
+
+int pipeline_push(struct ulogcat3_context *ctx, struct frame *frame)
+{
+	struct log_pipeline *p = ctx->pipeline;
+
+	/* only frames of the pool go through the rings */
+	if (p->inflight >= p->nframes)
+		return -ENOSPC;
+
+	ring_push(&p->todo, frame);
+	p->inflight++;
+	return 0;
+}
+
+/*
+ * Get back a frame output by the worker. If @wait is set and none is
+ * available yet, wait for one, unless no frame was pushed.
+ */
+struct frame *pipeline_reclaim(struct ulogcat3_context *ctx, int wait)
+{
+	struct log_pipeline *p = ctx->pipeline;
+	struct frame *frame;
+
+	frame = ring_pop(&p->done);
+	if ((frame == NULL) && wait && (p->inflight > 0)) {
+		pthread_mutex_lock(&p->lock);
+		__atomic_store_n(&p->reader_waiting, 1, __ATOMIC_SEQ_CST);
+		pthread_cond_signal(&p->worker_cond);
+		while ((frame = ring_pop(&p->done)) == NULL)
+			pthread_cond_wait(&p->reader_cond, &p->lock);
+		__atomic_store_n(&p->reader_waiting, 0, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&p->lock);
+	}
+
+	if (frame)
+		p->inflight--;
+
+	return frame;
+}
+
+int pipeline_failed(struct ulogcat3_context *ctx)
+{
+	return __atomic_load_n(&ctx->pipeline->error, __ATOMIC_RELAXED);
+}
+
+/* Wait until all pushed frames have been output, buffered output included */
+int pipeline_sync(struct ulogcat3_context *ctx)
+{
+	struct log_pipeline *p = ctx->pipeline;
+
+	pthread_mutex_lock(&p->lock);
+	p->sync = 1;
+	pthread_cond_signal(&p->worker_cond);
+	while (p->sync)
+		pthread_cond_wait(&p->reader_cond, &p->lock);
+	pthread_mutex_unlock(&p->lock);
+
+	return pipeline_failed(ctx) ? -1 : 0;
+}
+
+int pipeline_start(struct ulogcat3_context *ctx, int nframes)
+{
+	int ret;
+	struct log_pipeline *p;
+	pthread_condattr_t attr;
+	sigset_t set, oldset;
+
+	/* calloc() would not honor the alignment of ring indexes */
+	if (posix_memalign((void **)&p, __alignof__(*p), sizeof(*p)) != 0)
+		return -ENOMEM;
+	memset(p, 0, sizeof(*p));
+
+	p->nframes = nframes;
+	ret = ring_init(&p->todo, nframes);
+	if (ret == 0)
+		ret = ring_init(&p->done, nframes);
+	if (ret < 0)
+		goto fail;
+
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&p->worker_cond, &attr);
+	pthread_cond_init(&p->reader_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	/* signals should interrupt poll() in caller thread, not the worker */
+	ctx->pipeline = p;
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &oldset);
+	ret = -pthread_create(&p->thread, NULL, pipeline_worker, ctx);
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+	if (ret == 0)
+		return 0;
+
+	INFO("cannot create pipeline thread: %s\n", strerror(-ret));
+	ctx->pipeline = NULL;
+	pthread_cond_destroy(&p->reader_cond);
+	pthread_cond_destroy(&p->worker_cond);
+	pthread_mutex_destroy(&p->lock);
+fail:
+	free(p->done.slots);
+	free(p->todo.slots);
+	free(p);
+	return ret;
+}
+
+/* Output remaining frames and stop worker, frames must then be reclaimed */
+void pipeline_stop(struct ulogcat3_context *ctx)
+{
+	struct log_pipeline *p = ctx->pipeline;
+
+	pthread_mutex_lock(&p->lock);
+	p->stop = 1;
+	pthread_cond_signal(&p->worker_cond);
+	pthread_mutex_unlock(&p->lock);
+	pthread_join(p->thread, NULL);
+}
+
+void pipeline_destroy(struct ulogcat3_context *ctx)
+{
+	struct log_pipeline *p = ctx->pipeline;
+
+	ctx->pipeline = NULL;
+	pthread_cond_destroy(&p->reader_cond);
+	pthread_cond_destroy(&p->worker_cond);
+	pthread_mutex_destroy(&p->lock);
+	free(p->done.slots);
+	free(p->todo.slots);
+	free(p);
+}
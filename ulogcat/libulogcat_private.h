@@ -35,6 +35,7 @@
 #include <poll.h>
 #include <assert.h>
 #include <ctype.h>
+#include <limits.h>
 #include <alloca.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -81,13 +82,37 @@
  */
 #define ULOGCAT_FRAME_BUFSIZE   (200)
 
+/*
+ * Maximum number of frames read in a row from a device before merging them
+ * with frames from other devices.
+ */
+#define ULOGCAT_DEVICE_BATCH    (32)
+
+/*
+ * Unless output is line-buffered, frames are rendered in a large output
+ * buffer, which is written when full, before waiting for entries, or when
+ * its oldest frame is older than ULOGCAT_OUTPUT_DELAY_MS.
+ */
+#define ULOGCAT_OUTPUT_BUFSIZE  (64*1024)
+#define ULOGCAT_OUTPUT_DELAY_MS (100)
+
+/*
+ * Additional frames allocated in pipelined mode, for merged frames not output
+ * yet: this is how far reading may get ahead of a slow output.
+ */
+#define ULOGCAT_PIPELINE_FRAMES (2048)
+
 struct frame {
 	struct log_device       *dev;         /* device that issued frame */
 	struct listnode          flist;       /* queue to which frame belongs */
+	int                      parsed;      /* parse_entry() already done */
+	char                     label;       /* see struct log_device */
 	struct ulog_entry        entry;       /* parsed ulog entry */
 	uint8_t                 *buf;         /* pointer to raw data */
 	size_t                   bufsize;     /* raw buffer size */
 	uint64_t                 stamp;       /* message timestamp */
+	uint64_t                 seq;         /* sequence number, 0 if unknown */
+	/* after 8-byte fields: raw entries are read in place, aligned */
 	uint8_t                  data[ULOGCAT_FRAME_BUFSIZE];
 };
 
@@ -96,6 +121,18 @@ struct log_device;
 typedef int (*ulogcat_recv_entry_t)(struct log_device *, struct frame *);
 typedef int (*ulogcat_parse_entry_t)(struct frame *);
 typedef int (*ulogcat_clear_buffer_t)(struct log_device *);
+typedef void (*ulogcat_destroy_t)(struct log_device *);
+typedef int (*ulogcat_seek_t)(struct log_device *, uint64_t);
+typedef int (*ulogcat_set_watermark_t)(struct log_device *, unsigned int,
+				       unsigned int);
+
+/* position of an entry in a device, see libulogcat_cursor.c */
+struct cursor_pos {
+	uint64_t                 seq;         /* sequence number, 0 if unknown */
+	uint64_t                 stamp;       /* timestamp (usecs) */
+	uint32_t                 hash;        /* see cursor_hash() */
+	int                      valid;
+};
 
 struct log_device {
 	struct ulogcat3_context *ctx;
@@ -104,21 +141,41 @@ struct log_device {
 	int                      idx;
 	int                      printed;
 	ssize_t                  mark_readable;
-	struct listnode          queue;
+	struct listnode          queue;       /* frames read, not merged */
 	struct listnode          dlist;
 	ulogcat_recv_entry_t     receive_entry;
 	ulogcat_parse_entry_t    parse_entry;
 	ulogcat_clear_buffer_t   clear_buffer;
-	int                      pending;
+	ulogcat_destroy_t        destroy;
+	ulogcat_seek_t           seek;        /* move to sequence number */
+	ulogcat_set_watermark_t  set_watermark; /* batch poll() wakeups */
+	struct cursor_pos        resume;      /* last entry of previous run */
+	struct cursor_pos        last;        /* last entry output */
+	int                      resuming;    /* skipping entries up to resume */
+	int                      pending;     /* frames in queue */
+	int                      buffered;    /* entries read, not received */
 	char                     label;
 	void                    *priv;
 };
 
+/* format string dictionary entry (see libulogcat_fmt.c) */
+struct fmt_dict_entry {
+	uint32_t                 id;
+	char                    *fmt;
+};
+
 struct ulogcat3_context {
 	enum ulogcat_format      log_format;
 	unsigned int             flags;
 	int                      tail;
 	char                     ansi_color[8][32];
+	char                     text_prefix[2][8][40]; /* see setup_text() */
+	int                      text_prefix_len[2][8];
+	char                     text_suffix[8];
+	int                      text_suffix_len;
+	time_t                   text_time_sec; /* cached date string */
+	char                     text_time[32];
+	int                      text_time_len;
 	FILE                    *output_fp;
 	int                      output_fd;
 	int                      device_count;
@@ -128,14 +185,33 @@ struct ulogcat3_context {
 	struct listnode          log_devices;
 	struct listnode          free_queue;
 	struct listnode          render_queue;
-	struct listnode          pending_queue;
+	struct log_device      **heap;        /* devices with queued frames */
+	int                      heap_count;
 	struct frame            *frame_pool;
-	uint8_t                 *render_buf;
+	int                      frame_count;
+	uint8_t                 *render_buf;  /* in output_buf, if any */
 	int                      render_size;
 	int                      render_len;
+	uint8_t                 *output_buf;  /* block-buffered output */
+	size_t                   output_len;
+	uint64_t                 output_time; /* first buffered frame (ms) */
 	int                      ulog_device_count;
 	int                      mark_reached;
+	unsigned int             wm_bytes;    /* see ulogcat3_set_watermark() */
+	unsigned int             wm_latency_ms;
+	int                      wm_pending;  /* not set on devices yet */
 	int                      output_error;
+	int                      interrupted; /* poll() interrupted by signal */
+	struct log_filter       *filter;
+	struct capture_index    *capture_index;
+	uint64_t                 capture_offset; /* bytes of capture output */
+	int                      capture_started; /* header written */
+	struct log_archive      *archive;
+	struct log_cursor       *cursor;
+	struct log_pipeline     *pipeline;    /* see ULOGCAT_FLAG_PIPELINE */
+	struct fmt_dict_entry   *fmt_dict;    /* sorted by id */
+	size_t                   fmt_dict_count;
+	size_t                   fmt_dict_size;
 };
 
 struct log_device *log_device_create(struct ulogcat3_context *ctx);
@@ -146,11 +222,139 @@ void kmsgd_fix_entry(struct ulog_entry *entry);
 int add_klog_device(struct ulogcat3_context *ctx);
 
 int add_all_ulog_devices(struct ulogcat3_context *ctx);
+int ulog_process_entry(struct log_device *dev, struct frame *frame, int len);
+
+/* shared memory log buffers (see libulogcat_shm.c) */
+#define SHM_DEVICE_PREFIX "shm:"
+int add_shm_device(struct ulogcat3_context *ctx, const char *name);
+int add_all_shm_devices(struct ulogcat3_context *ctx);
+
+/* capture files (see libulogcat_capture.c) */
+#define FILE_DEVICE_PREFIX "file:"
+int add_file_device(struct ulogcat3_context *ctx, const char *path);
+int capture_render_header(struct ulogcat3_context *ctx, uint8_t *buf,
+			  size_t size, uint32_t flags);
+int capture_render_frame(struct ulogcat3_context *ctx, struct frame *frame,
+			 int is_banner);
+
+/*
+ * Capture files with flag CAPTURE_FLAG_BLOCKS store records in blocks: a
+ * struct capture_block followed by block data, which is LZ4-compressed if
+ * its size is smaller than raw_size.
+ */
+#define CAPTURE_FLAG_BLOCKS     (1 << 0)
+#define CAPTURE_BLOCK_SIZE      (64*1024)
+
+struct capture_block {
+	uint32_t                 raw_size;    /* size of records */
+	uint32_t                 size;        /* size of block data */
+};
+
+/* LZ4 block codec (see libulogcat_lz4.c) */
+size_t lz4_compress(const uint8_t *src, size_t srclen, uint8_t *dst,
+		    size_t dstsize);
+ssize_t lz4_decompress(const uint8_t *src, size_t srclen, uint8_t *dst,
+		       size_t dstsize);
+
+/* capture archives (see libulogcat_archive.c) */
+struct log_archive;
+int archive_open(struct ulogcat3_context *ctx,
+		 const struct ulogcat_archive_opts *opts);
+void archive_close(struct ulogcat3_context *ctx);
+int archive_write(struct ulogcat3_context *ctx, const void *buf, size_t len);
+int archive_timeout(struct ulogcat3_context *ctx, int timeout_ms);
+int archive_tick(struct ulogcat3_context *ctx);
+
+/*
+ * Capture file index: summary of a chunk of consecutive records, with bloom
+ * filters of their tags and pids. Index files are made of a struct
+ * capture_index_header followed by chunk summaries.
+ */
+#define CAPTURE_BLOOM_SIZE 32
+
+struct capture_chunk {
+	uint64_t                 offset;      /* first record in capture file */
+	uint32_t                 size;        /* records size */
+	uint32_t                 count;       /* number of records */
+	uint64_t                 first;       /* lowest timestamp (usecs) */
+	uint64_t                 last;        /* highest timestamp (usecs) */
+	uint8_t                  tags[CAPTURE_BLOOM_SIZE];
+	uint8_t                  pids[CAPTURE_BLOOM_SIZE];
+};
+
+static inline uint32_t capture_pid_hash(int32_t pid)
+{
+	return (uint32_t)pid * 2654435761U;
+}
+
+static inline uint32_t capture_tag_hash(const char *tag)
+{
+	return ulog_fmt_id(tag);
+}
+
+static inline void capture_bloom_add(uint8_t *bloom, uint32_t hash)
+{
+	int i;
+
+	for (i = 0; i < 3; i++, hash >>= 8)
+		bloom[(hash & 0xff) >> 3] |= 1 << (hash & 7);
+}
+
+static inline int capture_bloom_test(const uint8_t *bloom, uint32_t hash)
+{
+	int i;
+
+	for (i = 0; i < 3; i++, hash >>= 8) {
+		if (!(bloom[(hash & 0xff) >> 3] & (1 << (hash & 7))))
+			return 0;
+	}
+	return 1;
+}
+
+struct capture_index;
+int capture_index_open(struct ulogcat3_context *ctx, const char *path);
+void capture_index_close(struct ulogcat3_context *ctx);
+
+/* resumable cursors (see libulogcat_cursor.c) */
+struct log_cursor;
+int cursor_open(struct ulogcat3_context *ctx, const char *path);
+void cursor_close(struct ulogcat3_context *ctx);
+void cursor_update(struct ulogcat3_context *ctx, struct frame *frame);
+void cursor_sync(struct ulogcat3_context *ctx, int force);
+int cursor_skip_frame(struct log_device *dev, struct frame *frame);
+
+/* entry filters (see libulogcat_filter.c) */
+struct log_filter;
+int filter_compile(const char *expr, struct log_filter **filter);
+void filter_destroy(struct log_filter *filter);
+int filter_match(const struct log_filter *filter, const struct frame *frame);
+int filter_match_chunk(const struct log_filter *filter,
+		       const struct capture_chunk *chunk);
+
+int fmt_dict_load(struct ulogcat3_context *ctx, const char *path);
+void fmt_dict_clear(struct ulogcat3_context *ctx);
+const char *fmt_dict_lookup(uint32_t id, void *userdata);
+
+/* core functions used by pipeline worker (see libulogcat_core.c) */
+void flush_frame(struct ulogcat3_context *ctx, struct frame *frame);
+void output_flush(struct ulogcat3_context *ctx);
+
+/* pipelined processing (see libulogcat_pipeline.c) */
+struct log_pipeline;
+int pipeline_start(struct ulogcat3_context *ctx, int nframes);
+void pipeline_stop(struct ulogcat3_context *ctx);
+void pipeline_destroy(struct ulogcat3_context *ctx);
+int pipeline_push(struct ulogcat3_context *ctx, struct frame *frame);
+void pipeline_kick(struct ulogcat3_context *ctx);
+struct frame *pipeline_reclaim(struct ulogcat3_context *ctx, int wait);
+int pipeline_sync(struct ulogcat3_context *ctx);
+int pipeline_failed(struct ulogcat3_context *ctx);
 
-int text_render_size(void);
+int text_render_size(enum ulogcat_format format);
 int text_render_frame(struct ulogcat3_context *ctx, struct frame *frame,
 		      int is_banner);
 
 void setup_colors(struct ulogcat3_context *ctx);
+void setup_text(struct ulogcat3_context *ctx);
 
 #endif /* _LIBULOGCAT_PRIVATE_H */
@@ -0,0 +1,514 @@
+/**
+ * Copyright (C) 2024 Parrot S.A.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * libulogcat, a reader library for ulogger/kernel log buffers
+ *
+ * Reader of shared memory log buffers (see ulogshm.h). Records are read
+ * directly from the mapped ring; since poll() cannot wait on a futex, a
+ * helper thread waits for writers and signals an eventfd, which is the
+ * descriptor of the device.
+ */
+
+#include "libulogcat_private.h"
+
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include <ulogshm.h>
+
+/* give up waiting for a reserved record after this delay, in ms */
+#define SHM_STALL_TIMEOUT_MS  100
+
+struct shm_reader {
+	struct ulog_shm_header  *hdr;
+	const uint8_t           *ring;
+	size_t                   map_size;
+	uint32_t                 size;
+	uint64_t                 pos;         /* next record to read */
+	uint64_t                 dropped;     /* bytes lost, not yet reported */
+	uint64_t                 stall_pos;   /* unpublished record */
+	struct timespec          stall_time;  /* when it was first seen */
+	int32_t                  sec;         /* timestamp of last entry */
+	int32_t                  nsec;
+	char                     name[32];
+	/* notification thread */
+	pthread_t                thread;
+	pthread_mutex_t          lock;
+	pthread_cond_t           cond;
+	int                      started;
+	int                      armed;       /* thread should wait for data */
+	int                      stop;
+	uint64_t                 armed_pos;
+};
+
+static long futex(uint32_t *uaddr, int op, uint32_t val)
+{
+	return syscall(SYS_futex, uaddr, op, val, NULL, NULL, 0);
+}
+
+/* map a log buffer file and check its header */
+static int shm_map(struct shm_reader *r, const char *path, int quiet)
+{
+	int fd, ret = -1;
+	struct stat st;
+	void *addr;
+	const struct ulog_shm_header *hdr;
+
+	/* readers need write access to wait for writers */
+	fd = open(path, O_RDWR|O_CLOEXEC);
+	if (fd < 0) {
+		if (!quiet)
+			INFO("cannot open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+	    st.st_size < ULOG_SHM_HDR_SIZE + ULOG_SHM_MIN_SIZE) {
+		if (!quiet)
+			INFO("%s: not a log buffer\n", path);
+		goto out;
+	}
+
+	addr = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED) {
+		INFO("mmap(%s): %s\n", path, strerror(errno));
+		goto out;
+	}
+
+	hdr = addr;
+	if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != ULOG_SHM_MAGIC ||
+	    hdr->version != ULOG_SHM_VERSION ||
+	    hdr->hdr_size != ULOG_SHM_HDR_SIZE ||
+	    hdr->size < ULOG_SHM_MIN_SIZE || hdr->size > ULOG_SHM_MAX_SIZE ||
+	    (hdr->size & (hdr->size - 1)) ||
+	    (off_t)hdr->hdr_size + hdr->size > st.st_size) {
+		if (!quiet)
+			INFO("%s: invalid log buffer header\n", path);
+		munmap(addr, st.st_size);
+		goto out;
+	}
+
+	r->hdr = addr;
+	r->ring = (const uint8_t *)addr + hdr->hdr_size;
+	r->map_size = st.st_size;
+	r->size = hdr->size;
+	ret = 0;
+out:
+	close(fd);
+	return ret;
+}
+
+static void shm_copy_out(const struct shm_reader *r, uint64_t pos, void *dst,
+			 size_t len)
+{
+	uint32_t off = (uint32_t)pos & (r->size - 1);
+	size_t n = r->size - off;
+
+	if (n >= len) {
+		memcpy(dst, r->ring + off, len);
+	} else {
+		memcpy(dst, r->ring + off, n);
+		memcpy((uint8_t *)dst + n, r->ring, len - n);
+	}
+}
+
+static const struct ulog_shm_record *shm_record(const struct shm_reader *r,
+						uint64_t pos)
+{
+	return (const struct ulog_shm_record *)
+		&r->ring[(uint32_t)pos & (r->size - 1)];
+}
+
+/* return the length of the published record at 'pos', or 0 */
+static uint32_t shm_record_ready(const struct shm_reader *r, uint64_t pos)
+{
+	const struct ulog_shm_record *rec = shm_record(r, pos);
+	uint32_t len;
+
+	if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != pos + 1)
+		return 0;
+
+	len = __atomic_load_n(&rec->len, __ATOMIC_RELAXED);
+	if (len < sizeof(struct ulogger_entry) || len > ULOGGER_ENTRY_MAX_LEN)
+		return 0;
+
+	return len;
+}
+
+/* find the first published record between 'pos' and 'tail' */
+static uint64_t shm_resync(const struct shm_reader *r, uint64_t pos,
+			   uint64_t tail)
+{
+	for (; pos < tail; pos += ULOG_SHM_ALIGN) {
+		if (shm_record_ready(r, pos))
+			break;
+	}
+	return pos < tail ? pos : tail;
+}
+
+static void shm_skip(struct log_device *dev, uint64_t pos)
+{
+	struct shm_reader *r = dev->priv;
+
+	r->dropped += pos - r->pos;
+	dev->mark_readable -= (ssize_t)(pos - r->pos);
+	r->pos = pos;
+}
+
+/* has the record at the current position been reserved for too long ? */
+static int shm_stalled(struct shm_reader *r)
+{
+	struct timespec ts;
+	int64_t ms;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	if (r->stall_pos != r->pos) {
+		r->stall_pos = r->pos;
+		r->stall_time = ts;
+		return 0;
+	}
+
+	ms = (ts.tv_sec - r->stall_time.tv_sec) * 1000LL +
+	     (ts.tv_nsec - r->stall_time.tv_nsec) / 1000000LL;
+	return ms >= SHM_STALL_TIMEOUT_MS;
+}
+
+/* build a fake entry indicating how much data was lost */
+static int shm_read_drop_summary(struct log_device *dev, struct frame *frame)
+{
+	struct shm_reader *r = dev->priv;
+	struct ulogger_entry *raw = (struct ulogger_entry *)frame->buf;
+	int ret;
+
+	ret = snprintf(raw->msg, frame->bufsize - sizeof(*raw),
+		       /* <pname>\0<priority:4><tag>\0<message> */
+		       "%c%c%c%c%c%s%c%llu bytes of log entries dropped\n",
+		       '\0', /* empty pname, no thread (pid=tid) */
+		       ULOG_WARN, 0, 0, 0, r->name, '\0',
+		       (unsigned long long)r->dropped);
+	if (ret < 0 || ret >= (int)(frame->bufsize - sizeof(*raw)))
+		return -1;
+
+	raw->len = ret + 1;
+	raw->hdr_size = sizeof(*raw);
+	raw->pid = -1;
+	raw->tid = -1;
+	raw->sec = r->sec;
+	raw->nsec = r->nsec;
+	raw->euid = 0;
+	r->dropped = 0;
+
+	return ulog_process_entry(dev, frame, sizeof(*raw) + raw->len);
+}
+
+static int shm_read_entry(struct log_device *dev, struct frame *frame)
+{
+	struct shm_reader *r = dev->priv;
+	struct ulogger_entry *raw;
+	uint64_t tail;
+	uint32_t len;
+	int ret;
+
+	for (;;) {
+		tail = __atomic_load_n(&r->hdr->tail, __ATOMIC_ACQUIRE);
+		if (tail - r->pos > r->size) {
+			/* lapped by writers, skip overwritten records */
+			shm_skip(dev, shm_resync(r, tail - r->size, tail));
+			continue;
+		}
+
+		if (r->dropped)
+			return shm_read_drop_summary(dev, frame);
+
+		if (r->pos == tail)
+			return 0;
+
+		len = shm_record_ready(r, r->pos);
+		if (len == 0) {
+			if (!shm_stalled(r))
+				return 0;
+			/* writer was probably killed while writing */
+			shm_skip(dev, shm_resync(r, r->pos + ULOG_SHM_ALIGN,
+						 tail));
+			continue;
+		}
+
+		if (len > frame->bufsize && frame->buf == frame->data) {
+			/* regular frame buffer is too small */
+			frame->buf = malloc(ULOGGER_ENTRY_MAX_LEN);
+			if (frame->buf == NULL) {
+				INFO("malloc: %s\n", strerror(errno));
+				frame->buf = frame->data;
+				return -1;
+			}
+			frame->bufsize = ULOGGER_ENTRY_MAX_LEN;
+		}
+
+		shm_copy_out(r, r->pos + sizeof(struct ulog_shm_record),
+			     frame->buf, len);
+
+		/* make sure the record was not overwritten while copying */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		tail = __atomic_load_n(&r->hdr->tail, __ATOMIC_RELAXED);
+		if (tail - r->pos > r->size)
+			continue;
+
+		r->pos += ulog_shm_record_len(len);
+		dev->mark_readable -= ulog_shm_record_len(len) - len;
+
+		raw = (struct ulogger_entry *)frame->buf;
+		r->sec = raw->sec;
+		r->nsec = raw->nsec;
+
+		/* a corrupted record is not a reason to stop reading */
+		ret = ulog_process_entry(dev, frame, len);
+		return (ret < 0) ? 0 : ret;
+	}
+}
+
+/* let the notification thread wait for the record at 'r->pos' */
+static void shm_arm(struct shm_reader *r)
+{
+	pthread_mutex_lock(&r->lock);
+	r->armed = 1;
+	r->armed_pos = r->pos;
+	pthread_cond_signal(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+}
+
+static int shm_receive_entry(struct log_device *dev, struct frame *frame)
+{
+	struct shm_reader *r = dev->priv;
+	uint64_t val;
+	int ret;
+
+	ret = shm_read_entry(dev, frame);
+
+	/* keep the eventfd readable as long as there is something to read */
+	if (ret >= 0 && !r->dropped &&
+	    __atomic_load_n(&r->hdr->tail, __ATOMIC_ACQUIRE) == r->pos) {
+		if (read(dev->fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+			INFO("read(%s): %s\n", dev->path, strerror(errno));
+		shm_arm(r);
+	}
+
+	return ret;
+}
+
+static void *shm_notify_thread(void *arg)
+{
+	struct log_device *dev = arg;
+	struct shm_reader *r = dev->priv;
+	struct ulog_shm_header *hdr = r->hdr;
+	uint64_t pos, one = 1;
+	uint32_t val;
+	int stop;
+
+	for (;;) {
+		pthread_mutex_lock(&r->lock);
+		while (!r->armed && !r->stop)
+			pthread_cond_wait(&r->cond, &r->lock);
+		pos = r->armed_pos;
+		stop = r->stop;
+		pthread_mutex_unlock(&r->lock);
+		if (stop)
+			break;
+
+		/* writers wake up the futex only if someone is waiting */
+		for (;;) {
+			__atomic_store_n(&hdr->waiters, 1, __ATOMIC_SEQ_CST);
+			val = __atomic_load_n(&hdr->futex, __ATOMIC_ACQUIRE);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&r->stop, __ATOMIC_RELAXED) ||
+			    __atomic_load_n(&hdr->tail, __ATOMIC_RELAXED) != pos)
+				break;
+			(void)futex(&hdr->futex, FUTEX_WAIT, val);
+		}
+
+		pthread_mutex_lock(&r->lock);
+		r->armed = 0;
+		stop = r->stop;
+		pthread_mutex_unlock(&r->lock);
+		if (stop)
+			break;
+
+		if (write(dev->fd, &one, sizeof(one)) < 0)
+			INFO("write(%s): %s\n", dev->path, strerror(errno));
+	}
+	return NULL;
+}
+
+static int shm_parse_entry(struct frame *frame)
+{
+	/* no-op, parsing is done upon entry read */
+	return 0;
+}
+
+static int shm_clear_buffer(struct log_device *dev)
+{
+	struct shm_reader *r = dev->priv;
+	uint64_t tail = __atomic_load_n(&r->hdr->tail, __ATOMIC_ACQUIRE);
+
+	/* records are not erased, new readers just start after them */
+	__atomic_store_n(&r->hdr->head, tail, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static void shm_destroy(struct log_device *dev)
+{
+	struct shm_reader *r = dev->priv;
+
+	if (r == NULL)
+		return;
+
+	if (r->started) {
+		pthread_mutex_lock(&r->lock);
+		__atomic_store_n(&r->stop, 1, __ATOMIC_RELAXED);
+		pthread_cond_signal(&r->cond);
+		pthread_mutex_unlock(&r->lock);
+		__atomic_add_fetch(&r->hdr->futex, 1, __ATOMIC_SEQ_CST);
+		(void)futex(&r->hdr->futex, FUTEX_WAKE, INT_MAX);
+		pthread_join(r->thread, NULL);
+	}
+	pthread_cond_destroy(&r->cond);
+	pthread_mutex_destroy(&r->lock);
+
+	if (r->hdr)
+		munmap(r->hdr, r->map_size);
+}
+
+static int shm_start_thread(struct log_device *dev)
+{
+	struct shm_reader *r = dev->priv;
+	sigset_t set, oldset;
+	int ret;
+
+	/* helper thread should not receive any signal */
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &oldset);
+	ret = pthread_create(&r->thread, NULL, shm_notify_thread, dev);
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+	if (ret != 0) {
+		INFO("pthread_create: %s\n", strerror(ret));
+		return -1;
+	}
+
+	r->started = 1;
+	return 0;
+}
+
+int add_shm_device(struct ulogcat3_context *ctx, const char *name)
+{
+	struct log_device *dev;
+	struct shm_reader *r;
+	uint64_t head, tail;
+
+	dev = log_device_create(ctx);
+	if (dev == NULL)
+		return -1;
+
+	dev->fd = -1;
+	dev->destroy = shm_destroy;
+	r = calloc(1, sizeof(*r));
+	if (r == NULL) {
+		INFO("cannot allocate device: %s\n", strerror(errno));
+		goto fail;
+	}
+	dev->priv = r;
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->cond, NULL);
+	r->stall_pos = UINT64_MAX;
+	snprintf(r->name, sizeof(r->name), "%s", name);
+	snprintf(dev->path, sizeof(dev->path), ULOG_SHM_DIR "ulog_%s", name);
+
+	if (shm_map(r, dev->path, 0) < 0)
+		goto fail;
+
+	dev->fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+	if (dev->fd < 0) {
+		INFO("eventfd: %s\n", strerror(errno));
+		goto fail;
+	}
+
+	dev->receive_entry = shm_receive_entry;
+	dev->parse_entry = shm_parse_entry;
+	dev->clear_buffer = shm_clear_buffer;
+	dev->label = 'U';
+
+	/* start with the oldest record which was not overwritten */
+	tail = __atomic_load_n(&r->hdr->tail, __ATOMIC_ACQUIRE);
+	head = __atomic_load_n(&r->hdr->head, __ATOMIC_ACQUIRE);
+	if (head > tail)
+		head = tail;
+	r->pos = (tail - head > r->size) ?
+		shm_resync(r, tail - r->size, tail) : head;
+
+	/* get amount of data already present in buffer */
+	dev->mark_readable = (ssize_t)(tail - r->pos);
+	if (dev->mark_readable > 0)
+		(void)eventfd_write(dev->fd, 1);
+	else
+		shm_arm(r);
+
+	if (shm_start_thread(dev) < 0)
+		goto fail;
+
+	ctx->ulog_device_count++;
+	return 0;
+
+fail:
+	log_device_destroy(dev);
+	return -1;
+}
+
+/* add all valid log buffers found in ULOG_SHM_DIR, return their number */
+int add_all_shm_devices(struct ulogcat3_context *ctx)
+{
+	DIR *dir;
+	struct dirent *de;
+	struct shm_reader probe;
+	char path[PATH_MAX];
+	int count = 0;
+
+	dir = opendir(ULOG_SHM_DIR);
+	if (dir == NULL)
+		return 0;
+
+	while ((de = readdir(dir)) != NULL) {
+		if (strncmp(de->d_name, "ulog_", 5) != 0 ||
+		    strlen(de->d_name + 5) >= sizeof(probe.name))
+			continue;
+
+		/* silently skip files which are not log buffers */
+		snprintf(path, sizeof(path), ULOG_SHM_DIR "%s", de->d_name);
+		if (shm_map(&probe, path, 1) < 0)
+			continue;
+		munmap(probe.hdr, probe.map_size);
+
+		if (add_shm_device(ctx, de->d_name + 5) < 0) {
+			count = -1;
+			break;
+		}
+		count++;
+	}
+
+	closedir(dir);
+	return count;
+}
@@ -19,8 +19,12 @@
 
 #include "libulogcat_private.h"
 
-int text_render_size(void)
+int text_render_size(enum ulogcat_format format)
 {
+	/* escaped JSON strings may be up to 6 times longer than raw strings */
+	if (format == ULOGCAT_FORMAT_JSON)
+		return 6*ULOGGER_ENTRY_MAX_LEN;
+
 	return ULOGGER_ENTRY_MAX_LEN+128;
 }
 
@@ -107,144 +111,520 @@ static int print_log_line_csv(const struct frame *frame, char *buf,
 	return count;
 }
 
-static int print_ulog_line(const struct frame *frame, const char *message,
-			   char *buf, size_t bufsize)
+/*
+ * Text lines are built by copying bytes directly into the render buffer,
+ * which is much faster than snprintf(). Output is the same as with the
+ * printf-style formats given in comments, including truncation: a truncated
+ * line fills the whole buffer, its last byte being a null character.
+ */
+#define TEXT_TAG_WIDTH          12
+#define TEXT_FIELD_WIDTH        45
+#define TEXT_FIELD_MAX          127
+
+struct text_line {
+	char                    *p;
+	char                    *end;         /* reserved for null character */
+	int                      truncated;
+};
+
+static inline void line_put(struct text_line *l, const char *s, size_t len)
+{
+	size_t room = l->end - l->p;
+
+	if (len > room) {
+		len = room;
+		l->truncated = 1;
+	}
+	memcpy(l->p, s, len);
+	l->p += len;
+}
+
+static inline void line_puts(struct text_line *l, const char *s)
+{
+	line_put(l, s, strlen(s));
+}
+
+static inline void line_putc(struct text_line *l, char c)
+{
+	if (l->p < l->end)
+		*l->p++ = c;
+	else
+		l->truncated = 1;
+}
+
+/* "%-<width>s" */
+static void line_put_padded(struct text_line *l, const char *s, size_t width)
+{
+	size_t len = strlen(s), room;
+
+	line_put(l, s, len);
+	if (len >= width)
+		return;
+
+	len = width - len;
+	room = l->end - l->p;
+	if (len > room) {
+		len = room;
+		l->truncated = 1;
+	}
+	memset(l->p, ' ', len);
+	l->p += len;
+}
+
+/* "%0<width>lu" */
+static void line_put_ulong(struct text_line *l, unsigned long v, int width)
+{
+	char tmp[24], *p = tmp + sizeof(tmp);
+
+	do {
+		*--p = '0' + v % 10;
+		v /= 10;
+		width--;
+	} while (v || width > 0);
+
+	line_put(l, p, tmp + sizeof(tmp) - p);
+}
+
+/* "%ld" */
+static void line_put_int(struct text_line *l, long v)
+{
+	if (v < 0) {
+		line_putc(l, '-');
+		line_put_ulong(l, -(unsigned long)v, 0);
+	} else {
+		line_put_ulong(l, (unsigned long)v, 0);
+	}
+}
+
+/* "%m-%d %H:%M:%S.%03ld", date string is cached for consecutive entries */
+static void line_put_time(struct ulogcat3_context *ctx, struct text_line *l,
+			  const struct ulog_entry *entry)
 {
-	int count;
-	char cprio;
 	struct tm tmBuf;
 	struct tm *ptm;
-	char tbuf[32], buf2[128];
-	const char *cstart, *cend, *clabel;
+
+	if (!ctx->text_time_len || (ctx->text_time_sec != entry->tv_sec)) {
+		ptm = localtime_r(&entry->tv_sec, &tmBuf);
+		ctx->text_time_len = ptm ? strftime(ctx->text_time,
+						    sizeof(ctx->text_time),
+						    "%m-%d %H:%M:%S", ptm) : 0;
+		ctx->text_time_sec = entry->tv_sec;
+	}
+
+	line_put(l, ctx->text_time, ctx->text_time_len);
+	line_putc(l, '.');
+	if (entry->tv_nsec >= 0) {
+		line_put_ulong(l, entry->tv_nsec/1000000, 3);
+	} else {
+		line_putc(l, '-');
+		line_put_ulong(l, -(entry->tv_nsec/1000000), 2);
+	}
+}
+
+/* "(%s%s%s)" with process and thread names */
+static void line_put_names(struct text_line *l, const struct ulog_entry *entry)
+{
+	line_putc(l, '(');
+	line_puts(l, entry->pname);
+	if (entry->pid != entry->tid) {
+		line_putc(l, '/');
+		line_puts(l, entry->tname);
+	}
+	line_putc(l, ')');
+}
+
+/* "(%s-%d/%s-%d)" or "(%s-%d)" with process and thread names and ids */
+static void line_put_ids(struct text_line *l, const struct ulog_entry *entry)
+{
+	line_putc(l, '(');
+	line_puts(l, entry->pname);
+	line_putc(l, '-');
+	line_put_int(l, entry->pid);
+	if (entry->pid != entry->tid) {
+		line_putc(l, '/');
+		line_puts(l, entry->tname);
+		line_putc(l, '-');
+		line_put_int(l, entry->tid);
+	}
+	line_putc(l, ')');
+}
+
+/* "%-45s" with a field formerly built in a 128-byte buffer */
+static void line_pad_field(struct text_line *l, char *field)
+{
+	size_t len;
+
+	if (l->p - field > TEXT_FIELD_MAX) {
+		/* field is truncated, it fits in buffer */
+		l->p = field + TEXT_FIELD_MAX;
+		l->truncated = 0;
+	}
+
+	len = l->p - field;
+	if (len < TEXT_FIELD_WIDTH)
+		line_put_padded(l, "", TEXT_FIELD_WIDTH - len);
+}
+
+static int print_log_line(struct ulogcat3_context *ctx,
+			  const struct frame *frame, const char *message,
+			  char *buf, size_t bufsize)
+{
+	struct text_line l;
 	const struct ulog_entry *entry = &frame->entry;
-	struct ulogcat3_context *ctx = frame->dev->ctx;
+	int klog = (frame->label == 'K');
+	char *field;
+
+	if (bufsize == 0)
+		return 0;
 
-	cprio = priotab[entry->priority];
-	cstart = (ctx->flags & ULOGCAT_FLAG_COLOR) ?
-		ctx->ansi_color[entry->priority] : "";
-	cend  = (ctx->flags & ULOGCAT_FLAG_COLOR) ? ansinone : "";
-	clabel = (ctx->flags & ULOGCAT_FLAG_SHOW_LABEL) ? "U " : "";
+	l.p = buf;
+	l.end = buf + bufsize - 1;
+	l.truncated = 0;
+
+	/* color and label */
+	line_put(&l, ctx->text_prefix[klog][entry->priority],
+		 ctx->text_prefix_len[klog][entry->priority]);
+
+	if (ctx->log_format == ULOGCAT_FORMAT_LONG) {
+		line_put_time(ctx, &l, entry);
+		line_putc(&l, ' ');
+	}
+	line_putc(&l, priotab[entry->priority]);
+	line_putc(&l, ' ');
 
 	switch (ctx->log_format) {
 
 	case ULOGCAT_FORMAT_SHORT:
-		count = snprintf(buf, bufsize, "%s%s%c %-12s: %s%s\n", cstart,
-				 clabel, cprio, entry->tag, message, cend);
-		break;
-
-	default:
-	case ULOGCAT_FORMAT_ALIGNED:
-		snprintf(buf2, sizeof(buf2), "%-12s(%s%s%s)",
-			 entry->tag, entry->pname,
-			 (entry->pid != entry->tid) ? "/" : "",
-			 (entry->pid != entry->tid) ? entry->tname : "");
-		count = snprintf(buf, bufsize, "%s%s%c %-45s: %s%s\n",
-				 cstart, clabel, cprio, buf2, message, cend);
+		/* "%-12s" */
+		line_put_padded(&l, entry->tag, TEXT_TAG_WIDTH);
 		break;
 
 	case ULOGCAT_FORMAT_PROCESS:
-		count = snprintf(buf, bufsize,
-				 "%s%s%c %-12s(%s%s%s): %s%s\n", cstart,
-				 clabel, cprio, entry->tag, entry->pname,
-				 (entry->pid != entry->tid) ? "/" : "",
-				 (entry->pid != entry->tid) ? entry->tname : "",
-				 message, cend);
+		/* "%-12s(%s%s%s)", kernel messages have no process */
+		line_put_padded(&l, entry->tag, TEXT_TAG_WIDTH);
+		if (!klog)
+			line_put_names(&l, entry);
 		break;
 
+	default:
+	case ULOGCAT_FORMAT_ALIGNED:
 	case ULOGCAT_FORMAT_LONG:
-		ptm = localtime_r(&(entry->tv_sec), &tmBuf);
-		strftime(tbuf, sizeof(tbuf), "%m-%d %H:%M:%S", ptm);
-
-		if (entry->pid != entry->tid) {
-			snprintf(buf2, sizeof(buf2), "%-12s(%s-%d/%s-%d)",
-				 entry->tag,
-				 entry->pname, entry->pid,
-				 entry->tname, entry->tid);
-		} else {
-			snprintf(buf2, sizeof(buf2), "%-12s(%s-%d)",
-				 entry->tag, entry->pname, entry->pid);
+		if (klog) {
+			/* "%-45s" */
+			line_put_padded(&l, entry->tag, TEXT_FIELD_WIDTH);
+			break;
 		}
 
-		count = snprintf(buf, bufsize,
-				 "%s%s%s.%03ld %c %-45s: %s%s\n",
-				 cstart, clabel, tbuf, entry->tv_nsec/1000000,
-				 cprio, buf2, message, cend);
+		field = l.p;
+		line_put_padded(&l, entry->tag, TEXT_TAG_WIDTH);
+		if (ctx->log_format == ULOGCAT_FORMAT_LONG)
+			line_put_ids(&l, entry);
+		else
+			line_put_names(&l, entry);
+		line_pad_field(&l, field);
 		break;
 	}
-	if (count >= (int)bufsize)
+
+	/* ": %s%s\n" with message and color reset */
+	line_put(&l, ": ", 2);
+	line_puts(&l, message);
+	line_put(&l, ctx->text_suffix, ctx->text_suffix_len);
+
+	if (l.truncated) {
 		/* message has been truncated */
-		count = bufsize;
+		*l.end = '\0';
+		return bufsize;
+	}
 
-	return count;
+	*l.p = '\0';
+	return l.p - buf;
 }
 
-static int print_klog_line(const struct frame *frame, const char *message,
-			   char *buf, size_t bufsize)
+/*
+ * JSON format: one object per entry and per line. Strings are escaped with a
+ * lookup table and copied in runs of bytes which need no escaping; non-ASCII
+ * bytes are copied as is. Binary payloads are base64-encoded. Event payloads
+ * (see ULOG_EVT and ULOG_EVTS in ulog.h) are also split into fields:
+ *
+ * {"sec":1,"nsec":2,"prio":5,"tag":"t","pid":3,"pname":"p","tid":3,
+ *  "tname":"p","evt":{"type":"FOO","params":{"a":1,"b":"x"}},"msg":"EVT:..."}
+ */
+#define line_put_lit(_l, _s)    line_put((_l), (_s), sizeof(_s) - 1)
+
+static const char json_escape[256] = {
+	[0x00 ... 0x07] = 'u',
+	['\b'] = 'b',
+	['\t'] = 't',
+	['\n'] = 'n',
+	[0x0b] = 'u',
+	['\f'] = 'f',
+	['\r'] = 'r',
+	[0x0e ... 0x1f] = 'u',
+	['"'] = '"',
+	['\\'] = '\\',
+};
+
+static void json_put_chars(struct text_line *l, const char *s, size_t len)
 {
-	int count;
-	char cprio;
-	struct tm tmBuf;
-	struct tm *ptm;
-	char tbuf[32];
-	const char *cstart, *cend, *clabel;
-	const struct ulog_entry *entry = &frame->entry;
-	struct ulogcat3_context *ctx = frame->dev->ctx;
+	static const char hex[] = "0123456789abcdef";
+	const char *run = s, *end = s + len;
+	char esc[6] = {'\\', 'u', '0', '0'};
+	char c;
+
+	for (; s < end; s++) {
+		c = json_escape[(unsigned char)*s];
+		if (!c)
+			continue;
+
+		line_put(l, run, s - run);
+		run = s + 1;
+		if (c == 'u') {
+			esc[4] = hex[(unsigned char)*s >> 4];
+			esc[5] = hex[*s & 0xf];
+			line_put(l, esc, 6);
+		} else {
+			line_putc(l, '\\');
+			line_putc(l, c);
+		}
+	}
+	line_put(l, run, end - run);
+}
 
-	cprio = priotab[entry->priority];
-	cstart = (ctx->flags & ULOGCAT_FLAG_COLOR) ?
-		ctx->ansi_color[entry->priority] : "";
-	cend  = (ctx->flags & ULOGCAT_FLAG_COLOR) ? ansinone : "";
-	clabel = (ctx->flags & ULOGCAT_FLAG_SHOW_LABEL) ? "K " : "";
+static void json_put_string(struct text_line *l, const char *s, size_t len)
+{
+	line_putc(l, '"');
+	json_put_chars(l, s, len);
+	line_putc(l, '"');
+}
 
-	switch (ctx->log_format) {
+static void json_put_base64(struct text_line *l, const uint8_t *data,
+			    size_t len)
+{
+	static const char b64[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	char out[4];
+	uint32_t v;
+	size_t i;
+
+	line_putc(l, '"');
+	for (i = 0; i + 2 < len; i += 3) {
+		v = (data[i] << 16) | (data[i+1] << 8) | data[i+2];
+		out[0] = b64[v >> 18];
+		out[1] = b64[(v >> 12) & 0x3f];
+		out[2] = b64[(v >> 6) & 0x3f];
+		out[3] = b64[v & 0x3f];
+		line_put(l, out, 4);
+	}
+	if (i < len) {
+		v = data[i] << 16;
+		if (i + 1 < len)
+			v |= data[i+1] << 8;
+		out[0] = b64[v >> 18];
+		out[1] = b64[(v >> 12) & 0x3f];
+		out[2] = (i + 1 < len) ? b64[(v >> 6) & 0x3f] : '=';
+		out[3] = '=';
+		line_put(l, out, 4);
+	}
+	line_putc(l, '"');
+}
 
-	case ULOGCAT_FORMAT_SHORT:
-		count = snprintf(buf, bufsize, "%s%s%c %-12s: %s%s\n", cstart,
-				 clabel, cprio, entry->tag, message, cend);
-		break;
+static inline int json_isdigit(char c)
+{
+	return (c >= '0') && (c <= '9');
+}
 
-	default:
-	case ULOGCAT_FORMAT_ALIGNED:
-		count = snprintf(buf, bufsize, "%s%s%c %-45s: %s%s\n", cstart,
-				 clabel, cprio, entry->tag, message, cend);
-		break;
+/* Check that an unquoted event value is a JSON number: -?(0|[1-9]\d*)(.\d+)? */
+static int json_is_number(const char *s, const char *end)
+{
+	if ((s < end) && (*s == '-'))
+		s++;
+	if ((s == end) || !json_isdigit(*s))
+		return 0;
+	if ((*s == '0') && (s + 1 < end) && json_isdigit(s[1]))
+		return 0;
+	while ((s < end) && json_isdigit(*s))
+		s++;
+	if ((s < end) && (*s == '.')) {
+		s++;
+		if ((s == end) || !json_isdigit(*s))
+			return 0;
+		while ((s < end) && json_isdigit(*s))
+			s++;
+	}
+	return s == end;
+}
 
-	case ULOGCAT_FORMAT_PROCESS:
-		count = snprintf(buf, bufsize,
-				 "%s%s%c %-12s: %s%s\n", cstart,
-				 clabel, cprio, entry->tag, message, cend);
-		break;
+/* Find the first character @c of an event payload which is not escaped */
+static const char *evt_scan(const char *s, const char *end, char c)
+{
+	for (; s < end; s++) {
+		if (*s == c)
+			break;
+		if ((*s == '\\') && (s + 1 < end))
+			s++;
+	}
+	return s;
+}
 
-	case ULOGCAT_FORMAT_LONG:
-		ptm = localtime_r(&(entry->tv_sec), &tmBuf);
-		strftime(tbuf, sizeof(tbuf), "%m-%d %H:%M:%S", ptm);
+/* Write an event value as a string, removing escaping backslashes */
+static void json_put_evt_value(struct text_line *l, const char *s,
+			       const char *end)
+{
+	const char *bs;
 
-		count = snprintf(buf, bufsize,
-				 "%s%s%s.%03ld %c %-45s: %s%s\n",
-				 cstart, clabel, tbuf, entry->tv_nsec/1000000,
-				 cprio, entry->tag, message, cend);
-		break;
+	line_putc(l, '"');
+	while ((bs = memchr(s, '\\', end - s)) && (bs + 1 < end)) {
+		json_put_chars(l, s, bs - s);
+		json_put_chars(l, bs + 1, 1);
+		s = bs + 2;
 	}
-	if (count >= (int)bufsize)
-		/* message has been truncated */
-		count = bufsize;
+	json_put_chars(l, s, end - s);
+	line_putc(l, '"');
+}
 
-	return count;
+/* ',"evt":{"type":"<type>","params":{"<param>":<value>,...}}' */
+static void json_put_evt(struct text_line *l, const char *msg,
+			 const char *end)
+{
+	const char *p, *key, *val, *vend;
+	int secret, count = 0;
+	char quote;
+
+	secret = (strncmp(msg, "EVTS:", 5) == 0);
+	p = msg + (secret ? 5 : 4);
+
+	/* ignore trailing newlines */
+	while ((end > p) && (end[-1] == '\n'))
+		end--;
+
+	key = memchr(p, ';', end - p) ? : end;
+	if (key == p)
+		return;
+
+	if (secret)
+		line_put_lit(l, ",\"evts\":{\"type\":");
+	else
+		line_put_lit(l, ",\"evt\":{\"type\":");
+	json_put_string(l, p, key - p);
+	line_put_lit(l, ",\"params\":{");
+
+	/* '<param>=<value>;' terms, malformed ones are skipped */
+	for (p = key; p < end; p = vend) {
+		key = p + 1;
+		vend = evt_scan(key, end, ';');
+		val = memchr(key, '=', vend - key);
+		if ((val == NULL) || (val == key))
+			continue;
+
+		if (count++)
+			line_putc(l, ',');
+		json_put_string(l, key, val - key);
+		line_putc(l, ':');
+
+		val++;
+		if ((val < end) && ((*val == '\'') || (*val == '"'))) {
+			/* quoted value, ignore anything up to next term */
+			quote = *val++;
+			p = evt_scan(val, end, quote);
+			json_put_evt_value(l, val, p);
+			vend = (p < end) ? evt_scan(p + 1, end, ';') : end;
+		} else if (json_is_number(val, vend)) {
+			line_put(l, val, vend - val);
+		} else {
+			json_put_evt_value(l, val, vend);
+		}
+	}
+	line_put_lit(l, "}}");
 }
 
-static int print_log_line(const struct frame *frame, const char *message,
-			  char *buf, size_t bufsize)
+static int print_log_line_json(struct ulogcat3_context *ctx,
+			       const struct frame *frame, char *buf,
+			       size_t bufsize, int evt)
 {
-	/* some buffers require specific processing */
-	switch (frame->dev->label) {
-	case 'K':
-		return print_klog_line(frame, message, buf, bufsize);
-	case 'U':
-	default:
-		return print_ulog_line(frame, message, buf, bufsize);
+	struct text_line l;
+	const struct ulog_entry *entry = &frame->entry;
+	int klog = (frame->label == 'K');
+	size_t len;
+
+	l.p = buf;
+	l.end = buf + bufsize;
+	l.truncated = 0;
+
+	line_put_lit(&l, "{\"sec\":");
+	line_put_int(&l, entry->tv_sec);
+	line_put_lit(&l, ",\"nsec\":");
+	line_put_int(&l, entry->tv_nsec);
+	line_put_lit(&l, ",\"prio\":");
+	line_put_int(&l, entry->priority);
+
+	if (ctx->flags & ULOGCAT_FLAG_SHOW_LABEL) {
+		if (klog)
+			line_put_lit(&l, ",\"label\":\"K\"");
+		else
+			line_put_lit(&l, ",\"label\":\"U\"");
+	}
+
+	line_put_lit(&l, ",\"tag\":");
+	json_put_string(&l, entry->tag, strlen(entry->tag));
+
+	/* kernel messages have no process */
+	if (!klog) {
+		line_put_lit(&l, ",\"pid\":");
+		line_put_int(&l, entry->pid);
+		line_put_lit(&l, ",\"pname\":");
+		json_put_string(&l, entry->pname, strlen(entry->pname));
+		line_put_lit(&l, ",\"tid\":");
+		line_put_int(&l, entry->tid);
+		line_put_lit(&l, ",\"tname\":");
+		json_put_string(&l, entry->tname, strlen(entry->tname));
+	}
+
+	if (entry->is_binary) {
+		line_put_lit(&l, ",\"bin\":");
+		json_put_base64(&l, (const uint8_t *)entry->message,
+				entry->len);
+	} else {
+		len = strlen(entry->message);
+		if (evt && (strncmp(entry->message, "EVT", 3) == 0) &&
+		    ((entry->message[3] == ':') ||
+		     (strncmp(entry->message + 3, "S:", 2) == 0)))
+			json_put_evt(&l, entry->message, entry->message + len);
+
+		line_put_lit(&l, ",\"msg\":");
+		json_put_string(&l, entry->message, len);
 	}
-	/* should not be reached */
-	return -1;
+
+	line_putc(&l, '}');
+	line_putc(&l, '\n');
+
+	return l.truncated ? -1 : l.p - buf;
+}
+
+/* Precompute color and label prefixes of each level, and line suffix */
+void setup_text(struct ulogcat3_context *ctx)
+{
+	int i, klog;
+	const char *cstart;
+
+	for (klog = 0; klog < 2; klog++) {
+		for (i = 0; i < 8; i++) {
+			cstart = (ctx->flags & ULOGCAT_FLAG_COLOR) ?
+				ctx->ansi_color[i] : "";
+			snprintf(ctx->text_prefix[klog][i],
+				 sizeof(ctx->text_prefix[klog][i]), "%s%s",
+				 cstart,
+				 !(ctx->flags & ULOGCAT_FLAG_SHOW_LABEL) ? "" :
+				 klog ? "K " : "U ");
+			ctx->text_prefix_len[klog][i] =
+				strlen(ctx->text_prefix[klog][i]);
+		}
+	}
+
+	ctx->text_suffix_len = snprintf(ctx->text_suffix,
+					sizeof(ctx->text_suffix), "%s\n",
+					(ctx->flags & ULOGCAT_FLAG_COLOR) ?
+					ansinone : "");
+	ctx->text_time_len = 0;
 }
 
 int text_render_frame(struct ulogcat3_context *ctx, struct frame *frame,
@@ -256,6 +636,10 @@ int text_render_frame(struct ulogcat3_context *ctx, struct frame *frame,
 	size = ctx->render_size;
 
 	if (is_banner) {
+		/* banners are not entries, keep JSON output clean */
+		if (ctx->log_format == ULOGCAT_FORMAT_JSON)
+			return -1;
+
 		/* crude banner rendering */
 		count = snprintf((char *)ctx->render_buf, size,
 				 "---------------------------------------%s\n",
@@ -264,6 +648,18 @@ int text_render_frame(struct ulogcat3_context *ctx, struct frame *frame,
 		return (count < 0) ? -1 : 0;
 	}
 
+	/* process JSON format separately, event fields are optional */
+	if (ctx->log_format == ULOGCAT_FORMAT_JSON) {
+		count = print_log_line_json(ctx, frame,
+					    (char *)ctx->render_buf, size, 1);
+		if (count < 0)
+			count = print_log_line_json(ctx, frame,
+						    (char *)ctx->render_buf,
+						    size, 0);
+		ctx->render_len = count;
+		return (count < 0) ? -1 : 0;
+	}
+
 	/* process CSV format separately */
 	if (ctx->log_format == ULOGCAT_FORMAT_CSV) {
 		count = print_log_line_csv(frame, (char *)ctx->render_buf,
@@ -286,7 +682,7 @@ int text_render_frame(struct ulogcat3_context *ctx, struct frame *frame,
 		if (nl)
 			*nl = '\0';
 
-		count = print_log_line(frame, message, p, size);
+		count = print_log_line(ctx, frame, message, p, size);
 		if (count < 0)
 			break;
 
@@ -19,6 +19,94 @@
 
 #include "libulogcat_private.h"
 
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+/*
+ * Reader of a log mapped with mmap() (see struct ulogger_mmap_status): entries
+ * are copied directly from the ring buffer, and syscalls are only needed to
+ * wait for new entries once the reader has caught up with writers.
+ */
+struct ulog_mmap_reader {
+	const struct ulogger_mmap_status *st;
+	const uint8_t           *ring;
+	size_t                   map_size;
+	uint32_t                 size;
+	uint64_t                 pos;         /* next entry to read */
+	uint64_t                 dropped;     /* bytes lost, not yet reported */
+	int32_t                  sec;         /* timestamp of last entry */
+	int32_t                  nsec;
+	char                     name[32];
+};
+
+/*
+ * Entries returned by a single read() in bulk mode (see ULOGGER_SET_BULK_READ),
+ * handed out one at a time to frames.
+ *
+ * If the driver supports version 3 of the ABI, records are numbered entries
+ * without names, and names records; names of each thread slot are kept in
+ * 'names', and entries are turned back into version 2 entries for frames.
+ */
+#define ULOG_BULK_BUFSIZE (64*1024)
+
+struct ulog_names_slot {
+	int32_t                  pid;
+	int32_t                  tid;
+	size_t                   len;         /* names length, 0 if unknown */
+	char                    *names;       /* <pname>\0[<tname>\0] */
+};
+
+struct ulog_bulk_reader {
+	size_t                   len;         /* bytes read */
+	size_t                   off;         /* next entry */
+	struct ulog_names_slot  *names;       /* NULL unless ABI version 3 */
+	uint8_t                  buf[ULOG_BULK_BUFSIZE];
+};
+
+/*
+ * Format a deferred entry read from 'dev'; the text is stored in the frame
+ * buffer right after the raw entry, which is enlarged (and parsed again) if
+ * needed.
+ */
+static int ulog_format_deferred(struct log_device *dev, struct frame *frame,
+				int len)
+{
+	int ret;
+	uint8_t *buf;
+	char *text;
+	const size_t size = len + ULOG_BUF_SIZE;
+
+	if (frame->bufsize < size) {
+		buf = malloc(ULOGGER_ENTRY_MAX_LEN + ULOG_BUF_SIZE);
+		if (buf == NULL) {
+			INFO("malloc: %s\n", strerror(errno));
+			return -1;
+		}
+		memcpy(buf, frame->buf, len);
+		if (frame->buf != frame->data)
+			free(frame->buf);
+		frame->buf = buf;
+		frame->bufsize = ULOGGER_ENTRY_MAX_LEN + ULOG_BUF_SIZE;
+		if (ulog_parse_buf((struct ulogger_entry *)frame->buf,
+				   &frame->entry) < 0)
+			return -1;
+	}
+
+	/* same truncation as messages formatted by the writer */
+	text = (char *)frame->buf + len;
+	ret = ulog_deferred_format(&frame->entry, fmt_dict_lookup,
+				   dev->ctx, text, ULOG_BUF_SIZE);
+	if (ret == -ENOENT)
+		ret = snprintf(text, ULOG_BUF_SIZE, "<unknown format>");
+	if (ret < 0)
+		return -1;
+
+	frame->entry.message = text;
+	frame->entry.len = ret + 1;
+	frame->entry.is_binary = 0;
+	return 0;
+}
+
 /*
  * Read exactly one ulog entry.
  *
@@ -29,8 +117,6 @@
 static int ulog_receive_entry(struct log_device *dev, struct frame *frame)
 {
 	int ret;
-	struct ulogger_entry *raw;
-	const int header_sz = (int)sizeof(struct ulogger_entry);
 
 	/* read exactly one ulogger entry */
 	ret = read(dev->fd, frame->buf, frame->bufsize);
@@ -56,11 +142,497 @@ static int ulog_receive_entry(struct log_device *dev, struct frame *frame)
 		return -1;
 	}
 
+	return ulog_process_entry(dev, frame, ret);
+}
+
+static int ulog_bulk_store_names(struct ulog_bulk_reader *b,
+				 const struct ulogger_entry_v3 *hdr,
+				 const uint8_t *names)
+{
+	struct ulog_names_slot *slot;
+	char *p;
+
+	slot = &b->names[(uint32_t)hdr->tid % ULOGGER_NAMES_SLOTS];
+	if (hdr->len > slot->len) {
+		p = realloc(slot->names, hdr->len);
+		if (p == NULL) {
+			INFO("malloc: %s\n", strerror(errno));
+			return -1;
+		}
+		slot->names = p;
+	}
+
+	memcpy(slot->names, names, hdr->len);
+	slot->len = hdr->len;
+	slot->pid = hdr->pid;
+	slot->tid = hdr->tid;
+	return 0;
+}
+
+/*
+ * Rebuild a version 2 entry in the frame buffer from a version 3 entry and
+ * the names of its thread, if known. Returns the length of the entry.
+ */
+static size_t ulog_bulk_rebuild_entry(struct log_device *dev,
+				      struct frame *frame,
+				      const struct ulogger_entry_v3 *hdr,
+				      const uint8_t *payload)
+{
+	struct ulog_bulk_reader *b = dev->priv;
+	const struct ulog_names_slot *slot;
+	struct ulogger_entry entry;
+	const char *names = "\0";
+	size_t names_len;
+
+	slot = &b->names[(uint32_t)hdr->tid % ULOGGER_NAMES_SLOTS];
+	if (slot->len && slot->pid == hdr->pid && slot->tid == hdr->tid) {
+		names = slot->names;
+		names_len = slot->len;
+	} else {
+		/* empty names, not stored in the ring buffer */
+		names_len = (hdr->pid != hdr->tid) ? 2 : 1;
+		if ((hdr->pid != -1) || (hdr->tid != -1))
+			dev->mark_readable += (ssize_t)names_len;
+	}
+
+	entry.len = (uint16_t)(names_len + hdr->len);
+	entry.hdr_size = sizeof(entry);
+	entry.pid = hdr->pid;
+	entry.tid = hdr->tid;
+	entry.sec = hdr->sec;
+	entry.nsec = hdr->nsec;
+	entry.euid = 0;
+
+	memcpy(frame->buf, &entry, sizeof(entry));
+	memcpy(frame->buf + sizeof(entry), names, names_len);
+	memcpy(frame->buf + sizeof(entry) + names_len, payload, hdr->len);
+	frame->seq = hdr->seq;
+
+	return sizeof(entry) + entry.len;
+}
+
+/*
+ * Receive exactly one ulog entry from the buffer filled by read() in bulk
+ * mode, reading more entries if it is empty.
+ *
+ * Returns -1 if an error occured
+ *          0 if we received a signal and need to retry
+ *          1 if we successfully read one entry
+ */
+static int ulog_bulk_receive_entry(struct log_device *dev, struct frame *frame)
+{
+	struct ulog_bulk_reader *b = dev->priv;
+	struct ulogger_entry hdr;
+	struct ulogger_entry_v3 hdr3;
+	size_t len, hdrlen;
+	ssize_t ret;
+
+again:
+	if (b->off == b->len) {
+		ret = read(dev->fd, b->buf, sizeof(b->buf));
+		if (ret < 0) {
+			if ((errno == EINTR) || (errno == EAGAIN))
+				return 0;
+			INFO("read(%s): %s\n", dev->path, strerror(errno));
+			return -1;
+		} else if (ret == 0) {
+			INFO("read(%s): unexpected EOF\n", dev->path);
+			return -1;
+		}
+		b->len = (size_t)ret;
+		b->off = 0;
+	}
+
+	/* entries are packed, their headers may be unaligned */
+	hdrlen = b->names ? sizeof(hdr3) : sizeof(hdr);
+	len = hdrlen;
+	if (b->len - b->off >= hdrlen) {
+		if (b->names) {
+			memcpy(&hdr3, b->buf + b->off, sizeof(hdr3));
+			len += hdr3.len;
+		} else {
+			memcpy(&hdr, b->buf + b->off, sizeof(hdr));
+			len += hdr.len;
+		}
+	}
+	if (b->len - b->off < len) {
+		INFO("read(%s): unexpected length %zu\n", dev->path,
+		     b->len - b->off);
+		b->off = b->len;
+		dev->buffered = 0;
+		return -1;
+	}
+
+	if (b->names && hdr3.type == ULOGGER_RECORD_NAMES) {
+		if (ulog_bulk_store_names(b, &hdr3, b->buf + b->off + hdrlen))
+			return -1;
+		b->off += len;
+		goto again;
+	}
+
+	/* a rebuilt entry is at most as large as the one in the ring buffer */
+	if (b->names)
+		len = ULOGGER_ENTRY_MAX_LEN;
+
+	if (len > frame->bufsize && frame->buf == frame->data) {
+		/* regular frame buffer is too small */
+		frame->buf = malloc(ULOGGER_ENTRY_MAX_LEN);
+		if (frame->buf == NULL) {
+			INFO("malloc: %s\n", strerror(errno));
+			frame->buf = frame->data;
+			return -1;
+		}
+		frame->bufsize = ULOGGER_ENTRY_MAX_LEN;
+	}
+
+	if (b->names) {
+		len = ulog_bulk_rebuild_entry(dev, frame, &hdr3,
+					      b->buf + b->off + hdrlen);
+		b->off += hdrlen + hdr3.len;
+	} else {
+		memcpy(frame->buf, b->buf + b->off, len);
+		b->off += len;
+	}
+	dev->buffered = (b->off < b->len);
+
+	return ulog_process_entry(dev, frame, (int)len);
+}
+
+static void ulog_bulk_destroy(struct log_device *dev)
+{
+	struct ulog_bulk_reader *b = dev->priv;
+	int i;
+
+	if (b->names) {
+		for (i = 0; i < ULOGGER_NAMES_SLOTS; i++)
+			free(b->names[i].names);
+		free(b->names);
+	}
+	free(b);
+	dev->priv = NULL;
+}
+
+/*
+ * Let read() return as many entries as fit in a large buffer, if the driver
+ * supports it, and number entries if it supports version 3 of the ABI.
+ *
+ * Returns -1 if bulk reads are not supported, 0 otherwise.
+ */
+static int ulog_bulk_setup(struct log_device *dev)
+{
+	struct ulog_bulk_reader *b;
+	int mode = 1, version = 3;
+
+	if (ioctl(dev->fd, ULOGGER_SET_BULK_READ, &mode) < 0)
+		return -1;
+
+	b = calloc(1, sizeof(*b));
+	if (b == NULL) {
+		mode = 0;
+		(void)ioctl(dev->fd, ULOGGER_SET_BULK_READ, &mode);
+		return -1;
+	}
+
+	/* older drivers and per-CPU logs only support version 2 */
+	b->names = calloc(ULOGGER_NAMES_SLOTS, sizeof(*b->names));
+	if (b->names && ioctl(dev->fd, ULOGGER_SET_VERSION, &version) < 0) {
+		free(b->names);
+		b->names = NULL;
+	}
+
+	dev->priv = b;
+	dev->destroy = ulog_bulk_destroy;
+	dev->receive_entry = ulog_bulk_receive_entry;
+	return 0;
+}
+
+static void ulog_mmap_copy_out(const struct ulog_mmap_reader *r, uint64_t pos,
+			      void *dst, size_t len)
+{
+	uint32_t off = (uint32_t)pos & (r->size - 1);
+	size_t n = r->size - off;
+
+	if (n >= len) {
+		memcpy(dst, r->ring + off, len);
+	} else {
+		memcpy(dst, r->ring + off, n);
+		memcpy((uint8_t *)dst + n, r->ring, len - n);
+	}
+}
+
+/* has the data at 'pos' been overwritten, or is it being overwritten ? */
+static int ulog_mmap_lapped(const struct ulog_mmap_reader *r, uint64_t pos)
+{
+	return __atomic_load_n(&r->st->w_next, __ATOMIC_RELAXED) - pos >
+		r->size;
+}
+
+/* build a fake entry indicating how much data was lost */
+static int ulog_mmap_read_drop_summary(struct log_device *dev,
+				       struct frame *frame)
+{
+	struct ulog_mmap_reader *r = dev->priv;
+	struct ulogger_entry *raw = (struct ulogger_entry *)frame->buf;
+	int ret;
+
+	ret = snprintf(raw->msg, frame->bufsize - sizeof(*raw),
+		       /* <pname>\0<priority:4><tag>\0<message> */
+		       "%c%c%c%c%c%s%c%llu bytes of log entries dropped\n",
+		       '\0', /* empty pname, no thread (pid=tid) */
+		       ULOG_WARN, 0, 0, 0, r->name, '\0',
+		       (unsigned long long)r->dropped);
+	if (ret < 0 || ret >= (int)(frame->bufsize - sizeof(*raw)))
+		return -1;
+
+	raw->len = ret + 1;
+	raw->hdr_size = sizeof(*raw);
+	raw->pid = -1;
+	raw->tid = -1;
+	raw->sec = r->sec;
+	raw->nsec = r->nsec;
+	raw->euid = 0;
+	r->dropped = 0;
+
+	return ulog_process_entry(dev, frame, sizeof(*raw) + raw->len);
+}
+
+/*
+ * Read exactly one ulog entry from the mapped ring buffer.
+ *
+ * Returns -1 if an error occured
+ *          0 if there is no entry to read
+ *          1 if we successfully read one entry
+ */
+static int ulog_mmap_receive_entry(struct log_device *dev, struct frame *frame)
+{
+	struct ulog_mmap_reader *r = dev->priv;
+	struct ulogger_entry hdr;
+	uint64_t head, w_pos;
+	size_t len;
+	int ret;
+
+	for (;;) {
+		w_pos = __atomic_load_n(&r->st->w_pos, __ATOMIC_ACQUIRE);
+		head = __atomic_load_n(&r->st->head, __ATOMIC_RELAXED);
+
+		if (ulog_mmap_lapped(r, r->pos)) {
+			/* wait for the writer lapping us to publish the head */
+			if (head <= r->pos)
+				continue;
+			/* lapped by writers, skip overwritten entries */
+			r->dropped += head - r->pos;
+			dev->mark_readable -= (ssize_t)(head - r->pos);
+			r->pos = head;
+			continue;
+		} else if (r->pos < head) {
+			/* log was flushed */
+			dev->mark_readable -= (ssize_t)(head - r->pos);
+			r->pos = head;
+		}
+
+		if (r->dropped)
+			return ulog_mmap_read_drop_summary(dev, frame);
+
+		if (r->pos >= w_pos) {
+			/* caught up: let poll() wait for newer entries */
+			if (ioctl(dev->fd, ULOGGER_SET_READ_POS, &r->pos) < 0) {
+				INFO("ioctl(%s, ULOGGER_SET_READ_POS): %s\n",
+				     dev->path, strerror(errno));
+				return -1;
+			}
+			return 0;
+		}
+
+		ulog_mmap_copy_out(r, r->pos, &hdr, sizeof(hdr));
+		len = sizeof(hdr) + hdr.len;
+		if (hdr.hdr_size != sizeof(hdr) ||
+		    hdr.len > ULOGGER_ENTRY_MAX_PAYLOAD ||
+		    r->pos + len > w_pos) {
+			/* header may have been overwritten, check again */
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (ulog_mmap_lapped(r, r->pos))
+				continue;
+			INFO("%s: corrupted entry\n", dev->path);
+			return -1;
+		}
+
+		if (len > frame->bufsize && frame->buf == frame->data) {
+			/* regular frame buffer is too small */
+			frame->buf = malloc(ULOGGER_ENTRY_MAX_LEN);
+			if (frame->buf == NULL) {
+				INFO("malloc: %s\n", strerror(errno));
+				frame->buf = frame->data;
+				return -1;
+			}
+			frame->bufsize = ULOGGER_ENTRY_MAX_LEN;
+		}
+
+		ulog_mmap_copy_out(r, r->pos, frame->buf, len);
+
+		/* make sure the entry was not overwritten while copying */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (ulog_mmap_lapped(r, r->pos))
+			continue;
+
+		r->pos += len;
+		r->sec = hdr.sec;
+		r->nsec = hdr.nsec;
+
+		/* a corrupted entry is not a reason to stop reading */
+		ret = ulog_process_entry(dev, frame, (int)len);
+		return (ret < 0) ? 0 : ret;
+	}
+}
+
+static void ulog_mmap_destroy(struct log_device *dev)
+{
+	struct ulog_mmap_reader *r = dev->priv;
+
+	if (r == NULL)
+		return;
+
+	if (r->st)
+		munmap((void *)r->st, r->map_size);
+	free(r);
+	dev->priv = NULL;
+}
+
+/*
+ * Map the log of 'dev' if the driver allows it, and read entries from the
+ * mapping instead of using one read() call per entry.
+ *
+ * Returns -1 if the log cannot be mapped, 0 otherwise.
+ */
+static int ulog_mmap_setup(struct log_device *dev, const char *name)
+{
+	struct ulog_mmap_reader *r;
+	long page_size = sysconf(_SC_PAGESIZE);
+	int size;
+	void *addr;
+	uint64_t head, w_pos;
+
+	/* older drivers do not support mmap() */
+	size = ioctl(dev->fd, ULOGGER_GET_LOG_BUF_SIZE);
+	if (size <= 0 || page_size <= 0)
+		return -1;
+
+	addr = mmap(NULL, page_size + size, PROT_READ, MAP_SHARED, dev->fd, 0);
+	if (addr == MAP_FAILED) {
+		DEBUG("mmap(%s): %s\n", dev->path, strerror(errno));
+		return -1;
+	}
+
+	r = calloc(1, sizeof(*r));
+	if (r == NULL) {
+		munmap(addr, page_size + size);
+		return -1;
+	}
+
+	r->st = addr;
+	r->map_size = page_size + size;
+	if (r->st->size != (uint32_t)size ||
+	    r->st->offset != (uint32_t)page_size) {
+		INFO("%s: unexpected mapping layout\n", dev->path);
+		munmap(addr, r->map_size);
+		free(r);
+		return -1;
+	}
+	r->ring = (const uint8_t *)addr + r->st->offset;
+	r->size = r->st->size;
+	snprintf(r->name, sizeof(r->name), "%s", name);
+
+	/* start with the oldest entry, like read() does */
+	head = __atomic_load_n(&r->st->head, __ATOMIC_ACQUIRE);
+	w_pos = __atomic_load_n(&r->st->w_pos, __ATOMIC_ACQUIRE);
+	if (head > w_pos)
+		head = w_pos;
+	r->pos = head;
+
+	dev->priv = r;
+	dev->destroy = ulog_mmap_destroy;
+	dev->receive_entry = ulog_mmap_receive_entry;
+	dev->mark_readable = (ssize_t)(w_pos - head);
+	return 0;
+}
+
+/*
+ * Move the reader of 'dev' to the entry numbered 'seq'. Entries need to be
+ * read with read() to be numbered, a mapped log is unmapped first.
+ *
+ * Returns -1 if the driver does not number entries or cannot seek, 0 otherwise.
+ */
+static int ulog_seek(struct log_device *dev, uint64_t seq)
+{
+	struct ulog_bulk_reader *b;
+
+	if (dev->receive_entry == ulog_mmap_receive_entry) {
+		ulog_mmap_destroy(dev);
+		dev->destroy = NULL;
+		dev->receive_entry = ulog_receive_entry;
+		(void)ulog_bulk_setup(dev);
+		dev->mark_readable = (ssize_t)ioctl(dev->fd,
+						    ULOGGER_GET_LOG_LEN);
+		if (dev->mark_readable < 0)
+			return -1;
+	}
+
+	b = (dev->receive_entry == ulog_bulk_receive_entry) ? dev->priv : NULL;
+	if (b == NULL || b->names == NULL)
+		return -1;
+
+	if (ioctl(dev->fd, ULOGGER_SET_READ_SEQ, &seq) < 0) {
+		DEBUG("ioctl(%s, ULOGGER_SET_READ_SEQ): %s\n", dev->path,
+		      strerror(errno));
+		return -1;
+	}
+
+	/* forget entries read from the previous position */
+	b->off = b->len = 0;
+	dev->buffered = 0;
+	dev->mark_readable = (ssize_t)ioctl(dev->fd, ULOGGER_GET_LOG_LEN);
+	return (dev->mark_readable < 0) ? -1 : 0;
+}
+
+/*
+ * Only wake up poll() on 'dev' when 'bytes' bytes are readable, or
+ * 'latency_ms' milliseconds after entries became pending.
+ *
+ * Returns -1 if the driver does not support it, 0 otherwise.
+ */
+static int ulog_set_watermark(struct log_device *dev, unsigned int bytes,
+			      unsigned int latency_ms)
+{
+	struct ulogger_watermark wm = {
+		.bytes = bytes,
+		.latency_ms = latency_ms,
+	};
+
+	if (ioctl(dev->fd, ULOGGER_SET_WATERMARK, &wm) < 0) {
+		DEBUG("ioctl(%s, ULOGGER_SET_WATERMARK): %s\n", dev->path,
+		      strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Process one raw entry of 'len' bytes stored in the frame buffer.
+ *
+ * Returns -1 if the entry is invalid
+ *          0 if the entry should not be displayed
+ *          1 if the entry is ready for output
+ */
+int ulog_process_entry(struct log_device *dev, struct frame *frame, int len)
+{
+	int ret;
+	struct ulogger_entry *raw;
+	const int header_sz = (int)sizeof(struct ulogger_entry);
+
 	/* sanity check */
 	raw = (struct ulogger_entry *)frame->buf;
-	if (raw->len != ret-header_sz) {
+	if (raw->len != len-header_sz) {
 		INFO("read(%s): unexpected length %d\n",
-		     dev->path, ret-header_sz);
+		     dev->path, len-header_sz);
 		return -1;
 	}
 
@@ -75,17 +647,28 @@ static int ulog_receive_entry(struct log_device *dev, struct frame *frame)
 		return -1;
 	}
 
+	/* render messages whose formatting was deferred by the writer */
+	if (ulog_entry_is_deferred(&frame->entry)) {
+		if (ulog_format_deferred(dev, frame, len) < 0) {
+			DEBUG("ulog: dropping invalid deferred message\n");
+			return -1;
+		}
+		raw = (struct ulogger_entry *)frame->buf;
+	}
+
 	/* compute timestamp */
 	frame->stamp = raw->sec*1000000ULL + raw->nsec/1000ULL;
 	/* attach frame to device */
 	frame->dev = dev;
 	/* decrement read size except for special "dropped entries" messages */
 	if ((raw->pid != -1) || (raw->tid != -1))
-		dev->mark_readable -= ret;
+		dev->mark_readable -= len;
 
 	/* peek into data to drop non-displayable entries */
 	if (frame->entry.is_binary &&
-	    (dev->ctx->log_format != ULOGCAT_FORMAT_CSV))
+	    (dev->ctx->log_format != ULOGCAT_FORMAT_CSV) &&
+	    (dev->ctx->log_format != ULOGCAT_FORMAT_JSON) &&
+	    (dev->ctx->log_format != ULOGCAT_FORMAT_BINARY))
 		return 0;
 
 	return 1;
@@ -128,6 +711,14 @@ int add_ulog_device(struct ulogcat3_context *ctx, const char *name)
 {
 	struct log_device *dev = NULL;
 
+	/* shared memory buffers (see ULOG_SHM) */
+	if (strncmp(name, SHM_DEVICE_PREFIX, strlen(SHM_DEVICE_PREFIX)) == 0)
+		return add_shm_device(ctx, name + strlen(SHM_DEVICE_PREFIX));
+
+	/* capture files (see ULOGCAT_FORMAT_BINARY) */
+	if (strncmp(name, FILE_DEVICE_PREFIX, strlen(FILE_DEVICE_PREFIX)) == 0)
+		return add_file_device(ctx, name + strlen(FILE_DEVICE_PREFIX));
+
 	dev = log_device_create(ctx);
 	if (dev == NULL)
 		goto fail;
@@ -143,6 +734,8 @@ int add_ulog_device(struct ulogcat3_context *ctx, const char *name)
 	dev->receive_entry = ulog_receive_entry;
 	dev->parse_entry = ulog_parse_entry;
 	dev->clear_buffer = ulog_clear_buffer;
+	dev->seek = ulog_seek;
+	dev->set_watermark = ulog_set_watermark;
 	dev->label = 'U';
 	ctx->ulog_device_count++;
 
@@ -154,6 +747,13 @@ int add_ulog_device(struct ulogcat3_context *ctx, const char *name)
 		ctx->ulog_device_count--;
 	}
 
+	/* read entries in place if possible */
+	if (ulog_mmap_setup(dev, name) == 0)
+		return 0;
+
+	/* otherwise, read several entries per read() call */
+	(void)ulog_bulk_setup(dev);
+
 	/* get amount of data already present in buffer */
 	dev->mark_readable = (ssize_t)ioctl(dev->fd, ULOGGER_GET_LOG_LEN);
 	if (dev->mark_readable < 0) {
@@ -174,7 +774,12 @@ int add_all_ulog_devices(struct ulogcat3_context *ctx)
 	FILE *fp;
 	char *p, buf[32];
 	const char *name;
-	int ret = 0;
+	int ret = 0, shm_count;
+
+	/* shared memory buffers are only used if they exist */
+	shm_count = add_all_shm_devices(ctx);
+	if (shm_count < 0)
+		return -1;
 
 	/* retrieve list of dynamically created log devices */
 	fp = fopen("/sys/devices/virtual/misc/ulog_main/logs", "r");
@@ -194,7 +799,7 @@ int add_all_ulog_devices(struct ulogcat3_context *ctx)
 			}
 		}
 		fclose(fp);
-	} else {
+	} else if (!shm_count || access("/dev/" ULOGGER_LOG_MAIN, F_OK) == 0) {
 		/* backward compatibility if attribute file is not present */
 		ret = add_ulog_device(ctx, &ULOGGER_LOG_MAIN[5]);
 	}
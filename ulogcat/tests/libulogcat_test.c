@@ -34,10 +34,16 @@
 #include <assert.h>
 #include <stdarg.h>
 #include <sys/klog.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <pthread.h>
 
 #include <libulogcat.h>
+#include <ulogprint.h>
 
 #define ULOG_TAG libulogcat_test
+#define ULOG_FMT_REGISTRY
 #include <ulog.h>
 ULOG_DECLARE_TAG(libulogcat_test);
 
@@ -53,6 +59,14 @@ ULOG_DECLARE_TAG(libulogcat_test);
 #define LOG_MASK (ULOGCAT_FLAG_ULOG|ULOGCAT_FLAG_KLOG)
 
 #define TMP_FILENAME "/tmp/libulogcat-test"
+#define CAPTURE_FILENAME "/tmp/libulogcat-test.bin"
+#define ARCHIVE_DIRNAME "/tmp/libulogcat-test.d"
+#define ARCHIVE_SEGMENT ARCHIVE_DIRNAME "/test-00000000.ulc"
+#define CURSOR_FILENAME "/tmp/libulogcat-test.cursor"
+#define DICT_FILENAME "/tmp/libulogcat-test.dict"
+
+#define DEFERRED_FMT "Deferred %s #%d 0x%lx %hhd %5.1f%% %.*s %.3s"
+#define DEFERRED_MSG "Deferred hello #42 0xbeef 44  99.5% world abc"
 
 #define KMSGD_WAIT_US 10000
 
@@ -316,6 +330,7 @@ static void test_all_formats(unsigned int flags)
 	run_format(flags, ULOGCAT_FORMAT_PROCESS, 0);
 	run_format(flags, ULOGCAT_FORMAT_LONG, 0);
 	run_format(flags, ULOGCAT_FORMAT_CSV, 0);
+	run_format(flags, ULOGCAT_FORMAT_JSON, 0);
 }
 
 static void test_format(void)
@@ -382,6 +397,7 @@ static void test_lines(void)
 {
 	run_lines(ULOGCAT_FLAG_ULOG, 1000);
 	run_lines(ULOGCAT_FLAG_ULOG|ULOGCAT_FLAG_KLOG, 1000);
+	run_lines(ULOGCAT_FLAG_ULOG|ULOGCAT_FLAG_PIPELINE, 1000);
 }
 
 static void run_tail(unsigned int flags, int tail, int lines)
@@ -429,10 +445,594 @@ static void test_tail(void)
 	run_tail(ULOGCAT_FLAG_ULOG, 100, 10);
 	run_tail(ULOGCAT_FLAG_ULOG, 10, 100);
 	run_tail(ULOGCAT_FLAG_ULOG, 1000, 1000);
+	run_tail(ULOGCAT_FLAG_ULOG|ULOGCAT_FLAG_PIPELINE, 10, 100);
+}
+
+static void run_filter(const char *filter, int expected_lines)
+{
+	int ret, count;
+	struct ulogcat_opts_v3 opts;
+	struct ulogcat3_context *ctx;
+
+	TRACE("filter = '%s' expected_lines=%d", filter, expected_lines);
+
+	memset(&opts, 0, sizeof(opts));
+	clean_tmp_file();
+	opts.opt_output_fd = open_tmp_file();
+	opts.opt_flags = ULOGCAT_FLAG_DUMP|ULOGCAT_FLAG_ULOG;
+	opts.opt_format = ULOGCAT_FORMAT_LONG;
+
+	ctx = ulogcat3_open(&opts, NULL, 0);
+	assert(ctx);
+
+	ret = ulogcat3_set_filter(ctx, filter);
+	assert(ret == 0);
+
+	ret = ulogcat3_process_logs(ctx, 0);
+	assert(ret == 0);
+
+	ulogcat3_close(ctx);
+
+	count = count_lines_tmp_file();
+	TRACE("tmp file has %d lines\n", count);
+	assert(count == expected_lines);
+
+	clean_tmp_file();
+}
+
+static void test_filter(void)
+{
+	int i;
+	char filter[64];
+	struct ulogcat_opts_v3 opts;
+	struct ulogcat3_context *ctx;
+
+	clear(ULOGCAT_FLAG_ULOG);
+	ULOG_SET_LEVEL(ULOG_DEBUG);
+
+	for (i = 0; i < 10; i++) {
+		ULOGI("Hello from %s #%d", __func__, i);
+		ULOGD("Debug from %s #%d", __func__, i);
+	}
+
+	run_filter("", 20);
+	run_filter("libulogcat_test:I *:S", 10);
+	run_filter("*:S", 0);
+	run_filter("msg=#[0-4]$", 10);
+	run_filter("msg=^Debug msg=#9$", 11);
+	run_filter("libulogcat_test:D msg=^Debug", 10);
+	run_filter("pid=0", 0);
+	snprintf(filter, sizeof(filter), "pid=%d *:I", getpid());
+	run_filter(filter, 10);
+	run_filter("since=1000000000", 0);
+
+	/* invalid expressions */
+	memset(&opts, 0, sizeof(opts));
+	opts.opt_output_fd = -1;
+	opts.opt_flags = ULOGCAT_FLAG_DUMP|ULOGCAT_FLAG_ULOG;
+	ctx = ulogcat3_open(&opts, NULL, 0);
+	assert(ctx);
+	assert(ulogcat3_set_filter(ctx, "foo:X") == -EINVAL);
+	assert(ulogcat3_set_filter(ctx, "pid=abc") == -EINVAL);
+	assert(ulogcat3_set_filter(ctx, "msg=(") == -EINVAL);
+	assert(ulogcat3_set_filter(ctx, "bar=1") == -EINVAL);
+	ulogcat3_close(ctx);
+}
+
+static void test_json(void)
+{
+	struct ulogcat_opts_v3 opts;
+
+	clear(ULOGCAT_FLAG_ULOG);
+
+	ULOGI("Hello \"json\"\tfrom %s", __func__);
+	ULOG_EVT("TEST_JSON", "count=%d;name='a;b';ok=%s", 42, "yes");
+
+	memset(&opts, 0, sizeof(opts));
+	clean_tmp_file();
+	opts.opt_output_fd = open_tmp_file();
+	opts.opt_flags = ULOGCAT_FLAG_DUMP|ULOGCAT_FLAG_ULOG;
+	opts.opt_format = ULOGCAT_FORMAT_JSON;
+	run(&opts);
+	close(opts.opt_output_fd);
+
+	assert(count_lines_tmp_file() == 2);
+	assert(grep_tmp_file("\"tag\":\"libulogcat_test\"", 0) == 2);
+	assert(grep_tmp_file("\"msg\":\"Hello \\\"json\\\"\\tfrom "
+			     "test_json\"}", 0) == 1);
+	assert(grep_tmp_file("\"evt\":{\"type\":\"TEST_JSON\",\"params\":"
+			     "{\"count\":42,\"name\":\"a;b\",\"ok\":\"yes\"}}",
+			     0) == 1);
+
+	clean_tmp_file();
+}
+
+static void *v3_thread(void *arg)
+{
+	pthread_setname_np(pthread_self(), "v3-thread");
+	ULOGI("Hello from %s #1", __func__);
+	ULOGI("Hello from %s #2", __func__);
+	return NULL;
+}
+
+static void test_version3(void)
+{
+	int fd, ret, version = 3, names = 0, entries = 0;
+	unsigned long long seq = 0;
+	struct ulogcat_opts_v3 opts;
+	struct ulogger_entry_v3 hdr;
+	struct ulog_entry entry;
+	pthread_t thread;
+	union {
+		struct ulogger_entry entry;
+		char buf[ULOGGER_ENTRY_MAX_LEN + 1];
+	} u;
+
+	clear(ULOGCAT_FLAG_ULOG);
+
+	ULOGI("Hello from %s #1", __func__);
+	ret = pthread_create(&thread, NULL, v3_thread, NULL);
+	assert(ret == 0);
+	pthread_join(thread, NULL);
+	ULOGI("Hello from %s #2", __func__);
+
+	/* names are sent once per thread, before numbered entries */
+	fd = open("/dev/ulog_main", O_RDONLY|O_NONBLOCK);
+	assert(fd >= 0);
+	ret = ioctl(fd, ULOGGER_SET_VERSION, &version);
+	assert(ret == 0);
+
+	while ((ret = read(fd, u.buf, sizeof(u.buf) - 1)) > 0) {
+		memcpy(&hdr, u.buf, sizeof(hdr));
+		assert(hdr.hdr_size == sizeof(hdr));
+		assert((size_t)ret == sizeof(hdr) + hdr.len);
+		assert(seq == 0 || hdr.seq == seq + 1);
+		ret = ulog_parse_buf(&u.entry, &entry);
+		if (hdr.type == ULOGGER_RECORD_NAMES) {
+			assert(ret == 1);
+			assert((hdr.pid == hdr.tid) ||
+			       (strcmp(entry.tname, "v3-thread") == 0));
+			seq = hdr.seq - 1;
+			names++;
+		} else {
+			assert(ret == 0);
+			assert(strncmp(entry.message, "Hello from ", 11) == 0);
+			seq = hdr.seq;
+			entries++;
+		}
+	}
+	assert(ret < 0 && errno == EAGAIN);
+	close(fd);
+	assert(names == 2);
+	assert(entries == 4);
+
+	/* libulogcat rebuilds names of entries read without mmap() */
+	setenv("ULOGGER_EMU_NO_MMAP", "1", 1);
+	memset(&opts, 0, sizeof(opts));
+	clean_tmp_file();
+	opts.opt_output_fd = open_tmp_file();
+	opts.opt_flags = ULOGCAT_FLAG_DUMP|ULOGCAT_FLAG_ULOG;
+	opts.opt_format = ULOGCAT_FORMAT_JSON;
+	run(&opts);
+	close(opts.opt_output_fd);
+	unsetenv("ULOGGER_EMU_NO_MMAP");
+
+	assert(count_lines_tmp_file() == 4);
+	assert(grep_tmp_file("\"tname\":\"v3-thread\"", 0) == 2);
+	assert(grep_tmp_file("\"msg\":\"Hello from v3_thread #", 0) == 2);
+	assert(grep_tmp_file("\"msg\":\"Hello from test_version3 #", 0)
+	       == 2);
+
+	clean_tmp_file();
+}
+
+/* entry logged by a child process, see main() */
+static int log_deferred(void)
+{
+	long pagesize = sysconf(_SC_PAGESIZE);
+	char *page, *str;
+	int ret;
+
+	/* strings without null terminator, right before a guard page */
+	page = mmap(NULL, 2*pagesize, PROT_READ|PROT_WRITE,
+		    MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	assert(page != MAP_FAILED);
+	ret = mprotect(page + pagesize, pagesize, PROT_NONE);
+	assert(ret == 0);
+	str = page + pagesize - 8;
+	memcpy(str, "worldabc", 8);
+
+	ULOGI(DEFERRED_FMT, "hello", 42, 0xbeefUL, 300, 99.5, 5, str,
+	      str + 5);
+	munmap(page, 2*pagesize);
+	return 0;
+}
+
+static void run_deferred(const char *mode, const char *dict)
+{
+	int fd, ret, status, deferred = 0;
+	pid_t pid;
+	struct ulogcat_opts_v3 opts;
+	struct ulogcat3_context *ctx;
+	struct ulog_entry entry;
+	union {
+		struct ulogger_entry entry;
+		char buf[ULOGGER_ENTRY_MAX_LEN + 1];
+	} u;
+
+	TRACE("ULOG_DEFERRED=%s dict=%s", mode, dict ? dict : "none");
+	clear(ULOGCAT_FLAG_ULOG);
+
+	/* deferred formatting is set up when a process first logs */
+	pid = fork();
+	assert(pid >= 0);
+	if (pid == 0) {
+		setenv("ULOG_DEFERRED", mode, 1);
+		execl("/proc/self/exe", "libulogcat_test", "deferred",
+		      (char *)NULL);
+		_exit(1);
+	}
+	ret = waitpid(pid, &status, 0);
+	assert(ret == pid);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	/* the entry holds the arguments, not the message */
+	fd = open("/dev/ulog_main", O_RDONLY|O_NONBLOCK);
+	assert(fd >= 0);
+	while ((ret = read(fd, u.buf, sizeof(u.buf) - 1)) > 0) {
+		ret = ulog_parse_buf(&u.entry, &entry);
+		assert(ret == 0);
+		if (ulog_entry_is_deferred(&entry))
+			deferred++;
+	}
+	close(fd);
+	assert(deferred == 1);
+
+	memset(&opts, 0, sizeof(opts));
+	clean_tmp_file();
+	opts.opt_output_fd = open_tmp_file();
+	opts.opt_flags = ULOGCAT_FLAG_DUMP|ULOGCAT_FLAG_ULOG;
+
+	ctx = ulogcat3_open(&opts, NULL, 0);
+	assert(ctx);
+	if (dict) {
+		ret = ulogcat3_load_fmt_dict(ctx, dict);
+		assert(ret == 0);
+	}
+	ret = ulogcat3_process_logs(ctx, 0);
+	assert(ret == 0);
+	ulogcat3_close(ctx);
+	close(opts.opt_output_fd);
+
+	assert(count_lines_tmp_file() == 1);
+	assert(grep_tmp_file(DEFERRED_MSG, 0) == 1);
+
+	clean_tmp_file();
+}
+
+static void test_deferred(void)
+{
+	FILE *fp;
+
+	run_deferred("y", NULL);
+
+	/* a dictionary as generated by ulogfmt */
+	fp = fopen(DICT_FILENAME, "w");
+	assert(fp);
+	fprintf(fp, "# ulog format string dictionary\n");
+	fprintf(fp, "%08x\t%d\tlibulogcat_test\t%s\t%s\n",
+		ulog_fmt_id(DEFERRED_FMT), ULOG_INFO, __FILE__,
+		DEFERRED_FMT);
+	fclose(fp);
+
+	run_deferred("id", DICT_FILENAME);
+
+	unlink(DICT_FILENAME);
+}
+
+static void run_cursor(int expected_lines)
+{
+	int ret;
+	struct ulogcat_opts_v3 opts;
+	struct ulogcat3_context *ctx;
+
+	memset(&opts, 0, sizeof(opts));
+	clean_tmp_file();
+	opts.opt_output_fd = open_tmp_file();
+	opts.opt_flags = ULOGCAT_FLAG_DUMP|ULOGCAT_FLAG_ULOG;
+
+	ctx = ulogcat3_open(&opts, NULL, 0);
+	assert(ctx);
+	ret = ulogcat3_set_cursor(ctx, CURSOR_FILENAME);
+	assert(ret == 0);
+	ret = ulogcat3_process_logs(ctx, 0);
+	assert(ret == 0);
+	ulogcat3_close(ctx);
+
+	TRACE("tmp file has %d lines", count_lines_tmp_file());
+	assert(count_lines_tmp_file() == expected_lines);
+}
+
+static void test_cursor(void)
+{
+	int i;
+
+	clear(ULOGCAT_FLAG_ULOG);
+	unlink(CURSOR_FILENAME);
+
+	for (i = 0; i < 10; i++)
+		ULOGI("Hello from %s #%d", __func__, i);
+	run_cursor(10);
+
+	/* only new entries are output again */
+	for (i = 10; i < 15; i++)
+		ULOGI("Hello from %s #%d", __func__, i);
+	run_cursor(5);
+	assert(grep_tmp_file("test_cursor #9", 0) == 0);
+	assert(grep_tmp_file("test_cursor #10", 0) == 1);
+	assert(grep_tmp_file("test_cursor #14", 0) == 1);
+
+	run_cursor(0);
+
+	clean_tmp_file();
+	unlink(CURSOR_FILENAME);
+}
+
+static void test_watermark(void)
+{
+	int i, fd, ret;
+	char buf[ULOGGER_ENTRY_MAX_LEN];
+	struct pollfd pfd;
+	struct timespec start, end;
+	struct ulogger_watermark wm = {
+		.bytes = 4096,
+		.latency_ms = 200,
+	};
+	struct ulogcat_opts_v3 opts;
+	struct ulogcat3_context *ctx;
+
+	clear(ULOGCAT_FLAG_ULOG);
+
+	fd = open("/dev/ulog_main", O_RDONLY|O_NONBLOCK);
+	assert(fd >= 0);
+	ret = ioctl(fd, ULOGGER_SET_WATERMARK, &wm);
+	assert(ret == 0);
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	/* poll() only reports the reader once enough bytes are readable */
+	for (i = 0; i < 1000; i++) {
+		ULOGI("Hello from %s #%d", __func__, i);
+		ret = poll(&pfd, 1, 0);
+		assert(ret >= 0);
+		if (ret)
+			break;
+	}
+	TRACE("ready after %d entries", i + 1);
+	assert((i > 0) && (i < 1000));
+
+	/* non-blocking reads get any entry */
+	while ((ret = read(fd, buf, sizeof(buf))) > 0)
+		;
+	assert(ret < 0 && errno == EAGAIN);
+
+	/* ... or once the latency has passed */
+	ULOGI("Hello from %s", __func__);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ret = poll(&pfd, 1, 5000);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	assert(ret == 1);
+	assert((end.tv_sec - start.tv_sec)*1000 +
+	       (end.tv_nsec - start.tv_nsec)/1000000 >= 150);
+	close(fd);
+
+	/* dumps end when no device is readable */
+	memset(&opts, 0, sizeof(opts));
+	opts.opt_output_fd = -1;
+	opts.opt_flags = ULOGCAT_FLAG_DUMP|ULOGCAT_FLAG_ULOG;
+	ctx = ulogcat3_open(&opts, NULL, 0);
+	assert(ctx);
+	ret = ulogcat3_set_watermark(ctx, 4096, 200);
+	assert(ret == -EINVAL);
+	ulogcat3_close(ctx);
+}
+
+/* write an entry with priority 'prio' to log device 'fd' */
+static void write_prio(int fd, uint32_t prio, const char *fmt, ...)
+{
+	static const char tag[] = "libulogcat_test";
+	va_list ap;
+	char buf[128];
+	size_t len;
+	int ret;
+
+	/* <priority:4><tag>\0<message>\0 */
+	memcpy(buf, &prio, sizeof(prio));
+	memcpy(buf + sizeof(prio), tag, sizeof(tag));
+	len = sizeof(prio) + sizeof(tag);
+	va_start(ap, fmt);
+	len += vsnprintf(buf + len, sizeof(buf) - len, fmt, ap);
+	va_end(ap);
+
+	ret = write(fd, buf, len + 1);
+	assert(ret == (int)len + 1);
+}
+
+static void test_keep(void)
+{
+	int i, fd, ret;
+	const char *devices[] = { "keep" };
+	struct ulogcat_opts_v3 opts;
+	struct ulogcat3_context *ctx;
+
+	/* a small log with a keep ring (option 'keep' of the kernel driver) */
+	setenv("ULOGGER_EMU_KEEP", "1", 1);
+	setenv("ULOGGER_EMU_SIZE", "14", 1);
+	fd = open("/dev/ulog_keep", O_RDWR);
+	unsetenv("ULOGGER_EMU_KEEP");
+	unsetenv("ULOGGER_EMU_SIZE");
+	if (fd < 0) {
+		TRACE("skipped, no /dev/ulog_keep");
+		return;
+	}
+
+	ret = ioctl(fd, ULOGGER_FLUSH_LOG);
+	assert(ret == 0);
+
+	/* flood the log around an error */
+	for (i = 0; i < 10; i++)
+		write_prio(fd, ULOG_DEBUG, "Hello from %s #%d", __func__, i);
+	write_prio(fd, ULOG_ERR, "Error from %s", __func__);
+	for (i = 10; i < 1000; i++)
+		write_prio(fd, ULOG_DEBUG, "Hello from %s #%d", __func__, i);
+	close(fd);
+
+	/* the error is read in order, between summaries of dropped entries */
+	memset(&opts, 0, sizeof(opts));
+	clean_tmp_file();
+	opts.opt_output_fd = open_tmp_file();
+	opts.opt_flags = ULOGCAT_FLAG_DUMP|ULOGCAT_FLAG_ULOG;
+	ctx = ulogcat3_open(&opts, devices, 1);
+	assert(ctx);
+	ret = ulogcat3_process_logs(ctx, 0);
+	assert(ret == 0);
+	ulogcat3_close(ctx);
+	close(opts.opt_output_fd);
+
+	assert(grep_tmp_file("Error from test_keep", 0) == 1);
+	assert(grep_tmp_file("10 log entries dropped", 0) == 1);
+	assert(grep_tmp_file("log entries dropped", 0) == 2);
+	assert(grep_tmp_file("Hello from test_keep #999", 0) == 1);
+
+	clean_tmp_file();
+}
+
+static void test_capture(void)
+{
+	int i, ret, count;
+	struct ulogcat_opts_v3 opts;
+	struct ulogcat3_context *ctx;
+	const char *files[] = {"file:" CAPTURE_FILENAME};
+
+	clear(ULOGCAT_FLAG_ULOG);
+
+	for (i = 0; i < 100; i++)
+		ULOGI("Hello from %s #%d", __func__, i);
+
+	/* capture entries */
+	memset(&opts, 0, sizeof(opts));
+	opts.opt_output_fd = open(CAPTURE_FILENAME, O_WRONLY|O_CREAT|O_TRUNC,
+				  0644);
+	assert(opts.opt_output_fd >= 0);
+	opts.opt_flags = ULOGCAT_FLAG_DUMP|ULOGCAT_FLAG_ULOG;
+	opts.opt_format = ULOGCAT_FORMAT_BINARY;
+
+	ctx = ulogcat3_open(&opts, NULL, 0);
+	assert(ctx);
+	ret = ulogcat3_set_capture_index(ctx, CAPTURE_FILENAME ".idx");
+	assert(ret == 0);
+	ret = ulogcat3_process_logs(ctx, 0);
+	assert(ret == 0);
+	ulogcat3_close(ctx);
+
+	/* render them from capture file, buffers are not read */
+	clear(ULOGCAT_FLAG_ULOG);
+	memset(&opts, 0, sizeof(opts));
+	clean_tmp_file();
+	opts.opt_output_fd = open_tmp_file();
+	opts.opt_flags = ULOGCAT_FLAG_DUMP|ULOGCAT_FLAG_ULOG;
+	opts.opt_format = ULOGCAT_FORMAT_LONG;
+
+	ctx = ulogcat3_open(&opts, files, 1);
+	assert(ctx);
+	ret = ulogcat3_process_logs(ctx, 0);
+	assert(ret == 0);
+	ulogcat3_close(ctx);
+
+	count = count_lines_tmp_file();
+	TRACE("tmp file has %d lines\n", count);
+	assert(count == 100);
+	assert(grep_tmp_file("Hello from test_capture #99", 0) == 1);
+	clean_tmp_file();
+
+	/* indexed chunks of filtered out entries are skipped */
+	opts.opt_output_fd = open_tmp_file();
+	ctx = ulogcat3_open(&opts, files, 1);
+	assert(ctx);
+	ret = ulogcat3_set_filter(ctx, "foo *:S");
+	assert(ret == 0);
+	ret = ulogcat3_process_logs(ctx, 0);
+	assert(ret == 0);
+	ulogcat3_close(ctx);
+	assert(count_lines_tmp_file() == 0);
+
+	clean_tmp_file();
+	(void)remove(CAPTURE_FILENAME);
+	(void)remove(CAPTURE_FILENAME ".idx");
+}
+
+static void test_archive(void)
+{
+	int i, ret, count;
+	struct ulogcat_opts_v3 opts;
+	struct ulogcat_archive_opts archive;
+	struct ulogcat3_context *ctx;
+	const char *files[] = {"file:" ARCHIVE_SEGMENT};
+
+	clear(ULOGCAT_FLAG_ULOG);
+	(void)mkdir(ARCHIVE_DIRNAME, 0755);
+
+	for (i = 0; i < 1000; i++)
+		ULOGI("Hello from %s #%d", __func__, i);
+
+	/* archive entries in a single compressed segment */
+	memset(&opts, 0, sizeof(opts));
+	opts.opt_output_fd = -1;
+	opts.opt_flags = ULOGCAT_FLAG_DUMP|ULOGCAT_FLAG_ULOG;
+	opts.opt_format = ULOGCAT_FORMAT_BINARY;
+
+	memset(&archive, 0, sizeof(archive));
+	archive.dir = ARCHIVE_DIRNAME;
+	archive.prefix = "test";
+	archive.compress = 1;
+
+	ctx = ulogcat3_open(&opts, NULL, 0);
+	assert(ctx);
+	ret = ulogcat3_set_archive(ctx, &archive);
+	assert(ret == 0);
+	ret = ulogcat3_process_logs(ctx, 0);
+	assert(ret == 0);
+	ulogcat3_close(ctx);
+
+	/* render them from segment */
+	clear(ULOGCAT_FLAG_ULOG);
+	memset(&opts, 0, sizeof(opts));
+	clean_tmp_file();
+	opts.opt_output_fd = open_tmp_file();
+	opts.opt_flags = ULOGCAT_FLAG_DUMP|ULOGCAT_FLAG_ULOG;
+	opts.opt_format = ULOGCAT_FORMAT_LONG;
+
+	ctx = ulogcat3_open(&opts, files, 1);
+	assert(ctx);
+	ret = ulogcat3_process_logs(ctx, 0);
+	assert(ret == 0);
+	ulogcat3_close(ctx);
+
+	count = count_lines_tmp_file();
+	TRACE("tmp file has %d lines\n", count);
+	assert(count == 1000);
+	assert(grep_tmp_file("Hello from test_archive #999", 0) == 1);
+
+	clean_tmp_file();
+	(void)remove(ARCHIVE_SEGMENT);
+	(void)rmdir(ARCHIVE_DIRNAME);
 }
 
 int main(int argc, char *argv[])
 {
+	if (argc > 1 && strcmp(argv[1], "deferred") == 0)
+		return log_deferred();
+
 	INFO("STARTING TESTS...\n");
 	init_stamp();
 	test_ioctl();
@@ -441,6 +1041,15 @@ int main(int argc, char *argv[])
 	test_color();
 	test_lines();
 	test_tail();
+	test_filter();
+	test_json();
+	test_version3();
+	test_deferred();
+	test_cursor();
+	test_watermark();
+	test_keep();
+	test_capture();
+	test_archive();
 	INFO("SUCCESS !\n");
 
 	return 0;
@@ -0,0 +1,424 @@
+/**
+ * Copyright (C) 2024 Parrot S.A.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * libulogcat text rendering benchmark: a synthetic corpus of entries is
+ * rendered in each text format, with the library renderer and with a
+ * snprintf() reference renderer. Outputs of both renderers are compared
+ * byte for byte, and reported ns/entry is the average rendering time of an
+ * entry over the corpus.
+ */
+
+/* text renderer is internal to the library, build it in */
+#include "../libulogcat_text.c"
+
+#define BENCH_DEFAULT_ENTRIES   10000
+#define BENCH_DEFAULT_ROUNDS    20
+
+struct bench_format {
+	const char              *name;
+	enum ulogcat_format      format;
+	unsigned int             flags;
+};
+
+static const struct bench_format formats[] = {
+	{ "short",         ULOGCAT_FORMAT_SHORT,   0 },
+	{ "aligned",       ULOGCAT_FORMAT_ALIGNED, 0 },
+	{ "process",       ULOGCAT_FORMAT_PROCESS, 0 },
+	{ "long",          ULOGCAT_FORMAT_LONG,    0 },
+	{ "long_color",    ULOGCAT_FORMAT_LONG,    ULOGCAT_FLAG_COLOR },
+	{ "aligned_label", ULOGCAT_FORMAT_ALIGNED, ULOGCAT_FLAG_SHOW_LABEL },
+};
+
+static const char *const tags[] = {
+	"main", "videoenc", "a_very_long_tag_name", "pomp", "k",
+};
+
+static const char *const names[] = {
+	"dragon-prog", "sh", "avahi-daemon", "x", "a_very_long_process_name",
+};
+
+static const char *const messages[] = {
+	"started",
+	"frame %u encoded in 12345 us, queue depth 3, bitrate 4500 kbps",
+	"connection from 192.168.42.1:50123 accepted (fd=%u)",
+	"multi-line message %u\nsecond line\nthird line",
+	"",
+};
+
+/* a few entries have a long thread name, or many lines to be truncated */
+static char long_name[160];
+static char long_message[8192];
+
+struct corpus_entry {
+	struct frame             frame;
+	char                     message[256];
+	char                     tname[64];
+};
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Reference renderer: line formatting of previous versions, which built
+ * each line with snprintf() and formatted timestamps of each entry.
+ */
+static int ref_print_ulog_line(struct ulogcat3_context *ctx,
+			       const struct frame *frame, const char *message,
+			       char *buf, size_t bufsize)
+{
+	int count;
+	char cprio;
+	struct tm tmBuf;
+	struct tm *ptm;
+	char tbuf[32], buf2[128];
+	const char *cstart, *cend, *clabel;
+	const struct ulog_entry *entry = &frame->entry;
+
+	cprio = priotab[entry->priority];
+	cstart = (ctx->flags & ULOGCAT_FLAG_COLOR) ?
+		ctx->ansi_color[entry->priority] : "";
+	cend  = (ctx->flags & ULOGCAT_FLAG_COLOR) ? ansinone : "";
+	clabel = (ctx->flags & ULOGCAT_FLAG_SHOW_LABEL) ? "U " : "";
+
+	switch (ctx->log_format) {
+	case ULOGCAT_FORMAT_SHORT:
+		count = snprintf(buf, bufsize, "%s%s%c %-12s: %s%s\n", cstart,
+				 clabel, cprio, entry->tag, message, cend);
+		break;
+	default:
+	case ULOGCAT_FORMAT_ALIGNED:
+		snprintf(buf2, sizeof(buf2), "%-12s(%s%s%s)",
+			 entry->tag, entry->pname,
+			 (entry->pid != entry->tid) ? "/" : "",
+			 (entry->pid != entry->tid) ? entry->tname : "");
+		count = snprintf(buf, bufsize, "%s%s%c %-45s: %s%s\n",
+				 cstart, clabel, cprio, buf2, message, cend);
+		break;
+	case ULOGCAT_FORMAT_PROCESS:
+		count = snprintf(buf, bufsize,
+				 "%s%s%c %-12s(%s%s%s): %s%s\n", cstart,
+				 clabel, cprio, entry->tag, entry->pname,
+				 (entry->pid != entry->tid) ? "/" : "",
+				 (entry->pid != entry->tid) ? entry->tname : "",
+				 message, cend);
+		break;
+	case ULOGCAT_FORMAT_LONG:
+		ptm = localtime_r(&(entry->tv_sec), &tmBuf);
+		strftime(tbuf, sizeof(tbuf), "%m-%d %H:%M:%S", ptm);
+		if (entry->pid != entry->tid) {
+			snprintf(buf2, sizeof(buf2), "%-12s(%s-%d/%s-%d)",
+				 entry->tag,
+				 entry->pname, entry->pid,
+				 entry->tname, entry->tid);
+		} else {
+			snprintf(buf2, sizeof(buf2), "%-12s(%s-%d)",
+				 entry->tag, entry->pname, entry->pid);
+		}
+		count = snprintf(buf, bufsize,
+				 "%s%s%s.%03ld %c %-45s: %s%s\n",
+				 cstart, clabel, tbuf, entry->tv_nsec/1000000,
+				 cprio, buf2, message, cend);
+		break;
+	}
+	if (count >= (int)bufsize)
+		count = bufsize;
+
+	return count;
+}
+
+static int ref_print_klog_line(struct ulogcat3_context *ctx,
+			       const struct frame *frame, const char *message,
+			       char *buf, size_t bufsize)
+{
+	int count;
+	char cprio;
+	struct tm tmBuf;
+	struct tm *ptm;
+	char tbuf[32];
+	const char *cstart, *cend, *clabel;
+	const struct ulog_entry *entry = &frame->entry;
+
+	cprio = priotab[entry->priority];
+	cstart = (ctx->flags & ULOGCAT_FLAG_COLOR) ?
+		ctx->ansi_color[entry->priority] : "";
+	cend  = (ctx->flags & ULOGCAT_FLAG_COLOR) ? ansinone : "";
+	clabel = (ctx->flags & ULOGCAT_FLAG_SHOW_LABEL) ? "K " : "";
+
+	switch (ctx->log_format) {
+	case ULOGCAT_FORMAT_SHORT:
+	case ULOGCAT_FORMAT_PROCESS:
+		count = snprintf(buf, bufsize, "%s%s%c %-12s: %s%s\n", cstart,
+				 clabel, cprio, entry->tag, message, cend);
+		break;
+	default:
+	case ULOGCAT_FORMAT_ALIGNED:
+		count = snprintf(buf, bufsize, "%s%s%c %-45s: %s%s\n", cstart,
+				 clabel, cprio, entry->tag, message, cend);
+		break;
+	case ULOGCAT_FORMAT_LONG:
+		ptm = localtime_r(&(entry->tv_sec), &tmBuf);
+		strftime(tbuf, sizeof(tbuf), "%m-%d %H:%M:%S", ptm);
+		count = snprintf(buf, bufsize,
+				 "%s%s%s.%03ld %c %-45s: %s%s\n",
+				 cstart, clabel, tbuf, entry->tv_nsec/1000000,
+				 cprio, entry->tag, message, cend);
+		break;
+	}
+	if (count >= (int)bufsize)
+		count = bufsize;
+
+	return count;
+}
+
+static int ref_render_frame(struct ulogcat3_context *ctx, struct frame *frame)
+{
+	int count, size = ctx->render_size;
+	char *nl, *message, *p;
+
+	ctx->render_len = 0;
+	p = (char *)ctx->render_buf;
+	message = (char *)frame->entry.message;
+
+	do {
+		nl = strchr(message, '\n');
+		if (nl)
+			*nl = '\0';
+
+		count = (frame->label == 'K') ?
+			ref_print_klog_line(ctx, frame, message, p, size) :
+			ref_print_ulog_line(ctx, frame, message, p, size);
+		if (nl) {
+			/* restore message for next rounds */
+			*nl = '\n';
+			message = nl+1;
+		}
+		if (count < 0)
+			break;
+		ctx->render_len += count;
+		p += count;
+		size -= count;
+	} while (nl && message[0]);
+
+	return ctx->render_len ? 0 : -1;
+}
+
+static int lib_render_frame(struct ulogcat3_context *ctx, struct frame *frame)
+{
+	char *p, *message = (char *)frame->entry.message;
+	int ret;
+
+	ret = text_render_frame(ctx, frame, 0);
+
+	/* restore message for next rounds */
+	for (p = message; p < message + frame->entry.len - 1; p++) {
+		if (*p == '\0')
+			*p = '\n';
+	}
+	return ret;
+}
+
+/* Build a corpus of entries logged within a few minutes */
+static struct corpus_entry *build_corpus(struct log_device *dev,
+					 unsigned int count)
+{
+	struct corpus_entry *corpus, *c;
+	struct ulog_entry *e;
+	uint64_t stamp = 1700000000ULL*1000000ULL;
+	unsigned int i;
+
+	corpus = calloc(count, sizeof(*corpus));
+	if (corpus == NULL)
+		return NULL;
+
+	memset(long_name, 'n', sizeof(long_name) - 1);
+	for (i = 0; i + 32 < sizeof(long_message); i += 32)
+		memcpy(long_message + i, "line of a long message, cut it\n", 32);
+
+	srand(42);
+	for (i = 0; i < count; i++) {
+		c = &corpus[i];
+		e = &c->frame.entry;
+		stamp += rand() % 20000;
+
+		snprintf(c->message, sizeof(c->message),
+			 messages[i % 5], i);
+		snprintf(c->tname, sizeof(c->tname), "worker-%u", i % 7);
+
+		c->frame.dev = dev;
+		c->frame.label = (i % 11 == 0) ? 'K' : 'U';
+		e->tv_sec = (time_t)(stamp/1000000ULL);
+		e->tv_nsec = (long)(stamp % 1000000ULL)*1000;
+		e->priority = 2 + rand() % 6;
+		e->pid = 100 + i % 13;
+		e->tid = (i % 3) ? e->pid : e->pid + 1 + i % 5;
+		e->pname = names[i % 5];
+		e->tname = (e->pid != e->tid) ? c->tname : names[i % 5];
+		e->tag = tags[(i/3) % 5];
+		e->message = c->message;
+		if (i % 97 == 0)
+			e->message = long_message;
+		if ((i % 89 == 0) && (e->pid != e->tid))
+			e->tname = long_name;
+		e->len = strlen(e->message) + 1;
+	}
+
+	return corpus;
+}
+
+static double run_renderer(struct ulogcat3_context *ctx,
+			   struct corpus_entry *corpus, unsigned int count,
+			   unsigned int rounds,
+			   int (*render)(struct ulogcat3_context *,
+					 struct frame *),
+			   size_t *bytes)
+{
+	uint64_t start, elapsed;
+	unsigned int i, r;
+
+	*bytes = 0;
+	start = now_ns();
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < count; i++) {
+			if ((*render)(ctx, &corpus[i].frame) == 0)
+				*bytes += ctx->render_len;
+		}
+	}
+	elapsed = now_ns() - start;
+
+	return (double)elapsed/((double)count*rounds);
+}
+
+/* Check that both renderers produce the same output for each entry */
+static int compare_renderers(struct ulogcat3_context *ctx,
+			     struct corpus_entry *corpus, unsigned int count)
+{
+	uint8_t *ref;
+	int ref_len;
+	unsigned int i;
+
+	ref = malloc(ctx->render_size);
+	if (ref == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < count; i++) {
+		ref_render_frame(ctx, &corpus[i].frame);
+		ref_len = ctx->render_len;
+		memcpy(ref, ctx->render_buf, ref_len);
+
+		lib_render_frame(ctx, &corpus[i].frame);
+		if ((ref_len != ctx->render_len) ||
+		    (memcmp(ref, ctx->render_buf, ref_len) != 0)) {
+			fprintf(stderr, "entry %u differs:\n%.*s%.*s", i,
+				ref_len, ref, ctx->render_len,
+				ctx->render_buf);
+			free(ref);
+			return -1;
+		}
+	}
+
+	free(ref);
+	return 0;
+}
+
+static void show_usage(const char *cmd)
+{
+	fprintf(stderr, "Usage: %s [options]\n", cmd);
+
+	fprintf(stderr, "options include:\n"
+		"  -n <n>          Entries in corpus (default %d)\n"
+		"  -r <n>          Rendering rounds (default %d)\n"
+		"  -h              Show this help\n"
+		"\n", BENCH_DEFAULT_ENTRIES, BENCH_DEFAULT_ROUNDS);
+}
+
+int main(int argc, char *argv[])
+{
+	int c, ret = EXIT_SUCCESS;
+	unsigned int i, count = BENCH_DEFAULT_ENTRIES;
+	unsigned int rounds = BENCH_DEFAULT_ROUNDS;
+	struct ulogcat3_context ctx;
+	struct log_device dev;
+	struct corpus_entry *corpus;
+	double ref_ns, lib_ns;
+	size_t ref_bytes, lib_bytes;
+
+	while ((c = getopt(argc, argv, "hn:r:")) != -1) {
+		switch (c) {
+		case 'n':
+			count = (unsigned int)atoi(optarg);
+			break;
+		case 'r':
+			rounds = (unsigned int)atoi(optarg);
+			break;
+		case 'h':
+			show_usage(argv[0]);
+			return 0;
+		default:
+			show_usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (count == 0 || rounds == 0) {
+		show_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	memset(&ctx, 0, sizeof(ctx));
+	memset(&dev, 0, sizeof(dev));
+	dev.ctx = &ctx;
+	ctx.render_size = text_render_size(ULOGCAT_FORMAT_SHORT);
+	ctx.render_buf = malloc(ctx.render_size);
+	corpus = build_corpus(&dev, count);
+	if (ctx.render_buf == NULL || corpus == NULL) {
+		perror("malloc");
+		return EXIT_FAILURE;
+	}
+
+	printf("%-16s %12s %12s %8s %10s\n", "format", "ref ns/entry",
+	       "ns/entry", "speedup", "MB/s");
+
+	for (i = 0; i < sizeof(formats)/sizeof(formats[0]); i++) {
+		ctx.log_format = formats[i].format;
+		ctx.flags = formats[i].flags;
+		if (ctx.flags & ULOGCAT_FLAG_COLOR)
+			setup_colors(&ctx);
+		setup_text(&ctx);
+
+		if (compare_renderers(&ctx, corpus, count) < 0) {
+			fprintf(stderr, "%s: output mismatch\n",
+				formats[i].name);
+			ret = EXIT_FAILURE;
+			continue;
+		}
+
+		ref_ns = run_renderer(&ctx, corpus, count, rounds,
+				      ref_render_frame, &ref_bytes);
+		lib_ns = run_renderer(&ctx, corpus, count, rounds,
+				      lib_render_frame, &lib_bytes);
+
+		printf("%-16s %12.1f %12.1f %7.2fx %10.1f\n", formats[i].name,
+		       ref_ns, lib_ns, ref_ns/lib_ns,
+		       (double)lib_bytes/(lib_ns*count*rounds)*1000.0);
+	}
+
+	free(corpus);
+	free(ctx.render_buf);
+	return ret;
+}
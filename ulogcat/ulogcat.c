@@ -37,16 +37,23 @@ struct options {
 	int                     opt_clear;
 	char                  **ulog_devices;
 	int                     ulog_ndevices;
+	char                  **fmt_dicts;
+	int                     fmt_ndicts;
+	char                   *filter;
+	char                   *capture;
+	char                   *cursor;
+	char                  **files;
+	int                     nfiles;
 };
 
 static void show_usage(const char *cmd)
 {
-	fprintf(stderr, "Usage: %s [options]\n", cmd);
+	fprintf(stderr, "Usage: %s [options] [filterspecs]\n", cmd);
 
 	fprintf(stderr, "options include:\n"
 		"  -v <format>     Sets the log print format, where <format> is"
 		" one of:\n\n"
-		"                  short aligned process long csv\n\n"
+		"                  short aligned process long csv binary json\n\n"
 		"  -c              Clear (flush) the entire log and exit.\n"
 		"  -d              Dump the log and then exit (don't block)\n"
 		"  -k              Include kernel ring buffer messages in "
@@ -61,6 +68,8 @@ static void show_usage(const char *cmd)
 		"                  an interleaved output.\n"
 		"  -b <buffer>     Request alternate ulog buffer, 'main', "
 		"'balboa', etc.\n"
+		"                  Use 'shm:<name>' for shared memory buffers "
+		"(see ULOG_SHM).\n"
 		"                  Multiple -b parameters are allowed and the "
 		"results are\n"
 		"                  interleaved. The default is to show all "
@@ -74,6 +83,34 @@ static void show_usage(const char *cmd)
 		"                  '|'. Default value: "
 		"ULOGCAT_COLORS='||4;1;31|1;31|1;33|35||1;30'.\n"
 		"  -t <n>          Skip entries and show only <n> tail lines\n"
+		"  -P              Render and write entries in a separate "
+		"thread, so that a\n"
+		"                  slow output does not make buffers overflow.\n"
+		"  -F <dict>       Load format string dictionary generated by "
+		"'ulogfmt'.\n"
+		"                  Multiple -F parameters are allowed.\n"
+		"  -f <filter>     Only show entries matching filter terms, "
+		"which can also be\n"
+		"                  given as trailing arguments:\n\n"
+		"                  <tag>[:<level>]  *:<level>  pid=<pid>  "
+		"tid=<tid>\n"
+		"                  pname=<name>  tname=<name>  since=<secs>  "
+		"until=<secs>\n"
+		"                  msg=<regex>\n\n"
+		"                  where <level> is one of C E W N I D V (all) "
+		"S (silent).\n"
+		"                  Example: 'foo:D *:S' only shows tag 'foo'.\n"
+		"  -B <file>       Write unformatted entries to capture file "
+		"<file>, and\n"
+		"                  its index to <file>.idx.\n"
+		"  -r <file>       Read entries from capture file <file> "
+		"instead of buffers.\n"
+		"                  Multiple -r parameters are allowed and the "
+		"results are\n"
+		"                  interleaved. Implies -d.\n"
+		"  -R <file>       Skip entries output by a previous run with "
+		"cursor file\n"
+		"                  <file>, and record output entries in it.\n"
 		"  -h              Show this help\n"
 		"\n");
 }
@@ -93,11 +130,31 @@ static int parse_log_format(const char *str)
 			ret = ULOGCAT_FORMAT_LONG;
 		else if (strcmp(str, "csv") == 0)
 			ret = ULOGCAT_FORMAT_CSV;
+		else if (strcmp(str, "binary") == 0)
+			ret = ULOGCAT_FORMAT_BINARY;
+		else if (strcmp(str, "json") == 0)
+			ret = ULOGCAT_FORMAT_JSON;
 	}
 
 	return ret;
 }
 
+/* Append filter terms to the filter expression */
+static void add_filter(struct options *op, const char *terms)
+{
+	size_t len = op->filter ? strlen(op->filter) : 0;
+	char *filter;
+
+	filter = realloc(op->filter, len + strlen(terms) + 2);
+	if (filter == NULL)
+		return;
+
+	if (len)
+		filter[len++] = ' ';
+	strcpy(filter + len, terms);
+	op->filter = filter;
+}
+
 static void get_options(int argc, char **argv, struct options *op)
 {
 	int ret;
@@ -106,7 +163,7 @@ static void get_options(int argc, char **argv, struct options *op)
 	op->opts.opt_format = ULOGCAT_FORMAT_ALIGNED;
 
 	for (;;) {
-		ret = getopt(argc, argv, "b:Ccdhklt:uv:");
+		ret = getopt(argc, argv, "B:b:CcdF:f:hklPR:r:t:uv:");
 		if (ret < 0)
 			break;
 
@@ -129,6 +186,9 @@ static void get_options(int argc, char **argv, struct options *op)
 		case 'l':
 			op->opts.opt_flags |= ULOGCAT_FLAG_SHOW_LABEL;
 			break;
+		case 'P':
+			op->opts.opt_flags |= ULOGCAT_FLAG_PIPELINE;
+			break;
 		case 'b':
 			op->ulog_devices = realloc(op->ulog_devices,
 						   (op->ulog_ndevices+1)*
@@ -140,6 +200,30 @@ static void get_options(int argc, char **argv, struct options *op)
 		case 't':
 			op->opts.opt_tail = atoi(optarg);
 			break;
+		case 'B':
+			op->capture = optarg;
+			break;
+		case 'R':
+			op->cursor = optarg;
+			break;
+		case 'r':
+			op->files = realloc(op->files,
+					    (op->nfiles+1)*sizeof(*op->files));
+			if (op->files && asprintf(&op->files[op->nfiles],
+						  "file:%s", optarg) > 0)
+				op->nfiles++;
+			op->opts.opt_flags |= ULOGCAT_FLAG_DUMP;
+			break;
+		case 'F':
+			op->fmt_dicts = realloc(op->fmt_dicts,
+						(op->fmt_ndicts+1)*
+						sizeof(*op->fmt_dicts));
+			if (op->fmt_dicts)
+				op->fmt_dicts[op->fmt_ndicts++] = optarg;
+			break;
+		case 'f':
+			add_filter(op, optarg);
+			break;
 		case 'h':
 			show_usage(argv[0]);
 			exit(0);
@@ -161,6 +245,10 @@ static void get_options(int argc, char **argv, struct options *op)
 		}
 	}
 
+	/* logcat-style trailing filterspecs */
+	while (optind < argc)
+		add_filter(op, argv[optind++]);
+
 	if (!(op->opts.opt_flags & (ULOGCAT_FLAG_ULOG|ULOGCAT_FLAG_KLOG)))
 		/* default output is ulog buffers */
 		op->opts.opt_flags |= ULOGCAT_FLAG_ULOG;
@@ -188,12 +276,37 @@ static int process_logs(struct ulogcat3_context *ctx, int max_entries,
 
 int main(int argc, char **argv)
 {
-	int ret = -1;
+	int i, ret = -1;
 	struct options op;
-	struct ulogcat3_context *ctx;
+	struct ulogcat3_context *ctx = NULL;
+	char *index;
 
 	get_options(argc, argv, &op);
 	op.opts.opt_output_fp = stdout;
+	op.opts.opt_output_fd = -1;
+
+	if (op.capture) {
+		op.opts.opt_format = ULOGCAT_FORMAT_BINARY;
+		op.opts.opt_output_fp = NULL;
+		op.opts.opt_output_fd = open(op.capture,
+					     O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC,
+					     0644);
+		if (op.opts.opt_output_fd < 0) {
+			INFO("cannot open %s: %s\n", op.capture,
+			     strerror(errno));
+			goto finish;
+		}
+	}
+
+	/* read capture files as additional devices */
+	for (i = 0; i < op.nfiles; i++) {
+		op.ulog_devices = realloc(op.ulog_devices,
+					  (op.ulog_ndevices+1)*
+					  sizeof(*op.ulog_devices));
+		if (op.ulog_devices == NULL)
+			goto finish;
+		op.ulog_devices[op.ulog_ndevices++] = op.files[i];
+	}
 
 	/* ignore SIGPIPE */
 	signal(SIGPIPE, SIG_IGN);
@@ -205,6 +318,37 @@ int main(int argc, char **argv)
 		goto finish;
 	}
 
+	for (i = 0; i < op.fmt_ndicts; i++) {
+		ret = ulogcat3_load_fmt_dict(ctx, op.fmt_dicts[i]);
+		if (ret < 0)
+			goto finish;
+	}
+
+	if (op.filter) {
+		ret = ulogcat3_set_filter(ctx, op.filter);
+		if (ret < 0)
+			goto finish;
+	}
+
+	if (op.capture) {
+		ret = asprintf(&index, "%s.idx", op.capture);
+		if (ret < 0)
+			goto finish;
+		ret = ulogcat3_set_capture_index(ctx, index);
+		free(index);
+		if (ret < 0)
+			goto finish;
+	}
+
+	if (op.cursor) {
+		ret = ulogcat3_set_cursor(ctx, op.cursor);
+		if (ret < 0) {
+			INFO("cannot use cursor %s: %s\n", op.cursor,
+			     strerror(-ret));
+			goto finish;
+		}
+	}
+
 	/* get specific actions (clear) out of the way */
 	if (op.opt_clear) {
 		ret = ulogcat3_clear(ctx);
@@ -216,6 +360,11 @@ int main(int argc, char **argv)
 finish:
 	ulogcat3_close(ctx);
 	free(op.ulog_devices);
+	free(op.fmt_dicts);
+	free(op.filter);
+	for (i = 0; i < op.nfiles; i++)
+		free(op.files[i]);
+	free(op.files);
 
 	return ret;
 }
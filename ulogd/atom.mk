@@ -0,0 +1,14 @@
+LOCAL_PATH := $(call my-dir)
+
+ifeq ("$(TARGET_OS)","linux")
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := ulogd
+LOCAL_CATEGORY_PATH := utils
+LOCAL_DESCRIPTION := A daemon archiving ulog buffers to rotating files
+LOCAL_SRC_FILES := ulogd.c
+LOCAL_LIBRARIES := libulogcat
+LOCAL_COPY_FILES:= scripts/95-ulogd.rc:etc/boxinit.d/
+include $(BUILD_EXECUTABLE)
+
+endif
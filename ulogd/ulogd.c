@@ -0,0 +1,286 @@
+/**
+ * Copyright (C) 2014 Parrot S.A.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * ulogd, a daemon archiving ulog buffers to rotating files
+ *
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include <libulogcat.h>
+
+#define INFO(...)        fprintf(stderr, "ulogd: " __VA_ARGS__)
+
+#define DEFAULT_DIR             "/data/ulog"
+#define DEFAULT_SEGMENT_SIZE    (1024ULL*1024ULL)
+#define DEFAULT_MAX_SIZE        (16ULL*1024ULL*1024ULL)
+#define DEFAULT_WAKE_SIZE       (16U*1024U)
+#define DEFAULT_WAKE_DELAY_MS   100
+
+struct options {
+	struct ulogcat_opts_v3   opts;
+	struct ulogcat_archive_opts archive;
+	const char             **ulog_devices;
+	int                      ulog_ndevices;
+	char                    *filter;
+	char                    *cursor;
+	int                      no_cursor;
+	unsigned int             wake_size;
+	unsigned int             wake_delay_ms;
+};
+
+static volatile sig_atomic_t stop;
+
+static void show_usage(const char *cmd)
+{
+	fprintf(stderr, "Usage: %s [options]\n", cmd);
+
+	fprintf(stderr, "options include:\n"
+		"  -o <dir>        Write segment files to <dir> (default: "
+		DEFAULT_DIR ").\n"
+		"  -p <prefix>     Segment file name prefix (default: "
+		"'ulog').\n"
+		"  -s <kB>         Start a new segment after <kB> kilobytes "
+		"(default: 1024).\n"
+		"  -t <secs>       Start a new segment after <secs> seconds "
+		"(default: none).\n"
+		"  -m <kB>         Remove oldest segments to stay within <kB> "
+		"kilobytes\n"
+		"                  (default: 16384, 0 for no limit).\n"
+		"  -w <ms>         Write buffered entries after at most <ms> "
+		"milliseconds\n"
+		"                  (default: 1000).\n"
+		"  -y <policy>     Sync policy, one of: none segment write "
+		"(default: segment).\n"
+		"  -n              Do not compress segments.\n"
+		"  -b <buffer>     Archive ulog buffer <buffer> only; multiple "
+		"-b parameters\n"
+		"                  are allowed. The default is to archive all "
+		"buffers.\n"
+		"  -k              Also archive kernel ring buffer messages.\n"
+		"  -f <filter>     Only archive entries matching filter (see "
+		"ulogcat).\n"
+		"  -c <file>       Resume after the last archived entries "
+		"recorded in cursor\n"
+		"                  <file> (default: <dir>/<prefix>.cursor).\n"
+		"  -C              Do not resume, archive all entries present "
+		"in buffers.\n"
+		"  -W <kB>         Only wake up when <kB> kilobytes of entries "
+		"are pending\n"
+		"                  (default: 16, 0 to wake up for each "
+		"entry).\n"
+		"  -L <ms>         ... or after at most <ms> milliseconds "
+		"(default: 100).\n"
+		"  -h              Show this help\n"
+		"\n");
+}
+
+static int parse_sync_policy(const char *str)
+{
+	if (strcmp(str, "none") == 0)
+		return ULOGCAT_ARCHIVE_SYNC_NONE;
+	else if (strcmp(str, "segment") == 0)
+		return ULOGCAT_ARCHIVE_SYNC_SEGMENT;
+	else if (strcmp(str, "write") == 0)
+		return ULOGCAT_ARCHIVE_SYNC_WRITE;
+
+	return -1;
+}
+
+static void get_options(int argc, char **argv, struct options *op)
+{
+	int ret;
+
+	memset(op, 0, sizeof(*op));
+	op->opts.opt_format = ULOGCAT_FORMAT_BINARY;
+	/* compress and write segments without delaying buffer reads */
+	op->opts.opt_flags = ULOGCAT_FLAG_ULOG|ULOGCAT_FLAG_PIPELINE;
+	op->opts.opt_output_fd = -1;
+	op->archive.dir = DEFAULT_DIR;
+	op->archive.segment_size = DEFAULT_SEGMENT_SIZE;
+	op->archive.max_size = DEFAULT_MAX_SIZE;
+	op->archive.sync = ULOGCAT_ARCHIVE_SYNC_SEGMENT;
+	op->archive.compress = 1;
+	op->wake_size = DEFAULT_WAKE_SIZE;
+	op->wake_delay_ms = DEFAULT_WAKE_DELAY_MS;
+
+	for (;;) {
+		ret = getopt(argc, argv, "b:Cc:f:hkL:m:no:p:s:t:W:w:y:");
+		if (ret < 0)
+			break;
+
+		switch (ret) {
+		case 'o':
+			op->archive.dir = optarg;
+			break;
+		case 'p':
+			op->archive.prefix = optarg;
+			break;
+		case 's':
+			op->archive.segment_size = strtoull(optarg, NULL, 0)*1024;
+			break;
+		case 't':
+			op->archive.segment_time = atoi(optarg);
+			break;
+		case 'm':
+			op->archive.max_size = strtoull(optarg, NULL, 0)*1024;
+			break;
+		case 'w':
+			op->archive.flush_ms = atoi(optarg);
+			break;
+		case 'y':
+			ret = parse_sync_policy(optarg);
+			if (ret < 0) {
+				fprintf(stderr, "Invalid parameter to -y\n");
+				show_usage(argv[0]);
+				exit(-1);
+			}
+			op->archive.sync = ret;
+			break;
+		case 'n':
+			op->archive.compress = 0;
+			break;
+		case 'b':
+			op->ulog_devices = realloc(op->ulog_devices,
+						   (op->ulog_ndevices+1)*
+						   sizeof(*op->ulog_devices));
+			if (op->ulog_devices)
+				op->ulog_devices[op->ulog_ndevices++] = optarg;
+			break;
+		case 'k':
+			op->opts.opt_flags |= ULOGCAT_FLAG_KLOG;
+			break;
+		case 'f':
+			op->filter = optarg;
+			break;
+		case 'c':
+			op->cursor = optarg;
+			break;
+		case 'C':
+			op->no_cursor = 1;
+			break;
+		case 'W':
+			op->wake_size = strtoul(optarg, NULL, 0)*1024;
+			break;
+		case 'L':
+			op->wake_delay_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'h':
+			show_usage(argv[0]);
+			exit(0);
+			break;
+		default:
+			fprintf(stderr, "Unrecognized option\n");
+			show_usage(argv[0]);
+			exit(-1);
+			break;
+		}
+	}
+}
+
+static void sighandler(int signum)
+{
+	stop = 1;
+}
+
+int main(int argc, char **argv)
+{
+	int ret = -1;
+	struct options op;
+	struct sigaction sa;
+	struct ulogcat3_context *ctx = NULL;
+	char *cursor = NULL;
+
+	get_options(argc, argv, &op);
+
+	/* interrupt poll() on termination, buffered entries must be written */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sighandler;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+
+	if ((mkdir(op.archive.dir, 0755) < 0) && (errno != EEXIST)) {
+		INFO("cannot create %s: %s\n", op.archive.dir, strerror(errno));
+		goto finish;
+	}
+
+	ctx = ulogcat3_open(&op.opts, op.ulog_devices, op.ulog_ndevices);
+	if (ctx == NULL)
+		goto finish;
+
+	if (op.filter) {
+		ret = ulogcat3_set_filter(ctx, op.filter);
+		if (ret < 0) {
+			INFO("invalid filter\n");
+			goto finish;
+		}
+	}
+
+	ret = ulogcat3_set_archive(ctx, &op.archive);
+	if (ret < 0) {
+		INFO("cannot archive to %s: %s\n", op.archive.dir,
+		     strerror(-ret));
+		goto finish;
+	}
+
+	/* do not archive entries again after a restart */
+	if (!op.no_cursor) {
+		if (op.cursor)
+			cursor = strdup(op.cursor);
+		else if (asprintf(&cursor, "%s/%s.cursor", op.archive.dir,
+				  op.archive.prefix ? op.archive.prefix :
+				  "ulog") < 0)
+			cursor = NULL;
+		if (cursor == NULL) {
+			ret = -1;
+			goto finish;
+		}
+		ret = ulogcat3_set_cursor(ctx, cursor);
+		if (ret < 0) {
+			INFO("cannot use cursor %s: %s\n", cursor,
+			     strerror(-ret));
+			goto finish;
+		}
+	}
+
+	/* entries are archived in blocks anyway, read them likewise */
+	if (op.wake_size) {
+		ret = ulogcat3_set_watermark(ctx, op.wake_size,
+					     op.wake_delay_ms);
+		if (ret < 0) {
+			INFO("cannot set watermark: %s\n", strerror(-ret));
+			goto finish;
+		}
+	}
+
+	while (!stop) {
+		/* this will block until some entries are available */
+		ret = ulogcat3_process_logs(ctx, 0);
+		if (ret < 0)
+			break;
+	}
+
+finish:
+	ulogcat3_close(ctx);
+	free(cursor);
+	free(op.ulog_devices);
+	return (ret < 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,13 @@
+LOCAL_PATH := $(call my-dir)
+
+ifeq ("$(TARGET_OS)","linux")
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := ulogfmt
+LOCAL_CATEGORY_PATH := utils
+LOCAL_DESCRIPTION := Extract ulog format string registry from ELF binaries
+LOCAL_SRC_FILES := ulogfmt.c
+LOCAL_LIBRARIES := libulog
+include $(BUILD_EXECUTABLE)
+
+endif
@@ -0,0 +1,365 @@
+/**
+ * Copyright (C) 2024 Parrot S.A.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * ulogfmt: extract the format string registry (see ULOG_FMT_REGISTRY) of ELF
+ * binaries into a dictionary suitable for 'ulogcat -F'.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <elf.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ulog.h"
+#include "ulogprint.h"
+
+#define INFO(...)        fprintf(stderr, "ulogfmt: " __VA_ARGS__)
+
+struct site {
+	uint32_t    id;
+	int         level;
+	const char *tag;
+	const char *loc;
+	const char *fmt;
+};
+
+static struct {
+	struct site *sites;
+	size_t       count;
+	size_t       size;
+} reg;
+
+static void show_usage(const char *cmd)
+{
+	fprintf(stderr, "Usage: %s [-o <dict>] <elf-file>...\n", cmd);
+
+	fprintf(stderr, "Extract format strings registered by binaries built "
+		"with ULOG_FMT_REGISTRY,\nand write them to a dictionary for "
+		"'ulogcat -F'.\n\n"
+		"options include:\n"
+		"  -o <dict>       Write dictionary to file <dict> instead of "
+		"standard output\n"
+		"  -h              Show this help\n"
+		"\n");
+}
+
+static int add_site(const struct site *site)
+{
+	struct site *sites;
+
+	if (reg.count == reg.size) {
+		reg.size = reg.size ? 2*reg.size : 256;
+		sites = realloc(reg.sites, reg.size*sizeof(*sites));
+		if (sites == NULL)
+			return -ENOMEM;
+		reg.sites = sites;
+	}
+	reg.sites[reg.count++] = *site;
+	return 0;
+}
+
+/* get next null-terminated string of a record */
+static const char *get_string(const char **p, const char *end)
+{
+	const char *str = *p;
+	const char *nul = memchr(str, '\0', end - str);
+
+	if (nul == NULL)
+		return NULL;
+	*p = nul + 1;
+	return str;
+}
+
+/* parse registry section, which must remain mapped */
+static int parse_section(const char *path, const char *p, size_t size)
+{
+	const char *end = p + size;
+	const size_t magic_len = sizeof(ULOG_FMT_MAGIC)-1;
+	struct site site;
+	int ret;
+
+	while (p < end) {
+		/* skip alignment padding */
+		if (*p == '\0') {
+			p++;
+			continue;
+		}
+		if ((size_t)(end - p) < magic_len + 1 ||
+		    memcmp(p, ULOG_FMT_MAGIC, magic_len) != 0)
+			goto invalid;
+		p += magic_len;
+
+		site.level = (uint8_t)*p++;
+		site.tag = get_string(&p, end);
+		site.loc = site.tag ? get_string(&p, end) : NULL;
+		site.fmt = site.loc ? get_string(&p, end) : NULL;
+		if (site.fmt == NULL)
+			goto invalid;
+
+		site.id = ulog_fmt_id(site.fmt);
+		ret = add_site(&site);
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+
+invalid:
+	INFO("%s: invalid record at offset %zu of section '%s'\n", path,
+	     size - (size_t)(end - p), ULOG_FMT_SECTION);
+	return -EINVAL;
+}
+
+/* find registry section in ELF file (32 or 64-bit, native byte order) */
+#define FIND_SECTION(_Ehdr, _Shdr)					\
+	do {								\
+		const _Ehdr *ehdr = (const _Ehdr *)data;		\
+		const _Shdr *shdr, *strtab;				\
+		unsigned int i;						\
+									\
+		if (size < sizeof(*ehdr) || ehdr->e_shoff > size ||	\
+		    ehdr->e_shstrndx >= ehdr->e_shnum ||		\
+		    (size - ehdr->e_shoff) / sizeof(*shdr) <		\
+				ehdr->e_shnum)				\
+			return -EINVAL;					\
+		shdr = (const _Shdr *)(data + ehdr->e_shoff);		\
+		strtab = &shdr[ehdr->e_shstrndx];			\
+		if (strtab->sh_offset > size ||				\
+		    strtab->sh_size > size - strtab->sh_offset)		\
+			return -EINVAL;					\
+		for (i = 0; i < ehdr->e_shnum; i++) {			\
+			if (shdr[i].sh_name >= strtab->sh_size ||	\
+			    strncmp(data + strtab->sh_offset +		\
+				    shdr[i].sh_name, ULOG_FMT_SECTION,	\
+				    strtab->sh_size - shdr[i].sh_name)	\
+				    != 0)				\
+				continue;				\
+			if (shdr[i].sh_type == SHT_NOBITS ||		\
+			    shdr[i].sh_offset > size ||			\
+			    shdr[i].sh_size > size - shdr[i].sh_offset)	\
+				return -EINVAL;				\
+			*sec = data + shdr[i].sh_offset;		\
+			*sec_size = shdr[i].sh_size;			\
+			return 0;					\
+		}							\
+		return -ENOENT;						\
+	} while (0)
+
+static int find_section(const char *data, size_t size, const char **sec,
+			size_t *sec_size)
+{
+	const unsigned char *ident = (const unsigned char *)data;
+	const uint16_t order = 1;
+	const int data_native = (*(const uint8_t *)&order == 1) ?
+		ELFDATA2LSB : ELFDATA2MSB;
+
+	if (size < EI_NIDENT || memcmp(ident, ELFMAG, SELFMAG) != 0)
+		return -EINVAL;
+	if (ident[EI_DATA] != data_native)
+		return -ENOTSUP;
+
+	if (ident[EI_CLASS] == ELFCLASS32)
+		FIND_SECTION(Elf32_Ehdr, Elf32_Shdr);
+	else if (ident[EI_CLASS] == ELFCLASS64)
+		FIND_SECTION(Elf64_Ehdr, Elf64_Shdr);
+
+	return -EINVAL;
+}
+
+static int process_file(const char *path, void **map, size_t *map_size)
+{
+	int fd, ret;
+	struct stat st;
+	const char *sec;
+	size_t sec_size;
+
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		ret = -errno;
+		INFO("%s: %s\n", path, strerror(errno));
+		goto out;
+	}
+
+	*map_size = (size_t)st.st_size;
+	*map = mmap(NULL, *map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (*map == MAP_FAILED) {
+		ret = -errno;
+		*map = NULL;
+		INFO("%s: mmap: %s\n", path, strerror(errno));
+		goto out;
+	}
+
+	ret = find_section(*map, *map_size, &sec, &sec_size);
+	if (ret == -ENOENT) {
+		INFO("%s: no '%s' section\n", path, ULOG_FMT_SECTION);
+		ret = 0;
+	} else if (ret == -ENOTSUP) {
+		INFO("%s: unsupported byte order\n", path);
+	} else if (ret < 0) {
+		INFO("%s: invalid ELF file\n", path);
+	} else {
+		ret = parse_section(path, sec, sec_size);
+	}
+out:
+	if (fd >= 0)
+		close(fd);
+	return ret;
+}
+
+static int site_compare(const void *a, const void *b)
+{
+	const struct site *sa = a, *sb = b;
+
+	if (sa->id != sb->id)
+		return (sa->id > sb->id) - (sa->id < sb->id);
+	return strcmp(sa->fmt, sb->fmt);
+}
+
+static void print_escaped(FILE *fp, const char *str)
+{
+	for (; *str; str++) {
+		switch (*str) {
+		case '\\':
+			fputs("\\\\", fp);
+			break;
+		case '\t':
+			fputs("\\t", fp);
+			break;
+		case '\n':
+			fputs("\\n", fp);
+			break;
+		case '\r':
+			fputs("\\r", fp);
+			break;
+		default:
+			if ((uint8_t)*str < 0x20 || *str == 0x7f)
+				fprintf(fp, "\\x%02x", (uint8_t)*str);
+			else
+				fputc(*str, fp);
+			break;
+		}
+	}
+}
+
+/* write sorted dictionary; fail on identifier collisions */
+static int write_dict(FILE *fp)
+{
+	size_t i;
+	const struct site *site, *prev = NULL;
+	int ret = 0;
+
+	qsort(reg.sites, reg.count, sizeof(*reg.sites), site_compare);
+
+	fprintf(fp, "# ulog format string dictionary\n");
+	fprintf(fp, "# id\tlevel\ttag\tlocation\tformat\n");
+
+	for (i = 0; i < reg.count; i++) {
+		site = &reg.sites[i];
+		if (prev && prev->id == site->id) {
+			/* same format string from several call sites */
+			if (strcmp(prev->fmt, site->fmt) == 0)
+				continue;
+			INFO("format id %08x collision: '%s' (%s) and '%s' "
+			     "(%s)\n", site->id, prev->fmt, prev->loc,
+			     site->fmt, site->loc);
+			ret = -EEXIST;
+			continue;
+		}
+		prev = site;
+
+		fprintf(fp, "%08x\t", site->id);
+		if (site->level == ULOG_FMT_LEVEL_UNKNOWN)
+			fputc('-', fp);
+		else
+			fprintf(fp, "%d", site->level);
+		fprintf(fp, "\t%s\t%s\t", site->tag, site->loc);
+		print_escaped(fp, site->fmt);
+		fputc('\n', fp);
+	}
+
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	int c, i, ret = 0, nfiles;
+	const char *output = NULL;
+	void **maps;
+	size_t *map_sizes;
+	FILE *fp = stdout;
+
+	while ((c = getopt(argc, argv, "ho:")) != -1) {
+		switch (c) {
+		case 'o':
+			output = optarg;
+			break;
+		case 'h':
+			show_usage(argv[0]);
+			return 0;
+		default:
+			show_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	nfiles = argc - optind;
+	if (nfiles <= 0) {
+		show_usage(argv[0]);
+		return 1;
+	}
+
+	/* files remain mapped until dictionary is written */
+	maps = calloc(nfiles, sizeof(*maps));
+	map_sizes = calloc(nfiles, sizeof(*map_sizes));
+	if (maps == NULL || map_sizes == NULL) {
+		INFO("calloc: %s\n", strerror(errno));
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < nfiles; i++) {
+		ret = process_file(argv[optind+i], &maps[i], &map_sizes[i]);
+		if (ret < 0)
+			goto out;
+	}
+
+	if (output) {
+		fp = fopen(output, "we");
+		if (fp == NULL) {
+			ret = -errno;
+			INFO("%s: %s\n", output, strerror(errno));
+			goto out;
+		}
+	}
+
+	ret = write_dict(fp);
+	if (fp != stdout && fclose(fp) != 0) {
+		INFO("%s: %s\n", output, strerror(errno));
+		ret = -EIO;
+	}
+out:
+	for (i = 0; maps && i < nfiles; i++)
+		if (maps[i])
+			munmap(maps[i], map_sizes[i]);
+	free(maps);
+	free(map_sizes);
+	free(reg.sites);
+	return ret < 0 ? 1 : 0;
+}
@@ -0,0 +1,15 @@
+LOCAL_PATH := $(call my-dir)
+
+ifeq ("$(TARGET_OS)","linux")
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := libulogger-emu
+LOCAL_DESCRIPTION := Userspace emulation of ulogger devices (LD_PRELOAD)
+LOCAL_CATEGORY_PATH := test
+LOCAL_CFLAGS := -fvisibility=hidden
+LOCAL_SRC_FILES := ulogger_emu.c
+LOCAL_LDLIBS := -ldl -lpthread
+LOCAL_DEPENDS_HEADERS := libulog
+include $(BUILD_SHARED_LIBRARY)
+
+endif
@@ -0,0 +1,1481 @@
+/**
+ * Copyright (C) 2024 Parrot S.A.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * libulogger-emu: userspace emulation of ulogger devices, for testing and
+ * benchmarking on hosts without the ulogger kernel module.
+ *
+ * Preload this library (LD_PRELOAD=libulogger-emu.so) to emulate devices
+ * /dev/ulog_<name>: the open(), close(), read(), write(), writev(), ioctl(),
+ * poll() and mmap() calls made on them are implemented on top of ring buffers in
+ * shared memory files <ULOGGER_EMU_DIR>/ulogger-emu.ulog_<name> (default
+ * directory /dev/shm), using the ring buffer core of the kernel driver. Logs
+ * are created on first open, with a size of 2^ULOGGER_EMU_SIZE bytes (default
+ * 2^18, like the kernel 'main_buffer_size' parameter). If ULOGGER_EMU_KEEP is
+ * set, they also get a keep ring for high priority entries, like the kernel
+ * 'keep' option. If ULOGGER_EMU_NO_MMAP is set, mmap() fails as with older
+ * drivers, and readers fall back to read().
+ *
+ * Emulated file descriptors are actual descriptors of /dev/null, so that
+ * fstat() and fcntl() work as expected. Known limitations:
+ * - duplicated descriptors (dup(), fork()+exec()) are not emulated;
+ * - select(), ppoll() and epoll are not emulated, and poll() waits on
+ *   emulated descriptors by periodic checks;
+ * - all readers can read entries of all users;
+ * - the process name of entries is sampled once per process.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <linux/futex.h>
+
+#include "ulogger.h"
+
+/* not in include path: kernel/ulogger.h would shadow libulog's ulogger.h */
+#include "../kernel/ulogger_ring.h"
+
+#define EMU_EXPORT      __attribute__((visibility("default")))
+#define INFO(...)       fprintf(stderr, "ulogger-emu: " __VA_ARGS__)
+
+#define EMU_DEV_PREFIX    "/dev/"
+#define EMU_FILE_PREFIX   "ulogger-emu."
+#define EMU_DEFAULT_DIR   "/dev/shm"
+#define EMU_DEFAULT_SIZE  18
+#define EMU_MAGIC         0x34454c55 /* "ULE4" */
+#define EMU_MAX_READERS   64
+#define EMU_MAX_FDS       1024
+#define EMU_POLL_SLICE_MS 10
+#define EMU_NAME_MAX      32
+#define EMU_COMM_MAX      16
+
+/* reader offsets, shared by all processes */
+struct emu_reader {
+	int32_t  pid;		/* owner process, 0 if unused */
+	uint32_t __pad;
+	uint64_t r_off;		/* current read head offset */
+	uint64_t r_dropped;	/* dropped entries for reader */
+	uint64_t r_seq;		/* see struct ulogger_ring */
+	uint64_t k_off;		/* read offset in the keep ring */
+	uint64_t k_dropped;	/* entries of the keep ring missed */
+	uint64_t k_seq;
+};
+
+/*
+ * shared memory header, followed by the status page of readers mapping the
+ * log, by the ring buffer (both page aligned), and by the keep ring and its
+ * sequence numbers if the log has one
+ */
+struct emu_log {
+	uint32_t magic;		/* set once initialized */
+	uint32_t size;		/* size of the ring buffer */
+	uint32_t k_size;	/* size of the keep ring, or 0 */
+	uint32_t __pad;
+	char     name[EMU_NAME_MAX];
+	pthread_mutex_t mutex;	/* process-shared, protects everything below */
+	uint32_t seq;		/* futex word, bumped after each write */
+	uint32_t waiters;	/* number of readers blocked on 'seq' */
+	uint64_t w_off;
+	uint64_t head;
+	uint64_t dropped;
+	uint64_t w_seq;
+	uint64_t head_seq;
+	uint64_t k_w_off;	/* keep ring state */
+	uint64_t k_head;
+	uint64_t k_dropped;
+	uint64_t k_w_seq;
+	uint64_t k_head_seq;
+	struct emu_reader readers[EMU_MAX_READERS];
+};
+
+#define EMU_PAGE_SIZE   4096
+#define EMU_STATUS_OFF  ((sizeof(struct emu_log) + EMU_PAGE_SIZE - 1) & \
+			 ~(size_t)(EMU_PAGE_SIZE - 1))
+#define EMU_HDR_SIZE    (EMU_STATUS_OFF + EMU_PAGE_SIZE)
+
+/* an emulated open file */
+struct emu_file {
+	struct emu_log *log;
+	size_t          map_size;
+	int             readable;
+	int             writable;
+	int             raw;	/* raw mode for writes */
+	int             ver;	/* reader ABI version */
+	int             bulk;	/* read as many entries as fit */
+	int             slot;	/* index of reader offsets, or -1 */
+	struct ulogger_ring_names names; /* names sent, in version 3 */
+	struct ulogger_watermark wm;	/* bytes of 0 if no watermark */
+	unsigned long long wm_since;	/* see ulogger_ring_wait_ready() */
+};
+
+/* read positions of a reader, while its log is locked */
+struct emu_pos {
+	size_t             r_off;
+	size_t             r_dropped;
+	unsigned long long r_seq;
+	size_t             k_off;
+	size_t             k_dropped;
+	unsigned long long k_seq;
+};
+
+static struct emu_file *emu_files[EMU_MAX_FDS];
+static pthread_mutex_t emu_files_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* resolve the libc implementation of an interposed function */
+#define REAL(_ret, _name, ...)						\
+	static _ret (*real_##_name)(__VA_ARGS__);			\
+	if (real_##_name == NULL)					\
+		real_##_name = (_ret (*)(__VA_ARGS__))			\
+			dlsym(RTLD_NEXT, #_name)
+
+static struct emu_file *emu_get_file(int fd)
+{
+	if (fd < 0 || fd >= EMU_MAX_FDS)
+		return NULL;
+	return __atomic_load_n(&emu_files[fd], __ATOMIC_ACQUIRE);
+}
+
+static int futex(uint32_t *uaddr, int op, uint32_t val,
+		 const struct timespec *timeout)
+{
+	return (int)syscall(SYS_futex, uaddr, op, val, timeout, NULL, 0);
+}
+
+static void emu_lock(struct emu_log *log)
+{
+	/* a writer died while holding the lock: keep going */
+	if (pthread_mutex_lock(&log->mutex) == EOWNERDEAD)
+		pthread_mutex_consistent(&log->mutex);
+}
+
+static void emu_unlock(struct emu_log *log)
+{
+	pthread_mutex_unlock(&log->mutex);
+}
+
+static struct ulogger_mmap_status *emu_status(struct emu_log *log)
+{
+	return (struct ulogger_mmap_status *)((char *)log + EMU_STATUS_OFF);
+}
+
+/* load ring state of locked log */
+static void emu_ring_get(struct emu_log *log, struct ulogger_ring *ring)
+{
+	ring->buffer = (unsigned char *)log + EMU_HDR_SIZE;
+	ring->size = log->size;
+	ring->w_off = (size_t)log->w_off;
+	ring->head = (size_t)log->head;
+	ring->dropped = (size_t)log->dropped;
+	ring->w_seq = log->w_seq;
+	ring->head_seq = log->head_seq;
+}
+
+/*
+ * tell whether the reader of a locked log has entries to read, and enough of
+ * them if it has a watermark, as the kernel does
+ */
+static int emu_reader_ready(struct emu_file *file,
+			    const struct ulogger_ring *ring)
+{
+	const struct emu_reader *reader = &file->log->readers[file->slot];
+	struct timespec ts;
+
+	if (file->wm.bytes == 0)
+		return ring->w_off != reader->r_off;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ulogger_ring_wait_ready(ring, (size_t)reader->r_off,
+				       (size_t)reader->r_dropped,
+				       file->wm.bytes,
+				       file->wm.latency_ms * 1000000ULL,
+				       &file->wm_since,
+				       ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/* store ring state of locked log */
+static void emu_ring_put(struct emu_log *log, const struct ulogger_ring *ring)
+{
+	log->w_off = ring->w_off;
+	log->head = ring->head;
+	log->dropped = ring->dropped;
+	log->w_seq = ring->w_seq;
+	log->head_seq = ring->head_seq;
+}
+
+/* bytes of shared memory after the ring buffer for a keep ring of 'k_size' */
+static size_t emu_keep_len(size_t k_size)
+{
+	return k_size ? k_size + ulogger_ring_keep_nr_seqs(k_size) *
+		sizeof(unsigned long long) : 0;
+}
+
+/* load keep ring state of locked log, which has one */
+static void emu_keep_get(struct emu_log *log, struct ulogger_ring_keep *keep)
+{
+	keep->ring.buffer = (unsigned char *)log + EMU_HDR_SIZE + log->size;
+	keep->ring.size = log->k_size;
+	keep->ring.w_off = (size_t)log->k_w_off;
+	keep->ring.head = (size_t)log->k_head;
+	keep->ring.dropped = (size_t)log->k_dropped;
+	keep->ring.w_seq = log->k_w_seq;
+	keep->ring.head_seq = log->k_head_seq;
+	keep->seqs = (unsigned long long *)(keep->ring.buffer + log->k_size);
+	keep->nr_seqs = ulogger_ring_keep_nr_seqs(log->k_size);
+}
+
+/* store keep ring state of locked log */
+static void emu_keep_put(struct emu_log *log,
+			 const struct ulogger_ring_keep *keep)
+{
+	log->k_w_off = keep->ring.w_off;
+	log->k_head = keep->ring.head;
+	log->k_dropped = keep->ring.dropped;
+	log->k_w_seq = keep->ring.w_seq;
+	log->k_head_seq = keep->ring.head_seq;
+}
+
+static void emu_pos_get(const struct emu_reader *reader, struct emu_pos *pos)
+{
+	pos->r_off = (size_t)reader->r_off;
+	pos->r_dropped = (size_t)reader->r_dropped;
+	pos->r_seq = reader->r_seq;
+	pos->k_off = (size_t)reader->k_off;
+	pos->k_dropped = (size_t)reader->k_dropped;
+	pos->k_seq = reader->k_seq;
+}
+
+static void emu_pos_put(struct emu_reader *reader, const struct emu_pos *pos)
+{
+	reader->r_off = pos->r_off;
+	reader->r_dropped = pos->r_dropped;
+	reader->r_seq = pos->r_seq;
+	reader->k_off = pos->k_off;
+	reader->k_dropped = pos->k_dropped;
+	reader->k_seq = pos->k_seq;
+}
+
+/* return log name if 'path' is a ulogger device, like the kernel does */
+static const char *emu_log_name(const char *path)
+{
+	const char *name, *p;
+
+	if (path == NULL ||
+	    strncmp(path, EMU_DEV_PREFIX, strlen(EMU_DEV_PREFIX)) != 0)
+		return NULL;
+
+	name = path + strlen(EMU_DEV_PREFIX);
+	if (strncmp(name, "ulog_", 5) != 0 || name[5] == '\0' ||
+	    strlen(name) >= EMU_NAME_MAX)
+		return NULL;
+
+	for (p = name + 5; *p; p++)
+		if (!islower((unsigned char)*p))
+			return NULL;
+
+	return name;
+}
+
+static int emu_init_log(struct emu_log *log, const char *name, size_t size,
+			size_t k_size)
+{
+	pthread_mutexattr_t attr;
+	int ret;
+
+	snprintf(log->name, sizeof(log->name), "%s", name);
+	log->size = (uint32_t)size;
+	log->k_size = (uint32_t)k_size;
+	/* sequence numbers start at 1 */
+	log->w_seq = 1;
+	log->head_seq = 1;
+	log->k_w_seq = 1;
+	log->k_head_seq = 1;
+	emu_status(log)->size = (uint32_t)size;
+	emu_status(log)->offset = EMU_PAGE_SIZE;
+
+	ret = pthread_mutexattr_init(&attr);
+	if (ret == 0)
+		ret = pthread_mutexattr_setpshared(&attr,
+						   PTHREAD_PROCESS_SHARED);
+	if (ret == 0)
+		ret = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	if (ret == 0)
+		ret = pthread_mutex_init(&log->mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+	if (ret != 0)
+		return -ret;
+
+	__atomic_store_n(&log->magic, EMU_MAGIC, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* path of the shared memory file of log 'name' */
+static void emu_log_path(const char *name, char *path, size_t size)
+{
+	const char *dir;
+
+	dir = getenv("ULOGGER_EMU_DIR");
+	if (dir == NULL)
+		dir = EMU_DEFAULT_DIR;
+	snprintf(path, size, "%s/" EMU_FILE_PREFIX "%s", dir, name);
+}
+
+/* map shared memory of log 'name', creating it if needed */
+static int emu_map_log(const char *name, struct emu_log **plog,
+		       size_t *map_size)
+{
+	REAL(int, open, const char *, int, ...);
+	const char *prop;
+	char path[PATH_MAX];
+	struct stat st;
+	struct emu_log *log;
+	int fd, i, creator = 1, pow2 = EMU_DEFAULT_SIZE;
+	size_t size, k_size = 0;
+
+	emu_log_path(name, path, sizeof(path));
+
+	fd = real_open(path, O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC, 0666);
+	if (fd < 0 && errno == EEXIST) {
+		creator = 0;
+		fd = real_open(path, O_RDWR|O_CLOEXEC);
+	}
+	if (fd < 0)
+		return -errno;
+
+	if (creator) {
+		/* 16 kB <= size <= 16 MB, as in the kernel */
+		prop = getenv("ULOGGER_EMU_SIZE");
+		if (prop)
+			pow2 = atoi(prop);
+		if (pow2 < 14 || pow2 > 24) {
+			INFO("invalid ULOGGER_EMU_SIZE '%s'\n", prop);
+			pow2 = EMU_DEFAULT_SIZE;
+		}
+		size = (size_t)1 << pow2;
+		if (getenv("ULOGGER_EMU_KEEP"))
+			k_size = ulogger_ring_keep_size(size);
+		/* logs are shared by all users, as /dev/ulog_* devices */
+		if (fchmod(fd, 0666) < 0 ||
+		    ftruncate(fd, (off_t)(EMU_HDR_SIZE + size +
+					  emu_keep_len(k_size))) < 0)
+			goto error;
+	} else {
+		/* wait for the creator to size the file */
+		for (i = 0; i < 100; i++) {
+			if (fstat(fd, &st) < 0)
+				goto error;
+			if ((size_t)st.st_size > EMU_HDR_SIZE)
+				break;
+			usleep(10000);
+		}
+		if ((size_t)st.st_size <= EMU_HDR_SIZE) {
+			errno = EINVAL;
+			goto error;
+		}
+		/* the ring buffer is the largest power of two which fits */
+		size = (size_t)st.st_size - EMU_HDR_SIZE;
+		while (size & (size-1))
+			size &= size - 1;
+		if ((size_t)st.st_size - EMU_HDR_SIZE > size)
+			k_size = ulogger_ring_keep_size(size);
+		if ((size_t)st.st_size != EMU_HDR_SIZE + size +
+		    emu_keep_len(k_size)) {
+			errno = EINVAL;
+			goto error;
+		}
+	}
+
+	*map_size = EMU_HDR_SIZE + size + emu_keep_len(k_size);
+	log = mmap(NULL, *map_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (log == MAP_FAILED)
+		goto error;
+	close(fd);
+
+	if (creator) {
+		errno = -emu_init_log(log, name, size, k_size);
+		if (errno != 0)
+			goto error_unmap;
+	} else {
+		/* wait for the creator to initialize the header */
+		for (i = 0; i < 100; i++) {
+			if (__atomic_load_n(&log->magic, __ATOMIC_ACQUIRE) ==
+			    EMU_MAGIC)
+				break;
+			usleep(10000);
+		}
+		if (log->magic != EMU_MAGIC || log->size != size ||
+		    log->k_size != k_size) {
+			INFO("%s: invalid shared memory file\n", path);
+			errno = EINVAL;
+			goto error_unmap;
+		}
+	}
+
+	*plog = log;
+	return 0;
+
+error_unmap:
+	i = errno;
+	munmap(log, *map_size);
+	return -i;
+error:
+	i = errno;
+	close(fd);
+	return -i;
+}
+
+/* is reader slot owned by a dead process ? */
+static int emu_slot_is_stale(const struct emu_reader *reader)
+{
+	return kill(reader->pid, 0) < 0 && errno == ESRCH;
+}
+
+static int emu_add_reader(struct emu_log *log)
+{
+	struct emu_reader *reader;
+	int i, slot = -1;
+
+	emu_lock(log);
+	for (i = 0; i < EMU_MAX_READERS; i++) {
+		reader = &log->readers[i];
+		if (reader->pid == 0 || emu_slot_is_stale(reader)) {
+			reader->pid = getpid();
+			reader->r_off = log->head;
+			reader->r_dropped = log->dropped;
+			reader->r_seq = log->head_seq;
+			reader->k_off = log->k_head;
+			reader->k_dropped = log->k_dropped;
+			reader->k_seq = log->k_head_seq;
+			slot = i;
+			break;
+		}
+	}
+	emu_unlock(log);
+
+	return slot;
+}
+
+static int emu_open(const char *name, int flags)
+{
+	REAL(int, open, const char *, int, ...);
+	struct emu_file *file;
+	int fd, ret, accmode = flags & O_ACCMODE;
+
+	file = calloc(1, sizeof(*file));
+	if (file == NULL)
+		return -1;
+
+	file->readable = (accmode == O_RDONLY || accmode == O_RDWR);
+	file->writable = (accmode == O_WRONLY || accmode == O_RDWR);
+	file->ver = 2;
+	file->slot = -1;
+
+	ret = emu_map_log(name, &file->log, &file->map_size);
+	if (ret < 0) {
+		free(file);
+		errno = -ret;
+		return -1;
+	}
+
+	if (file->readable) {
+		file->slot = emu_add_reader(file->log);
+		if (file->slot < 0) {
+			ret = -ENOMEM;
+			goto error;
+		}
+	}
+
+	/* keep status flags (O_NONBLOCK...) in a real file descriptor */
+	fd = real_open("/dev/null",
+		       flags & (O_ACCMODE|O_NONBLOCK|O_CLOEXEC));
+	if (fd < 0) {
+		ret = -errno;
+		goto error;
+	}
+	if (fd >= EMU_MAX_FDS) {
+		close(fd);
+		ret = -EMFILE;
+		goto error;
+	}
+
+	pthread_mutex_lock(&emu_files_mutex);
+	__atomic_store_n(&emu_files[fd], file, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&emu_files_mutex);
+	return fd;
+
+error:
+	if (file->slot >= 0) {
+		emu_lock(file->log);
+		file->log->readers[file->slot].pid = 0;
+		emu_unlock(file->log);
+	}
+	munmap(file->log, file->map_size);
+	free(file);
+	errno = -ret;
+	return -1;
+}
+
+static void emu_close(int fd)
+{
+	struct emu_file *file;
+
+	pthread_mutex_lock(&emu_files_mutex);
+	file = emu_files[fd];
+	__atomic_store_n(&emu_files[fd], NULL, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&emu_files_mutex);
+
+	if (file->slot >= 0) {
+		emu_lock(file->log);
+		file->log->readers[file->slot].pid = 0;
+		emu_unlock(file->log);
+	}
+	munmap(file->log, file->map_size);
+	free(file);
+}
+
+/*
+ * Fill 'header' with the identity of the current task and the current time,
+ * and retrieve null-terminated process and thread names into 'pcomm' and
+ * 'tcomm' (thread name is empty if pid == tid), as the kernel does.
+ */
+static void emu_current_header(struct ulogger_entry *header, char *pcomm,
+			       size_t *plen, char *tcomm, size_t *tlen)
+{
+	REAL(int, open, const char *, int, ...);
+	static char comm[EMU_COMM_MAX + 1];
+	static pid_t comm_pid;
+	struct timespec now;
+	ssize_t len;
+	int fd;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	header->pid = getpid();
+	header->tid = (int32_t)syscall(SYS_gettid);
+
+	/* process name of /proc/self is the thread group leader's */
+	if (comm_pid != header->pid) {
+		len = 0;
+		fd = real_open("/proc/self/comm", O_RDONLY|O_CLOEXEC);
+		if (fd >= 0) {
+			len = read(fd, comm, EMU_COMM_MAX);
+			close(fd);
+		}
+		if (len > 0 && comm[len-1] == '\n')
+			len--;
+		comm[len > 0 ? len : 0] = '\0';
+		comm_pid = header->pid;
+	}
+	snprintf(pcomm, EMU_COMM_MAX + 1, "%s", comm);
+	*plen = strlen(pcomm) + 1;
+
+	*tlen = 0;
+	if (header->pid != header->tid) {
+		tcomm[0] = '\0';
+		prctl(PR_GET_NAME, tcomm, 0, 0, 0);
+		tcomm[EMU_COMM_MAX] = '\0';
+		*tlen = strlen(tcomm) + 1;
+	}
+
+	header->sec = (int32_t)now.tv_sec;
+	header->nsec = (int32_t)now.tv_nsec;
+	header->euid = (int32_t)geteuid();
+}
+
+/* fix up start head and readers of locked log for a write of 'len' bytes */
+static void emu_reserve(struct emu_log *log, struct ulogger_ring *ring,
+			size_t len)
+{
+	struct emu_reader *reader;
+	size_t r_off, r_dropped;
+	int i;
+
+	ulogger_ring_mmap_begin(ring, emu_status(log), len);
+	ulogger_ring_fix_up(ring, len, &ring->head, &ring->dropped);
+
+	for (i = 0; i < EMU_MAX_READERS; i++) {
+		reader = &log->readers[i];
+		if (reader->pid == 0)
+			continue;
+		r_off = (size_t)reader->r_off;
+		r_dropped = (size_t)reader->r_dropped;
+		ulogger_ring_fix_up(ring, len, &r_off, &r_dropped);
+		reader->r_off = r_off;
+		reader->r_dropped = r_dropped;
+	}
+}
+
+/*
+ * copy the entry of 'len' bytes just written at 'off' to the keep ring of
+ * locked log, if it has one and the entry is of high priority
+ */
+static void emu_keep_entry(struct emu_log *log,
+			   const struct ulogger_ring *ring, size_t off,
+			   size_t len)
+{
+	struct ulogger_ring_keep keep;
+	struct emu_reader *reader;
+	size_t k_off, k_dropped;
+	int i, prio;
+
+	if (!log->k_size)
+		return;
+
+	prio = ulogger_ring_entry_priority(ring, off);
+	if (prio < 0 || prio > ULOGGER_KEEP_PRIORITY)
+		return;
+
+	emu_keep_get(log, &keep);
+	ulogger_ring_fix_up(&keep.ring, len, &keep.ring.head,
+			    &keep.ring.dropped);
+
+	for (i = 0; i < EMU_MAX_READERS; i++) {
+		reader = &log->readers[i];
+		if (reader->pid == 0)
+			continue;
+		k_off = (size_t)reader->k_off;
+		k_dropped = (size_t)reader->k_dropped;
+		ulogger_ring_fix_up(&keep.ring, len, &k_off, &k_dropped);
+		reader->k_off = k_off;
+		reader->k_dropped = k_dropped;
+	}
+
+	ulogger_ring_keep_write(&keep, ring, off, len, ring->w_seq);
+	emu_keep_put(log, &keep);
+}
+
+/* unlock log after writes, and wake up blocked readers */
+static void emu_commit(struct emu_log *log, const struct ulogger_ring *ring)
+{
+	ulogger_ring_mmap_end(ring, emu_status(log));
+	emu_ring_put(log, ring);
+	__atomic_add_fetch(&log->seq, 1, __ATOMIC_RELEASE);
+	emu_unlock(log);
+
+	if (__atomic_load_n(&log->waiters, __ATOMIC_ACQUIRE))
+		futex(&log->seq, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+/* gather up to 'len' bytes of 'iov' into 'dst', return copied length */
+static size_t emu_gather(char *dst, size_t len, const struct iovec *iov,
+			 int iovcnt)
+{
+	size_t n, off = 0;
+	int i;
+
+	for (i = 0; i < iovcnt && off < len; i++) {
+		n = ulogger_ring_min(iov[i].iov_len, len - off);
+		memcpy(dst + off, iov[i].iov_base, n);
+		off += n;
+	}
+
+	return off;
+}
+
+/*
+ * Build an entry from a write() of 'iov' into 'entry', the same way the
+ * kernel does. Return the number of user bytes stored, and the total entry
+ * length in '*size'.
+ */
+static ssize_t emu_build_entry(struct emu_file *file, char *entry,
+			       size_t *size, const struct iovec *iov,
+			       int iovcnt)
+{
+	struct ulogger_entry header;
+	const size_t prefix = sizeof(header.len) + sizeof(header.hdr_size);
+	char tcomm[EMU_COMM_MAX + 1];
+	char pcomm[EMU_COMM_MAX + 1];
+	size_t tlen = 0, plen = 0, len = 0, off;
+	ssize_t ret;
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	if (file->raw) {
+		if (len < (sizeof(struct ulogger_entry) - prefix))
+			return -EINVAL;
+		/* user payload must contain a partial ulogger_entry */
+		len -= (sizeof(struct ulogger_entry) - prefix);
+		header.len = ulogger_ring_min(len, ULOGGER_ENTRY_MAX_PAYLOAD);
+	} else {
+		emu_current_header(&header, pcomm, &plen, tcomm, &tlen);
+		header.len = ulogger_ring_min(plen + tlen + len,
+					      ULOGGER_ENTRY_MAX_PAYLOAD);
+	}
+
+	header.hdr_size = sizeof(struct ulogger_entry);
+
+	/* null writes succeed, return zero */
+	if (!header.len) {
+		*size = 0;
+		return 0;
+	}
+
+	*size = sizeof(struct ulogger_entry) + header.len;
+
+	if (file->raw) {
+		memcpy(entry, &header, prefix);
+		off = prefix;
+	} else {
+		memcpy(entry, &header, sizeof(struct ulogger_entry));
+		off = sizeof(struct ulogger_entry);
+		/* append null-terminated process and thread names */
+		memcpy(entry + off, pcomm, plen);
+		off += plen;
+		memcpy(entry + off, tcomm, tlen);
+		off += tlen;
+	}
+
+	ret = (ssize_t)emu_gather(entry + off, *size - off, iov, iovcnt);
+	return ret;
+}
+
+static ssize_t emu_writev(struct emu_file *file, const struct iovec *iov,
+			  int iovcnt)
+{
+	struct emu_log *log = file->log;
+	struct ulogger_ring ring;
+	char entry[sizeof(struct ulogger_entry) + ULOGGER_ENTRY_MAX_PAYLOAD];
+	size_t size, start;
+	ssize_t ret;
+
+	if (!file->writable)
+		return -EBADF;
+
+	ret = emu_build_entry(file, entry, &size, iov, iovcnt);
+	if (ret <= 0)
+		return ret;
+
+	emu_lock(log);
+	emu_ring_get(log, &ring);
+	emu_reserve(log, &ring, size);
+	start = ring.w_off;
+	ulogger_ring_write(&ring, entry, size);
+	emu_keep_entry(log, &ring, start, size);
+	ring.w_seq++;
+	emu_commit(log, &ring);
+
+	return ret;
+}
+
+/*
+ * read the entry at the position of a reader of locked log, or if it missed
+ * dropped entries, those still in the keep ring and summaries of the others
+ */
+static ssize_t emu_read_entry(struct emu_file *file,
+			      const struct ulogger_ring *ring,
+			      const struct ulogger_ring_keep *keep,
+			      struct emu_pos *pos, char *buf, size_t count)
+{
+	if (pos->r_dropped > 0)
+		return ulogger_ring_read_dropped(ring, keep, file->log->name,
+						 pos->r_off, file->ver,
+						 &file->names, &pos->r_dropped,
+						 &pos->r_seq, &pos->k_off,
+						 &pos->k_dropped, &pos->k_seq,
+						 buf, count);
+
+	/* get exactly one record from the log */
+	return ulogger_ring_read_record(ring, &pos->r_off, file->ver,
+					&file->names, &pos->r_seq, buf, count);
+}
+
+/* in bulk mode, read the whole records which fit after the first one */
+static ssize_t emu_read_more(struct emu_file *file,
+			     const struct ulogger_ring *ring,
+			     const struct ulogger_ring_keep *keep,
+			     struct emu_pos *pos, char *buf, size_t count)
+{
+	ssize_t ret, total = 0;
+
+	while (ring->w_off != pos->r_off) {
+		ret = emu_read_entry(file, ring, keep, pos, buf + total,
+				     count);
+		if (ret < 0)
+			break;
+
+		total += ret;
+		count -= ret;
+	}
+
+	return total;
+}
+
+static ssize_t emu_read(int fd, struct emu_file *file, char *buf,
+			size_t count)
+{
+	REAL(int, fcntl, int, int, ...);
+	struct emu_log *log = file->log;
+	struct emu_reader *reader;
+	struct ulogger_ring ring;
+	struct ulogger_ring_keep keep;
+	struct emu_pos pos;
+	struct timespec slice = { 0, EMU_POLL_SLICE_MS * 1000000L };
+	uint32_t seq;
+	ssize_t ret;
+	int nonblock;
+
+	if (!file->readable)
+		return -EBADF;
+
+	reader = &log->readers[file->slot];
+	nonblock = real_fcntl(fd, F_GETFL) & O_NONBLOCK;
+
+	while (1) {
+		emu_lock(log);
+		emu_ring_get(log, &ring);
+		/* non-blocking readers get whatever is there */
+		if (nonblock ? ring.w_off != reader->r_off :
+			       emu_reader_ready(file, &ring))
+			break;
+
+		seq = log->seq;
+		emu_unlock(log);
+
+		if (nonblock)
+			return -EAGAIN;
+
+		/* with a watermark, check again for the end of its latency */
+		__atomic_add_fetch(&log->waiters, 1, __ATOMIC_ACQ_REL);
+		ret = futex(&log->seq, FUTEX_WAIT, seq,
+			    file->wm.bytes ? &slice : NULL);
+		__atomic_sub_fetch(&log->waiters, 1, __ATOMIC_ACQ_REL);
+		if (ret < 0 && errno == EINTR)
+			return -EINTR;
+	}
+
+	if (log->k_size)
+		emu_keep_get(log, &keep);
+
+	emu_pos_get(reader, &pos);
+	ret = emu_read_entry(file, &ring, log->k_size ? &keep : NULL, &pos,
+			     buf, count);
+
+	if (file->bulk && ret > 0)
+		ret += emu_read_more(file, &ring, log->k_size ? &keep : NULL,
+				     &pos, buf + ret, count - ret);
+
+	emu_pos_put(reader, &pos);
+	emu_unlock(log);
+	return ret;
+}
+
+/* write several entries with a single lock acquisition */
+static long emu_write_batch(struct emu_file *file,
+			    const struct ulogger_batch *batch)
+{
+	struct emu_log *log = file->log;
+	struct ulogger_ring ring;
+	struct ulogger_entry header;
+	const char *buf = (const char *)(uintptr_t)batch->buf;
+	char *entries, *entry;
+	size_t off, start, size, total;
+	struct iovec iov;
+	__u32 i;
+
+	if (batch->len > ULOGGER_BATCH_MAX_LEN)
+		return -E2BIG;
+
+	if (!batch->count || !batch->len)
+		return 0;
+
+	/* check that all records are within buffer */
+	for (i = 0, off = 0; i < batch->count; i++) {
+		if (batch->len - off < sizeof(struct ulogger_entry))
+			return -EINVAL;
+		memcpy(&header, buf + off, sizeof(header));
+		off += sizeof(struct ulogger_entry);
+		if (batch->len - off < header.len)
+			return -EINVAL;
+		off += header.len;
+	}
+
+	/* build all entries before taking the lock; names may be added */
+	entries = malloc(batch->len + batch->count * 2 * (EMU_COMM_MAX + 1));
+	if (entries == NULL)
+		return -ENOMEM;
+
+	for (i = 0, off = 0, total = 0; i < batch->count; i++) {
+		memcpy(&header, buf + off, sizeof(header));
+		off += sizeof(struct ulogger_entry);
+
+		/* raw records carry their header, as a raw write() */
+		if (file->raw) {
+			iov.iov_base = (char *)buf + off - sizeof(header) +
+				       sizeof(header.len) +
+				       sizeof(header.hdr_size);
+			iov.iov_len = sizeof(header) - sizeof(header.len) -
+				      sizeof(header.hdr_size) + header.len;
+		} else {
+			iov.iov_base = (char *)buf + off;
+			iov.iov_len = header.len;
+		}
+		off += header.len;
+
+		/* null writes succeed, skip them */
+		if (!header.len)
+			continue;
+
+		if (emu_build_entry(file, entries + total, &size, &iov, 1) < 0)
+			continue;
+		total += size;
+	}
+
+	emu_lock(log);
+	emu_ring_get(log, &ring);
+	for (off = 0; off < total; off += size) {
+		entry = entries + off;
+		memcpy(&header, entry, sizeof(header));
+		size = sizeof(struct ulogger_entry) + header.len;
+		emu_reserve(log, &ring, size);
+		start = ring.w_off;
+		ulogger_ring_write(&ring, entry, size);
+		emu_keep_entry(log, &ring, start, size);
+		ring.w_seq++;
+	}
+	emu_commit(log, &ring);
+
+	free(entries);
+	return batch->count;
+}
+
+static long emu_ioctl(struct emu_file *file, unsigned long cmd, void *arg)
+{
+	struct emu_log *log = file->log;
+	struct emu_reader *reader;
+	struct ulogger_ring ring;
+	struct ulogger_ring_keep keep;
+	long ret = -EINVAL;
+	size_t r_off, r_dropped;
+	unsigned long long r_seq;
+	uint64_t pos, seq;
+	int i, val;
+
+	/* batch writes handle locking by themselves */
+	if (cmd == ULOGGER_WRITE_BATCH) {
+		if (!file->writable)
+			return -EBADF;
+		return emu_write_batch(file, arg);
+	}
+
+	emu_lock(log);
+	emu_ring_get(log, &ring);
+	reader = file->readable ? &log->readers[file->slot] : NULL;
+
+	switch (cmd) {
+	case ULOGGER_GET_LOG_BUF_SIZE:
+		ret = ring.size;
+		break;
+	case ULOGGER_GET_LOG_LEN:
+		if (!reader) {
+			ret = -EBADF;
+			break;
+		}
+		ret = ulogger_ring_readable(&ring, reader->r_off);
+		/* dropped entries may still be read from the keep ring */
+		if (log->k_size && reader->r_dropped) {
+			emu_keep_get(log, &keep);
+			ret += ulogger_ring_readable(&keep.ring,
+						     reader->k_off);
+		}
+		break;
+	case ULOGGER_GET_NEXT_ENTRY_LEN:
+		if (!reader) {
+			ret = -EBADF;
+			break;
+		}
+		if (ring.w_off != reader->r_off)
+			ret = ulogger_ring_record_len(&ring, reader->r_off,
+						      file->ver, &file->names);
+		else
+			ret = 0;
+		break;
+	case ULOGGER_FLUSH_LOG:
+		if (!file->writable) {
+			ret = -EBADF;
+			break;
+		}
+		for (i = 0; i < EMU_MAX_READERS; i++) {
+			log->readers[i].r_off = ring.w_off;
+			log->readers[i].r_dropped = 0;
+			log->readers[i].r_seq = ring.w_seq;
+			log->readers[i].k_off = log->k_w_off;
+			log->readers[i].k_dropped = 0;
+			log->readers[i].k_seq = log->k_w_seq;
+		}
+		ring.head = ring.w_off;
+		ring.dropped = 0;
+		ring.head_seq = ring.w_seq;
+		ulogger_ring_mmap_end(&ring, emu_status(log));
+		emu_ring_put(log, &ring);
+		log->k_head = log->k_w_off;
+		log->k_dropped = 0;
+		log->k_head_seq = log->k_w_seq;
+		ret = 0;
+		break;
+	case ULOGGER_GET_VERSION:
+		if (!reader) {
+			ret = -EBADF;
+			break;
+		}
+		ret = file->ver;
+		break;
+	case ULOGGER_SET_VERSION:
+		if (!reader) {
+			ret = -EBADF;
+			break;
+		}
+		memcpy(&val, arg, sizeof(val));
+		if ((val < 1) || (val > 3))
+			break;
+		/* names are sent again */
+		if (val == 3)
+			memset(&file->names, 0, sizeof(file->names));
+		file->ver = val;
+		ret = 0;
+		break;
+	case ULOGGER_SET_RAW_MODE:
+		if (!file->writable) {
+			ret = -EBADF;
+			break;
+		}
+		memcpy(&val, arg, sizeof(val));
+		if ((val != 0) && (val != 1))
+			break;
+		file->raw = val;
+		ret = 0;
+		break;
+	case ULOGGER_SET_BULK_READ:
+		if (!reader) {
+			ret = -EBADF;
+			break;
+		}
+		memcpy(&val, arg, sizeof(val));
+		if ((val != 0) && (val != 1))
+			break;
+		file->bulk = val;
+		ret = 0;
+		break;
+	case ULOGGER_SET_READ_POS:
+		if (!reader) {
+			ret = -EBADF;
+			break;
+		}
+		memcpy(&pos, arg, sizeof(pos));
+		if (pos > emu_status(log)->w_pos)
+			break;
+		/* older entries may have been overwritten */
+		if (pos < emu_status(log)->head)
+			pos = emu_status(log)->head;
+		/* count entries skipped, to number the next ones */
+		r_off = (size_t)reader->r_off;
+		r_dropped = (size_t)reader->r_dropped;
+		r_seq = reader->r_seq;
+		ulogger_ring_seek(&ring, ulogger_ring_offset(&ring, pos),
+				  &r_off, &r_dropped, &r_seq);
+		reader->r_off = r_off;
+		reader->r_dropped = r_dropped;
+		reader->r_seq = r_seq;
+		ret = 0;
+		break;
+	case ULOGGER_SET_READ_SEQ:
+		if (!reader) {
+			ret = -EBADF;
+			break;
+		}
+		memcpy(&seq, arg, sizeof(seq));
+		r_off = (size_t)reader->r_off;
+		r_dropped = (size_t)reader->r_dropped;
+		r_seq = reader->r_seq;
+		ulogger_ring_seek_seq(&ring, seq, &r_off, &r_dropped, &r_seq);
+		reader->r_off = r_off;
+		reader->r_dropped = r_dropped;
+		reader->r_seq = r_seq;
+		ret = 0;
+		break;
+	case ULOGGER_SET_WATERMARK:
+		if (!reader) {
+			ret = -EBADF;
+			break;
+		}
+		memcpy(&file->wm, arg, sizeof(file->wm));
+		if (file->wm.bytes <= 1)
+			file->wm.bytes = 0;
+		else if (file->wm.bytes > ring.size / 2)
+			file->wm.bytes = ring.size / 2;
+		file->wm_since = 0;
+		ret = 0;
+		break;
+	}
+
+	emu_unlock(log);
+
+	return ret;
+}
+
+/* map the status page and ring buffer of a log read-only, as the kernel does */
+static void *emu_mmap(struct emu_file *file, void *addr, size_t len, int prot,
+		      int flags, off_t offset)
+{
+	REAL(int, open, const char *, int, ...);
+	REAL(void *, mmap, void *, size_t, int, int, int, off_t);
+	char path[PATH_MAX];
+	void *ret;
+	int fd;
+
+	/* read() merges kept entries with those of the log */
+	if (getenv("ULOGGER_EMU_NO_MMAP") || file->log->k_size) {
+		errno = ENODEV;
+		return MAP_FAILED;
+	}
+	if (!file->readable) {
+		errno = EACCES;
+		return MAP_FAILED;
+	}
+	if (prot & PROT_WRITE) {
+		errno = EPERM;
+		return MAP_FAILED;
+	}
+	if (offset != 0 || len != EMU_PAGE_SIZE + file->log->size) {
+		errno = EINVAL;
+		return MAP_FAILED;
+	}
+
+	emu_log_path(file->log->name, path, sizeof(path));
+	fd = real_open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return MAP_FAILED;
+
+	ret = real_mmap(addr, len, prot, flags, fd, (off_t)EMU_STATUS_OFF);
+	close(fd);
+	return ret;
+}
+
+/* poll readiness of an emulated file, as the kernel does */
+static short emu_poll_file(struct emu_file *file)
+{
+	struct emu_log *log = file->log;
+	struct ulogger_ring ring;
+	short ret = POLLOUT | POLLWRNORM;
+
+	if (!file->readable)
+		return ret;
+
+	emu_lock(log);
+	emu_ring_get(log, &ring);
+	if (emu_reader_ready(file, &ring))
+		ret |= POLLIN | POLLRDNORM;
+	emu_unlock(log);
+
+	return ret;
+}
+
+static int64_t emu_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Interposed functions
+ */
+
+static int emu_open_common(const char *path, int flags, mode_t mode,
+			   int (*real)(const char *, int, ...))
+{
+	const char *name = emu_log_name(path);
+
+	if (name == NULL)
+		return real(path, flags, mode);
+
+	return emu_open(name, flags);
+}
+
+EMU_EXPORT int open(const char *path, int flags, ...)
+{
+	REAL(int, open, const char *, int, ...);
+	mode_t mode = 0;
+	va_list ap;
+
+	if (flags & (O_CREAT|O_TMPFILE)) {
+		va_start(ap, flags);
+		mode = va_arg(ap, mode_t);
+		va_end(ap);
+	}
+
+	return emu_open_common(path, flags, mode, real_open);
+}
+
+EMU_EXPORT int open64(const char *path, int flags, ...)
+{
+	REAL(int, open64, const char *, int, ...);
+	mode_t mode = 0;
+	va_list ap;
+
+	if (flags & (O_CREAT|O_TMPFILE)) {
+		va_start(ap, flags);
+		mode = va_arg(ap, mode_t);
+		va_end(ap);
+	}
+
+	return emu_open_common(path, flags, mode, real_open64);
+}
+
+EMU_EXPORT int __open_2(const char *path, int flags)
+{
+	REAL(int, open, const char *, int, ...);
+	return emu_open_common(path, flags, 0, real_open);
+}
+
+EMU_EXPORT int __open64_2(const char *path, int flags)
+{
+	REAL(int, open64, const char *, int, ...);
+	return emu_open_common(path, flags, 0, real_open64);
+}
+
+EMU_EXPORT int openat(int dirfd, const char *path, int flags, ...)
+{
+	REAL(int, openat, int, const char *, int, ...);
+	mode_t mode = 0;
+	va_list ap;
+
+	if (flags & (O_CREAT|O_TMPFILE)) {
+		va_start(ap, flags);
+		mode = va_arg(ap, mode_t);
+		va_end(ap);
+	}
+
+	/* device paths are absolute, 'dirfd' does not matter */
+	if (emu_log_name(path))
+		return emu_open(emu_log_name(path), flags);
+
+	return real_openat(dirfd, path, flags, mode);
+}
+
+EMU_EXPORT int close(int fd)
+{
+	REAL(int, close, int);
+
+	if (emu_get_file(fd))
+		emu_close(fd);
+
+	return real_close(fd);
+}
+
+EMU_EXPORT ssize_t read(int fd, void *buf, size_t count)
+{
+	REAL(ssize_t, read, int, void *, size_t);
+	struct emu_file *file = emu_get_file(fd);
+	ssize_t ret;
+
+	if (file == NULL)
+		return real_read(fd, buf, count);
+
+	ret = emu_read(fd, file, buf, count);
+	if (ret < 0) {
+		errno = (int)-ret;
+		return -1;
+	}
+	return ret;
+}
+
+EMU_EXPORT ssize_t __read_chk(int fd, void *buf, size_t count, size_t buflen)
+{
+	if (count > buflen)
+		abort();
+	return read(fd, buf, count);
+}
+
+EMU_EXPORT ssize_t writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	REAL(ssize_t, writev, int, const struct iovec *, int);
+	struct emu_file *file = emu_get_file(fd);
+	ssize_t ret;
+
+	if (file == NULL)
+		return real_writev(fd, iov, iovcnt);
+
+	ret = emu_writev(file, iov, iovcnt);
+	if (ret < 0) {
+		errno = (int)-ret;
+		return -1;
+	}
+	return ret;
+}
+
+EMU_EXPORT ssize_t write(int fd, const void *buf, size_t count)
+{
+	REAL(ssize_t, write, int, const void *, size_t);
+	struct emu_file *file = emu_get_file(fd);
+	struct iovec iov;
+	ssize_t ret;
+
+	if (file == NULL)
+		return real_write(fd, buf, count);
+
+	iov.iov_base = (void *)buf;
+	iov.iov_len = count;
+	ret = emu_writev(file, &iov, 1);
+	if (ret < 0) {
+		errno = (int)-ret;
+		return -1;
+	}
+	return ret;
+}
+
+EMU_EXPORT int ioctl(int fd, unsigned long request, ...)
+{
+	REAL(int, ioctl, int, unsigned long, ...);
+	struct emu_file *file = emu_get_file(fd);
+	void *arg;
+	long ret;
+	va_list ap;
+
+	va_start(ap, request);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+
+	if (file == NULL)
+		return real_ioctl(fd, request, arg);
+
+	ret = emu_ioctl(file, request, arg);
+	if (ret < 0) {
+		errno = (int)-ret;
+		return -1;
+	}
+	return (int)ret;
+}
+
+EMU_EXPORT void *mmap(void *addr, size_t len, int prot, int flags, int fd,
+		      off_t offset)
+{
+	REAL(void *, mmap, void *, size_t, int, int, int, off_t);
+	struct emu_file *file = emu_get_file(fd);
+
+	if (file == NULL || (flags & MAP_ANONYMOUS))
+		return real_mmap(addr, len, prot, flags, fd, offset);
+
+	return emu_mmap(file, addr, len, prot, flags, offset);
+}
+
+EMU_EXPORT void *mmap64(void *addr, size_t len, int prot, int flags, int fd,
+			off64_t offset)
+{
+	REAL(void *, mmap64, void *, size_t, int, int, int, off64_t);
+	struct emu_file *file = emu_get_file(fd);
+
+	if (file == NULL || (flags & MAP_ANONYMOUS))
+		return real_mmap64(addr, len, prot, flags, fd, offset);
+
+	return emu_mmap(file, addr, len, prot, flags, (off_t)offset);
+}
+
+EMU_EXPORT int poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+	REAL(int, poll, struct pollfd *, nfds_t, int);
+	struct emu_file *file;
+	unsigned char stack_hidden[64], *hidden = stack_hidden;
+	int64_t deadline = 0, left;
+	int ret, ready, slice;
+	nfds_t i;
+
+	for (i = 0; i < nfds; i++)
+		if (emu_get_file(fds[i].fd) != NULL)
+			break;
+	if (i == nfds)
+		return real_poll(fds, nfds, timeout);
+
+	if (nfds > sizeof(stack_hidden)) {
+		hidden = malloc(nfds);
+		if (hidden == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+
+	if (timeout > 0)
+		deadline = emu_now_ms() + timeout;
+
+	do {
+		/* hide emulated descriptors from the real poll() */
+		ready = 0;
+		for (i = 0; i < nfds; i++) {
+			file = emu_get_file(fds[i].fd);
+			hidden[i] = (file != NULL);
+			if (file == NULL)
+				continue;
+			fds[i].revents = emu_poll_file(file) &
+				(fds[i].events | POLLERR | POLLHUP);
+			ready += (fds[i].revents != 0);
+			fds[i].fd = ~fds[i].fd;
+		}
+
+		slice = EMU_POLL_SLICE_MS;
+		if (ready || timeout == 0) {
+			slice = 0;
+		} else if (timeout > 0) {
+			left = deadline - emu_now_ms();
+			if (left < slice)
+				slice = left > 0 ? (int)left : 0;
+		}
+
+		ret = real_poll(fds, nfds, slice);
+
+		/* real poll() cleared revents of hidden descriptors */
+		for (i = 0, ready = 0; i < nfds; i++) {
+			if (hidden[i]) {
+				fds[i].fd = ~fds[i].fd;
+				file = emu_get_file(fds[i].fd);
+				fds[i].revents = file ? emu_poll_file(file) &
+					(fds[i].events | POLLERR | POLLHUP) : 0;
+			}
+			ready += (fds[i].revents != 0);
+		}
+	} while (ret >= 0 && !ready && timeout != 0 &&
+		 (timeout < 0 || emu_now_ms() < deadline));
+
+	if (hidden != stack_hidden)
+		free(hidden);
+
+	return ret < 0 ? ret : ready;
+}
+
+EMU_EXPORT int __poll_chk(struct pollfd *fds, nfds_t nfds, int timeout,
+			  size_t fdslen)
+{
+	if (fdslen / sizeof(*fds) < nfds)
+		abort();
+	return poll(fds, nfds, timeout);
+}